@@ -0,0 +1,850 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "mock_hw.h"
+#include "hardware/irq.h"
+#include "hardware/timer.h"
+#include "tusb.h"
+#include "spsc_ring_lib.h"
+#include "midi_device_multistream.h"
+#include "midi_task.h"
+
+// Runs canonical MIDI workloads through the routing core with the host
+// stand-ins in mock/ and prints the results as JSON, so that a change can be
+// compared against a baseline run:
+//   midistributor_host_bench [benchmark...] > results.json
+//
+// A workload feeds DIN MIDI IN ports and USB MIDI OUT cables in virtual time
+// and matches every packet that comes out against the packet that went in.
+// Latency runs from the end of the message's last byte on the DIN MIDI IN
+// wire, or from the host getting the packet into the USB MIDI OUT endpoint
+// FIFO, to the end of the last byte on the DIN MIDI OUT wire, or to the
+// device writing the packet to the USB MIDI IN endpoint FIFO. The stand-ins
+// take no virtual time to run code, so latencies are multiples of the main
+// loop pass. CPU time is host time spent in midi_task(), core1 in the
+// dual-core build and the IRQ handlers; compare it between runs on the same
+// machine only. Messages are USB MIDI event packets, so a SysEx message
+// counts once per 3 bytes, and a message routed to several destinations
+// counts once in and once per destination out.
+//
+// Every benchmark runs in its own process because the routing core, like the
+// firmware, is only initialized once.
+
+// The DIN MIDI port pins midi_task.c creates the MIDI UARTs with
+static const uint32_t DIN_IN_GPIO[NUM_PHY_MIDI_PORT_PAIRS] = { 11, 10, 9, 8};
+static const uint32_t DIN_OUT_GPIO[NUM_PHY_MIDI_PORT_PAIRS] = { 24, 25, 22, 23};
+
+// Time one main loop pass takes
+#define LOOP_US 20
+// How long a workload may take to deliver what it sent after it stops sending
+#define DRAIN_LIMIT_US 5000000
+
+// Packets sent on one route and not delivered yet; a power of 2
+#define PENDING_LENGTH 4096
+// Latency samples kept per workload
+#define MAX_SAMPLES (1u << 18)
+// USB MIDI OUT packets the host has yet to get into the endpoint FIFO; a power of 2
+#define HOST_QUEUE_LENGTH 8192
+
+static inline uint64_t host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+//--------------------------------------------------------------------+
+// Traffic and matching
+//--------------------------------------------------------------------+
+
+/**
+ * @struct a packet on its way along one route
+ */
+typedef struct {
+    uint8_t bytes[4];
+    uint32_t in_us;
+} bench_pending_t;
+
+static bench_pending_t pending[MIDI_ROUTER_NUM_SOURCES][MIDI_ROUTER_NUM_DESTS][PENDING_LENGTH];
+static uint32_t pending_head[MIDI_ROUTER_NUM_SOURCES][MIDI_ROUTER_NUM_DESTS];
+static uint32_t pending_tail[MIDI_ROUTER_NUM_SOURCES][MIDI_ROUTER_NUM_DESTS];
+static uint32_t routes[MIDI_ROUTER_NUM_SOURCES];
+
+static uint32_t messages_in = 0;   // packets that entered the device
+static uint32_t messages_out = 0;  // packets that reached a destination
+static uint32_t outstanding = 0;   // packets still on their way to a destination
+static uint32_t unmatched = 0;     // packets out that match nothing that went in
+
+static uint32_t latency_us[MAX_SAMPLES];
+static uint32_t nlatency = 0;
+static uint32_t rt_latency_us[MAX_SAMPLES];
+static uint32_t nrt_latency = 0;
+
+// Time between two MIDI clock bytes on the same DIN MIDI OUT wire
+static uint32_t clock_out_us[NUM_PHY_MIDI_PORT_PAIRS];
+static bool clock_out_seen[NUM_PHY_MIDI_PORT_PAIRS];
+static uint32_t clock_intervals = 0;
+static uint32_t clock_interval_min_us = UINT32_MAX;
+static uint32_t clock_interval_max_us = 0;
+
+static uint32_t din_in_free_us[NUM_PHY_MIDI_PORT_PAIRS]; // when each DIN MIDI IN wire is idle
+static midi_parser_t din_in_parser[NUM_PHY_MIDI_PORT_PAIRS];
+static midi_parser_t din_out_parser[NUM_PHY_MIDI_PORT_PAIRS];
+
+static uint8_t host_queue[HOST_QUEUE_LENGTH][4];
+static uint32_t host_queue_head = 0;
+static uint32_t host_queue_tail = 0;
+
+// A packet entered the device at a source; expect it at the source's destinations
+static void expect(uint8_t src, const uint8_t bytes[4], uint32_t in_us)
+{
+    ++messages_in;
+    for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS; dest++) {
+        if (!(routes[src] & MIDI_ROUTER_DEST_BIT(dest))) {
+            continue;
+        }
+        if (pending_head[src][dest] - pending_tail[src][dest] == PENDING_LENGTH) {
+            fprintf(stderr, "bench: more than %u packets on route %u > %u\n", PENDING_LENGTH, src, dest);
+            exit(1);
+        }
+        bench_pending_t* entry = &pending[src][dest][pending_head[src][dest]++ & (PENDING_LENGTH - 1)];
+        memcpy(entry->bytes, bytes, 4);
+        entry->bytes[0] &= 0x0F; // the cable number changes on the way
+        entry->in_us = in_us;
+        ++outstanding;
+    }
+}
+
+// A packet reached a destination; find the route it took. Every source in a
+// workload sends distinct messages to a destination, so the first packet
+// still on its way from any source identifies it.
+static void deliver(uint8_t dest, const uint8_t bytes[4], uint32_t out_us)
+{
+    for (uint8_t src = 0; src < MIDI_ROUTER_NUM_SOURCES; src++) {
+        if (pending_head[src][dest] == pending_tail[src][dest]) {
+            continue;
+        }
+        const bench_pending_t* entry = &pending[src][dest][pending_tail[src][dest] & (PENDING_LENGTH - 1)];
+        if ((bytes[0] & 0x0F) != entry->bytes[0] || memcmp(bytes + 1, entry->bytes + 1, 3) != 0) {
+            continue;
+        }
+        ++pending_tail[src][dest];
+        --outstanding;
+        ++messages_out;
+        if (nlatency < MAX_SAMPLES) {
+            latency_us[nlatency++] = out_us - entry->in_us;
+        }
+        if (bytes[0] == 0x0F && bytes[1] >= 0xF8 && nrt_latency < MAX_SAMPLES) {
+            rt_latency_us[nrt_latency++] = out_us - entry->in_us;
+        }
+        return;
+    }
+    ++unmatched;
+}
+
+// Send bytes to a DIN MIDI IN port behind the bytes already on the wire
+static void din_send(uint8_t port, const uint8_t* bytes, uint32_t nbytes)
+{
+    uint32_t now_us = time_us_32();
+    uint32_t start_us = (int32_t)(din_in_free_us[port] - now_us) > 0 ? din_in_free_us[port] : now_us;
+    midi_packet_t packets[2];
+    for (uint32_t idx = 0; idx < nbytes; idx++) {
+        uint8_t npackets = midi_parser_parse(&din_in_parser[port], bytes[idx], packets);
+        for (uint8_t n = 0; n < npackets; n++) {
+            expect(MIDI_ROUTER_SRC_DIN_IN(port), packets[n].bytes, start_us + (idx + 1) * MOCK_MIDI_BYTE_US);
+        }
+    }
+    if (mock_din_in_send(DIN_IN_GPIO[port], bytes, nbytes) != nbytes) {
+        fprintf(stderr, "bench: DIN MIDI IN %c wire is full\n", 'A' + port);
+        exit(1);
+    }
+    din_in_free_us[port] = start_us + nbytes * MOCK_MIDI_BYTE_US;
+}
+
+// Check if a DIN MIDI IN wire runs dry within the next main loop pass
+static inline bool din_idle_soon(uint8_t port)
+{
+    return (int32_t)(din_in_free_us[port] - time_us_32()) <= LOOP_US;
+}
+
+static void usb_send(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3)
+{
+    if (host_queue_head - host_queue_tail == HOST_QUEUE_LENGTH) {
+        fprintf(stderr, "bench: host queue is full\n");
+        exit(1);
+    }
+    uint8_t* packet = host_queue[host_queue_head++ & (HOST_QUEUE_LENGTH - 1)];
+    packet[0] = b0;
+    packet[1] = b1;
+    packet[2] = b2;
+    packet[3] = b3;
+}
+
+// Fill a SysEx message with a manufacturer ID for non-commercial use and
+// data that tells the sources apart
+static void fill_sysex(uint8_t* bytes, uint32_t nbytes, uint8_t tag)
+{
+    bytes[0] = 0xF0;
+    bytes[1] = 0x7D;
+    for (uint32_t idx = 2; idx < nbytes - 1; idx++) {
+        bytes[idx] = (uint8_t)((tag * 16 + idx) & 0x7F);
+    }
+    bytes[nbytes - 1] = 0xF7;
+}
+
+static void usb_send_sysex(uint8_t cable, const uint8_t* bytes, uint32_t nbytes)
+{
+    for (uint32_t idx = 0; idx < nbytes; idx += 3) {
+        uint32_t left = nbytes - idx;
+        uint8_t cin = left > 3 ? 0x4 : (uint8_t)(0x4 + left);
+        usb_send((uint8_t)((cable << 4) | cin), bytes[idx], left > 1 ? bytes[idx + 1] : 0, left > 2 ? bytes[idx + 2] : 0);
+    }
+}
+
+// Send what the endpoint FIFO takes
+static void host_flush(void)
+{
+    while (host_queue_tail != host_queue_head) {
+        const uint8_t* packet = host_queue[host_queue_tail & (HOST_QUEUE_LENGTH - 1)];
+        if (!mock_usb_midi_out_send(packet)) {
+            break;
+        }
+        expect(MIDI_ROUTER_SRC_USB_OUT(packet[0] >> 4), packet, time_us_32());
+        ++host_queue_tail;
+    }
+}
+
+static void clock_out(uint8_t port, uint32_t out_us)
+{
+    if (clock_out_seen[port]) {
+        uint32_t interval_us = out_us - clock_out_us[port];
+        ++clock_intervals;
+        if (interval_us < clock_interval_min_us) {
+            clock_interval_min_us = interval_us;
+        }
+        if (interval_us > clock_interval_max_us) {
+            clock_interval_max_us = interval_us;
+        }
+    }
+    clock_out_seen[port] = true;
+    clock_out_us[port] = out_us;
+}
+
+static void collect(void)
+{
+    uint8_t bytes[64];
+    uint32_t times_us[64];
+    midi_packet_t packets[2];
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        uint32_t nbytes;
+        while ((nbytes = mock_din_out_receive(DIN_OUT_GPIO[port], bytes, times_us, sizeof(bytes))) > 0) {
+            for (uint32_t idx = 0; idx < nbytes; idx++) {
+                if (bytes[idx] == 0xF8) {
+                    clock_out(port, times_us[idx]);
+                }
+                uint8_t npackets = midi_parser_parse(&din_out_parser[port], bytes[idx], packets);
+                for (uint8_t n = 0; n < npackets; n++) {
+                    deliver(MIDI_ROUTER_DEST_DIN_OUT(port), packets[n].bytes, times_us[idx]);
+                }
+            }
+        }
+    }
+    uint8_t packet[4];
+    uint32_t time_us;
+    while (mock_usb_midi_in_receive(packet, &time_us)) {
+        deliver(MIDI_ROUTER_DEST_USB_IN(packet[0] >> 4), packet, time_us);
+    }
+}
+
+static void set_route(uint8_t src, uint32_t dest_mask)
+{
+    midi_router_table_t* table = midi_router_edit();
+    if (table == NULL) {
+        fprintf(stderr, "bench: the routing table is busy\n");
+        exit(1);
+    }
+    table->dest_mask[src] = dest_mask;
+    midi_router_commit();
+}
+
+//--------------------------------------------------------------------+
+// Workloads
+//--------------------------------------------------------------------+
+
+/**
+ * @struct a traffic pattern
+ */
+typedef struct {
+    const char* name;
+    uint32_t duration_us;                // how long generate() is called
+    void (*setup)(void);                 // change the default routing; may be NULL
+    void (*generate)(uint32_t elapsed_us); // called before every main loop pass
+    uint32_t core0_stall_us;             // how long midi_task() cannot run every CORE0_STALL_PERIOD_US
+} bench_workload_t;
+
+// A slow tud_task(), such as one busy with a long control transfer, keeps
+// core0 from running midi_task() now and then
+#define CORE0_STALL_PERIOD_US 10000
+
+// Note On and Note Off for 12 notes in turn
+static void note(uint32_t count, uint8_t channel, uint8_t msg[3])
+{
+    msg[0] = (uint8_t)(((count & 1) ? 0x80 : 0x90) | channel);
+    msg[1] = (uint8_t)(48 + (count / 2) % 12);
+    msg[2] = 100;
+}
+
+// Every DIN MIDI IN port at full wire speed to its USB MIDI IN cable, and
+// every USB MIDI OUT cable to its DIN MIDI OUT port at almost full wire speed
+static void note_flood_generate(uint32_t elapsed_us)
+{
+    static uint32_t din_count[NUM_PHY_MIDI_PORT_PAIRS];
+    static uint32_t usb_count[NUM_PHY_MIDI_PORT_PAIRS];
+    uint8_t msg[3];
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        while (din_idle_soon(port)) {
+            note(din_count[port]++, port, msg);
+            din_send(port, msg, sizeof(msg));
+        }
+        // a Note On/Off pair takes 6 bytes or 1920 us on the wire
+        while (usb_count[port] * 1000 <= elapsed_us) {
+            note(usb_count[port]++, port, msg);
+            usb_send((uint8_t)((port << 4) | (msg[0] >> 4)), msg[0], msg[1], msg[2]);
+        }
+    }
+}
+
+// A 2 KiB SysEx dump on every USB MIDI OUT cable and every DIN MIDI IN port
+// at once
+#define SYSEX_DUMP_LENGTH 2048
+static void sysex_dump_generate(uint32_t elapsed_us)
+{
+    (void)elapsed_us;
+    static uint8_t sysex[SYSEX_DUMP_LENGTH];
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        fill_sysex(sysex, sizeof(sysex), port);
+        usb_send_sysex(port, sysex, sizeof(sysex));
+        fill_sysex(sysex, sizeof(sysex), (uint8_t)(NUM_PHY_MIDI_PORT_PAIRS + port));
+        din_send(port, sysex, sizeof(sysex));
+    }
+}
+
+// A MIDI clock at 120 BPM on DIN MIDI IN A goes to every DIN MIDI OUT port and
+// to USB MIDI IN cable 1, which also get dense Control Changes: every USB MIDI
+// OUT cable sends one every millisecond to its DIN MIDI OUT port and DIN MIDI
+// IN B-D send them at full wire speed to their USB MIDI IN cables
+#define CLOCK_PERIOD_US 20833
+static void clock_cc_setup(void)
+{
+    set_route(MIDI_ROUTER_SRC_DIN_IN(0), MIDI_ROUTER_DIN_OUT_MASK | MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_USB_IN(0)));
+}
+
+static void clock_cc_generate(uint32_t elapsed_us)
+{
+    static uint32_t clocks = 0;
+    static uint32_t din_count[NUM_PHY_MIDI_PORT_PAIRS];
+    static uint32_t usb_count[NUM_PHY_MIDI_PORT_PAIRS];
+    static const uint8_t clock = 0xF8;
+    if (clocks * CLOCK_PERIOD_US <= elapsed_us) {
+        ++clocks;
+        din_send(0, &clock, 1);
+    }
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        while (port > 0 && din_idle_soon(port)) {
+            uint8_t msg[3] = { (uint8_t)(0xB0 | port), 1, (uint8_t)(din_count[port]++ & 0x7F)};
+            din_send(port, msg, sizeof(msg));
+        }
+        while (usb_count[port] * 1000 <= elapsed_us) {
+            uint8_t value = (uint8_t)(usb_count[port]++ & 0x7F);
+            usb_send((uint8_t)((port << 4) | 0xB), (uint8_t)(0xB0 | port), 7, value);
+        }
+    }
+}
+
+// The same clock with a burst of 24 Notes from every USB MIDI OUT cable to
+// its DIN MIDI OUT port every 40 ms, about half the wire time. Unlike the
+// steady Control Changes the bursts fill the TX buffers, which the clock
+// messages have to get past
+#define NOTE_BURST_PERIOD_US 40000
+#define NOTE_BURST_LENGTH 24
+static void clock_note_burst_generate(uint32_t elapsed_us)
+{
+    static uint32_t clocks = 0;
+    static uint32_t bursts = 0;
+    static uint32_t usb_count[NUM_PHY_MIDI_PORT_PAIRS];
+    static const uint8_t clock = 0xF8;
+    if (clocks * CLOCK_PERIOD_US <= elapsed_us) {
+        ++clocks;
+        din_send(0, &clock, 1);
+    }
+    if (bursts * NOTE_BURST_PERIOD_US <= elapsed_us) {
+        ++bursts;
+        for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+            for (uint32_t count = 0; count < NOTE_BURST_LENGTH; count++) {
+                uint8_t msg[3];
+                note(usb_count[port]++, port, msg);
+                usb_send((uint8_t)((port << 4) | (msg[0] >> 4)), msg[0], msg[1], msg[2]);
+            }
+        }
+    }
+}
+
+// Every DIN MIDI IN port forwards a Note every 2 ms to its DIN MIDI OUT port
+// while core0 is stalled for 2 ms of every 10 ms. In the single-core build
+// the stall holds up the DIN forwarding too; in the dual-core build core1
+// forwards meanwhile.
+static void din_forward_setup(void)
+{
+    midi_router_table_t* table = midi_router_edit();
+    if (table == NULL) {
+        fprintf(stderr, "bench: the routing table is busy\n");
+        exit(1);
+    }
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        table->dest_mask[MIDI_ROUTER_SRC_DIN_IN(port)] = MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_DIN_OUT(port));
+    }
+    midi_router_commit();
+}
+
+static void din_forward_generate(uint32_t elapsed_us)
+{
+    static uint32_t din_count[NUM_PHY_MIDI_PORT_PAIRS];
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        // stagger the ports by a quarter period
+        while (din_count[port] * 2000 + port * 500 <= elapsed_us) {
+            uint8_t msg[3];
+            note(din_count[port]++, port, msg);
+            din_send(port, msg, sizeof(msg));
+        }
+    }
+}
+
+// 2000 Note On messages at once on USB MIDI OUT cable 1 for DIN MIDI OUT A
+#define BURST_LENGTH 2000
+static void burst_generate(uint32_t elapsed_us)
+{
+    (void)elapsed_us;
+    for (uint32_t count = 0; count < BURST_LENGTH; count++) {
+        usb_send(0x09, 0x90, (uint8_t)(count & 0x7F), 100);
+    }
+}
+
+static const bench_workload_t workloads[] = {
+    { "note_flood", 2000000, NULL, note_flood_generate, 0},
+    { "sysex_dump_4x", 1, NULL, sysex_dump_generate, 0},
+    { "clock_cc_mix", 2000000, clock_cc_setup, clock_cc_generate, 0},
+    { "clock_note_burst_mix", 2000000, clock_cc_setup, clock_note_burst_generate, 0},
+    { "single_cable_burst", 1, NULL, burst_generate, 0},
+    { "din_forward_usb_stall", 2000000, din_forward_setup, din_forward_generate, 2000},
+};
+
+static int compare_u32(const void* a, const void* b)
+{
+    uint32_t va = *(const uint32_t*)a;
+    uint32_t vb = *(const uint32_t*)b;
+    return va < vb ? -1 : va > vb;
+}
+
+// Nearest rank percentile of sorted samples
+static uint32_t percentile(const uint32_t* samples, uint32_t nsamples, uint32_t pct)
+{
+    if (nsamples == 0) {
+        return 0;
+    }
+    uint32_t rank = (uint32_t)(((uint64_t)nsamples * pct + 99) / 100);
+    return samples[rank > 0 ? rank - 1 : 0];
+}
+
+static void print_latency(const char* name, uint32_t* samples, uint32_t nsamples)
+{
+    qsort(samples, nsamples, sizeof(uint32_t), compare_u32);
+    printf("\"%s\": {\"samples\": %u, \"p50\": %u, \"p99\": %u, \"max\": %u}", name, nsamples,
+           percentile(samples, nsamples, 50), percentile(samples, nsamples, 99),
+           nsamples ? samples[nsamples - 1] : 0);
+}
+
+static bool run_workload(const bench_workload_t* workload)
+{
+    midi_task_init();
+    if (workload->setup) {
+        workload->setup();
+    }
+    for (uint8_t src = 0; src < MIDI_ROUTER_NUM_SOURCES; src++) {
+        routes[src] = midi_router_get_route(src);
+    }
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        midi_parser_init(&din_in_parser[port]);
+        midi_parser_init(&din_out_parser[port]);
+    }
+    uint64_t task_ns = 0;
+    uint32_t start_us = time_us_32();
+    uint32_t elapsed_us = 0;
+    for (;;) {
+        elapsed_us = time_us_32() - start_us;
+        if (elapsed_us < workload->duration_us) {
+            workload->generate(elapsed_us);
+        }
+        else if ((outstanding == 0 && host_queue_head == host_queue_tail) ||
+                 elapsed_us >= workload->duration_us + DRAIN_LIMIT_US) {
+            break;
+        }
+        host_flush();
+        // like main(), only run midi_task() when it is ready and core0 is not
+        // stalled; core1 runs regardless in the dual-core build
+        bool stalled = elapsed_us % CORE0_STALL_PERIOD_US < workload->core0_stall_us;
+        uint64_t task_start_ns = host_ns();
+        if (!stalled && midi_task_is_ready()) {
+            midi_task();
+        }
+        mock_core1_run();
+        task_ns += host_ns() - task_start_ns;
+        mock_advance_us(LOOP_US);
+        collect();
+    }
+    uint64_t cpu_ns = task_ns + mock_irq_handler_ns();
+
+    uint32_t dropped = 0;
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        din_midi_stats_t stats;
+        if (midi_task_get_din_stats(port, &stats)) {
+            dropped += stats.rx.dropped + stats.parse_dropped + stats.merge_dropped + stats.tx.rejected;
+        }
+        dropped += mock_din_in_overruns(DIN_IN_GPIO[port]);
+    }
+    usb_midi_stats_t usb_stats;
+    midi_task_get_usb_stats(&usb_stats);
+    dropped += usb_stats.out_dropped + usb_stats.in_dropped;
+
+    printf("{\"name\": \"%s\", \"kind\": \"workload\", \"virtual_us\": %u, \"messages_in\": %u, "
+           "\"messages_out\": %u, \"lost\": %u, \"unmatched\": %u, \"dropped\": %u, "
+           "\"messages_per_s\": %.1f, \"cpu_ns_per_message\": %.1f, ",
+           workload->name, elapsed_us, messages_in, messages_out, outstanding, unmatched, dropped,
+           elapsed_us ? messages_out * 1e6 / elapsed_us : 0.0, messages_out ? (double)cpu_ns / messages_out : 0.0);
+    print_latency("latency_us", latency_us, nlatency);
+    printf(", ");
+    print_latency("realtime_latency_us", rt_latency_us, nrt_latency);
+    if (clock_intervals > 0) {
+        printf(", \"din_clock_interval_us\": {\"samples\": %u, \"min\": %u, \"max\": %u, \"jitter\": %u}",
+               clock_intervals, clock_interval_min_us, clock_interval_max_us,
+               clock_interval_max_us - clock_interval_min_us);
+    }
+    printf("}");
+    return outstanding == 0 && unmatched == 0;
+}
+
+//--------------------------------------------------------------------+
+// Micro benchmarks of the paths the workloads spend their time in
+//--------------------------------------------------------------------+
+
+#define RING_OPERATIONS 4000000
+#define RING_SIZE 256
+// The IRQ the baseline ring masks, like the PIO IRQ of a MIDI UART
+#define RING_IRQ PIO0_IRQ_0
+
+// The ring the PIO MIDI UART library used before spsc_ring_lib: every push
+// and pop disables the IRQ of the other side for the whole copy
+typedef struct {
+    uint8_t* buf;
+    uint32_t size;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t count;
+} locked_ring_t;
+
+// How long each push and pop kept RING_IRQ disabled, if measured, in 1 ns
+// bins. The longest times on a host are the OS preempting the benchmark, so
+// the percentiles are the figures to compare
+#define BLOCKED_BINS 4096
+static uint32_t locked_ring_blocked_ns[BLOCKED_BINS];
+static uint64_t locked_ring_blocked_max_ns;
+static bool locked_ring_measure;
+
+static uint64_t locked_ring_lock(void)
+{
+    irq_set_enabled(RING_IRQ, false);
+    return locked_ring_measure ? host_ns() : 0;
+}
+
+static void locked_ring_unlock(uint64_t start_ns)
+{
+    if (locked_ring_measure) {
+        uint64_t blocked_ns = host_ns() - start_ns;
+        ++locked_ring_blocked_ns[blocked_ns < BLOCKED_BINS ? blocked_ns : BLOCKED_BINS - 1];
+        if (blocked_ns > locked_ring_blocked_max_ns) {
+            locked_ring_blocked_max_ns = blocked_ns;
+        }
+    }
+    irq_set_enabled(RING_IRQ, true);
+}
+
+static uint32_t locked_ring_push(locked_ring_t* ring, const uint8_t* data, uint32_t len)
+{
+    uint64_t start_ns = locked_ring_lock();
+    uint32_t npushed = 0;
+    while (npushed < len && ring->count < ring->size) {
+        ring->buf[ring->head] = data[npushed++];
+        ring->head = (ring->head + 1) % ring->size;
+        ++ring->count;
+    }
+    locked_ring_unlock(start_ns);
+    return npushed;
+}
+
+static uint32_t locked_ring_pop(locked_ring_t* ring, uint8_t* data, uint32_t maxlen)
+{
+    uint64_t start_ns = locked_ring_lock();
+    uint32_t npopped = 0;
+    while (npopped < maxlen && ring->count > 0) {
+        data[npopped++] = ring->buf[ring->tail];
+        ring->tail = (ring->tail + 1) % ring->size;
+        --ring->count;
+    }
+    locked_ring_unlock(start_ns);
+    return npopped;
+}
+
+// Nearest rank per mille of the measured blocked times
+static uint32_t blocked_percentile(uint32_t per_mille)
+{
+    uint64_t total = 0;
+    for (uint32_t bin = 0; bin < BLOCKED_BINS; bin++) {
+        total += locked_ring_blocked_ns[bin];
+    }
+    uint64_t rank = (total * per_mille + 999) / 1000;
+    uint64_t count = 0;
+    for (uint32_t bin = 0; bin < BLOCKED_BINS; bin++) {
+        count += locked_ring_blocked_ns[bin];
+        if (count >= rank && count > 0) {
+            return bin;
+        }
+    }
+    return 0;
+}
+
+// Push and pop a 3 byte message through the SPSC ring and through the locked
+// baseline. The SPSC ring never masks an IRQ; for the baseline a second pass
+// times every critical section for the longest time the IRQ waited
+static bool run_ring_push_pop(void)
+{
+    static uint8_t buf[RING_SIZE];
+    static spsc_ring_t ring;
+    static locked_ring_t locked = { buf, RING_SIZE, 0, 0, 0};
+    spsc_ring_init(&ring, buf, sizeof(buf));
+    const uint8_t msg[3] = { 0x90, 0x3C, 0x64};
+    uint8_t out[3];
+    uint32_t errors = 0;
+    uint64_t start_ns = host_ns();
+    for (uint32_t op = 0; op < RING_OPERATIONS; op++) {
+        spsc_ring_push(&ring, msg, sizeof(msg));
+        if (spsc_ring_pop(&ring, out, sizeof(out)) != sizeof(out)) {
+            ++errors;
+        }
+    }
+    uint64_t spsc_ns = host_ns() - start_ns;
+
+    start_ns = host_ns();
+    for (uint32_t op = 0; op < RING_OPERATIONS; op++) {
+        locked_ring_push(&locked, msg, sizeof(msg));
+        if (locked_ring_pop(&locked, out, sizeof(out)) != sizeof(out)) {
+            ++errors;
+        }
+    }
+    uint64_t locked_ns = host_ns() - start_ns;
+
+    locked_ring_measure = true;
+    for (uint32_t op = 0; op < RING_OPERATIONS; op++) {
+        locked_ring_push(&locked, msg, sizeof(msg));
+        if (locked_ring_pop(&locked, out, sizeof(out)) != sizeof(out)) {
+            ++errors;
+        }
+    }
+    printf("{\"name\": \"ring_push_pop\", \"kind\": \"micro\", \"operations\": %u, \"ns_per_operation\": %.2f, "
+           "\"irq_blocked_max_ns\": 0, \"locked_ns_per_operation\": %.2f, \"locked_irq_blocked_ns\": "
+           "{\"p50\": %u, \"p99\": %u, \"p99_9\": %u, \"max\": %llu}}",
+           RING_OPERATIONS, (double)spsc_ns / RING_OPERATIONS, (double)locked_ns / RING_OPERATIONS,
+           blocked_percentile(500), blocked_percentile(990), blocked_percentile(999),
+           (unsigned long long)locked_ring_blocked_max_ns);
+    return errors == 0;
+}
+
+// Read full endpoint FIFOs of Note On packets that interleave the 4 cables
+// packet by packet, the worst case for tud_midi_demux_stream_read(), which
+// returns at every cable switch
+#define DEMUX_ROUNDS 200000
+#define DEMUX_FIFO_PACKETS 16
+#define DEMUX_CABLES 4
+
+static void demux_fill_fifo(void)
+{
+    for (uint8_t idx = 0; idx < DEMUX_FIFO_PACKETS; idx++) {
+        const uint8_t packet[4] = { (uint8_t)(((idx % DEMUX_CABLES) << 4) | 0x9), 0x90, 0x3C, 0x64};
+        mock_usb_midi_out_send(packet);
+    }
+}
+
+static void print_demux(const char* name, uint64_t ns, uint64_t npackets, uint64_t nbytes, uint64_t ncalls)
+{
+    printf("{\"name\": \"%s\", \"kind\": \"micro\", \"operations\": %llu, \"ns_per_operation\": %.2f, "
+           "\"bytes_per_s\": %.0f, \"calls_per_packet\": %.3f}",
+           name, (unsigned long long)npackets, (double)ns / (double)npackets,
+           ns ? nbytes * 1e9 / (double)ns : 0.0, (double)ncalls / (double)npackets);
+}
+
+static bool run_demux_stream_read(void)
+{
+    uint8_t bytes[48];
+    uint64_t ns = 0;
+    uint64_t npackets = 0;
+    uint64_t nbytes = 0;
+    uint64_t ncalls = 0;
+    for (uint32_t round = 0; round < DEMUX_ROUNDS; round++) {
+        demux_fill_fifo();
+        uint8_t cable;
+        uint32_t len;
+        uint64_t start_ns = host_ns();
+        do {
+            len = tud_midi_demux_stream_read(&cable, bytes, sizeof(bytes));
+            nbytes += len;
+            ++ncalls;
+        } while (len > 0);
+        ns += host_ns() - start_ns;
+        npackets += DEMUX_FIFO_PACKETS;
+    }
+    print_demux("demux_stream_read", ns, npackets, nbytes, ncalls);
+    return nbytes == npackets * 3;
+}
+
+// Counts the MIDI bytes of every packet like tud_midi_demux_stream_read()
+// copies them, so both micros do the same work per packet
+static void demux_count_bytes(uint8_t cable_num, uint8_t const packet[4], void* context)
+{
+    static const uint8_t cin_bytes[16] = { 0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1};
+    (void)cable_num;
+    *(uint64_t*)context += cin_bytes[packet[0] & 0x0f];
+}
+
+static bool run_demux_dispatch(void)
+{
+    uint64_t ns = 0;
+    uint64_t npackets = 0;
+    uint64_t nbytes = 0;
+    uint64_t ncalls = 0;
+    for (uint32_t round = 0; round < DEMUX_ROUNDS; round++) {
+        demux_fill_fifo();
+        uint64_t start_ns = host_ns();
+        // like midi_task(), a single call drains the FIFO
+        npackets += tud_midi_n_demux_dispatch(0, DEMUX_FIFO_PACKETS, demux_count_bytes, &nbytes);
+        ++ncalls;
+        ns += host_ns() - start_ns;
+    }
+    print_demux("demux_dispatch", ns, npackets, nbytes, ncalls);
+    return npackets == (uint64_t)DEMUX_ROUNDS * DEMUX_FIFO_PACKETS && nbytes == npackets * 3;
+}
+
+//--------------------------------------------------------------------+
+// Runner
+//--------------------------------------------------------------------+
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+/**
+ * @struct a micro benchmark
+ */
+typedef struct {
+    const char* name;
+    bool (*run)(void); // prints the result as JSON, returns false if the results were wrong
+} bench_micro_t;
+
+static const bench_micro_t micros[] = {
+    { "ring_push_pop", run_ring_push_pop},
+    { "demux_stream_read", run_demux_stream_read},
+    { "demux_dispatch", run_demux_dispatch},
+};
+#define NUM_MICROS (sizeof(micros) / sizeof(micros[0]))
+#define NUM_BENCHMARKS (NUM_WORKLOADS + NUM_MICROS)
+
+static const char* benchmark_name(size_t idx)
+{
+    return idx < NUM_WORKLOADS ? workloads[idx].name : micros[idx - NUM_WORKLOADS].name;
+}
+
+static bool run_benchmark(size_t idx)
+{
+    if (idx < NUM_WORKLOADS) {
+        return run_workload(&workloads[idx]);
+    }
+    return micros[idx - NUM_WORKLOADS].run();
+}
+
+int main(int argc, char** argv)
+{
+    size_t selected[NUM_BENCHMARKS];
+    size_t nselected = 0;
+    for (int arg = 1; arg < argc; arg++) {
+        size_t idx = 0;
+        while (idx < NUM_BENCHMARKS && strcmp(argv[arg], benchmark_name(idx)) != 0) {
+            ++idx;
+        }
+        if (idx == NUM_BENCHMARKS || nselected == NUM_BENCHMARKS) {
+            fprintf(stderr, "usage: %s [benchmark...]\nbenchmarks:", argv[0]);
+            for (idx = 0; idx < NUM_BENCHMARKS; idx++) {
+                fprintf(stderr, " %s", benchmark_name(idx));
+            }
+            fprintf(stderr, "\n");
+            return 2;
+        }
+        selected[nselected++] = idx;
+    }
+    if (nselected == 0) {
+        for (size_t idx = 0; idx < NUM_BENCHMARKS; idx++) {
+            selected[nselected++] = idx;
+        }
+    }
+
+    int failed = 0;
+    printf("{\"loop_us\": %u, \"benchmarks\": [\n", LOOP_US);
+    for (size_t n = 0; n < nselected; n++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            bool passed = run_benchmark(selected[n]);
+            printf("%s\n", n + 1 < nselected ? "," : "");
+            fflush(stdout);
+            _exit(passed ? 0 : 1);
+        }
+        int status = 0;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "bench: %s failed\n", benchmark_name(selected[n]));
+            failed = 1;
+        }
+    }
+    printf("]}\n");
+    return failed;
+}
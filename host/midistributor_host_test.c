@@ -0,0 +1,1253 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "mock_hw.h"
+#include "hardware/timer.h"
+#include "tusb.h"
+#include "spsc_ring_lib.h"
+#include "midi_device_multistream.h"
+#include "midi_task.h"
+#include "midi_latency.h"
+#include "midi_clock.h"
+#include "midi_sched.h"
+#include "midi_merge.h"
+#include "pio_midi_uart_lib.h"
+
+// Runs synthetic MIDI traffic through the routing core with the host
+// stand-ins in mock/. Every test runs in its own process because the routing
+// core, like the firmware, is only initialized once:
+//   midistributor_host_test <test>
+
+// The DIN MIDI port pins midi_task.c creates the MIDI UARTs with
+static const uint32_t DIN_IN_GPIO[NUM_PHY_MIDI_PORT_PAIRS] = { 11, 10, 9, 8};
+static const uint32_t DIN_OUT_GPIO[NUM_PHY_MIDI_PORT_PAIRS] = { 24, 25, 22, 23};
+
+// Time one main loop pass takes
+#define LOOP_US 20
+
+#define CHECK(_cond) do { \
+        if (!(_cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #_cond); \
+            return false; \
+        } \
+    } while (0)
+
+// USB MIDI OUT packets the host has yet to get into the endpoint FIFO
+#define HOST_QUEUE_LENGTH 4096
+static uint8_t host_queue[HOST_QUEUE_LENGTH][4];
+static uint32_t host_queue_head = 0;
+static uint32_t host_queue_tail = 0;
+
+// Everything the device sent
+#define CAPTURE_LENGTH 8192
+static uint8_t din_out[NUM_PHY_MIDI_PORT_PAIRS][CAPTURE_LENGTH];
+static uint32_t din_out_us[NUM_PHY_MIDI_PORT_PAIRS][CAPTURE_LENGTH];
+static uint32_t din_out_len[NUM_PHY_MIDI_PORT_PAIRS];
+static uint8_t usb_in[CAPTURE_LENGTH][4];
+static uint32_t usb_in_len = 0;
+
+static void host_send(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3)
+{
+    uint8_t* packet = host_queue[host_queue_head++ % HOST_QUEUE_LENGTH];
+    packet[0] = b0;
+    packet[1] = b1;
+    packet[2] = b2;
+    packet[3] = b3;
+}
+
+// Queue a SysEx message as USB MIDI event packets
+static void host_send_sysex(uint8_t cable, const uint8_t* bytes, uint32_t nbytes)
+{
+    for (uint32_t idx = 0; idx < nbytes; idx += 3) {
+        uint32_t left = nbytes - idx;
+        uint8_t cin = left > 3 ? 0x4 : (uint8_t)(0x4 + left);
+        host_send((uint8_t)((cable << 4) | cin), bytes[idx], left > 1 ? bytes[idx + 1] : 0, left > 2 ? bytes[idx + 2] : 0);
+    }
+}
+
+// Send what the endpoint FIFO takes
+static void host_flush(void)
+{
+    while (host_queue_tail != host_queue_head &&
+           mock_usb_midi_out_send(host_queue[host_queue_tail % HOST_QUEUE_LENGTH])) {
+        ++host_queue_tail;
+    }
+}
+
+static void collect(void)
+{
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        din_out_len[port] += mock_din_out_receive(DIN_OUT_GPIO[port], din_out[port] + din_out_len[port],
+                                                  din_out_us[port] + din_out_len[port],
+                                                  CAPTURE_LENGTH - din_out_len[port]);
+    }
+    while (usb_in_len < CAPTURE_LENGTH && mock_usb_midi_in_receive(usb_in[usb_in_len], NULL)) {
+        ++usb_in_len;
+    }
+}
+
+// Run the main loop for a while
+static void run_us(uint32_t us)
+{
+    for (uint32_t elapsed = 0; elapsed < us; elapsed += LOOP_US) {
+        host_flush();
+        mock_usb_task();
+        midi_task();
+        mock_core1_run();
+        mock_advance_us(LOOP_US);
+        collect();
+    }
+}
+
+// Run the main loop for a while the way main() does: midi_task() only runs
+// when it is ready
+static void run_ready_us(uint32_t us)
+{
+    for (uint32_t elapsed = 0; elapsed < us; elapsed += LOOP_US) {
+        host_flush();
+        mock_usb_task();
+        if (midi_task_is_ready()) {
+            midi_task();
+        }
+        mock_core1_run();
+        mock_advance_us(LOOP_US);
+        collect();
+    }
+}
+
+static bool set_route(uint8_t src, uint32_t dest_mask)
+{
+    midi_router_table_t* table = midi_router_edit();
+    if (table == NULL) {
+        return false;
+    }
+    table->dest_mask[src] = dest_mask;
+    midi_router_commit();
+    return true;
+}
+
+// Parse the bytes a DIN MIDI OUT port sent back into packets
+static uint32_t parse_din_out(uint8_t port, midi_packet_t* packets, uint32_t maxpackets)
+{
+    midi_parser_t parser;
+    midi_parser_init(&parser);
+    uint32_t npackets = 0;
+    midi_packet_t parsed[2];
+    for (uint32_t idx = 0; idx < din_out_len[port]; idx++) {
+        uint8_t nparsed = midi_parser_parse(&parser, din_out[port][idx], parsed);
+        for (uint8_t n = 0; n < nparsed && npackets < maxpackets; n++) {
+            packets[npackets++] = parsed[n];
+        }
+    }
+    return npackets;
+}
+
+//--------------------------------------------------------------------+
+// Tests
+//--------------------------------------------------------------------+
+
+// All four DIN MIDI port pairs get their buffers from the pool
+static bool test_din_ports(void)
+{
+    midi_task_init();
+    din_midi_stats_t stats;
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        CHECK(midi_task_get_din_stats(port, &stats));
+    }
+    // the buffers in midi_task.c fill the default pool exactly, RX DMA rings too
+    CHECK(pio_midi_uart_get_buffer_pool_free() == 0);
+    return true;
+}
+
+// DIN MIDI IN messages reach their USB MIDI IN cables as whole packets
+static bool test_din_to_usb(void)
+{
+    static const uint8_t bytes_a[] = { 0x90, 0x3C, 0x64, 0x3E, 0x64, 0x80, 0x3C, 0x00};
+    static const uint8_t bytes_b[] = { 0xC3, 0x05};
+    static const uint8_t expected[][4] = {
+        { 0x09, 0x90, 0x3C, 0x64}, { 0x09, 0x90, 0x3E, 0x64}, { 0x08, 0x80, 0x3C, 0x00},
+        { 0x1C, 0xC3, 0x05, 0x00},
+    };
+    midi_task_init();
+    mock_din_in_send(DIN_IN_GPIO[0], bytes_a, sizeof(bytes_a));
+    run_us(sizeof(bytes_a) * MOCK_MIDI_BYTE_US + 1000);
+    mock_din_in_send(DIN_IN_GPIO[1], bytes_b, sizeof(bytes_b));
+    run_us(sizeof(bytes_b) * MOCK_MIDI_BYTE_US + 1000);
+    CHECK(usb_in_len == 4);
+    CHECK(memcmp(usb_in, expected, sizeof(expected)) == 0);
+    // a message is as old as its first byte
+    const midi_latency_hist_t* hist = &midi_latency_hists[MIDI_ROUTER_SRC_DIN_IN(0)][MIDI_ROUTER_DEST_USB_IN(0)];
+    uint32_t count = 0;
+    for (uint8_t bucket = 0; bucket < MIDI_LATENCY_NUM_BUCKETS; bucket++) {
+        count += hist->count[bucket];
+    }
+    CHECK(count == 3);
+    CHECK(hist->max_us >= 2 * MOCK_MIDI_BYTE_US);
+    CHECK(hist->max_us <= 2 * MOCK_MIDI_BYTE_US + 2 * LOOP_US);
+    return true;
+}
+
+// USB MIDI OUT messages reach their DIN MIDI OUT port with running status
+static bool test_usb_to_din(void)
+{
+    static const uint8_t expected[] = { 0x91, 0x3C, 0x64, 0x3E, 0x64, 0xC1, 0x05};
+    midi_task_init();
+    host_send(0x19, 0x91, 0x3C, 0x64);
+    host_send(0x19, 0x91, 0x3E, 0x64);
+    host_send(0x1C, 0xC1, 0x05, 0x00);
+    run_us(sizeof(expected) * MOCK_MIDI_BYTE_US + 1000);
+    CHECK(din_out_len[1] == sizeof(expected));
+    CHECK(memcmp(din_out[1], expected, sizeof(expected)) == 0);
+    CHECK(din_out_len[0] == 0 && din_out_len[2] == 0 && din_out_len[3] == 0);
+    CHECK(usb_in_len == 0);
+    return true;
+}
+
+// A DIN MIDI OUT port sends every status byte with running status off, and
+// Note Off as Note On velocity 0 when asked to; the encoder counts what it saved
+static bool test_out_encoding(void)
+{
+    static const uint8_t expected_off[] = { 0x91, 0x3C, 0x64, 0x91, 0x3E, 0x64, 0x81, 0x3C, 0x00};
+    static const uint8_t expected_vel0[] = { 0x91, 0x3C, 0x64, 0x3E, 0x64, 0x3C, 0x00};
+    bool running_status;
+    bool note_off_as_note_on;
+    midi_task_init();
+    CHECK(midi_task_get_out_encoding(1, &running_status, &note_off_as_note_on));
+    CHECK(running_status && !note_off_as_note_on);
+    CHECK(!midi_task_set_out_encoding(NUM_PHY_MIDI_PORT_PAIRS, true, true));
+    CHECK(midi_task_set_out_encoding(1, false, false));
+    host_send(0x19, 0x91, 0x3C, 0x64);
+    host_send(0x19, 0x91, 0x3E, 0x64);
+    host_send(0x18, 0x81, 0x3C, 0x00);
+    run_us(sizeof(expected_off) * MOCK_MIDI_BYTE_US + 1000);
+    CHECK(din_out_len[1] == sizeof(expected_off));
+    CHECK(memcmp(din_out[1], expected_off, sizeof(expected_off)) == 0);
+    din_midi_stats_t stats;
+    CHECK(midi_task_get_din_stats(1, &stats) && stats.out_bytes_in == 9 && stats.out_bytes_saved == 0);
+    CHECK(midi_task_set_out_encoding(1, true, true));
+    CHECK(midi_task_get_out_encoding(1, &running_status, &note_off_as_note_on));
+    CHECK(running_status && note_off_as_note_on);
+    din_out_len[1] = 0;
+    host_send(0x19, 0x91, 0x3C, 0x64);
+    host_send(0x19, 0x91, 0x3E, 0x64);
+    host_send(0x18, 0x81, 0x3C, 0x00);
+    run_us(sizeof(expected_vel0) * MOCK_MIDI_BYTE_US + 1000);
+    CHECK(din_out_len[1] == sizeof(expected_vel0));
+    CHECK(memcmp(din_out[1], expected_vel0, sizeof(expected_vel0)) == 0);
+    CHECK(midi_task_get_din_stats(1, &stats) && stats.out_bytes_in == 18 && stats.out_bytes_saved == 2);
+    return true;
+}
+
+// A DIN MIDI IN port routed to a DIN MIDI OUT port only
+static bool test_din_to_din(void)
+{
+    static const uint8_t bytes[] = { 0xB2, 0x07, 0x64};
+    midi_task_init();
+    CHECK(set_route(MIDI_ROUTER_SRC_DIN_IN(0), MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_DIN_OUT(2))));
+    mock_din_in_send(DIN_IN_GPIO[0], bytes, sizeof(bytes));
+    run_us(2 * sizeof(bytes) * MOCK_MIDI_BYTE_US + 1000);
+    CHECK(din_out_len[2] == sizeof(bytes));
+    CHECK(memcmp(din_out[2], bytes, sizeof(bytes)) == 0);
+    CHECK(usb_in_len == 0);
+    // from the first byte in to the last byte leaving the TX buffer
+    const midi_latency_hist_t* hist = &midi_latency_hists[MIDI_ROUTER_SRC_DIN_IN(0)][MIDI_ROUTER_DEST_DIN_OUT(2)];
+    CHECK(hist->max_us >= 2 * MOCK_MIDI_BYTE_US);
+    return true;
+}
+
+// A route changed at run time takes its source to the new destinations only;
+// the next change waits until the routing loop let go of the old table
+static bool test_route_edit(void)
+{
+    static const uint8_t bytes[] = { 0x93, 0x3C, 0x64};
+    static const uint8_t expected_usb[] = { 0x29, 0x93, 0x3C, 0x64};
+    uint8_t src = MIDI_ROUTER_SRC_DIN_IN(0);
+    uint32_t dest_mask = MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_DIN_OUT(1)) |
+                         MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_USB_IN(2));
+    midi_task_init();
+    CHECK(!midi_task_set_route(MIDI_ROUTER_NUM_SOURCES, dest_mask));
+    CHECK(!midi_task_set_route(src, MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_NUM_DESTS)));
+    CHECK(midi_task_set_route(src, dest_mask));
+    CHECK(!midi_task_set_route(src, 0));
+    CHECK(midi_router_get_route(src) == dest_mask);
+    mock_din_in_send(DIN_IN_GPIO[0], bytes, sizeof(bytes));
+    run_us(2 * sizeof(bytes) * MOCK_MIDI_BYTE_US + 1000);
+    CHECK(din_out_len[1] == sizeof(bytes) && memcmp(din_out[1], bytes, sizeof(bytes)) == 0);
+    CHECK(usb_in_len == 1 && memcmp(usb_in[0], expected_usb, sizeof(expected_usb)) == 0);
+    CHECK(din_out_len[0] == 0 && din_out_len[2] == 0 && din_out_len[3] == 0);
+    // routed to nothing
+    CHECK(midi_task_set_route(src, 0));
+    mock_din_in_send(DIN_IN_GPIO[0], bytes, sizeof(bytes));
+    run_us(2 * sizeof(bytes) * MOCK_MIDI_BYTE_US + 1000);
+    CHECK(din_out_len[1] == sizeof(bytes) && usb_in_len == 1);
+    return true;
+}
+
+// Filters keep the dropped message classes and channels of a DIN MIDI IN port
+// from one destination while another destination gets everything
+static bool test_filter_din(void)
+{
+    static const uint8_t bytes[] = {
+        0xFE, 0x90, 0x3C, 0x64, 0xF8, 0x91, 0x3C, 0x64, 0xF0, 0x01, 0x02, 0xF7, 0xB0, 0x07, 0x64, 0xF8,
+    };
+    static const uint8_t expected_usb[][4] = { { 0x09, 0x90, 0x3C, 0x64}, { 0x0B, 0xB0, 0x07, 0x64}};
+    uint8_t src = MIDI_ROUTER_SRC_DIN_IN(0);
+    midi_task_init();
+    CHECK(midi_task_set_route(src, MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_USB_IN(0)) |
+                                   MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_DIN_OUT(1))));
+    midi_router_sync();
+    midi_filter_t filter;
+    midi_filter_init(&filter);
+    filter.channels = MIDI_FILTER_ALL_CHANNELS & ~(1u << 1);
+    filter.blocked = MIDI_FILTER_ACTIVE_SENSING | MIDI_FILTER_CLOCK | MIDI_FILTER_SYSEX;
+    CHECK(!midi_task_set_filter(src, MIDI_ROUTER_NUM_DESTS, &filter));
+    CHECK(midi_task_set_filter(src, MIDI_ROUTER_DEST_USB_IN(0), &filter));
+    midi_filter_t active;
+    CHECK(midi_router_get_filter(src, MIDI_ROUTER_DEST_USB_IN(0), &active));
+    CHECK(active.channels == filter.channels && active.blocked == filter.blocked);
+    mock_din_in_send(DIN_IN_GPIO[0], bytes, sizeof(bytes));
+    run_us(2 * sizeof(bytes) * MOCK_MIDI_BYTE_US + 1000);
+    CHECK(usb_in_len == 2 && memcmp(usb_in, expected_usb, sizeof(expected_usb)) == 0);
+    // the unfiltered route gets every byte; the encoder keeps them all here
+    midi_packet_t packets[16];
+    CHECK(parse_din_out(1, packets, 16) == 8);
+    return true;
+}
+
+// A filtered USB MIDI OUT cable never puts a dropped status byte or a message
+// on a dropped channel on the DIN MIDI OUT wire
+static bool test_filter_usb(void)
+{
+    static const uint8_t sysex[] = { 0xF0, 0x7D, 0x10, 0x11, 0xF7};
+    static const uint8_t expected[] = { 0x90, 0x3C, 0x64, 0xB0, 0x07, 0x64};
+    uint8_t src = MIDI_ROUTER_SRC_USB_OUT(0);
+    midi_task_init();
+    midi_filter_t filter;
+    midi_filter_init(&filter);
+    filter.channels = 1u << 0;
+    filter.blocked = MIDI_FILTER_CLOCK | MIDI_FILTER_TRANSPORT | MIDI_FILTER_ACTIVE_SENSING | MIDI_FILTER_SYSEX;
+    CHECK(midi_task_set_filter(src, MIDI_ROUTER_DEST_DIN_OUT(0), &filter));
+    host_send(0x0F, 0xFA, 0x00, 0x00);
+    host_send(0x0F, 0xF8, 0x00, 0x00);
+    host_send(0x09, 0x90, 0x3C, 0x64);
+    host_send(0x0F, 0xFE, 0x00, 0x00);
+    host_send(0x09, 0x95, 0x3C, 0x64);
+    host_send_sysex(0, sysex, sizeof(sysex));
+    host_send(0x0E, 0xEF, 0x00, 0x40);
+    host_send(0x0B, 0xB0, 0x07, 0x64);
+    host_send(0x0F, 0xFC, 0x00, 0x00);
+    run_us(40 * MOCK_MIDI_BYTE_US);
+    CHECK(host_queue_tail == host_queue_head);
+    CHECK(din_out_len[0] == sizeof(expected) && memcmp(din_out[0], expected, sizeof(expected)) == 0);
+    // passing everything again lets them through
+    midi_filter_init(&filter);
+    CHECK(midi_task_set_filter(src, MIDI_ROUTER_DEST_DIN_OUT(0), &filter));
+    host_send(0x0F, 0xF8, 0x00, 0x00);
+    host_send(0x09, 0x95, 0x3C, 0x64);
+    run_us(10 * MOCK_MIDI_BYTE_US);
+    CHECK(din_out_len[0] == sizeof(expected) + 4 && din_out[0][sizeof(expected)] == 0xF8);
+    CHECK(din_out[0][sizeof(expected) + 1] == 0x95);
+    return true;
+}
+
+// Two sources merged into one DIN MIDI OUT port interleave whole messages only
+static bool test_merge(void)
+{
+    midi_task_init();
+    uint32_t dest = MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_DIN_OUT(0));
+    CHECK(set_route(MIDI_ROUTER_SRC_DIN_IN(0), dest));
+    midi_router_sync();
+    CHECK(set_route(MIDI_ROUTER_SRC_USB_OUT(0), dest));
+    uint8_t bytes[60];
+    for (uint8_t n = 0; n < 20; n++) {
+        bytes[3 * n] = 0x91;
+        bytes[3 * n + 1] = n;
+        bytes[3 * n + 2] = 0x40;
+        host_send(0x0B, 0xB0, n, 0x7F);
+    }
+    mock_din_in_send(DIN_IN_GPIO[0], bytes, sizeof(bytes));
+    run_us(200000);
+    midi_packet_t packets[64];
+    uint32_t npackets = parse_din_out(0, packets, 64);
+    CHECK(npackets == 40);
+    uint8_t next_note = 0;
+    uint8_t next_cc = 0;
+    for (uint32_t n = 0; n < npackets; n++) {
+        if (packets[n].bytes[1] == 0x91) {
+            CHECK(packets[n].bytes[2] == next_note++ && packets[n].bytes[3] == 0x40);
+        }
+        else {
+            CHECK(packets[n].bytes[1] == 0xB0);
+            CHECK(packets[n].bytes[2] == next_cc++ && packets[n].bytes[3] == 0x7F);
+        }
+    }
+    CHECK(next_note == 20 && next_cc == 20);
+    return true;
+}
+
+// A source with weight 3 sends three messages per round robin turn while
+// another one waits, and the queue statistics of both show the backlog
+static bool test_merge_weight(void)
+{
+    midi_task_init();
+    uint8_t src0 = MIDI_ROUTER_SRC_USB_OUT(0);
+    uint8_t src1 = MIDI_ROUTER_SRC_USB_OUT(1);
+    CHECK(set_route(src1, MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_DIN_OUT(0))));
+    CHECK(!midi_task_set_merge_weight(0, src0, 0) && !midi_task_set_merge_weight(NUM_PHY_MIDI_PORT_PAIRS, src0, 3));
+    CHECK(midi_task_set_merge_weight(0, src0, 3) && midi_task_get_merge_weight(0, src0) == 3);
+    CHECK(midi_task_get_merge_weight(0, src1) == 1);
+    for (uint8_t n = 0; n < 120; n++) {
+        host_send(0x09, 0x90, n, 0x40);
+        host_send(0x19, 0x91, n, 0x40);
+    }
+    run_us(20000);
+    midi_merge_stats_t stats0;
+    midi_merge_stats_t stats1;
+    CHECK(midi_task_get_merge_stats(0, src0, &stats0) && midi_task_get_merge_stats(0, src1, &stats1));
+    CHECK(stats0.depth > 0 && stats1.depth > 0);
+    CHECK(!midi_task_get_merge_stats(0, MIDI_ROUTER_NUM_SOURCES, &stats0));
+    run_us(300000);
+    CHECK(host_queue_tail == host_queue_head);
+    CHECK(midi_task_get_merge_stats(0, src0, &stats0) && midi_task_get_merge_stats(0, src1, &stats1));
+    CHECK(stats0.depth == 0 && stats1.depth == 0);
+    CHECK(stats0.messages == 120 && stats1.messages == 120);
+    CHECK(stats0.max_depth == MIDI_MERGE_QUEUE_LENGTH && stats1.max_depth == MIDI_MERGE_QUEUE_LENGTH);
+    // the cable with weight 1 waited about three other messages each turn
+    CHECK(stats1.max_wait_us >= 3 * 2 * MOCK_MIDI_BYTE_US && stats1.max_wait_us > stats0.max_wait_us);
+    midi_packet_t packets[256];
+    uint32_t npackets = parse_din_out(0, packets, 256);
+    CHECK(npackets == 240);
+    // once both queues are full, the turns go three to one until cable 0 runs out
+    uint32_t last0 = npackets;
+    while (packets[--last0].bytes[1] != 0x90) {
+    }
+    uint32_t first = npackets / 4;
+    uint32_t n0 = 0;
+    uint32_t n1 = 0;
+    for (uint32_t n = first; n <= last0; n++) {
+        if (packets[n].bytes[1] == 0x90) {
+            ++n0;
+        }
+        else {
+            CHECK(packets[n - 1].bytes[1] == 0x90);
+            ++n1;
+        }
+    }
+    CHECK(n1 > 0 && n0 >= 3 * n1 - 3 && n0 <= 3 * n1 + 3);
+    return true;
+}
+
+// A SysEx message much longer than every buffer on the way arrives intact
+static bool test_sysex(void)
+{
+    static uint8_t sysex[600];
+    midi_task_init();
+    sysex[0] = 0xF0;
+    for (uint32_t idx = 1; idx < sizeof(sysex) - 1; idx++) {
+        sysex[idx] = (uint8_t)(idx & 0x7F);
+    }
+    sysex[sizeof(sysex) - 1] = 0xF7;
+    host_send_sysex(0, sysex, sizeof(sysex));
+    run_us(sizeof(sysex) * MOCK_MIDI_BYTE_US + 10000);
+    CHECK(host_queue_tail == host_queue_head);
+    CHECK(din_out_len[0] == sizeof(sysex));
+    CHECK(memcmp(din_out[0], sysex, sizeof(sysex)) == 0);
+    usb_midi_stats_t stats;
+    midi_task_get_usb_stats(&stats);
+    CHECK(stats.out_dropped == 0);
+    return true;
+}
+
+// A clock from another source cuts into a SysEx message on its way out
+static bool test_realtime(void)
+{
+    static uint8_t sysex[300];
+    midi_task_init();
+    CHECK(set_route(MIDI_ROUTER_SRC_USB_OUT(1), MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_DIN_OUT(0))));
+    sysex[0] = 0xF0;
+    for (uint32_t idx = 1; idx < sizeof(sysex) - 1; idx++) {
+        sysex[idx] = (uint8_t)(idx & 0x7F);
+    }
+    sysex[sizeof(sysex) - 1] = 0xF7;
+    host_send_sysex(0, sysex, sizeof(sysex));
+    run_us(20000);
+    host_send(0x1F, 0xF8, 0x00, 0x00);
+    uint32_t sent_us = time_us_32();
+    run_us(sizeof(sysex) * MOCK_MIDI_BYTE_US);
+    CHECK(din_out_len[0] == sizeof(sysex) + 1);
+    uint32_t clock_idx = 0;
+    while (clock_idx < din_out_len[0] && din_out[0][clock_idx] != 0xF8) {
+        ++clock_idx;
+    }
+    CHECK(clock_idx < sizeof(sysex) - 1);
+    // the clock only waits for the bytes already in the state machine FIFO
+    // and shifter (9), for a free FIFO entry (1) and for its own byte time (1)
+    CHECK(din_out_us[0][clock_idx] - sent_us <= 12 * MOCK_MIDI_BYTE_US + 2 * LOOP_US);
+    CHECK(memcmp(din_out[0], sysex, clock_idx) == 0);
+    CHECK(memcmp(din_out[0] + clock_idx + 1, sysex + clock_idx, sizeof(sysex) - clock_idx) == 0);
+    return true;
+}
+
+// A source that stops in the middle of a SysEx message gives up the DIN MIDI
+// OUT port after MIDI_MERGE_SYSEX_TIMEOUT_US, and the rest of its message is
+// dropped when it comes after all
+static bool test_sysex_stall(void)
+{
+    static const uint8_t expected[] = { 0xF0, 0x01, 0x02, 0x03, 0x04, 0x05, 0xF7, 0x90, 0x3C, 0x64, 0x80, 0x3C, 0x00};
+    static const uint8_t note[] = { 0x90, 0x3C, 0x64};
+    midi_task_init();
+    CHECK(set_route(MIDI_ROUTER_SRC_DIN_IN(0), MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_DIN_OUT(0))));
+    host_send(0x04, 0xF0, 0x01, 0x02);
+    host_send(0x04, 0x03, 0x04, 0x05);
+    run_ready_us(5000);
+    mock_din_in_send(DIN_IN_GPIO[0], note, sizeof(note));
+    run_ready_us(MIDI_MERGE_SYSEX_TIMEOUT_US / 2);
+    CHECK(din_out_len[0] == 6);
+    run_ready_us(MIDI_MERGE_SYSEX_TIMEOUT_US / 2 + 5000);
+    CHECK(din_out_len[0] == 10);
+    // the end of the stalled message does not come out on its own
+    host_send(0x04, 0x06, 0x07, 0x08);
+    host_send(0x05, 0xF7, 0x00, 0x00);
+    host_send(0x08, 0x80, 0x3C, 0x00);
+    run_ready_us(5000);
+    CHECK(din_out_len[0] == sizeof(expected));
+    CHECK(memcmp(din_out[0], expected, sizeof(expected)) == 0);
+    din_midi_stats_t stats;
+    CHECK(midi_task_get_din_stats(0, &stats));
+    CHECK(stats.merge_sysex_cut == 1 && stats.merge_dropped == 2);
+    return true;
+}
+
+// A USB MIDI OUT cable flooding a slow DIN MIDI OUT port loses nothing and
+// does not hold up another cable
+static bool test_usb_backpressure(void)
+{
+    const uint32_t nflood = 400;
+    midi_task_init();
+    for (uint32_t n = 0; n < nflood; n++) {
+        host_send(0x09, 0x90, (uint8_t)(n & 0x7F), (uint8_t)(1 + n / 128));
+        if (n < 10) {
+            host_send(0x19, 0x91, (uint8_t)n, 0x40);
+        }
+    }
+    run_us(50000);
+    // DIN MIDI OUT B got everything right away
+    midi_packet_t packets[512];
+    CHECK(parse_din_out(1, packets, 512) == 10);
+    CHECK(din_out_us[1][din_out_len[1] - 1] < 50000);
+    run_us(nflood * 2 * MOCK_MIDI_BYTE_US);
+    CHECK(host_queue_tail == host_queue_head);
+    uint32_t npackets = parse_din_out(0, packets, 512);
+    CHECK(npackets == nflood);
+    for (uint32_t n = 0; n < npackets; n++) {
+        CHECK(packets[n].bytes[2] == (n & 0x7F) && packets[n].bytes[3] == 1 + n / 128);
+    }
+    usb_midi_stats_t usb_stats;
+    midi_task_get_usb_stats(&usb_stats);
+    CHECK(usb_stats.out_packets == nflood + 10);
+    CHECK(usb_stats.out_dropped == 0);
+    CHECK(usb_stats.out_deferred > 0);
+    din_midi_stats_t din_stats;
+    CHECK(midi_task_get_din_stats(0, &din_stats));
+    CHECK(din_stats.merge_dropped == 0);
+    CHECK(din_stats.tx.rejected == 0);
+    return true;
+}
+
+// Two flooded USB MIDI OUT cables share the deferral pool: their messages
+// interleave in it and still reach each DIN MIDI OUT port in order
+static bool test_usb_deferred_pool(void)
+{
+    const uint32_t nflood = 300;
+    midi_task_init();
+    for (uint32_t n = 0; n < nflood; n++) {
+        host_send(0x09, 0x90, (uint8_t)(n & 0x7F), (uint8_t)(1 + n / 128));
+        host_send(0x29, 0x92, (uint8_t)(n & 0x7F), (uint8_t)(1 + n / 128));
+        if (n < 10) {
+            host_send(0x19, 0x91, (uint8_t)n, 0x40);
+        }
+    }
+    run_us(50000);
+    midi_packet_t packets[512];
+    CHECK(parse_din_out(1, packets, 512) == 10);
+    usb_midi_stats_t usb_stats;
+    midi_task_get_usb_stats(&usb_stats);
+    // the whole pool is in use, split between the two cables
+    CHECK(usb_stats.out_deferred_max == 128);
+    run_us(nflood * 2 * MOCK_MIDI_BYTE_US);
+    CHECK(host_queue_tail == host_queue_head);
+    for (uint8_t port = 0; port < 3; port += 2) {
+        uint32_t npackets = parse_din_out(port, packets, 512);
+        CHECK(npackets == nflood);
+        for (uint32_t n = 0; n < npackets; n++) {
+            CHECK(packets[n].bytes[1] == (0x90 | port));
+            CHECK(packets[n].bytes[2] == (n & 0x7F) && packets[n].bytes[3] == 1 + n / 128);
+        }
+    }
+    midi_task_get_usb_stats(&usb_stats);
+    CHECK(usb_stats.out_packets == 2 * nflood + 10 && usb_stats.out_dropped == 0);
+    return true;
+}
+
+// A USB MIDI OUT cable sending controller data much faster than the DIN MIDI
+// OUT port can take it: the port keeps up with the latest values, and a Note
+// On in between keeps its place among them
+static bool test_coalesce(void)
+{
+    const uint32_t nramp = 600;
+    midi_task_init();
+    for (uint32_t n = 0; n < nramp; n++) {
+        uint8_t value = (uint8_t)(n * 127 / (nramp - 1));
+        host_send(0x0B, 0xB0, 7, value);
+        host_send(0x0E, 0xE0, 0, value);
+        if (n == nramp / 2) {
+            host_send(0x09, 0x90, 60, value);
+        }
+    }
+    run_us(200000);
+    CHECK(host_queue_tail == host_queue_head);
+    midi_packet_t packets[512];
+    uint32_t npackets = parse_din_out(0, packets, 512);
+    din_midi_stats_t stats;
+    CHECK(midi_task_get_din_stats(0, &stats));
+    CHECK(stats.merge_dropped == 0 && stats.tx.rejected == 0);
+    CHECK(stats.merge_coalesced > 0 && npackets + stats.merge_coalesced == 2 * nramp + 1);
+    // every message whole, the values in order and the last ones sent
+    uint8_t last_cc = 0;
+    uint8_t last_bend = 0;
+    uint32_t nnotes = 0;
+    for (uint32_t n = 0; n < npackets; n++) {
+        const uint8_t* bytes = packets[n].bytes;
+        if (bytes[1] == 0xB0) {
+            CHECK(bytes[2] == 7 && bytes[3] >= last_cc);
+            last_cc = bytes[3];
+        }
+        else if (bytes[1] == 0xE0) {
+            CHECK(bytes[2] == 0 && bytes[3] >= last_bend);
+            last_bend = bytes[3];
+        }
+        else {
+            CHECK(bytes[1] == 0x90 && bytes[2] == 60);
+            // nothing sent after the Note On came before it
+            CHECK(last_cc <= bytes[3] && last_bend <= bytes[3]);
+            last_cc = bytes[3];
+            last_bend = bytes[3];
+            ++nnotes;
+        }
+    }
+    CHECK(nnotes == 1 && last_cc == 127 && last_bend == 127);
+    // it took about the wire time of a full TX buffer (128 bytes), not that
+    // of every value sent
+    CHECK(din_out_us[0][din_out_len[0] - 1] < 200 * MOCK_MIDI_BYTE_US);
+    return true;
+}
+
+// midi_task() is only ready when an IRQ handler or the USB stack signals
+// work, and no work gets stuck when it only runs then
+static bool test_event_ready(void)
+{
+    static const uint8_t bytes[] = { 0x90, 0x3C, 0x64};
+    const uint32_t nflood = 300;
+    midi_task_init();
+    run_ready_us(1000);
+    CHECK(!midi_task_is_ready());
+    CHECK(midi_task_get_wake_us() == UINT64_MAX);
+    // DIN MIDI IN bytes
+    mock_din_in_send(DIN_IN_GPIO[2], bytes, sizeof(bytes));
+    mock_advance_us(sizeof(bytes) * MOCK_MIDI_BYTE_US);
+    CHECK(midi_task_is_ready());
+    run_ready_us(100);
+    CHECK(!midi_task_is_ready());
+    CHECK(usb_in_len == 1);
+    // USB MIDI OUT packets, more than the DIN MIDI OUT port takes at once
+    for (uint32_t n = 0; n < nflood; n++) {
+        host_send(0x39, 0x93, (uint8_t)(n & 0x7F), 0x40);
+    }
+    host_flush();
+    CHECK(midi_task_is_ready());
+    run_ready_us(nflood * 2 * MOCK_MIDI_BYTE_US + 10000);
+    CHECK(host_queue_tail == host_queue_head);
+    midi_packet_t packets[512];
+    CHECK(parse_din_out(3, packets, 512) == nflood);
+    CHECK(!midi_task_is_ready());
+    return true;
+}
+
+// Check that a DIN MIDI OUT port sent Timing Clock every period_us, within
+// the rounding to whole microseconds, from index first on; return the number
+// of clocks
+static uint32_t check_clock_spacing(uint8_t port, uint32_t first, uint32_t period_us)
+{
+    uint32_t nclocks = 0;
+    uint32_t last_us = 0;
+    for (uint32_t idx = first; idx < din_out_len[port]; idx++) {
+        if (din_out[port][idx] != 0xF8) {
+            continue;
+        }
+        if (nclocks > 0) {
+            uint32_t interval_us = din_out_us[port][idx] - last_us;
+            if (interval_us < period_us || interval_us > period_us + 1) {
+                fprintf(stderr, "DIN OUT %c clock %u came %u us after the one before\n", 'A' + port, nclocks,
+                        interval_us);
+                return 0;
+            }
+        }
+        last_us = din_out_us[port][idx];
+        ++nclocks;
+    }
+    return nclocks;
+}
+
+// The internal clock ticks at the tempo times each destination's ratio,
+// Start puts every destination on the downbeat, and the tick times do not
+// depend on how often midi_task() runs
+static bool test_clock(void)
+{
+    midi_task_init();
+    CHECK(midi_clock_set_bpm(12000));
+    CHECK(midi_clock_set_ratio(MIDI_ROUTER_DEST_DIN_OUT(1), 1, 2));
+    CHECK(midi_clock_set_ratio(MIDI_ROUTER_DEST_DIN_OUT(2), 2, 1));
+    CHECK(midi_clock_set_ratio(MIDI_ROUTER_DEST_DIN_OUT(3), 0, 1));
+    CHECK(midi_clock_set_ratio(MIDI_ROUTER_DEST_USB_IN(1), 1, 1));
+    CHECK(!midi_clock_set_ratio(MIDI_ROUTER_DEST_DIN_OUT(0), 1, 0));
+    CHECK(midi_clock_send_transport(0xFA));
+    midi_clock_set_enabled(true);
+    // 120 BPM: 48 clocks per second at 1/1
+    run_ready_us(1000000);
+    for (uint8_t port = 0; port < 3; port++) {
+        CHECK(din_out_len[port] > 0 && din_out[port][0] == 0xFA);
+        // the first clock of every port goes out right after Start
+        CHECK(din_out[port][1] == 0xF8 && din_out_us[port][1] == din_out_us[0][1]);
+    }
+    // the first clock had to wait for Start on the wire
+    CHECK(check_clock_spacing(0, 2, 20833) == 47);
+    CHECK(check_clock_spacing(1, 2, 41666) == 23);
+    CHECK(check_clock_spacing(2, 2, 10416) == 95);
+    CHECK(din_out_len[3] == 0);
+    // measured at the FIFO; the late first clock does not count
+    midi_clock_stats_t stats;
+    midi_clock_get_stats(&stats);
+    CHECK(stats.out_interval_min_us[0] >= 20832 && stats.out_interval_max_us[0] <= 20834);
+    CHECK(stats.out_interval_min_us[2] >= 10415 && stats.out_interval_max_us[2] <= 10417);
+    CHECK(stats.out_interval_min_us[3] > stats.out_interval_max_us[3]);
+    CHECK(usb_in_len >= 48 && usb_in[0][0] == 0x1F && usb_in[0][1] == 0xFA);
+    for (uint32_t n = 1; n < usb_in_len; n++) {
+        CHECK(usb_in[n][0] == 0x1F && usb_in[n][1] == 0xF8);
+    }
+    // half the tempo from the next beat on; the divided clock stays on the beats
+    CHECK(midi_clock_set_bpm(6000));
+    run_ready_us(100000);
+    uint32_t first[3];
+    for (uint8_t port = 0; port < 3; port++) {
+        first[port] = din_out_len[port];
+    }
+    // clock and transport routed from elsewhere do not double the clock
+    host_send(0x0F, 0xF8, 0x00, 0x00);
+    host_send(0x0F, 0xFB, 0x00, 0x00);
+    host_send(0x0F, 0xF8, 0x00, 0x00);
+    run_ready_us(2000000);
+    CHECK(check_clock_spacing(0, first[0], 41666) == 48);
+    for (uint32_t idx = first[0]; idx < din_out_len[0]; idx++) {
+        CHECK(din_out[0][idx] == 0xF8);
+    }
+    CHECK(check_clock_spacing(1, first[1], 83333) == 24);
+    CHECK(check_clock_spacing(2, first[2], 20833) == 96);
+    uint32_t last_b_us = din_out_us[1][din_out_len[1] - 1];
+    bool on_beat = false;
+    for (uint32_t idx = first[0]; idx < din_out_len[0]; idx++) {
+        on_beat |= din_out_us[0][idx] == last_b_us;
+    }
+    CHECK(on_beat);
+    midi_clock_get_stats(&stats);
+    CHECK(stats.ticks > 0 && stats.late_max_us == 0 && stats.dropped == 0);
+    CHECK(stats.handoff_max_us[0] < MOCK_MIDI_BYTE_US);
+    // Stop goes out, the clock keeps ticking until it is disabled
+    uint32_t stop_idx = din_out_len[0];
+    CHECK(midi_clock_send_transport(0xFC));
+    run_ready_us(100000);
+    CHECK(din_out[0][stop_idx] == 0xFC);
+    CHECK(din_out_len[0] > stop_idx + 1);
+    midi_clock_set_enabled(false);
+    run_ready_us(100000);
+    uint32_t stopped_len = din_out_len[0];
+    run_ready_us(100000);
+    CHECK(din_out_len[0] == stopped_len);
+    return true;
+}
+
+// The clock starts its bytes in phase on the idle DIN MIDI OUT ports, and a
+// busy port still gets every byte, after the bytes already in its TX FIFO
+static bool test_clock_in_phase(void)
+{
+    const uint32_t nnotes = 1000;
+    midi_task_init();
+    // keep DIN OUT C busy for longer than the test runs
+    for (uint32_t n = 0; n < nnotes; n++) {
+        host_send(0x29, 0x92, (uint8_t)(n & 0x7F), 0x40);
+    }
+    run_ready_us(10000);
+    CHECK(midi_clock_send_transport(0xFA));
+    midi_clock_set_enabled(true);
+    run_ready_us(500000);
+    midi_clock_set_enabled(false);
+    run_ready_us(10000);
+    uint32_t nclocks = 0;
+    uint32_t idx_c = 0;
+    for (uint32_t idx = 0; idx < din_out_len[0]; idx++) {
+        // the same bytes at the same times on A, B and D
+        CHECK(din_out_len[1] > idx && din_out_len[3] > idx);
+        CHECK(din_out[1][idx] == din_out[0][idx] && din_out_us[1][idx] == din_out_us[0][idx]);
+        CHECK(din_out[3][idx] == din_out[0][idx] && din_out_us[3][idx] == din_out_us[0][idx]);
+        // C sends the same byte later, between its notes
+        while (idx_c < din_out_len[2] && din_out[2][idx_c] != din_out[0][idx]) {
+            ++idx_c;
+        }
+        CHECK(idx_c < din_out_len[2]);
+        CHECK(din_out_us[2][idx_c] > din_out_us[0][idx]);
+        // behind the byte on the wire and up to 8 in the TX FIFO
+        CHECK(din_out_us[2][idx_c] - din_out_us[0][idx] <= 9 * MOCK_MIDI_BYTE_US);
+        ++idx_c;
+        nclocks += din_out[0][idx] == 0xF8;
+    }
+    CHECK(din_out_len[1] == din_out_len[0] && din_out_len[3] == din_out_len[0]);
+    CHECK(nclocks >= 23);
+    din_midi_stats_t stats;
+    CHECK(midi_task_get_din_stats(0, &stats));
+    // the first clock follows Start back to back, so it waits in the lane
+    CHECK(stats.tx.rt_bytes == nclocks + 1 && stats.tx.rt_in_phase == nclocks);
+    CHECK(midi_task_get_din_stats(2, &stats));
+    CHECK(stats.tx.rt_bytes == nclocks + 1 && stats.tx.rt_in_phase < stats.tx.rt_bytes);
+    midi_clock_stats_t clock_stats;
+    midi_clock_get_stats(&clock_stats);
+    CHECK(clock_stats.dropped == 0);
+    return true;
+}
+
+// The host sends Timing Clock on USB MIDI OUT cable 0 every period_us, but
+// the device only gets it at the next 1 ms USB frame
+static void run_host_clock_us(uint32_t us, double period_us)
+{
+    static double next_tick_us = 0;
+    if (next_tick_us == 0) {
+        next_tick_us = (double)time_us_64();
+    }
+    for (uint32_t elapsed = 0; elapsed < us; elapsed += LOOP_US) {
+        if (time_us_64() >= ((uint64_t)next_tick_us / 1000 + 1) * 1000) {
+            host_send(0x0F, 0xF8, 0, 0);
+            next_tick_us += period_us;
+        }
+        run_ready_us(LOOP_US);
+    }
+}
+
+// Get the shortest and longest time between the Timing Clocks a DIN MIDI OUT
+// port sent from index first on
+static void get_clock_intervals(uint8_t port, uint32_t first, uint32_t* min_us, uint32_t* max_us)
+{
+    uint32_t last_us = 0;
+    *min_us = UINT32_MAX;
+    *max_us = 0;
+    for (uint32_t idx = first; idx < din_out_len[port]; idx++) {
+        if (din_out[port][idx] != 0xF8) {
+            continue;
+        }
+        if (last_us) {
+            uint32_t interval_us = din_out_us[port][idx] - last_us;
+            *min_us = interval_us < *min_us ? interval_us : *min_us;
+            *max_us = interval_us > *max_us ? interval_us : *max_us;
+        }
+        last_us = din_out_us[port][idx];
+    }
+}
+
+// The clock follows USB MIDI clock that arrives on 1 ms frame boundaries,
+// sends it on evenly spaced, takes Start and Stop right away and catches up
+// with a tempo jump
+static bool test_clock_sync(void)
+{
+    midi_task_init();
+    CHECK(midi_clock_set_ratio(MIDI_ROUTER_DEST_DIN_OUT(1), 1, 2));
+    CHECK(midi_clock_set_ratio(MIDI_ROUTER_DEST_DIN_OUT(2), 0, 1));
+    CHECK(midi_clock_set_ratio(MIDI_ROUTER_DEST_DIN_OUT(3), 0, 1));
+    CHECK(!midi_clock_set_sync_source(MIDI_ROUTER_NUM_SOURCES));
+    CHECK(midi_clock_set_sync_source(MIDI_ROUTER_SRC_USB_OUT(0)));
+    midi_clock_set_enabled(true);
+    run_ready_us(50000);
+    // nothing goes out before the clock comes in
+    CHECK(midi_clock_get_sync_state() == MIDI_CLOCK_SYNC_IDLE);
+    CHECK(din_out_len[0] == 0);
+    // 123 BPM
+    host_send(0x0F, 0xFA, 0, 0);
+    uint64_t start_us = time_us_64();
+    run_host_clock_us(2000000, 60000000.0 / (24 * 123));
+    CHECK(midi_clock_get_sync_state() == MIDI_CLOCK_SYNC_LOCKED);
+    // Start went out once, at once; the incoming clock does not go out as routed
+    CHECK(din_out[0][0] == 0xFA && din_out_us[0][0] - (uint32_t)start_us < 1000 + MOCK_MIDI_BYTE_US);
+    CHECK(din_out[1][0] == 0xFA);
+    uint32_t nclocks = 0;
+    for (uint32_t idx = 1; idx < din_out_len[0]; idx++) {
+        CHECK(din_out[0][idx] == 0xF8);
+        ++nclocks;
+    }
+    CHECK(nclocks >= 97 && nclocks <= 99);
+    midi_clock_stats_t stats;
+    midi_clock_get_stats(&stats);
+    CHECK(stats.bpm_x100 >= 12290 && stats.bpm_x100 <= 12310);
+    // the incoming intervals are off by up to a USB frame, the outgoing ones are not
+    midi_clock_reset_stats();
+    uint32_t first[2] = {din_out_len[0], din_out_len[1]};
+    run_host_clock_us(2000000, 60000000.0 / (24 * 123));
+    midi_clock_get_stats(&stats);
+    CHECK(stats.sync_relocks == 0 && stats.dropped == 0);
+    CHECK(stats.bpm_x100 >= 12295 && stats.bpm_x100 <= 12305);
+    CHECK(stats.in_interval_max_us - stats.in_interval_min_us >= 900);
+    CHECK(stats.out_interval_min_us[0] >= 20300 && stats.out_interval_max_us[0] <= 20350);
+    CHECK(stats.out_interval_min_us[1] >= 40600 && stats.out_interval_max_us[1] <= 40700);
+    uint32_t min_us;
+    uint32_t max_us;
+    get_clock_intervals(0, first[0], &min_us, &max_us);
+    CHECK(min_us >= 20300 && max_us <= 20350);
+    // the divided clock has every other tick
+    get_clock_intervals(1, first[1], &min_us, &max_us);
+    CHECK(min_us >= 40600 && max_us <= 40700);
+    // Stop goes out at once and the clock keeps going
+    uint32_t stop_idx = din_out_len[0];
+    host_send(0x0F, 0xFC, 0, 0);
+    run_host_clock_us(1500, 60000000.0 / (24 * 123));
+    CHECK(din_out_len[0] > stop_idx);
+    CHECK(din_out[0][stop_idx] == 0xFC);
+    // a jump to 90 BPM loses the lock for a moment
+    run_host_clock_us(1000000, 60000000.0 / (24 * 90));
+    midi_clock_get_stats(&stats);
+    CHECK(midi_clock_get_sync_state() == MIDI_CLOCK_SYNC_LOCKED);
+    CHECK(stats.sync_relocks >= 1);
+    CHECK(stats.bpm_x100 >= 8980 && stats.bpm_x100 <= 9020);
+    // the ticks stop soon after the clock stops coming in
+    run_ready_us(200000);
+    CHECK(midi_clock_get_sync_state() == MIDI_CLOCK_SYNC_IDLE);
+    uint32_t stopped_len = din_out_len[0];
+    run_ready_us(200000);
+    CHECK(din_out_len[0] == stopped_len);
+    // back to the clock's own tempo
+    CHECK(midi_clock_set_sync_source(MIDI_CLOCK_INTERNAL));
+    run_ready_us(200000);
+    CHECK(din_out_len[0] > stopped_len);
+    return true;
+}
+
+// Queue a scheduled message envelope for a microsecond in a USB frame
+static void host_send_scheduled(uint8_t cable, uint64_t frame, uint32_t offset_us, uint8_t status, uint8_t data1,
+                                uint8_t data2)
+{
+    uint32_t sched_time = (uint32_t)((frame & 0x7FF) << 10) | offset_us;
+    const uint8_t envelope[] = {
+        0xF0, MIDI_SCHED_SYSEX_ID, MIDI_SCHED_SYSEX_TYPE, (uint8_t)(sched_time & 0x7F),
+        (uint8_t)((sched_time >> 7) & 0x7F), (uint8_t)(sched_time >> 14), (uint8_t)(status & 0x7F), data1, data2, 0xF7
+    };
+    host_send_sysex(cable, envelope, sizeof(envelope));
+}
+
+// Scheduled messages go out on DIN at the time the host gave on its USB frame
+// clock, though that clock runs at another rate than the device's
+static bool test_sched(void)
+{
+    const uint32_t frame_ns = 1000050; // 50 ppm slow
+    const uint32_t nmessages = 8;
+    midi_task_init();
+    mock_usb_set_frame_ns(frame_ns);
+    midi_sched_set_enabled(true);
+    run_ready_us(4 * MIDI_SCHED_SOF_WINDOW_FRAMES * 1000 + 10000);
+    CHECK(midi_sched_is_locked());
+    midi_sched_stats_t stats;
+    midi_sched_get_stats(&stats);
+    CHECK(stats.sof_period_ns >= frame_ns - 5 && stats.sof_period_ns <= frame_ns + 5);
+    CHECK(stats.sof_relocks == 0);
+    // USB MIDI OUT cable 1 goes to DIN MIDI OUT B; every message is on
+    // another channel, so they all go out with their status bytes
+    uint64_t frame = time_us_64() * 1000 / frame_ns;
+    uint64_t due_us[nmessages];
+    for (uint32_t n = 0; n < nmessages; n++) {
+        uint64_t due_frame = frame + 20 + n * 7;
+        uint32_t offset_us = (uint32_t)(n * 137) % 1000;
+        host_send_scheduled(1, due_frame, offset_us, (uint8_t)(0x90 | n), 60, 100);
+        due_us[n] = (due_frame * frame_ns + offset_us * frame_ns / 1000) / 1000;
+    }
+    // a time that has passed goes out at once
+    host_send_scheduled(1, frame - 5, 0, 0x80, 60, 0);
+    run_ready_us(10000);
+    CHECK(din_out_len[1] == 3 && din_out[1][0] == 0x80);
+    CHECK(midi_sched_get_pending() == nmessages);
+    run_ready_us(100000);
+    CHECK(din_out_len[1] == 3 + 3 * nmessages);
+    for (uint32_t n = 0; n < nmessages; n++) {
+        uint32_t idx = 3 + 3 * n;
+        CHECK(din_out[1][idx] == (0x90 | n) && din_out[1][idx + 1] == 60 && din_out[1][idx + 2] == 100);
+        // the first byte starts on the wire when it is due
+        int64_t error_us = (int64_t)(din_out_us[1][idx] - MOCK_MIDI_BYTE_US) - (int64_t)(uint32_t)due_us[n];
+        CHECK(error_us >= -2 && error_us <= 2);
+    }
+    midi_sched_get_stats(&stats);
+    CHECK(stats.events == nmessages + 1 && stats.expired == 1 && stats.dropped == 0);
+    CHECK(stats.late_max_us == 0 && stats.handoff_max_us[1] < MOCK_MIDI_BYTE_US);
+    CHECK(midi_sched_get_pending() == 0);
+    // disabled, the envelope is routed as it is
+    midi_sched_set_enabled(false);
+    host_send_scheduled(1, frame, 0, 0x90, 60, 100);
+    run_ready_us(10000);
+    CHECK(din_out_len[1] == 3 + 3 * nmessages + 10);
+    CHECK(din_out[1][3 + 3 * nmessages] == 0xF0 && din_out[1][din_out_len[1] - 1] == 0xF7);
+    return true;
+}
+
+// A scheduled message that comes due while its DIN MIDI OUT port sends a
+// SysEx message from another cable waits for the end of the SysEx message
+static bool test_sched_sysex(void)
+{
+    static uint8_t sysex[300];
+    midi_task_init();
+    midi_sched_set_enabled(true);
+    run_ready_us(100000);
+    CHECK(midi_sched_is_locked());
+    // cable 0 goes to DIN MIDI OUT B too, next to cable 1
+    CHECK(set_route(MIDI_ROUTER_SRC_USB_OUT(0), MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_DIN_OUT(1))));
+    sysex[0] = 0xF0;
+    for (uint32_t idx = 1; idx < sizeof(sysex) - 1; idx++) {
+        sysex[idx] = (uint8_t)(idx & 0x7F);
+    }
+    sysex[sizeof(sysex) - 1] = 0xF7;
+    uint64_t frame = time_us_64() / 1000;
+    // due a third of the way through the SysEx message
+    host_send_scheduled(0, frame + sizeof(sysex) * MOCK_MIDI_BYTE_US / 3000, 0, 0x91, 60, 100);
+    host_send_sysex(1, sysex, sizeof(sysex));
+    run_ready_us(sizeof(sysex) * MOCK_MIDI_BYTE_US + 20000);
+    CHECK(din_out_len[1] == sizeof(sysex) + 3);
+    CHECK(memcmp(din_out[1], sysex, sizeof(sysex)) == 0);
+    CHECK(din_out[1][sizeof(sysex)] == 0x91 && din_out[1][sizeof(sysex) + 1] == 60);
+    midi_sched_stats_t stats;
+    midi_sched_get_stats(&stats);
+    CHECK(stats.events == 1 && stats.held == 1 && stats.dropped == 0);
+    CHECK(midi_sched_get_pending() == 0);
+    return true;
+}
+
+// Check that the message at idx of a DIN MIDI OUT port started on the wire
+// from delay_us to a loop pass after in_us
+static bool check_delayed(uint8_t port, uint32_t idx, uint32_t in_us, uint32_t delay_us)
+{
+    uint32_t start_us = din_out_us[port][idx] - MOCK_MIDI_BYTE_US;
+    CHECK(start_us - in_us >= delay_us && start_us - in_us <= delay_us + LOOP_US);
+    return true;
+}
+
+// DIN MIDI OUT ports with a constant latency send every message the delay of
+// their own after it entered, in the order the messages entered
+static bool test_constant_latency(void)
+{
+    const uint32_t delay_a_us = 5000;
+    const uint32_t delay_b_us = 7250;
+    const uint32_t nmessages = 8;
+    midi_task_init();
+    CHECK(!midi_task_set_out_delay(0, MIDI_TASK_MAX_OUT_DELAY_US + 1));
+    CHECK(midi_task_set_out_delay(0, delay_a_us));
+    CHECK(midi_task_set_out_delay(1, delay_b_us));
+    CHECK(midi_task_get_out_delay(0) == delay_a_us && midi_task_get_out_delay(2) == 0);
+    // DIN MIDI IN A goes to DIN MIDI OUT A next to USB MIDI OUT cable 0;
+    // cable 1 goes to DIN MIDI OUT B
+    CHECK(set_route(MIDI_ROUTER_SRC_DIN_IN(0), MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_DIN_OUT(0))));
+    uint32_t usb_us[nmessages];
+    uint32_t din_us[nmessages];
+    for (uint32_t n = 0; n < nmessages; n++) {
+        // every message is on another channel, so they all go out with their
+        // status bytes; the DIN message enters first every other time
+        const uint8_t cc[] = { (uint8_t)(0xB0 | n), 7, 100};
+        if (n % 2 == 0) {
+            mock_din_in_send(DIN_IN_GPIO[0], cc, sizeof(cc));
+            // a message enters when its first byte has arrived
+            din_us[n] = time_us_32() + MOCK_MIDI_BYTE_US;
+            run_ready_us(1500 + 20 * n);
+        }
+        host_send(0x09, (uint8_t)(0x90 | n), 60, 100);
+        host_send(0x19, (uint8_t)(0x90 | n), 62, 100);
+        usb_us[n] = time_us_32();
+        run_ready_us(1500 + 20 * n);
+        if (n % 2 == 1) {
+            mock_din_in_send(DIN_IN_GPIO[0], cc, sizeof(cc));
+            din_us[n] = time_us_32() + MOCK_MIDI_BYTE_US;
+        }
+        run_ready_us(2000);
+    }
+    run_ready_us(20000);
+    CHECK(din_out_len[0] == 6 * nmessages && din_out_len[1] == 3 * nmessages);
+    for (uint32_t n = 0; n < nmessages; n++) {
+        uint32_t note_idx = 6 * n + (n % 2 == 0 ? 3 : 0);
+        uint32_t cc_idx = 6 * n + (n % 2 == 0 ? 0 : 3);
+        CHECK(din_out[0][note_idx] == (0x90 | n) && din_out[0][note_idx + 1] == 60);
+        CHECK(check_delayed(0, note_idx, usb_us[n], delay_a_us));
+        CHECK(din_out[0][cc_idx] == (0xB0 | n) && din_out[0][cc_idx + 1] == 7);
+        CHECK(check_delayed(0, cc_idx, din_us[n], delay_a_us));
+        CHECK(din_out[1][3 * n] == (0x90 | n) && din_out[1][3 * n + 1] == 62);
+        CHECK(check_delayed(1, 3 * n, usb_us[n], delay_b_us));
+    }
+    din_midi_stats_t stats;
+    CHECK(midi_task_get_din_stats(0, &stats) && stats.merge_dropped == 0);
+    // without a delay, a message goes out as soon as possible again
+    CHECK(midi_task_set_out_delay(0, 0));
+    host_send(0x09, 0x80, 60, 0);
+    uint32_t sent_us = time_us_32();
+    run_ready_us(5000);
+    CHECK(din_out_len[0] == 6 * nmessages + 3 && din_out[0][6 * nmessages] == 0x80);
+    CHECK(din_out_us[0][6 * nmessages] - sent_us <= MOCK_MIDI_BYTE_US + 2 * LOOP_US);
+    return true;
+}
+
+// tud_midi_demux_stream_read() returns the bytes of one cable at a time
+static bool test_demux_stream_read(void)
+{
+    static const uint8_t packets[][4] = {
+        { 0x09, 0x90, 0x3C, 0x64}, { 0x0C, 0xC0, 0x05, 0x00}, { 0x39, 0x93, 0x40, 0x64},
+    };
+    for (uint8_t n = 0; n < 3; n++) {
+        CHECK(mock_usb_midi_out_send(packets[n]));
+    }
+    uint8_t cable = 0xFF;
+    uint8_t bytes[16];
+    CHECK(tud_midi_demux_stream_read(&cable, bytes, sizeof(bytes)) == 5);
+    CHECK(cable == 0);
+    CHECK(memcmp(bytes, "\x90\x3C\x64\xC0\x05", 5) == 0);
+    CHECK(tud_midi_demux_stream_read(&cable, bytes, sizeof(bytes)) == 3);
+    CHECK(cable == 3);
+    CHECK(memcmp(bytes, "\x93\x40\x64", 3) == 0);
+    CHECK(tud_midi_demux_stream_read(&cable, bytes, sizeof(bytes)) == 0);
+    return true;
+}
+
+// The lock-free ring between two threads: every byte arrives once and in order
+#define SPSC_TEST_BYTES (1u << 20)
+static uint8_t spsc_test_buf[256];
+static spsc_ring_t spsc_test_ring;
+
+static void* spsc_test_producer(void* arg)
+{
+    (void)arg;
+    uint8_t chunk[64];
+    uint32_t seed = 1;
+    uint32_t sent = 0;
+    while (sent < SPSC_TEST_BYTES) {
+        seed = seed * 1103515245u + 12345u;
+        uint32_t len = 1 + (seed >> 16) % sizeof(chunk);
+        if (len > SPSC_TEST_BYTES - sent) {
+            len = SPSC_TEST_BYTES - sent;
+        }
+        for (uint32_t idx = 0; idx < len; idx++) {
+            chunk[idx] = (uint8_t)((sent + idx) * 7);
+        }
+        uint32_t count = spsc_ring_push(&spsc_test_ring, chunk, len);
+        if (count == 0) {
+            // let the consumer run, even on a single CPU
+            sched_yield();
+        }
+        sent += count;
+    }
+    return NULL;
+}
+
+static bool test_spsc_threads(void)
+{
+    CHECK(spsc_ring_init(&spsc_test_ring, spsc_test_buf, sizeof(spsc_test_buf)));
+    pthread_t producer;
+    CHECK(pthread_create(&producer, NULL, spsc_test_producer, NULL) == 0);
+    uint8_t chunk[48];
+    uint32_t received = 0;
+    uint32_t errors = 0;
+    while (received < SPSC_TEST_BYTES) {
+        uint32_t len = spsc_ring_pop(&spsc_test_ring, chunk, sizeof(chunk));
+        for (uint32_t idx = 0; idx < len; idx++) {
+            if (chunk[idx] != (uint8_t)((received + idx) * 7)) {
+                ++errors;
+            }
+        }
+        if (len == 0) {
+            sched_yield();
+        }
+        received += len;
+    }
+    pthread_join(producer, NULL);
+    CHECK(errors == 0);
+    CHECK(spsc_ring_is_empty(&spsc_test_ring));
+    return true;
+}
+
+typedef struct {
+    const char* name;
+    bool (*run)(void);
+} host_test_t;
+
+static const host_test_t host_tests[] = {
+    { "din_ports", test_din_ports},
+    { "din_to_usb", test_din_to_usb},
+    { "usb_to_din", test_usb_to_din},
+    { "din_to_din", test_din_to_din},
+    { "route_edit", test_route_edit},
+    { "filter_din", test_filter_din},
+    { "filter_usb", test_filter_usb},
+    { "out_encoding", test_out_encoding},
+    { "merge", test_merge},
+    { "merge_weight", test_merge_weight},
+    { "sysex", test_sysex},
+    { "realtime", test_realtime},
+    { "sysex_stall", test_sysex_stall},
+    { "usb_backpressure", test_usb_backpressure},
+    { "usb_deferred_pool", test_usb_deferred_pool},
+    { "coalesce", test_coalesce},
+    { "event_ready", test_event_ready},
+    { "clock", test_clock},
+    { "clock_in_phase", test_clock_in_phase},
+    { "clock_sync", test_clock_sync},
+    { "sched", test_sched},
+    { "sched_sysex", test_sched_sysex},
+    { "constant_latency", test_constant_latency},
+    { "demux_stream_read", test_demux_stream_read},
+    { "spsc_threads", test_spsc_threads},
+};
+
+int main(int argc, char** argv)
+{
+    for (size_t n = 0; argc == 2 && n < sizeof(host_tests) / sizeof(host_tests[0]); n++) {
+        if (strcmp(argv[1], host_tests[n].name) == 0) {
+            bool passed = host_tests[n].run();
+            printf("%s: %s\n", host_tests[n].name, passed ? "passed" : "FAILED");
+            return passed ? 0 : 1;
+        }
+    }
+    fprintf(stderr, "usage: %s <test>\ntests:", argv[0]);
+    for (size_t n = 0; n < sizeof(host_tests) / sizeof(host_tests[0]); n++) {
+        fprintf(stderr, " %s", host_tests[n].name);
+    }
+    fprintf(stderr, "\n");
+    return 2;
+}
@@ -0,0 +1,86 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/types.h"
+#include "hardware/pio.h"
+
+// Host stand-in for hardware/dma.h with what PIO_MIDI_UART_RX_DMA uses: an
+// 8-bit channel paced by a PIO RX FIFO that writes a ring in memory. The
+// channel moves a byte as soon as the state machine pushes it (see
+// mock_hw.c). TX DMA is not modelled.
+
+enum dma_channel_transfer_size {
+    DMA_SIZE_8 = 0,
+    DMA_SIZE_16 = 1,
+    DMA_SIZE_32 = 2
+};
+
+typedef struct {
+    bool write_increment;
+    uint ring_bits; // the write address wraps at 2^ring_bits bytes; 0 for no ring
+    uint dreq;
+} dma_channel_config;
+
+typedef struct {
+    volatile uint32_t transfer_count;
+} dma_channel_hw_t;
+
+int dma_claim_unused_channel(bool required);
+dma_channel_config dma_channel_get_default_config(uint channel);
+dma_channel_hw_t* dma_channel_hw_addr(uint channel);
+void dma_channel_configure(uint channel, const dma_channel_config* config, volatile void* write_addr,
+                           const volatile void* read_addr, uint transfer_count, bool trigger);
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger);
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx);
+
+static inline void channel_config_set_transfer_data_size(dma_channel_config* config,
+                                                         enum dma_channel_transfer_size size)
+{
+    (void)config;
+    (void)size;
+}
+
+static inline void channel_config_set_read_increment(dma_channel_config* config, bool incr)
+{
+    (void)config;
+    (void)incr;
+}
+
+static inline void channel_config_set_write_increment(dma_channel_config* config, bool incr)
+{
+    config->write_increment = incr;
+}
+
+static inline void channel_config_set_ring(dma_channel_config* config, bool write, uint size_bits)
+{
+    config->ring_bits = write ? size_bits : 0;
+}
+
+static inline void channel_config_set_dreq(dma_channel_config* config, uint dreq)
+{
+    config->dreq = dreq;
+}
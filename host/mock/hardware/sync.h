@@ -0,0 +1,63 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Host stand-ins for the Cortex-M0+ memory barrier, events and interrupt masking.
+// Interrupts are the IRQ handlers mock_hw.c runs; masking them defers the
+// handlers until restore_interrupts().
+
+static inline void __dmb(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief set the event register of both cores, like the SEV instruction
+ */
+void __sev(void);
+
+/**
+ * @brief wait for an event, like the WFE instruction; only core1 waits in the
+ * host build, and an IRQ handler that runs or __sev() wakes it (see
+ * pico/multicore.h)
+ */
+void __wfe(void);
+
+/**
+ * @brief mask the IRQ handlers
+ *
+ * @return the masking state to pass to restore_interrupts()
+ */
+uint32_t save_and_disable_interrupts(void);
+
+/**
+ * @brief restore the masking state save_and_disable_interrupts() returned and
+ * run the handlers of the interrupts that became pending in the meantime
+ *
+ * @param status the masking state
+ */
+void restore_interrupts(uint32_t status);
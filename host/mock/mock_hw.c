@@ -0,0 +1,732 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "hardware/pio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "hardware/dma.h"
+#include "pico/multicore.h"
+#include "pico/time.h"
+#include "pio_midi_uart.pio.h"
+#include "mock_hw.h"
+
+#define MOCK_NUM_PIOS 2
+#define MOCK_NUM_SMS 4
+#define MOCK_PIO_INSTRUCTIONS 32
+#define MOCK_NUM_IRQS 32
+// The MIDI programs join the RX and TX FIFOs of a state machine
+#define MOCK_FIFO_DEPTH 8
+#define MOCK_NUM_ALARMS 4
+#define MOCK_NUM_DMA_CHANNELS 12
+// IRQ handler runs in a row that mean an interrupt can never be cleared
+#define MOCK_IRQ_LIVELOCK_RUNS 10000
+
+typedef enum {
+    MOCK_SM_UNUSED,
+    MOCK_SM_RX,
+    MOCK_SM_TX,
+} mock_sm_role_t;
+
+/**
+ * @struct a DIN MIDI wire: the bytes still to arrive at an RX state machine
+ * or the bytes a TX state machine sent
+ */
+typedef struct {
+    uint8_t bytes[MOCK_WIRE_LENGTH];
+    uint32_t times_us[MOCK_WIRE_LENGTH]; // when each sent byte's stop bit ended
+    uint32_t head;                       // free-running write index
+    uint32_t tail;                       // free-running read index
+} mock_wire_t;
+
+/**
+ * @struct a state machine running midi_rx_program or midi_tx_program
+ */
+typedef struct {
+    bool claimed;
+    bool enabled;
+    mock_sm_role_t role;
+    uint pin;
+    uint8_t fifo[MOCK_FIFO_DEPTH];
+    uint8_t fifo_head;
+    uint8_t fifo_count;
+    bool busy;              // a byte is on the wire
+    uint64_t busy_until_us; // when the byte on the wire is complete
+    uint8_t shift;          // the byte a TX state machine is sending
+    mock_wire_t wire;
+    uint32_t overruns;      // RX bytes lost because the FIFO was full
+} mock_sm_t;
+
+pio_hw_t mock_pio_hw[MOCK_NUM_PIOS];
+const pio_program_t midi_rx_program = {.instructions = NULL, .length = 9, .origin = -1};
+const pio_program_t midi_tx_program = {.instructions = NULL, .length = 6, .origin = -1};
+
+static mock_sm_t mock_sms[MOCK_NUM_PIOS][MOCK_NUM_SMS];
+static uint32_t mock_pio_inte[MOCK_NUM_PIOS][2]; // interrupt source enables of PIO IRQ 0 and 1
+static uint mock_pio_used_instructions[MOCK_NUM_PIOS];
+static uint64_t mock_now_us = 0;
+static irq_handler_t mock_irq_handlers[MOCK_NUM_IRQS];
+static uint32_t mock_irq_enabled = 0;
+static bool mock_irq_masked = false;
+static bool mock_in_irq = false;
+static bool mock_time_irqs = false; // time the handlers that run while virtual time moves
+static uint64_t mock_irq_ns = 0;
+static bool mock_alarm_claimed[MOCK_NUM_ALARMS];
+static bool mock_alarm_armed[MOCK_NUM_ALARMS];
+static uint64_t mock_alarm_target_us[MOCK_NUM_ALARMS];
+static hardware_alarm_callback_t mock_alarm_callbacks[MOCK_NUM_ALARMS];
+// The cores take turns; see pico/multicore.h
+static void (*mock_core1_entry)(void) = NULL;
+static pthread_mutex_t mock_core_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mock_core_cond = PTHREAD_COND_INITIALIZER;
+static uint mock_core_running = 0; // the core whose turn it is
+static bool mock_core1_event = false; // the event register of core1
+static uint64_t mock_core1_timeout_us = UINT64_MAX; // when core1 stops waiting for an event
+
+/**
+ * @struct a DMA channel paced by a PIO RX FIFO
+ */
+typedef struct {
+    bool claimed;
+    dma_channel_config config;
+    dma_channel_hw_t hw;
+    volatile uint8_t* write_base; // the write address the channel was configured with
+    uint32_t write_offset;        // bytes written since then
+} mock_dma_t;
+static mock_dma_t mock_dmas[MOCK_NUM_DMA_CHANNELS];
+
+static inline uint mock_pio_index(PIO pio)
+{
+    return (uint)(pio - mock_pio_hw);
+}
+
+static mock_sm_t* mock_find_sm(uint32_t gpio, mock_sm_role_t role)
+{
+    for (uint pio_idx = 0; pio_idx < MOCK_NUM_PIOS; pio_idx++) {
+        for (uint sm = 0; sm < MOCK_NUM_SMS; sm++) {
+            mock_sm_t* mock_sm = &mock_sms[pio_idx][sm];
+            if (mock_sm->role == role && mock_sm->pin == gpio) {
+                return mock_sm;
+            }
+        }
+    }
+    fprintf(stderr, "mock_hw: no %s state machine on GPIO %u\n", role == MOCK_SM_RX ? "RX" : "TX", (unsigned)gpio);
+    abort();
+}
+
+// Recompute the interrupt status registers from the FIFO levels
+static void mock_pio_update_ints(uint pio_idx)
+{
+    uint32_t raw = 0;
+    for (uint sm = 0; sm < MOCK_NUM_SMS; sm++) {
+        const mock_sm_t* mock_sm = &mock_sms[pio_idx][sm];
+        if (mock_sm->role == MOCK_SM_RX && mock_sm->fifo_count > 0) {
+            raw |= 1u << (pis_sm0_rx_fifo_not_empty + sm);
+        }
+        if (mock_sm->role != MOCK_SM_RX && mock_sm->fifo_count < MOCK_FIFO_DEPTH) {
+            raw |= 1u << (pis_sm0_tx_fifo_not_full + sm);
+        }
+    }
+    *(volatile uint32_t*)&mock_pio_hw[pio_idx].ints0 = raw & mock_pio_inte[pio_idx][0];
+    *(volatile uint32_t*)&mock_pio_hw[pio_idx].ints1 = raw & mock_pio_inte[pio_idx][1];
+}
+
+static bool mock_irq_is_pending(uint num)
+{
+    if (!(mock_irq_enabled & (1u << num)) || mock_irq_handlers[num] == NULL) {
+        return false;
+    }
+    switch (num) {
+    case PIO0_IRQ_0:
+        return mock_pio_hw[0].ints0 != 0;
+    case PIO0_IRQ_1:
+        return mock_pio_hw[0].ints1 != 0;
+    case PIO1_IRQ_0:
+        return mock_pio_hw[1].ints0 != 0;
+    case PIO1_IRQ_1:
+        return mock_pio_hw[1].ints1 != 0;
+    case TIMER_IRQ_0:
+    case TIMER_IRQ_1:
+    case TIMER_IRQ_2:
+    case TIMER_IRQ_3:
+        return mock_alarm_armed[num - TIMER_IRQ_0] && mock_alarm_target_us[num - TIMER_IRQ_0] <= mock_now_us;
+    default:
+        return false;
+    }
+}
+
+// Run the handlers of the pending interrupts until none is pending
+static void mock_irq_service(void)
+{
+    if (mock_irq_masked || mock_in_irq) {
+        return;
+    }
+    mock_in_irq = true;
+    uint32_t nruns = 0;
+    bool ran;
+    do {
+        ran = false;
+        for (uint num = 0; num < MOCK_NUM_IRQS; num++) {
+            if (mock_irq_is_pending(num)) {
+                struct timespec start;
+                if (mock_time_irqs) {
+                    clock_gettime(CLOCK_MONOTONIC, &start);
+                }
+                mock_irq_handlers[num]();
+                if (mock_time_irqs) {
+                    struct timespec end;
+                    clock_gettime(CLOCK_MONOTONIC, &end);
+                    mock_irq_ns += (uint64_t)((end.tv_sec - start.tv_sec) * 1000000000l + (end.tv_nsec - start.tv_nsec));
+                }
+                ran = true;
+                // taking an interrupt wakes a core from __wfe()
+                mock_core1_event = true;
+                if (++nruns == MOCK_IRQ_LIVELOCK_RUNS) {
+                    fprintf(stderr, "mock_hw: IRQ %u stays pending after %u handler runs\n", num, nruns);
+                    abort();
+                }
+            }
+        }
+    } while (ran);
+    mock_in_irq = false;
+}
+
+// Start sending the next byte in the TX FIFO, if any
+static void mock_tx_start(mock_sm_t* mock_sm, uint64_t start_us)
+{
+    if (mock_sm->fifo_count == 0 || !mock_sm->enabled) {
+        mock_sm->busy = false;
+        return;
+    }
+    mock_sm->shift = mock_sm->fifo[mock_sm->fifo_head];
+    mock_sm->fifo_head = (uint8_t)((mock_sm->fifo_head + 1) % MOCK_FIFO_DEPTH);
+    --mock_sm->fifo_count;
+    mock_sm->busy = true;
+    mock_sm->busy_until_us = start_us + MOCK_MIDI_BYTE_US;
+}
+
+// Let the DMA channels paced by RX FIFOs move the bytes that are there
+static void mock_dma_service(void)
+{
+    for (uint ch = 0; ch < MOCK_NUM_DMA_CHANNELS; ch++) {
+        mock_dma_t* dma = &mock_dmas[ch];
+        uint dreq = dma->config.dreq;
+        if (!dma->claimed || dma->write_base == NULL || !(dreq & 4)) {
+            continue;
+        }
+        uint pio_idx = dreq >> 3;
+        mock_sm_t* mock_sm = &mock_sms[pio_idx][dreq & 3];
+        while (mock_sm->fifo_count > 0 && dma->hw.transfer_count > 0) {
+            // like the hardware, a ring wraps the low bits of the write address
+            uintptr_t addr = (uintptr_t)dma->write_base + dma->write_offset;
+            if (dma->config.ring_bits) {
+                uintptr_t mask = ((uintptr_t)1 << dma->config.ring_bits) - 1;
+                addr = ((uintptr_t)dma->write_base & ~mask) | (addr & mask);
+            }
+            *(volatile uint8_t*)addr = mock_sm->fifo[mock_sm->fifo_head];
+            mock_sm->fifo_head = (uint8_t)((mock_sm->fifo_head + 1) % MOCK_FIFO_DEPTH);
+            --mock_sm->fifo_count;
+            if (dma->config.write_increment) {
+                ++dma->write_offset;
+            }
+            --dma->hw.transfer_count;
+        }
+        mock_pio_update_ints(pio_idx);
+    }
+}
+
+// Finish the byte on the wire of a state machine
+static void mock_sm_step(mock_sm_t* mock_sm)
+{
+    mock_wire_t* wire = &mock_sm->wire;
+    if (mock_sm->role == MOCK_SM_RX) {
+        uint8_t val = wire->bytes[wire->tail++ & (MOCK_WIRE_LENGTH - 1)];
+        if (mock_sm->fifo_count < MOCK_FIFO_DEPTH) {
+            mock_sm->fifo[(mock_sm->fifo_head + mock_sm->fifo_count++) % MOCK_FIFO_DEPTH] = val;
+        }
+        else {
+            ++mock_sm->overruns;
+        }
+        mock_sm->busy = wire->head != wire->tail;
+        mock_sm->busy_until_us += MOCK_MIDI_BYTE_US;
+    }
+    else {
+        if (wire->head - wire->tail == MOCK_WIRE_LENGTH) {
+            fprintf(stderr, "mock_hw: DIN MIDI OUT on GPIO %u is full; call mock_din_out_receive()\n", mock_sm->pin);
+            abort();
+        }
+        wire->bytes[wire->head & (MOCK_WIRE_LENGTH - 1)] = mock_sm->shift;
+        wire->times_us[wire->head++ & (MOCK_WIRE_LENGTH - 1)] = (uint32_t)mock_sm->busy_until_us;
+        mock_tx_start(mock_sm, mock_sm->busy_until_us);
+    }
+}
+
+//--------------------------------------------------------------------+
+// Pico SDK stand-ins
+//--------------------------------------------------------------------+
+
+uint32_t time_us_32(void)
+{
+    return (uint32_t)mock_now_us;
+}
+
+uint64_t time_us_64(void)
+{
+    return mock_now_us;
+}
+
+uint32_t save_and_disable_interrupts(void)
+{
+    uint32_t status = mock_irq_masked;
+    mock_irq_masked = true;
+    return status;
+}
+
+void restore_interrupts(uint32_t status)
+{
+    mock_irq_masked = status != 0;
+    mock_irq_service();
+}
+
+void irq_set_enabled(uint num, bool enabled)
+{
+    if (enabled) {
+        mock_irq_enabled |= 1u << num;
+        mock_irq_service();
+    }
+    else {
+        mock_irq_enabled &= ~(1u << num);
+    }
+}
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler)
+{
+    if (mock_irq_handlers[num] != NULL && mock_irq_handlers[num] != handler) {
+        fprintf(stderr, "mock_hw: IRQ %u already has a handler\n", num);
+        abort();
+    }
+    mock_irq_handlers[num] = handler;
+}
+
+void irq_add_shared_handler(uint num, irq_handler_t handler, uint8_t order_priority)
+{
+    (void)order_priority;
+    mock_irq_handlers[num] = handler;
+}
+
+// The handler of all alarm IRQs; it disarms the alarms that fired before
+// their callbacks run, as the SDK's does
+static void mock_timer_irq(void)
+{
+    for (uint alarm = 0; alarm < MOCK_NUM_ALARMS; alarm++) {
+        if (mock_alarm_armed[alarm] && mock_alarm_target_us[alarm] <= mock_now_us) {
+            mock_alarm_armed[alarm] = false;
+            mock_alarm_callbacks[alarm](alarm);
+        }
+    }
+}
+
+int hardware_alarm_claim_unused(bool required)
+{
+    for (uint alarm = 0; alarm < MOCK_NUM_ALARMS; alarm++) {
+        if (!mock_alarm_claimed[alarm]) {
+            mock_alarm_claimed[alarm] = true;
+            return (int)alarm;
+        }
+    }
+    if (required) {
+        fprintf(stderr, "mock_hw: no hardware alarm left\n");
+        abort();
+    }
+    return -1;
+}
+
+void hardware_alarm_set_callback(uint alarm_num, hardware_alarm_callback_t callback)
+{
+    mock_alarm_callbacks[alarm_num] = callback;
+    mock_alarm_armed[alarm_num] = false;
+    irq_set_exclusive_handler(TIMER_IRQ_0 + alarm_num, mock_timer_irq);
+    irq_set_enabled(TIMER_IRQ_0 + alarm_num, callback != NULL);
+}
+
+bool hardware_alarm_set_target(uint alarm_num, absolute_time_t t)
+{
+    if (t <= mock_now_us) {
+        mock_alarm_armed[alarm_num] = false;
+        return true;
+    }
+    mock_alarm_target_us[alarm_num] = t;
+    mock_alarm_armed[alarm_num] = true;
+    return false;
+}
+
+void pio_set_irqn_source_enabled(PIO pio, uint irq_index, enum pio_interrupt_source source, bool enabled)
+{
+    uint pio_idx = mock_pio_index(pio);
+    if (enabled) {
+        mock_pio_inte[pio_idx][irq_index] |= 1u << source;
+    }
+    else {
+        mock_pio_inte[pio_idx][irq_index] &= ~(1u << source);
+    }
+    mock_pio_update_ints(pio_idx);
+    mock_irq_service();
+}
+
+bool pio_sm_is_claimed(PIO pio, uint sm)
+{
+    return mock_sms[mock_pio_index(pio)][sm].claimed;
+}
+
+void pio_sm_claim(PIO pio, uint sm)
+{
+    mock_sms[mock_pio_index(pio)][sm].claimed = true;
+}
+
+bool pio_can_add_program(PIO pio, const pio_program_t* program)
+{
+    return mock_pio_used_instructions[mock_pio_index(pio)] + program->length <= MOCK_PIO_INSTRUCTIONS;
+}
+
+uint pio_add_program(PIO pio, const pio_program_t* program)
+{
+    uint pio_idx = mock_pio_index(pio);
+    uint offset = mock_pio_used_instructions[pio_idx];
+    mock_pio_used_instructions[pio_idx] += program->length;
+    return offset;
+}
+
+bool pio_sm_is_rx_fifo_empty(PIO pio, uint sm)
+{
+    return mock_sms[mock_pio_index(pio)][sm].fifo_count == 0;
+}
+
+bool pio_sm_is_tx_fifo_full(PIO pio, uint sm)
+{
+    return mock_sms[mock_pio_index(pio)][sm].fifo_count == MOCK_FIFO_DEPTH;
+}
+
+uint32_t pio_sm_get(PIO pio, uint sm)
+{
+    uint pio_idx = mock_pio_index(pio);
+    mock_sm_t* mock_sm = &mock_sms[pio_idx][sm];
+    if (mock_sm->fifo_count == 0) {
+        return 0;
+    }
+    uint8_t val = mock_sm->fifo[mock_sm->fifo_head];
+    mock_sm->fifo_head = (uint8_t)((mock_sm->fifo_head + 1) % MOCK_FIFO_DEPTH);
+    --mock_sm->fifo_count;
+    mock_pio_update_ints(pio_idx);
+    return val;
+}
+
+void pio_sm_put(PIO pio, uint sm, uint32_t data)
+{
+    uint pio_idx = mock_pio_index(pio);
+    mock_sm_t* mock_sm = &mock_sms[pio_idx][sm];
+    if (mock_sm->fifo_count == MOCK_FIFO_DEPTH) {
+        return; // the PIO drops writes to a full FIFO
+    }
+    mock_sm->fifo[(mock_sm->fifo_head + mock_sm->fifo_count++) % MOCK_FIFO_DEPTH] = (uint8_t)data;
+    if (!mock_sm->busy) {
+        mock_tx_start(mock_sm, mock_now_us);
+    }
+    mock_pio_update_ints(pio_idx);
+}
+
+bool pio_sm_is_tx_fifo_empty(PIO pio, uint sm)
+{
+    return mock_sms[mock_pio_index(pio)][sm].fifo_count == 0;
+}
+
+uint pio_get_index(PIO pio)
+{
+    return mock_pio_index(pio);
+}
+
+// A stopped TX state machine finishes nothing here; the library only stops
+// idle ones
+void pio_set_sm_mask_enabled(PIO pio, uint32_t mask, bool enabled)
+{
+    for (uint sm = 0; sm < MOCK_NUM_SMS; sm++) {
+        if (mask & (1u << sm)) {
+            mock_sm_t* mock_sm = &mock_sms[mock_pio_index(pio)][sm];
+            mock_sm->enabled = enabled;
+            if (enabled && mock_sm->role == MOCK_SM_TX && !mock_sm->busy) {
+                mock_tx_start(mock_sm, mock_now_us);
+            }
+        }
+    }
+    mock_pio_update_ints(mock_pio_index(pio));
+}
+
+void pio_enable_sm_mask_in_sync(PIO pio, uint32_t mask)
+{
+    pio_set_sm_mask_enabled(pio, mask, true);
+}
+
+// DREQ numbers: bit 2 set for RX, the PIO index above it
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx)
+{
+    return (mock_pio_index(pio) << 3) | (is_tx ? 0 : 4) | sm;
+}
+
+int dma_claim_unused_channel(bool required)
+{
+    for (uint ch = 0; ch < MOCK_NUM_DMA_CHANNELS; ch++) {
+        if (!mock_dmas[ch].claimed) {
+            mock_dmas[ch].claimed = true;
+            return (int)ch;
+        }
+    }
+    if (required) {
+        fprintf(stderr, "mock_hw: no DMA channel left\n");
+        abort();
+    }
+    return -1;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel)
+{
+    (void)channel;
+    dma_channel_config config = {.write_increment = false, .ring_bits = 0, .dreq = 0};
+    return config;
+}
+
+dma_channel_hw_t* dma_channel_hw_addr(uint channel)
+{
+    return &mock_dmas[channel].hw;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config* config, volatile void* write_addr,
+                           const volatile void* read_addr, uint transfer_count, bool trigger)
+{
+    (void)read_addr; // always the RX FIFO the channel is paced by
+    mock_dma_t* dma = &mock_dmas[channel];
+    if (config->ring_bits && ((uintptr_t)write_addr & ((1u << config->ring_bits) - 1)) != 0) {
+        // the ring would wrap outside the buffer
+        fprintf(stderr, "mock_hw: DMA write ring of %u bytes at unaligned address %p\n", 1u << config->ring_bits,
+                (void*)(uintptr_t)write_addr);
+        abort();
+    }
+    dma->config = *config;
+    dma->write_base = (volatile uint8_t*)write_addr;
+    dma->write_offset = 0;
+    dma->hw.transfer_count = trigger ? transfer_count : 0;
+}
+
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger)
+{
+    mock_dmas[channel].hw.transfer_count = trigger ? trans_count : 0;
+}
+
+bool midi_tx_program_is_idle(PIO pio, uint sm)
+{
+    const mock_sm_t* mock_sm = &mock_sms[mock_pio_index(pio)][sm];
+    return mock_sm->enabled && !mock_sm->busy && mock_sm->fifo_count == 0;
+}
+
+void midi_rx_program_init(PIO pio, uint sm, uint offset, uint pin, uint baud)
+{
+    (void)offset;
+    (void)baud;
+    mock_sms[mock_pio_index(pio)][sm].enabled = true;
+    mock_sms[mock_pio_index(pio)][sm].role = MOCK_SM_RX;
+    mock_sms[mock_pio_index(pio)][sm].pin = pin;
+    mock_pio_update_ints(mock_pio_index(pio));
+}
+
+void midi_tx_program_init(PIO pio, uint sm, uint offset, uint pin_tx, uint baud)
+{
+    (void)offset;
+    (void)baud;
+    mock_sms[mock_pio_index(pio)][sm].enabled = true;
+    mock_sms[mock_pio_index(pio)][sm].role = MOCK_SM_TX;
+    mock_sms[mock_pio_index(pio)][sm].pin = pin_tx;
+    mock_pio_update_ints(mock_pio_index(pio));
+}
+
+// Hand the turn to a core and wait until the calling core has it back
+static void mock_core_switch(uint core)
+{
+    uint caller = 1 - core;
+    pthread_mutex_lock(&mock_core_mutex);
+    mock_core_running = core;
+    pthread_cond_broadcast(&mock_core_cond);
+    while (mock_core_running != caller) {
+        pthread_cond_wait(&mock_core_cond, &mock_core_mutex);
+    }
+    pthread_mutex_unlock(&mock_core_mutex);
+}
+
+static void* mock_core1_thread(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&mock_core_mutex);
+    while (mock_core_running != 1) {
+        pthread_cond_wait(&mock_core_cond, &mock_core_mutex);
+    }
+    pthread_mutex_unlock(&mock_core_mutex);
+    mock_core1_entry();
+    fprintf(stderr, "mock_hw: the core1 entry function returned\n");
+    abort();
+}
+
+void multicore_launch_core1(void (*entry)(void))
+{
+    if (mock_core1_entry != NULL) {
+        fprintf(stderr, "mock_hw: core1 was launched already\n");
+        abort();
+    }
+    mock_core1_entry = entry;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, mock_core1_thread, NULL) != 0) {
+        fprintf(stderr, "mock_hw: cannot start the core1 thread\n");
+        abort();
+    }
+    pthread_detach(thread);
+    // core1 starts at once and runs until it first waits for an event
+    mock_core_switch(1);
+}
+
+void __sev(void)
+{
+    mock_core1_event = true;
+}
+
+void __wfe(void)
+{
+    // core0 does not wait in the host build
+    if (mock_core_running != 1) {
+        return;
+    }
+    if (!mock_core1_event) {
+        mock_core_switch(0);
+    }
+    mock_core1_event = false;
+}
+
+bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp)
+{
+    if (mock_core_running == 1 && !mock_core1_event && mock_now_us < timeout_timestamp) {
+        mock_core1_timeout_us = timeout_timestamp;
+        mock_core_switch(0);
+        mock_core1_timeout_us = UINT64_MAX;
+    }
+    mock_core1_event = false;
+    return mock_now_us >= timeout_timestamp;
+}
+
+//--------------------------------------------------------------------+
+// Test controls
+//--------------------------------------------------------------------+
+
+void mock_core1_run(void)
+{
+    if (mock_core1_entry != NULL && (mock_core1_event || mock_now_us >= mock_core1_timeout_us)) {
+        mock_core_switch(1);
+    }
+}
+
+void mock_advance_us(uint32_t us)
+{
+    uint64_t end_us = mock_now_us + us;
+    for (;;) {
+        // find the next byte to complete on any wire or the next alarm
+        uint64_t next_us = end_us + 1;
+        for (uint alarm = 0; alarm < MOCK_NUM_ALARMS; alarm++) {
+            if (mock_alarm_armed[alarm] && mock_alarm_target_us[alarm] < next_us) {
+                next_us = mock_alarm_target_us[alarm];
+            }
+        }
+        for (uint pio_idx = 0; pio_idx < MOCK_NUM_PIOS; pio_idx++) {
+            for (uint sm = 0; sm < MOCK_NUM_SMS; sm++) {
+                const mock_sm_t* mock_sm = &mock_sms[pio_idx][sm];
+                if (mock_sm->busy && mock_sm->busy_until_us < next_us) {
+                    next_us = mock_sm->busy_until_us;
+                }
+            }
+        }
+        if (next_us > end_us) {
+            break;
+        }
+        mock_now_us = next_us;
+        for (uint pio_idx = 0; pio_idx < MOCK_NUM_PIOS; pio_idx++) {
+            for (uint sm = 0; sm < MOCK_NUM_SMS; sm++) {
+                mock_sm_t* mock_sm = &mock_sms[pio_idx][sm];
+                if (mock_sm->busy && mock_sm->busy_until_us == mock_now_us) {
+                    mock_sm_step(mock_sm);
+                }
+            }
+            mock_pio_update_ints(pio_idx);
+        }
+        mock_dma_service();
+        mock_time_irqs = true;
+        mock_irq_service();
+        mock_time_irqs = false;
+    }
+    mock_now_us = end_us;
+}
+
+uint32_t mock_din_in_send(uint32_t gpio, const uint8_t* bytes, uint32_t nbytes)
+{
+    mock_sm_t* mock_sm = mock_find_sm(gpio, MOCK_SM_RX);
+    mock_wire_t* wire = &mock_sm->wire;
+    uint32_t nsent = 0;
+    while (nsent < nbytes && wire->head - wire->tail < MOCK_WIRE_LENGTH) {
+        wire->bytes[wire->head++ & (MOCK_WIRE_LENGTH - 1)] = bytes[nsent++];
+    }
+    if (nsent > 0 && !mock_sm->busy) {
+        mock_sm->busy = true;
+        mock_sm->busy_until_us = mock_now_us + MOCK_MIDI_BYTE_US;
+    }
+    return nsent;
+}
+
+uint32_t mock_din_in_overruns(uint32_t gpio)
+{
+    return mock_find_sm(gpio, MOCK_SM_RX)->overruns;
+}
+
+uint64_t mock_irq_handler_ns(void)
+{
+    return mock_irq_ns;
+}
+
+uint32_t mock_din_out_receive(uint32_t gpio, uint8_t* bytes, uint32_t* times_us, uint32_t maxbytes)
+{
+    mock_wire_t* wire = &mock_find_sm(gpio, MOCK_SM_TX)->wire;
+    uint32_t nreceived = 0;
+    while (nreceived < maxbytes && wire->head != wire->tail) {
+        if (times_us) {
+            times_us[nreceived] = wire->times_us[wire->tail & (MOCK_WIRE_LENGTH - 1)];
+        }
+        bytes[nreceived++] = wire->bytes[wire->tail++ & (MOCK_WIRE_LENGTH - 1)];
+    }
+    return nreceived;
+}
@@ -0,0 +1,136 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Controls of the host stand-ins for the RP2040 and the USB host.
+//
+// Time is virtual and only moves in mock_advance_us(). While it moves, the
+// PIO state machines shift bytes along the DIN MIDI wires at MIDI speed, and
+// every IRQ handler whose interrupt is pending and enabled runs at once, as
+// the NVIC would run it. Setting an interrupt source pending from the main
+// loop (e.g. enabling the TX FIFO not full IRQ) runs the handler right away.
+//
+// The DIN MIDI wires are identified by the GPIO the MIDI UART uses for them.
+
+// Time one MIDI byte (start bit, 8 data bits, stop bit) takes at 31250 baud
+#define MOCK_MIDI_BYTE_US 320
+
+// Bytes each DIN MIDI wire can hold; a power of 2
+#define MOCK_WIRE_LENGTH 8192
+
+/**
+ * @brief let virtual time pass
+ *
+ * @param us the number of microseconds
+ */
+void mock_advance_us(uint32_t us);
+
+/**
+ * @brief let core1 run until it waits for an event again, if an event or its
+ * wait timeout woke it (see pico/multicore.h); does nothing before
+ * multicore_launch_core1(). Call it once per main loop pass, after the work
+ * of core0.
+ */
+void mock_core1_run(void);
+
+/**
+ * @brief send bytes to a DIN MIDI IN port; they arrive at the state machine
+ * back to back, one per MOCK_MIDI_BYTE_US, after the bytes already sent
+ *
+ * @param gpio the RX pin of the MIDI UART
+ * @param bytes the bytes
+ * @param nbytes the number of bytes
+ * @return the number of bytes that fit on the wire
+ */
+uint32_t mock_din_in_send(uint32_t gpio, const uint8_t* bytes, uint32_t nbytes);
+
+/**
+ * @brief get the number of bytes a DIN MIDI IN state machine lost because
+ * its RX FIFO was full when they arrived
+ *
+ * @param gpio the RX pin of the MIDI UART
+ * @return the number of bytes lost
+ */
+uint32_t mock_din_in_overruns(uint32_t gpio);
+
+/**
+ * @brief get the host time spent in IRQ handlers that ran while virtual time
+ * moved; handlers that run from the main loop count toward the main loop
+ *
+ * @return the time in nanoseconds
+ */
+uint64_t mock_irq_handler_ns(void);
+
+/**
+ * @brief take the bytes a DIN MIDI OUT port sent
+ *
+ * @param gpio the TX pin of the MIDI UART
+ * @param bytes receives the bytes in the order sent
+ * @param times_us receives the time each byte's stop bit ended; may be NULL
+ * @param maxbytes the most bytes to take
+ * @return the number of bytes taken
+ */
+uint32_t mock_din_out_receive(uint32_t gpio, uint8_t* bytes, uint32_t* times_us, uint32_t maxbytes);
+
+/**
+ * @brief connect or disconnect the USB host; the host is connected at startup
+ *
+ * @param mounted true if the host configured the device
+ */
+void mock_usb_set_mounted(bool mounted);
+
+/**
+ * @brief run what tud_task() does for the device besides the endpoints: call
+ * tud_sof_cb() for every USB frame that started since the last call, if
+ * tud_sof_cb_enable() asked for it
+ */
+void mock_usb_task(void);
+
+/**
+ * @brief set how long a USB frame takes on the host clock; frame n starts at
+ * n * frame_ns nanoseconds of virtual time. The default is 1000000.
+ *
+ * @param frame_ns the frame length in nanoseconds
+ */
+void mock_usb_set_frame_ns(uint32_t frame_ns);
+
+/**
+ * @brief send a USB MIDI event packet to the USB MIDI OUT endpoint
+ *
+ * @param packet the packet
+ * @return false if the endpoint FIFO is full; the host would see a NAK
+ */
+bool mock_usb_midi_out_send(const uint8_t packet[4]);
+
+/**
+ * @brief take a USB MIDI event packet from the USB MIDI IN endpoint
+ *
+ * @param packet receives the packet
+ * @param time_us receives the time the device wrote the packet; may be NULL
+ * @return false if the device has not written a packet
+ */
+bool mock_usb_midi_in_receive(uint8_t packet[4], uint32_t* time_us);
@@ -0,0 +1,148 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "tusb.h"
+#include "hardware/timer.h"
+#include "mock_hw.h"
+
+// The USB MIDI endpoint FIFOs of the tinyusb MIDI device class driver, in packets
+#define MOCK_USB_OUT_PACKETS (CFG_TUD_MIDI_RX_BUFSIZE / 4)
+#define MOCK_USB_IN_PACKETS  (CFG_TUD_MIDI_TX_BUFSIZE / 4)
+
+typedef struct {
+    uint8_t packet[4];
+    uint32_t time_us;
+} mock_usb_packet_t;
+
+static mock_usb_packet_t mock_usb_out_fifo[MOCK_USB_OUT_PACKETS];
+static uint32_t mock_usb_out_head = 0;
+static uint32_t mock_usb_out_tail = 0;
+static mock_usb_packet_t mock_usb_in_fifo[MOCK_USB_IN_PACKETS];
+static uint32_t mock_usb_in_head = 0;
+static uint32_t mock_usb_in_tail = 0;
+static bool mock_usb_mounted = true;
+// USB frame n starts at n * mock_usb_frame_ns of virtual time
+static uint32_t mock_usb_frame_ns = 1000000;
+static bool mock_usb_sof_enabled = false;
+static uint64_t mock_usb_next_frame = 0; // the first frame not reported yet
+
+//--------------------------------------------------------------------+
+// tinyusb stand-ins
+//--------------------------------------------------------------------+
+
+bool tud_midi_n_mounted(uint8_t itf)
+{
+    (void)itf;
+    return mock_usb_mounted;
+}
+
+uint32_t tud_midi_n_available(uint8_t itf, uint8_t cable_num)
+{
+    (void)itf;
+    (void)cable_num;
+    return (mock_usb_out_head - mock_usb_out_tail) * 4;
+}
+
+bool tud_midi_n_packet_read(uint8_t itf, uint8_t packet[4])
+{
+    (void)itf;
+    if (mock_usb_out_head == mock_usb_out_tail) {
+        return false;
+    }
+    memcpy(packet, mock_usb_out_fifo[mock_usb_out_tail++ % MOCK_USB_OUT_PACKETS].packet, 4);
+    return true;
+}
+
+bool tud_midi_n_packet_write(uint8_t itf, uint8_t const packet[4])
+{
+    (void)itf;
+    if (!mock_usb_mounted || mock_usb_in_head - mock_usb_in_tail == MOCK_USB_IN_PACKETS) {
+        return false;
+    }
+    mock_usb_packet_t* item = &mock_usb_in_fifo[mock_usb_in_head++ % MOCK_USB_IN_PACKETS];
+    memcpy(item->packet, packet, 4);
+    item->time_us = time_us_32();
+    tud_midi_rx_cb(0);
+    return true;
+}
+
+void tud_sof_cb_enable(bool en)
+{
+    if (en && !mock_usb_sof_enabled) {
+        mock_usb_next_frame = time_us_64() * 1000 / mock_usb_frame_ns + 1;
+    }
+    mock_usb_sof_enabled = en;
+}
+
+//--------------------------------------------------------------------+
+// Test controls
+//--------------------------------------------------------------------+
+
+void mock_usb_task(void)
+{
+    uint64_t frame = time_us_64() * 1000 / mock_usb_frame_ns;
+    for (; mock_usb_sof_enabled && mock_usb_next_frame <= frame; ++mock_usb_next_frame) {
+        tud_sof_cb((uint32_t)(mock_usb_next_frame & 0x7FF));
+    }
+}
+
+void mock_usb_set_frame_ns(uint32_t frame_ns)
+{
+    mock_usb_frame_ns = frame_ns;
+    mock_usb_next_frame = time_us_64() * 1000 / frame_ns + 1;
+}
+
+void mock_usb_set_mounted(bool mounted)
+{
+    mock_usb_mounted = mounted;
+    if (!mounted) {
+        mock_usb_out_tail = mock_usb_out_head;
+        mock_usb_in_tail = mock_usb_in_head;
+    }
+}
+
+bool mock_usb_midi_out_send(const uint8_t packet[4])
+{
+    if (!mock_usb_mounted || mock_usb_out_head - mock_usb_out_tail == MOCK_USB_OUT_PACKETS) {
+        return false;
+    }
+    mock_usb_packet_t* item = &mock_usb_out_fifo[mock_usb_out_head++ % MOCK_USB_OUT_PACKETS];
+    memcpy(item->packet, packet, 4);
+    item->time_us = time_us_32();
+    tud_midi_rx_cb(0);
+    return true;
+}
+
+bool mock_usb_midi_in_receive(uint8_t packet[4], uint32_t* time_us)
+{
+    if (mock_usb_in_head == mock_usb_in_tail) {
+        return false;
+    }
+    const mock_usb_packet_t* item = &mock_usb_in_fifo[mock_usb_in_tail++ % MOCK_USB_IN_PACKETS];
+    memcpy(packet, item->packet, 4);
+    if (time_us) {
+        *time_us = item->time_us;
+    }
+    return true;
+}
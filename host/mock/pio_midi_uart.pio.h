@@ -0,0 +1,60 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include "hardware/pio.h"
+
+// Host stand-in for the header pioasm generates from pio_midi_uart.pio. The
+// programs are placeholders; mock_hw.c shifts the bytes in and out at MIDI
+// speed instead.
+
+extern const pio_program_t midi_rx_program;
+extern const pio_program_t midi_tx_program;
+
+void midi_rx_program_init(PIO pio, uint sm, uint offset, uint pin, uint baud);
+void midi_tx_program_init(PIO pio, uint sm, uint offset, uint pin_tx, uint baud);
+// The state machine has no byte on the wire and none in its TX FIFO
+bool midi_tx_program_is_idle(PIO pio, uint sm);
+
+static inline uint8_t midi_rx_program_get(PIO pio, uint sm)
+{
+    return (uint8_t)pio_sm_get(pio, sm);
+}
+
+static inline bool midi_tx_program_can_put(PIO pio, uint sm)
+{
+    return !pio_sm_is_tx_fifo_full(pio, sm);
+}
+
+static inline void midi_tx_program_put(PIO pio, uint sm, uint8_t c)
+{
+    pio_sm_put(pio, sm, (uint32_t)c);
+}
+
+static inline void midi_tx_program_clear_stall(PIO pio, uint sm)
+{
+    // midi_tx_program_is_idle() looks at the state machine itself
+    (void)pio;
+    (void)sm;
+}
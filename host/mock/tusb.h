@@ -0,0 +1,101 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "tusb_config.h"
+
+// Host stand-in for the parts of tinyusb the MIDI routing core uses: the MIDI
+// device class FIFO API. mock_tusb.c keeps the endpoint FIFOs; the test plays
+// the USB host with the functions in mock_hw.h.
+
+#define OPT_MCU_NONE 0
+#define TUD_OPT_HIGH_SPEED 0
+
+#define TU_LOG1(...) do { } while (0)
+
+static inline uint32_t tu_min32(uint32_t x, uint32_t y)
+{
+    return (x < y) ? x : y;
+}
+
+// USB MIDI 1.0 Code Index Numbers
+enum {
+    MIDI_CIN_MISC = 0,
+    MIDI_CIN_CABLE_EVENT = 1,
+    MIDI_CIN_SYSCOM_2BYTE = 2,
+    MIDI_CIN_SYSCOM_3BYTE = 3,
+    MIDI_CIN_SYSEX_START = 4,
+    MIDI_CIN_SYSEX_END_1BYTE = 5,
+    MIDI_CIN_SYSEX_END_2BYTE = 6,
+    MIDI_CIN_SYSEX_END_3BYTE = 7,
+    MIDI_CIN_NOTE_OFF = 8,
+    MIDI_CIN_NOTE_ON = 9,
+    MIDI_CIN_POLY_KEYPRESS = 10,
+    MIDI_CIN_CONTROL_CHANGE = 11,
+    MIDI_CIN_PROGRAM_CHANGE = 12,
+    MIDI_CIN_CHANNEL_PRESSURE = 13,
+    MIDI_CIN_PITCH_BEND_CHANGE = 14,
+    MIDI_CIN_1BYTE_DATA = 15,
+};
+
+// MIDI 1.0 status bytes
+enum {
+    MIDI_STATUS_SYSEX_START = 0xF0,
+    MIDI_STATUS_SYSEX_END = 0xF7,
+    MIDI_STATUS_SYSREAL_TIMING_CLOCK = 0xF8,
+    MIDI_STATUS_SYSREAL_START = 0xFA,
+    MIDI_STATUS_SYSREAL_CONTINUE = 0xFB,
+    MIDI_STATUS_SYSREAL_STOP = 0xFC,
+    MIDI_STATUS_SYSREAL_ACTIVE_SENSING = 0xFE,
+    MIDI_STATUS_SYSREAL_SYSTEM_RESET = 0xFF,
+};
+
+bool tud_midi_n_mounted(uint8_t itf);
+uint32_t tud_midi_n_available(uint8_t itf, uint8_t cable_num);
+bool tud_midi_n_packet_read(uint8_t itf, uint8_t packet[4]);
+bool tud_midi_n_packet_write(uint8_t itf, uint8_t const packet[4]);
+// Invoked when the USB MIDI OUT endpoint received data
+void tud_midi_rx_cb(uint8_t itf);
+// Report every SOF with tud_sof_cb() or stop reporting them
+void tud_sof_cb_enable(bool en);
+void tud_sof_cb(uint32_t frame_count);
+
+static inline bool tud_midi_mounted(void)
+{
+    return tud_midi_n_mounted(0);
+}
+
+static inline bool tud_midi_packet_read(uint8_t packet[4])
+{
+    return tud_midi_n_packet_read(0, packet);
+}
+
+static inline bool tud_midi_packet_write(uint8_t const packet[4])
+{
+    return tud_midi_n_packet_write(0, packet);
+}
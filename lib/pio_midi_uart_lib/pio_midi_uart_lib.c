@@ -28,12 +28,16 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
 #include "hardware/irq.h"
 #include "pico/binary_info.h"
 #include "pico/sync.h"
 #include "pio_midi_uart_lib.h"
+#if PIO_MIDI_UART_TX_DMA || PIO_MIDI_UART_RX_DMA
+#include "hardware/dma.h"
+#endif
 
 // You can override these to save space if need be
 #ifndef MAX_PIO_MIDI_UARTS
@@ -42,12 +46,74 @@
 #ifndef MAX_PIO_MIDI_OUTS
 #define MAX_PIO_MIDI_OUTS 4
 #endif
+// The RX and TX buffer length of pio_midi_uart_create() and the TX buffer
+// length of pio_midi_out_create()
 #ifndef MIDI_UART_RING_BUFFER_LENGTH
 #define MIDI_UART_RING_BUFFER_LENGTH 128
 #endif
+#if (MIDI_UART_RING_BUFFER_LENGTH & (MIDI_UART_RING_BUFFER_LENGTH - 1)) != 0
+#error "MIDI_UART_RING_BUFFER_LENGTH must be a power of 2"
+#endif
 #ifndef MIDI_BAUD_RATE
 #define MIDI_BAUD_RATE 31250
 #endif
+// With PIO_MIDI_UART_TX_DMA, a DMA channel per MIDI UART feeds the TX FIFO
+// from the TX buffer and interrupts once per block instead of once per byte
+#if PIO_MIDI_UART_TX_DMA
+#ifndef PIO_MIDI_UART_DMA_IRQ_INDEX
+#define PIO_MIDI_UART_DMA_IRQ_INDEX 0
+#endif
+#define PIO_MIDI_UART_DMA_IRQ (DMA_IRQ_0 + PIO_MIDI_UART_DMA_IRQ_INDEX)
+// Longest TX DMA block; realtime bytes wait for the block in progress
+#ifndef PIO_MIDI_UART_TX_DMA_MAX_BLOCK
+#define PIO_MIDI_UART_TX_DMA_MAX_BLOCK 8
+#endif
+#endif
+// With PIO_MIDI_UART_RX_DMA, a DMA channel per MIDI UART copies the RX FIFO
+// into the RX buffer in ring mode. There is no RX interrupt; reading the RX
+// buffer looks at how far the DMA channel got.
+#if PIO_MIDI_UART_RX_DMA
+// The transfer count the RX DMA channel is started with; it restarts when done
+#define PIO_MIDI_UART_RX_DMA_COUNT 0xFFFFFFFFu
+#endif
+
+// Number of message timestamps the RX IRQ handler can store per MIDI UART;
+// must be a power of 2
+#ifndef MIDI_UART_RX_TIMESTAMP_LENGTH
+#define MIDI_UART_RX_TIMESTAMP_LENGTH 32
+#endif
+
+/**
+ * @struct the arrival time of a message in the RX buffer
+ */
+typedef struct {
+    uint32_t index;   // free-running RX buffer index of the first byte of the message
+    uint32_t time_us; // when the IRQ handler took the byte out of the RX FIFO
+} PIO_MIDI_UART_RX_TIMESTAMP_T;
+
+// Number of realtime bytes that can wait to jump the TX buffer per MIDI UART;
+// must be a power of 2
+#ifndef MIDI_UART_RT_BUFFER_LENGTH
+#define MIDI_UART_RT_BUFFER_LENGTH 8
+#endif
+#if (MIDI_UART_RT_BUFFER_LENGTH & (MIDI_UART_RT_BUFFER_LENGTH - 1)) != 0
+#error "MIDI_UART_RT_BUFFER_LENGTH must be a power of 2"
+#endif
+
+// Number of TX marks that can wait for the TX buffer to drain per MIDI UART;
+// must be a power of 2
+#ifndef MIDI_UART_TX_MARK_LENGTH
+#define MIDI_UART_TX_MARK_LENGTH 32
+#endif
+
+/**
+ * @struct a position in the TX buffer to report when the IRQ handler gets there
+ */
+typedef struct {
+    uint16_t index;   // free-running TX buffer index just after the marked byte
+    uint16_t tag;     // passed to the TX mark callback
+    uint32_t time_us; // passed to the TX mark callback
+} PIO_MIDI_UART_TX_MARK_T;
 
 #define PIO_PROG_INVALID_OFFSET 0xFFFF
 static uint pio_prog_rx_offset[2] = {PIO_PROG_INVALID_OFFSET, PIO_PROG_INVALID_OFFSET};
@@ -67,10 +133,43 @@ typedef struct PIO_MIDI_UART_S {
     io_ro_32* ints; // the PIO IRQ status register for this UART
     uint rx_offset; // The offset in PIO program RAM of the RX code
     uint tx_offset; // The offset in PIO program RAM of the TX code
-    // PIO UART ring buffer info
-    ring_buffer_t rx_rb, tx_rb;
-    uint8_t rx_buf[MIDI_UART_RING_BUFFER_LENGTH];
-    uint8_t tx_buf[MIDI_UART_RING_BUFFER_LENGTH];
+    // PIO UART ring buffer info; the IRQ handler produces rx_rb and consumes tx_rb
+    spsc_ring_t rx_rb, tx_rb;
+    // allocated from buffer_pool when the MIDI UART is created
+    uint8_t* rx_buf;
+    uint8_t* tx_buf;
+    // Message timestamps; the IRQ handler produces them along with rx_rb
+    spsc_ring_t rx_ts_rb;
+    uint8_t rx_ts_buf[MIDI_UART_RX_TIMESTAMP_LENGTH * sizeof(PIO_MIDI_UART_RX_TIMESTAMP_T)] __attribute__((aligned(4)));
+    uint8_t rx_msg_len;      // data bytes in the message being received; 0 if no message can follow
+    uint8_t rx_msg_count;    // data bytes received of that message
+    bool rx_running_status;  // true if data bytes after a complete message start a new one
+    uint32_t rx_msg_time_us; // timestamp of the message the reader is in
+    // Realtime lane; the IRQ handler sends these bytes before the bytes in tx_rb
+    spsc_ring_t rt_rb;
+    uint8_t rt_buf[MIDI_UART_RT_BUFFER_LENGTH];
+    uint16_t rt_tag[MIDI_UART_RT_BUFFER_LENGTH];     // TX mark tag of each byte in rt_rb
+    uint32_t rt_time_us[MIDI_UART_RT_BUFFER_LENGTH]; // TX mark time of each byte in rt_rb
+    // TX marks; the IRQ handler consumes them along with tx_rb
+    spsc_ring_t tx_mark_rb;
+    uint8_t tx_mark_buf[MIDI_UART_TX_MARK_LENGTH * sizeof(PIO_MIDI_UART_TX_MARK_T)] __attribute__((aligned(4)));
+    pio_midi_uart_tx_mark_cb_t tx_mark_cb;
+    void* tx_mark_context;
+    pio_midi_uart_event_cb_t event_cb;
+    void* event_context;
+#if PIO_MIDI_UART_RX_DMA
+    uint rx_dma_chan;           // The DMA channel copying the RX FIFO to rx_buf
+    uint32_t rx_dma_base;       // rx_rb.head when the RX DMA channel was last started
+#endif
+#if PIO_MIDI_UART_TX_DMA
+    uint tx_dma_chan;           // The DMA channel feeding the TX FIFO
+    volatile bool tx_dma_busy;  // true while a DMA transfer is in progress
+    uint32_t tx_dma_len;        // The number of bytes in the transfer in progress
+    bool tx_dma_rt;             // true if the transfer in progress is from rt_rb
+    uint32_t tx_dma_start_us;   // When the transfer in progress started
+#endif
+    pio_midi_uart_tx_stats_t tx_stats;
+    pio_midi_uart_rx_stats_t rx_stats;
 } PIO_MIDI_UART_T;
 
 /**
@@ -81,6 +180,41 @@ typedef struct PIO_MIDI_UART_S {
  */
 static PIO_MIDI_UART_T pio_midi_uarts[MAX_PIO_MIDI_UARTS];
 
+// The RX and TX buffers of all MIDI UARTs share one static block of memory.
+// Buffers are allocated when a MIDI UART is created and never freed, so the
+// memory cannot fragment.
+static uint8_t buffer_pool[PIO_MIDI_UART_BUFFER_POOL_SIZE] __attribute__((aligned(PIO_MIDI_UART_BUFFER_POOL_ALIGN)));
+static uint32_t buffer_pool_used = 0;
+
+/**
+ * @brief take a buffer from the buffer pool
+ *
+ * @param len the buffer length
+ * @param align the buffer address alignment; a power of 2
+ * @return the buffer or NULL if the pool does not have enough room left
+ */
+static uint8_t* pio_midi_uart_alloc_buffer(uint32_t len, uint32_t align)
+{
+    uintptr_t base = (uintptr_t)buffer_pool;
+    uint32_t start = (uint32_t)(((base + buffer_pool_used + align - 1) & ~(uintptr_t)(align - 1)) - base);
+    if (start + len > PIO_MIDI_UART_BUFFER_POOL_SIZE) {
+        return NULL;
+    }
+    buffer_pool_used = start + len;
+    return buffer_pool + start;
+}
+
+/**
+ * @brief check a buffer length requested from pio_midi_uart_create_sized()
+ *
+ * @param len the buffer length
+ * @return true if len is a power of 2 between 2 and PIO_MIDI_UART_MAX_BUFFER_LENGTH
+ */
+static inline bool pio_midi_uart_is_valid_buffer_length(uint32_t len)
+{
+    return len >= 2 && len <= PIO_MIDI_UART_MAX_BUFFER_LENGTH && (len & (len - 1)) == 0;
+}
+
 typedef struct PIO_MIDI_OUT_S {
     struct PIO_MIDI_OUT_S* out_shared_irq; // a pointer to the other state machine, that shares the same IRQ; NULL if not shared
     PIO pio;        // The PIO containing the RX and TX code
@@ -90,8 +224,8 @@ typedef struct PIO_MIDI_OUT_S {
     uint32_t tx_mask; // The tx queue not empty interrupt mask
     io_ro_32* ints; // the PIO IRQ status register for this UART
     uint tx_offset; // The offset in PIO program RAM of the TX code
-    // PIO MIDI OUT ring buffer info
-    ring_buffer_t tx_rb;
+    // PIO MIDI OUT ring buffer info; the IRQ handler consumes tx_rb
+    spsc_ring_t tx_rb;
     uint8_t tx_buf[MIDI_UART_RING_BUFFER_LENGTH];
 } PIO_MIDI_OUT_T;
 
@@ -177,6 +311,92 @@ static inline bool pio_midi_out_is_tx_irq_pending(PIO_MIDI_OUT_T* midi_out)
     return (*(midi_out->ints) & midi_out->tx_mask) != 0;
 }
 
+/**
+ * @brief track the MIDI message framing of the received bytes
+ *
+ * @param midi_uart the MIDI UART
+ * @param val the received byte
+ * @return true if val is the first byte of a message
+ */
+static inline bool pio_midi_uart_rx_starts_message(PIO_MIDI_UART_T* midi_uart, uint8_t val)
+{
+    if (val >= 0xF8) {
+        return true; // realtime; may appear anywhere
+    }
+    if (val >= 0x80) {
+        midi_uart->rx_running_status = val < 0xF0;
+        midi_uart->rx_msg_count = 0;
+        if (val < 0xF0) {
+            midi_uart->rx_msg_len = ((val & 0xE0) == 0xC0) ? 1 : 2;
+        }
+        else if (val == 0xF2) {
+            midi_uart->rx_msg_len = 2;
+        }
+        else if (val == 0xF1 || val == 0xF3) {
+            midi_uart->rx_msg_len = 1;
+        }
+        else {
+            midi_uart->rx_msg_len = 0; // SysEx data, single byte messages and EOX
+        }
+        return true;
+    }
+    if (midi_uart->rx_msg_count < midi_uart->rx_msg_len) {
+        ++midi_uart->rx_msg_count;
+        return false;
+    }
+    if (midi_uart->rx_msg_len == 0 || !midi_uart->rx_running_status) {
+        return false;
+    }
+    midi_uart->rx_msg_count = 1;
+    return true;
+}
+
+/**
+ * @brief report the TX marks the IRQ handler has passed in the TX buffer
+ *
+ * @param midi_uart the MIDI UART
+ * @param now_us the current time in microseconds
+ */
+static inline void pio_midi_uart_report_tx_marks(PIO_MIDI_UART_T* midi_uart, uint32_t now_us)
+{
+    PIO_MIDI_UART_TX_MARK_T mark;
+    uint16_t tail = (uint16_t)midi_uart->tx_rb.tail;
+    while (spsc_ring_get_num_bytes(&midi_uart->tx_mark_rb) >= sizeof(mark)) {
+        const uint8_t* data;
+        spsc_ring_peek_contiguous(&midi_uart->tx_mark_rb, &data);
+        memcpy(&mark, data, sizeof(mark));
+        if ((int16_t)(uint16_t)(tail - mark.index) < 0) {
+            break; // the marked byte is still in the TX buffer
+        }
+        spsc_ring_consume(&midi_uart->tx_mark_rb, sizeof(mark));
+        if (midi_uart->tx_mark_cb) {
+            midi_uart->tx_mark_cb(midi_uart->tx_mark_context, mark.tag, mark.time_us, now_us);
+        }
+    }
+}
+
+/**
+ * @brief take the next byte out of the realtime lane and report it
+ *
+ * @param midi_uart the MIDI UART; rt_rb must not be empty
+ * @param now_us the current time in microseconds
+ * @return the realtime byte
+ */
+static inline uint8_t pio_midi_uart_pop_rt(PIO_MIDI_UART_T* midi_uart, uint32_t now_us)
+{
+    // read the tag and time before the slot is released to the writer
+    uint32_t slot = midi_uart->rt_rb.tail & midi_uart->rt_rb.mask;
+    uint8_t val = midi_uart->rt_buf[slot];
+    uint16_t tag = midi_uart->rt_tag[slot];
+    uint32_t time_us = midi_uart->rt_time_us[slot];
+    spsc_ring_consume(&midi_uart->rt_rb, 1);
+    ++midi_uart->tx_stats.rt_bytes;
+    if (midi_uart->tx_mark_cb) {
+        midi_uart->tx_mark_cb(midi_uart->tx_mark_context, tag, time_us, now_us);
+    }
+    return val;
+}
+
 static void on_pio_midi_uart_irq(PIO_MIDI_UART_T *pio_midi_uart);
 
 static void on_pio_midi_uart0_irq()
@@ -201,26 +421,132 @@ static void on_pio_midi_uart3_irq()
 
 static void on_pio_midi_uart_irq(PIO_MIDI_UART_T *pio_midi_uart)
 {
+    uint32_t events = 0;
     if (pio_midi_uart_is_rx_irq_pending(pio_midi_uart)) {
-        while (!pio_sm_is_rx_fifo_empty(pio_midi_uart->pio, pio_midi_uart->rx_sm) && 
-                !ring_buffer_is_full_unsafe(&pio_midi_uart->rx_rb)) {
+        uint32_t now_us = time_us_32();
+        while (!pio_sm_is_rx_fifo_empty(pio_midi_uart->pio, pio_midi_uart->rx_sm)) {
             uint8_t val = midi_rx_program_get(pio_midi_uart->pio, pio_midi_uart->rx_sm);
-            ring_buffer_push_unsafe(&pio_midi_uart->rx_rb, &val, 1);
+            if (spsc_ring_get_free_space(&pio_midi_uart->rx_rb) == 0) {
+                // drop the byte; leaving it in the RX FIFO would retrigger the IRQ forever
+                ++pio_midi_uart->rx_stats.dropped;
+                continue;
+            }
+            if (pio_midi_uart_rx_starts_message(pio_midi_uart, val)) {
+                // if there is no room, the reader uses the previous timestamp
+                PIO_MIDI_UART_RX_TIMESTAMP_T timestamp = {.index = pio_midi_uart->rx_rb.head, .time_us = now_us};
+                spsc_ring_push_all(&pio_midi_uart->rx_ts_rb, (const uint8_t*)&timestamp, sizeof(timestamp));
+            }
+            spsc_ring_push(&pio_midi_uart->rx_rb, &val, 1);
+            ++pio_midi_uart->rx_stats.bytes;
+            events |= PIO_MIDI_UART_EVENT_RX;
+        }
+        uint32_t level = spsc_ring_get_num_bytes(&pio_midi_uart->rx_rb);
+        if (level > pio_midi_uart->rx_stats.max_level) {
+            pio_midi_uart->rx_stats.max_level = level;
         }
     }
     if (pio_midi_uart_is_tx_irq_pending(pio_midi_uart)) {
-        while (!ring_buffer_is_empty_unsafe(&pio_midi_uart->tx_rb) &&
-                midi_tx_program_can_put(pio_midi_uart->pio, pio_midi_uart->tx_sm)) {
-            uint8_t val;
-            (void)ring_buffer_pop_unsafe(&pio_midi_uart->tx_rb, &val, 1);
-            midi_tx_program_put(pio_midi_uart->pio, pio_midi_uart->tx_sm, val);
+        uint32_t start_us = time_us_32();
+        uint8_t val;
+        uint32_t nput = 0;
+        while (midi_tx_program_can_put(pio_midi_uart->pio, pio_midi_uart->tx_sm)) {
+            // realtime bytes go between any two bytes of the normal stream
+            if (!spsc_ring_is_empty(&pio_midi_uart->rt_rb)) {
+                midi_tx_program_put(pio_midi_uart->pio, pio_midi_uart->tx_sm, pio_midi_uart_pop_rt(pio_midi_uart, start_us));
+            }
+            else if (spsc_ring_pop(&pio_midi_uart->tx_rb, &val, 1) == 1) {
+                midi_tx_program_put(pio_midi_uart->pio, pio_midi_uart->tx_sm, val);
+                events |= PIO_MIDI_UART_EVENT_TX;
+            }
+            else {
+                break;
+            }
+            ++nput;
+        }
+        if (nput > 0) {
+            pio_midi_uart->tx_stats.bytes += nput;
+            // the state machine is not idle until it stalls again
+            midi_tx_program_clear_stall(pio_midi_uart->pio, pio_midi_uart->tx_sm);
         }
-        if (ring_buffer_is_empty_unsafe(&pio_midi_uart->tx_rb)) {
+        pio_midi_uart_report_tx_marks(pio_midi_uart, start_us);
+        if (spsc_ring_is_empty(&pio_midi_uart->tx_rb) && spsc_ring_is_empty(&pio_midi_uart->rt_rb)) {
             pio_midi_uart_set_tx_irq_enable(pio_midi_uart->pio, pio_midi_uart->tx_sm, false);
+            // bytes written between the check above and disabling the IRQ
+            // would never be sent, so check again
+            if (!spsc_ring_is_empty(&pio_midi_uart->tx_rb) || !spsc_ring_is_empty(&pio_midi_uart->rt_rb)) {
+                pio_midi_uart_set_tx_irq_enable(pio_midi_uart->pio, pio_midi_uart->tx_sm, true);
+            }
         }
+        ++pio_midi_uart->tx_stats.irqs;
+        pio_midi_uart->tx_stats.irq_us += time_us_32() - start_us;
+    }
+    if (events && pio_midi_uart->event_cb) {
+        pio_midi_uart->event_cb(pio_midi_uart->event_context, events);
     }
 }
 
+#if PIO_MIDI_UART_TX_DMA
+/**
+ * @brief start a DMA transfer of the next contiguous block of the TX buffer
+ *
+ * @param midi_uart the MIDI UART; no transfer may be in progress
+ */
+static void pio_midi_uart_start_tx_dma(PIO_MIDI_UART_T* midi_uart)
+{
+    const uint8_t* block;
+    // realtime bytes go between two blocks of the normal stream
+    uint32_t len = spsc_ring_peek_contiguous(&midi_uart->rt_rb, &block);
+    midi_uart->tx_dma_rt = len > 0;
+    if (len == 0) {
+        len = spsc_ring_peek_contiguous(&midi_uart->tx_rb, &block);
+    }
+    if (len == 0) {
+        midi_uart->tx_dma_busy = false;
+        return;
+    }
+    if (len > PIO_MIDI_UART_TX_DMA_MAX_BLOCK) {
+        len = PIO_MIDI_UART_TX_DMA_MAX_BLOCK;
+    }
+    midi_uart->tx_dma_busy = true;
+    midi_uart->tx_dma_len = len;
+    midi_uart->tx_dma_start_us = time_us_32();
+    ++midi_uart->tx_stats.dma_blocks;
+    dma_channel_transfer_from_buffer_now(midi_uart->tx_dma_chan, block, len);
+}
+
+static void on_pio_midi_uart_dma_irq()
+{
+    for (uint idx = 0; idx < MAX_PIO_MIDI_UARTS; idx++) {
+        PIO_MIDI_UART_T* midi_uart = pio_midi_uarts + idx;
+        if (midi_uart->pio == NULL || !dma_irqn_get_channel_status(PIO_MIDI_UART_DMA_IRQ_INDEX, midi_uart->tx_dma_chan)) {
+            continue;
+        }
+        uint32_t start_us = time_us_32();
+        dma_irqn_acknowledge_channel(PIO_MIDI_UART_DMA_IRQ_INDEX, midi_uart->tx_dma_chan);
+        midi_uart->tx_stats.bytes += midi_uart->tx_dma_len;
+        midi_uart->tx_stats.dma_us += start_us - midi_uart->tx_dma_start_us;
+        // the whole block went into the TX FIFO; the state machine is not idle until it stalls again
+        midi_tx_program_clear_stall(midi_uart->pio, midi_uart->tx_sm);
+        // the block is in the TX FIFO or already sent; release it and send the next one
+        if (midi_uart->tx_dma_rt) {
+            for (uint32_t n = 0; n < midi_uart->tx_dma_len; n++) {
+                pio_midi_uart_pop_rt(midi_uart, start_us);
+            }
+        }
+        else {
+            spsc_ring_consume(&midi_uart->tx_rb, midi_uart->tx_dma_len);
+            pio_midi_uart_report_tx_marks(midi_uart, start_us);
+            if (midi_uart->event_cb) {
+                midi_uart->event_cb(midi_uart->event_context, PIO_MIDI_UART_EVENT_TX);
+            }
+        }
+        pio_midi_uart_start_tx_dma(midi_uart);
+        ++midi_uart->tx_stats.irqs;
+        midi_uart->tx_stats.irq_us += time_us_32() - start_us;
+    }
+}
+#endif
+
 static void on_pio_midi_out_irq(PIO_MIDI_OUT_T *pio_midi_out);
 
 static void on_pio_midi_out01_irq()
@@ -247,21 +573,32 @@ static void on_pio_midi_out67_irq()
 static void on_pio_midi_out_irq(PIO_MIDI_OUT_T *pio_midi_out)
 {
     if (pio_midi_out && pio_midi_out_is_tx_irq_pending(pio_midi_out)) {
-        while (!ring_buffer_is_empty_unsafe(&pio_midi_out->tx_rb) &&
-                midi_tx_program_can_put(pio_midi_out->pio, pio_midi_out->tx_sm)) {
-            uint8_t val;
-            (void)ring_buffer_pop_unsafe(&pio_midi_out->tx_rb, &val, 1);
+        uint8_t val;
+        while (midi_tx_program_can_put(pio_midi_out->pio, pio_midi_out->tx_sm) &&
+                spsc_ring_pop(&pio_midi_out->tx_rb, &val, 1) == 1) {
             midi_tx_program_put(pio_midi_out->pio, pio_midi_out->tx_sm, val);
         }
-        if (ring_buffer_is_empty_unsafe(&pio_midi_out->tx_rb)) {
+        if (spsc_ring_is_empty(&pio_midi_out->tx_rb)) {
             pio_midi_uart_set_tx_irq_enable(pio_midi_out->pio, pio_midi_out->tx_sm, false);
+            // bytes written between the check above and disabling the IRQ
+            // would never be sent, so check again
+            if (!spsc_ring_is_empty(&pio_midi_out->tx_rb)) {
+                pio_midi_uart_set_tx_irq_enable(pio_midi_out->pio, pio_midi_out->tx_sm, true);
+            }
         }
     }
 }
 
 void* pio_midi_uart_create(uint8_t txgpio, uint8_t rxgpio)
+{
+    return pio_midi_uart_create_sized(txgpio, rxgpio, MIDI_UART_RING_BUFFER_LENGTH, MIDI_UART_RING_BUFFER_LENGTH);
+}
+
+void* pio_midi_uart_create_sized(uint8_t txgpio, uint8_t rxgpio, RING_BUFFER_SIZE_TYPE rx_len, RING_BUFFER_SIZE_TYPE tx_len)
 {
     PIO_MIDI_UART_T* midi_uart = NULL;
+    if (!pio_midi_uart_is_valid_buffer_length(rx_len) || !pio_midi_uart_is_valid_buffer_length(tx_len))
+        return NULL;
     // claim two state machines in the same PIO
     PIO pio = pio0;
     int rx_sm = 0;
@@ -305,6 +642,20 @@ void* pio_midi_uart_create(uint8_t txgpio, uint8_t rxgpio)
 
     midi_uart = pio_midi_uarts + idx;
 
+    uint32_t pool_used = buffer_pool_used;
+#if PIO_MIDI_UART_RX_DMA
+    // DMA ring mode wraps the write address at a multiple of the buffer size
+    midi_uart->rx_buf = pio_midi_uart_alloc_buffer(rx_len, rx_len);
+#else
+    midi_uart->rx_buf = pio_midi_uart_alloc_buffer(rx_len, 1);
+#endif
+    midi_uart->tx_buf = pio_midi_uart_alloc_buffer(tx_len, 1);
+    if (midi_uart->rx_buf == NULL || midi_uart->tx_buf == NULL) {
+        // not enough memory left in the buffer pool
+        buffer_pool_used = pool_used;
+        return NULL;
+    }
+
     if (pio_prog_rx_offset[pio_idx] == PIO_PROG_INVALID_OFFSET) {
         if (pio_can_add_program(pio, &midi_rx_program)) {
             midi_uart->rx_offset = pio_add_program(pio, &midi_rx_program);
@@ -312,6 +663,7 @@ void* pio_midi_uart_create(uint8_t txgpio, uint8_t rxgpio)
         }
         else {
             // programs won't fit
+            buffer_pool_used = pool_used;
             return NULL;
         }
     }
@@ -325,6 +677,7 @@ void* pio_midi_uart_create(uint8_t txgpio, uint8_t rxgpio)
         }
         else {
             // programs won't fit
+            buffer_pool_used = pool_used;
             return NULL;
         }
     }
@@ -357,8 +710,40 @@ void* pio_midi_uart_create(uint8_t txgpio, uint8_t rxgpio)
     midi_rx_program_init(pio, rx_sm, midi_uart->rx_offset, rxgpio, MIDI_BAUD_RATE);
     midi_tx_program_init(pio, tx_sm, midi_uart->tx_offset, txgpio, MIDI_BAUD_RATE);
     // Prepare the MIDI UART ring buffers and interrupt handler and enable interrupts
-    ring_buffer_init(&midi_uart->rx_rb, midi_uart->rx_buf, MIDI_UART_RING_BUFFER_LENGTH, midi_uart->irq);
-    ring_buffer_init(&midi_uart->tx_rb, midi_uart->tx_buf, MIDI_UART_RING_BUFFER_LENGTH, midi_uart->irq);
+    spsc_ring_init(&midi_uart->rx_rb, midi_uart->rx_buf, rx_len);
+    spsc_ring_init(&midi_uart->tx_rb, midi_uart->tx_buf, tx_len);
+    memset(&midi_uart->tx_stats, 0, sizeof(midi_uart->tx_stats));
+    memset(&midi_uart->rx_stats, 0, sizeof(midi_uart->rx_stats));
+    spsc_ring_init(&midi_uart->rx_ts_rb, midi_uart->rx_ts_buf, sizeof(midi_uart->rx_ts_buf));
+    midi_uart->rx_msg_len = 0;
+    midi_uart->rx_msg_count = 0;
+    midi_uart->rx_running_status = false;
+    midi_uart->rx_msg_time_us = 0;
+    spsc_ring_init(&midi_uart->rt_rb, midi_uart->rt_buf, MIDI_UART_RT_BUFFER_LENGTH);
+    spsc_ring_init(&midi_uart->tx_mark_rb, midi_uart->tx_mark_buf, sizeof(midi_uart->tx_mark_buf));
+    midi_uart->tx_mark_cb = NULL;
+    midi_uart->tx_mark_context = NULL;
+    midi_uart->event_cb = NULL;
+    midi_uart->event_context = NULL;
+#if PIO_MIDI_UART_TX_DMA
+    // The DMA channel writes one byte per TX DREQ; the byte is replicated to
+    // all byte lanes of the FIFO, so the state machine shifts out the right bits
+    midi_uart->tx_dma_chan = (uint)dma_claim_unused_channel(true);
+    midi_uart->tx_dma_busy = false;
+    dma_channel_config dma_config = dma_channel_get_default_config(midi_uart->tx_dma_chan);
+    channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_8);
+    channel_config_set_read_increment(&dma_config, true);
+    channel_config_set_write_increment(&dma_config, false);
+    channel_config_set_dreq(&dma_config, pio_get_dreq(pio, tx_sm, true));
+    dma_channel_configure(midi_uart->tx_dma_chan, &dma_config, &pio->txf[tx_sm], NULL, 0, false);
+    dma_irqn_set_channel_enabled(PIO_MIDI_UART_DMA_IRQ_INDEX, midi_uart->tx_dma_chan, true);
+    static bool dma_irq_handler_installed = false;
+    if (!dma_irq_handler_installed) {
+        irq_add_shared_handler(PIO_MIDI_UART_DMA_IRQ, on_pio_midi_uart_dma_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        irq_set_enabled(PIO_MIDI_UART_DMA_IRQ, true);
+        dma_irq_handler_installed = true;
+    }
+#endif
 
     // Install the interrupt handler
     if (idx == 0) {
@@ -373,8 +758,24 @@ void* pio_midi_uart_create(uint8_t txgpio, uint8_t rxgpio)
     else if (idx == 3) {
         irq_set_exclusive_handler(midi_uart->irq, on_pio_midi_uart3_irq);
     }
+#if PIO_MIDI_UART_RX_DMA
+    // The DMA channel reads the received byte from the most significant byte
+    // of the RX FIFO, like midi_rx_program_get(), and writes it to rx_buf
+    midi_uart->rx_dma_chan = (uint)dma_claim_unused_channel(true);
+    midi_uart->rx_dma_base = 0;
+    dma_channel_config rx_dma_config = dma_channel_get_default_config(midi_uart->rx_dma_chan);
+    channel_config_set_transfer_data_size(&rx_dma_config, DMA_SIZE_8);
+    channel_config_set_read_increment(&rx_dma_config, false);
+    channel_config_set_write_increment(&rx_dma_config, true);
+    channel_config_set_ring(&rx_dma_config, true, (uint)__builtin_ctz(rx_len));
+    channel_config_set_dreq(&rx_dma_config, pio_get_dreq(pio, rx_sm, false));
+    dma_channel_configure(midi_uart->rx_dma_chan, &rx_dma_config, midi_uart->rx_buf, (io_rw_8*)&pio->rxf[rx_sm] + 3,
+                          PIO_MIDI_UART_RX_DMA_COUNT, true);
+    pio_midi_uart_set_rx_irq_enable(pio, rx_sm, false);
+#else
     // enable the rx state machine IRQ
     pio_midi_uart_set_rx_irq_enable(pio, rx_sm, true);
+#endif
     // disable the tx state machine IRQ (no data to send yet)
     pio_midi_uart_set_tx_irq_enable(pio, tx_sm, false);
 
@@ -457,7 +858,7 @@ void* pio_midi_out_create(uint8_t txgpio)
 
     midi_tx_program_init(pio, tx_sm, midi_out->tx_offset, txgpio, MIDI_BAUD_RATE);
     // Prepare the MIDI UART ring buffers and interrupt handler and enable interrupts
-    ring_buffer_init(&midi_out->tx_rb, midi_out->tx_buf, MIDI_UART_RING_BUFFER_LENGTH, midi_out->irq);
+    spsc_ring_init(&midi_out->tx_rb, midi_out->tx_buf, MIDI_UART_RING_BUFFER_LENGTH);
 
     irq_set_enabled(midi_out->irq, false);
     // Install the interrupt handler
@@ -488,62 +889,286 @@ void* pio_midi_out_create(uint8_t txgpio)
     return midi_out;
 }
 
-uint8_t pio_midi_uart_poll_rx_buffer(void *instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
+#if PIO_MIDI_UART_RX_DMA
+/**
+ * @brief make the bytes the RX DMA channel wrote available in the RX buffer
+ *
+ * @param midi_uart the MIDI UART
+ */
+static void pio_midi_uart_update_rx_dma(PIO_MIDI_UART_T* midi_uart)
+{
+    uint32_t remaining = dma_channel_hw_addr(midi_uart->rx_dma_chan)->transfer_count;
+    uint32_t head = midi_uart->rx_dma_base + (PIO_MIDI_UART_RX_DMA_COUNT - remaining);
+    midi_uart->rx_stats.bytes += head - midi_uart->rx_rb.head;
+    uint32_t len = midi_uart->rx_rb.mask + 1;
+    uint32_t level = head - midi_uart->rx_rb.tail;
+    if (level > len) {
+        // The DMA channel overwrote bytes that were not read in time. Skip to
+        // the newest half of the buffer, which the channel will not reach
+        // before the bytes are read.
+        midi_uart->rx_rb.tail = head - len / 2;
+        midi_uart->rx_stats.dropped += level - len / 2;
+        level = len;
+    }
+    if (level > midi_uart->rx_stats.max_level) {
+        midi_uart->rx_stats.max_level = level;
+    }
+    midi_uart->rx_rb.head = head;
+    if (remaining == 0) {
+        // The write address keeps wrapping in the ring, so just start over
+        midi_uart->rx_dma_base = head;
+        dma_channel_set_trans_count(midi_uart->rx_dma_chan, PIO_MIDI_UART_RX_DMA_COUNT, true);
+    }
+}
+#endif
+
+RING_BUFFER_SIZE_TYPE pio_midi_uart_poll_rx_buffer(void *instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
 {
     PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
-    return ring_buffer_pop(&midi_uart->rx_rb, buffer, buflen);
+#if PIO_MIDI_UART_RX_DMA
+    pio_midi_uart_update_rx_dma(midi_uart);
+#endif
+    return (RING_BUFFER_SIZE_TYPE)spsc_ring_pop(&midi_uart->rx_rb, buffer, buflen);
 }
 
-uint8_t pio_midi_uart_write_tx_buffer(void* instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
+RING_BUFFER_SIZE_TYPE pio_midi_uart_poll_rx_buffer_timestamped(void *instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen,
+                                                               uint32_t* timestamps_us)
 {
+#if PIO_MIDI_UART_RX_DMA
+    RING_BUFFER_SIZE_TYPE nread = pio_midi_uart_poll_rx_buffer(instance, buffer, buflen);
+    uint32_t now_us = time_us_32();
+    for (RING_BUFFER_SIZE_TYPE idx = 0; idx < nread; idx++) {
+        timestamps_us[idx] = now_us;
+    }
+    return nread;
+#else
     PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
-    return ring_buffer_push(&midi_uart->tx_rb, buffer, buflen);
+    uint32_t index = midi_uart->rx_rb.tail;
+    RING_BUFFER_SIZE_TYPE nread = (RING_BUFFER_SIZE_TYPE)spsc_ring_pop(&midi_uart->rx_rb, buffer, buflen);
+    for (RING_BUFFER_SIZE_TYPE idx = 0; idx < nread; idx++, index++) {
+        uint32_t time_us = midi_uart->rx_msg_time_us;
+        const uint8_t* record;
+        // timestamps are contiguous in rx_ts_buf because their size divides its size
+        while (spsc_ring_peek_contiguous(&midi_uart->rx_ts_rb, &record) >= sizeof(PIO_MIDI_UART_RX_TIMESTAMP_T)) {
+            const PIO_MIDI_UART_RX_TIMESTAMP_T* timestamp = (const PIO_MIDI_UART_RX_TIMESTAMP_T*)record;
+            int32_t ahead = (int32_t)(timestamp->index - index);
+            if (ahead > 0) {
+                break; // the timestamp of a later byte
+            }
+            if (ahead == 0) {
+                time_us = timestamp->time_us;
+            }
+            // older timestamps belong to bytes read without timestamps
+            spsc_ring_consume(&midi_uart->rx_ts_rb, sizeof(PIO_MIDI_UART_RX_TIMESTAMP_T));
+            if (ahead == 0) {
+                break;
+            }
+        }
+        timestamps_us[idx] = time_us;
+        if (buffer[idx] < 0xF8) {
+            // realtime bytes do not change the timestamp of the message they interrupt
+            midi_uart->rx_msg_time_us = time_us;
+        }
+    }
+    return nread;
+#endif
+}
+
+RING_BUFFER_SIZE_TYPE pio_midi_uart_write_tx_buffer(void* instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
+{
+    PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
+    uint32_t nwritten = spsc_ring_push(&midi_uart->tx_rb, buffer, buflen);
+    // only this function adds bytes, so the level cannot get higher than now
+    uint32_t level = spsc_ring_get_num_bytes(&midi_uart->tx_rb);
+    if (level > midi_uart->tx_stats.max_level) {
+        midi_uart->tx_stats.max_level = level;
+    }
+    midi_uart->tx_stats.rejected += buflen - nwritten;
+    return (RING_BUFFER_SIZE_TYPE)nwritten;
 }
 
-uint8_t pio_midi_out_write_tx_buffer(void* instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
+RING_BUFFER_SIZE_TYPE pio_midi_uart_get_tx_buffer_space(void* instance)
+{
+    PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
+    uint32_t space = spsc_ring_get_free_space(&midi_uart->tx_rb);
+    return space > (RING_BUFFER_SIZE_TYPE)~0 ? (RING_BUFFER_SIZE_TYPE)~0 : (RING_BUFFER_SIZE_TYPE)space;
+}
+
+void pio_midi_uart_set_tx_mark_cb(void* instance, pio_midi_uart_tx_mark_cb_t callback, void* context)
+{
+    PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
+    uint32_t status = save_and_disable_interrupts();
+    midi_uart->tx_mark_context = context;
+    midi_uart->tx_mark_cb = callback;
+    restore_interrupts(status);
+}
+
+void pio_midi_uart_set_event_cb(void* instance, pio_midi_uart_event_cb_t callback, void* context)
+{
+    PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
+    uint32_t status = save_and_disable_interrupts();
+    midi_uart->event_context = context;
+    midi_uart->event_cb = callback;
+    restore_interrupts(status);
+}
+
+bool pio_midi_uart_mark_tx_buffer(void* instance, RING_BUFFER_SIZE_TYPE offset, uint16_t tag, uint32_t time_us)
+{
+    PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
+    if (midi_uart->tx_mark_cb == NULL) {
+        return false;
+    }
+    PIO_MIDI_UART_TX_MARK_T mark = {.index = (uint16_t)(midi_uart->tx_rb.head + offset), .tag = tag, .time_us = time_us};
+    return spsc_ring_push_all(&midi_uart->tx_mark_rb, (const uint8_t*)&mark, sizeof(mark));
+}
+
+RING_BUFFER_SIZE_TYPE pio_midi_out_write_tx_buffer(void* instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
 {
     PIO_MIDI_OUT_T *midi_out = (PIO_MIDI_OUT_T *)instance;
-    return ring_buffer_push(&midi_out->tx_rb, buffer, buflen);
+    return (RING_BUFFER_SIZE_TYPE)spsc_ring_push(&midi_out->tx_rb, buffer, buflen);
 }
 
 void pio_midi_uart_drain_tx_buffer(void* instance)
 {
     PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
-    // disable UART interrupts because checking if still transmitting from the buffer
-    irq_set_enabled(midi_uart->irq, false);
-    // can use the unsafe version of ring_buffer_is_empty_unsafe() because UART IRQ
-    // is disabled
-    if (!ring_buffer_is_empty_unsafe(&midi_uart->tx_rb)) {
-        uint8_t val;
-        if (pio_sm_is_tx_fifo_empty(midi_uart->pio, midi_uart->tx_sm)) {
-            // then last transmission is complete. Kick start a new one
-            RING_BUFFER_SIZE_TYPE result = ring_buffer_pop_unsafe(&midi_uart->tx_rb, &val, 1);
-            assert(result == 1);
-            pio_sm_put(midi_uart->pio, midi_uart->tx_sm, val);
-            pio_midi_uart_set_tx_irq_enable(midi_uart->pio, midi_uart->tx_sm, true);
+#if PIO_MIDI_UART_TX_DMA
+    // Only this function and the DMA IRQ handler start transfers, and the
+    // handler keeps starting them until the TX buffer is empty
+    if (!midi_uart->tx_dma_busy) {
+        pio_midi_uart_start_tx_dma(midi_uart);
+    }
+#else
+    // The IRQ handler is the only reader of the TX buffer. Enabling the TX FIFO
+    // not full IRQ starts a transmission if none is in progress; the IRQ source
+    // enable bits are set and cleared atomically, so the IRQ stays unmasked.
+    if (!spsc_ring_is_empty(&midi_uart->tx_rb) || !spsc_ring_is_empty(&midi_uart->rt_rb)) {
+        pio_midi_uart_set_tx_irq_enable(midi_uart->pio, midi_uart->tx_sm, true);
+    }
+#endif
+}
+
+bool pio_midi_uart_write_realtime(void* instance, uint8_t val, uint16_t tag, uint32_t time_us)
+{
+    PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
+    if (spsc_ring_get_free_space(&midi_uart->rt_rb) == 0) {
+        return false;
+    }
+    uint32_t slot = midi_uart->rt_rb.head & midi_uart->rt_rb.mask;
+    midi_uart->rt_tag[slot] = tag;
+    midi_uart->rt_time_us[slot] = time_us;
+    spsc_ring_push(&midi_uart->rt_rb, &val, 1);
+    pio_midi_uart_drain_tx_buffer(instance);
+    return true;
+}
+
+/**
+ * @brief check if a MIDI UART's TX state machine waits for a byte with nothing
+ * else to send first
+ *
+ * @param midi_uart the MIDI UART
+ * @return true if a byte put into the TX FIFO now starts at the state machine's next clock
+ */
+static inline bool pio_midi_uart_is_tx_idle(PIO_MIDI_UART_T* midi_uart)
+{
+#if PIO_MIDI_UART_TX_DMA
+    if (midi_uart->tx_dma_busy) {
+        return false;
+    }
+#endif
+    // realtime bytes already in the lane go first
+    return spsc_ring_is_empty(&midi_uart->rt_rb) && midi_tx_program_is_idle(midi_uart->pio, midi_uart->tx_sm);
+}
+
+uint32_t pio_midi_uart_broadcast_realtime(void* const midi_ports[], uint8_t nports, uint8_t val, uint16_t tag,
+                                          uint32_t time_us)
+{
+    uint32_t sm_mask[2] = {0, 0};
+    uint32_t in_phase = 0;
+    uint32_t full = 0;
+    uint32_t status = save_and_disable_interrupts();
+    for (uint8_t idx = 0; idx < nports; idx++) {
+        PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)midi_ports[idx];
+        if (midi_uart == NULL) {
+            continue;
+        }
+        if (pio_midi_uart_is_tx_idle(midi_uart)) {
+            sm_mask[pio_get_index(midi_uart->pio)] |= 1u << midi_uart->tx_sm;
+            in_phase |= 1u << idx;
+        }
+        else if (!pio_midi_uart_write_realtime(midi_uart, val, tag, time_us)) {
+            full |= 1u << idx;
         }
     }
-    irq_set_enabled(midi_uart->irq, true);
+    if (in_phase) {
+        // A stopped state machine stays at the pull, so it takes the byte
+        // when it runs again
+        pio_set_sm_mask_enabled(pio0, sm_mask[0], false);
+        pio_set_sm_mask_enabled(pio1, sm_mask[1], false);
+        for (uint8_t idx = 0; idx < nports; idx++) {
+            if (in_phase & (1u << idx)) {
+                PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)midi_ports[idx];
+                midi_tx_program_put(midi_uart->pio, midi_uart->tx_sm, val);
+                midi_tx_program_clear_stall(midi_uart->pio, midi_uart->tx_sm);
+            }
+        }
+        // the two PIOs can only be started one after the other
+        pio_enable_sm_mask_in_sync(pio0, sm_mask[0]);
+        pio_enable_sm_mask_in_sync(pio1, sm_mask[1]);
+        uint32_t now_us = time_us_32();
+        for (uint8_t idx = 0; idx < nports; idx++) {
+            if (in_phase & (1u << idx)) {
+                PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)midi_ports[idx];
+                ++midi_uart->tx_stats.bytes;
+                ++midi_uart->tx_stats.rt_bytes;
+                ++midi_uart->tx_stats.rt_in_phase;
+                if (midi_uart->tx_mark_cb) {
+                    midi_uart->tx_mark_cb(midi_uart->tx_mark_context, tag, time_us, now_us);
+                }
+            }
+        }
+    }
+    restore_interrupts(status);
+    return full;
+}
+
+uint32_t pio_midi_uart_get_buffer_pool_free(void)
+{
+    return PIO_MIDI_UART_BUFFER_POOL_SIZE - buffer_pool_used;
+}
+
+void pio_midi_uart_get_tx_stats(void* instance, pio_midi_uart_tx_stats_t* stats)
+{
+    PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
+    *stats = midi_uart->tx_stats;
+}
+
+void pio_midi_uart_reset_tx_stats(void* instance)
+{
+    PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
+    memset(&midi_uart->tx_stats, 0, sizeof(midi_uart->tx_stats));
+}
+
+void pio_midi_uart_get_rx_stats(void* instance, pio_midi_uart_rx_stats_t* stats)
+{
+    PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
+    *stats = midi_uart->rx_stats;
+}
+
+void pio_midi_uart_reset_rx_stats(void* instance)
+{
+    PIO_MIDI_UART_T *midi_uart = (PIO_MIDI_UART_T *)instance;
+    memset(&midi_uart->rx_stats, 0, sizeof(midi_uart->rx_stats));
 }
 
 void pio_midi_out_drain_tx_buffer(void* instance)
 {
     PIO_MIDI_OUT_T *midi_out = (PIO_MIDI_OUT_T *)instance;
-    // disable UART interrupts because checking if still transmitting from the buffer
-    irq_set_enabled(midi_out->irq, false);
-    // can use the unsafe version of ring_buffer_is_empty_unsafe() because UART IRQ
-    // is disabled
-    if (!ring_buffer_is_empty_unsafe(&midi_out->tx_rb)) {
-        uint8_t val;
-        if (pio_sm_is_tx_fifo_empty(midi_out->pio, midi_out->tx_sm)) {
-            // then last transmission is complete. Kick start a new one
-            RING_BUFFER_SIZE_TYPE result = ring_buffer_pop_unsafe(&midi_out->tx_rb, &val, 1);
-            assert(result == 1);
-            pio_sm_put(midi_out->pio, midi_out->tx_sm, val);
-            pio_midi_uart_set_tx_irq_enable(midi_out->pio, midi_out->tx_sm, true);
-        }
+    // The IRQ handler is the only reader of the TX buffer. Enabling the TX FIFO
+    // not full IRQ starts a transmission if none is in progress; the IRQ source
+    // enable bits are set and cleared atomically, so the IRQ stays unmasked.
+    if (!spsc_ring_is_empty(&midi_out->tx_rb)) {
+        pio_midi_uart_set_tx_irq_enable(midi_out->pio, midi_out->tx_sm, true);
     }
-    irq_set_enabled(midi_out->irq, true);
 }
 
 void pio_midi_uart_show_pio_info(void* instance)
@@ -31,11 +31,80 @@
 #include <stdint.h>
 #include "hardware/pio.h"
 #include "pio_midi_uart.pio.h"
-#include "ring_buffer_lib.h"
+#include "spsc_ring_lib.h"
+
+// Type of the buffer lengths in the API
+#ifndef RING_BUFFER_SIZE_TYPE
+#define RING_BUFFER_SIZE_TYPE uint16_t
+#endif
+// Bytes of static memory the RX and TX buffers of all MIDI UARTs are taken from
+#ifndef PIO_MIDI_UART_BUFFER_POOL_SIZE
+#define PIO_MIDI_UART_BUFFER_POOL_SIZE 1024
+#endif
+// Longest RX or TX buffer of a MIDI UART
+#define PIO_MIDI_UART_MAX_BUFFER_LENGTH 16384
+// Address alignment of the buffer pool. With PIO_MIDI_UART_RX_DMA every RX
+// buffer is aligned to its length for the DMA ring, so RX buffers no longer
+// than this pack into the pool without gaps.
+#ifndef PIO_MIDI_UART_BUFFER_POOL_ALIGN
+#if PIO_MIDI_UART_RX_DMA
+#define PIO_MIDI_UART_BUFFER_POOL_ALIGN 256
+#else
+#define PIO_MIDI_UART_BUFFER_POOL_ALIGN 4
+#endif
+#endif
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @struct transmit statistics of a MIDI port
+ */
+typedef struct {
+    uint32_t bytes;      // bytes moved to the state machine TX FIFO
+    uint32_t irqs;       // TX FIFO interrupts, or DMA completion interrupts in DMA mode
+    uint32_t irq_us;     // approximate CPU time spent in those interrupts
+    uint32_t dma_blocks; // DMA transfers started; DMA mode only
+    uint32_t dma_us;     // time DMA transfers were in progress; DMA mode only
+    uint32_t rejected;   // bytes pio_midi_uart_write_tx_buffer() could not take because the TX buffer was full
+    uint32_t max_level;  // most bytes ever waiting in the TX buffer
+    uint32_t rt_bytes;   // bytes sent from the realtime lane (included in bytes)
+    uint32_t rt_in_phase; // realtime bytes pio_midi_uart_broadcast_realtime() released in phase (included in rt_bytes)
+} pio_midi_uart_tx_stats_t;
+
+/**
+ * @struct receive statistics of a MIDI port
+ */
+typedef struct {
+    uint32_t bytes;     // bytes put into the RX buffer
+    uint32_t dropped;   // bytes lost because the RX buffer was full (in DMA mode: overwritten before they were read)
+    uint32_t max_level; // most bytes ever waiting in the RX buffer
+} pio_midi_uart_rx_stats_t;
+
+/**
+ * @brief called from the TX IRQ handler when it took a marked byte out of the TX buffer
+ *
+ * @param context the context passed to pio_midi_uart_set_tx_mark_cb()
+ * @param tag the tag passed to pio_midi_uart_mark_tx_buffer()
+ * @param time_us the time passed to pio_midi_uart_mark_tx_buffer()
+ * @param now_us the time the IRQ handler started, in microseconds
+ */
+typedef void (*pio_midi_uart_tx_mark_cb_t)(void* context, uint16_t tag, uint32_t time_us, uint32_t now_us);
+
+// Events reported to the event callback
+#define PIO_MIDI_UART_EVENT_RX 0x1 // the RX IRQ handler put bytes into the RX buffer
+#define PIO_MIDI_UART_EVENT_TX 0x2 // a TX IRQ handler made room in the TX buffer
+
+/**
+ * @brief called from the IRQ handlers when they moved bytes, so that the code
+ * that reads the RX buffer and fills the TX buffer can sleep until there is work
+ *
+ * @param context the context passed to pio_midi_uart_set_event_cb()
+ * @param events PIO_MIDI_UART_EVENT_RX and/or PIO_MIDI_UART_EVENT_TX
+ * @note with PIO_MIDI_UART_RX_DMA received bytes take no IRQ, so there are no RX events
+ */
+typedef void (*pio_midi_uart_event_cb_t)(void* context, uint32_t events);
+
 /**
  * @brief Create a PIO MIDI port pair
  *
@@ -46,6 +115,31 @@ extern "C" {
  */
 void* pio_midi_uart_create(uint8_t txgpio, uint8_t rxgpio);
 
+/**
+ * @brief Create a PIO MIDI port pair with RX and TX buffers of the given lengths
+ *
+ * The buffers are taken from a static pool of PIO_MIDI_UART_BUFFER_POOL_SIZE
+ * bytes shared by all MIDI UARTs and are never freed.
+ * pio_midi_uart_create() uses MIDI_UART_RING_BUFFER_LENGTH (128) for both.
+ *
+ * @param txgpio the GPIO number of the MIDI OUT pin
+ * @param rxgpio the GPIO number of the MIDI IN pin
+ * @param rx_len the RX buffer length; a power of 2 up to PIO_MIDI_UART_MAX_BUFFER_LENGTH
+ * @param tx_len the TX buffer length; a power of 2 up to PIO_MIDI_UART_MAX_BUFFER_LENGTH
+ * @return a pointer to the MIDI port instance or NULL if the new MIDI port
+ * could not be created, the lengths are not valid or the pool is too small
+ * @note with PIO_MIDI_UART_RX_DMA the RX buffer is aligned to its length;
+ * create the ports with the longest RX buffers first to waste no pool memory
+ */
+void* pio_midi_uart_create_sized(uint8_t txgpio, uint8_t rxgpio, RING_BUFFER_SIZE_TYPE rx_len, RING_BUFFER_SIZE_TYPE tx_len);
+
+/**
+ * @brief get the number of buffer pool bytes that no MIDI UART uses
+ *
+ * @return the free bytes in the buffer pool
+ */
+uint32_t pio_midi_uart_get_buffer_pool_free(void);
+
 /**
  * @brief Create a PIO MIDI out port
  *
@@ -64,7 +158,28 @@ void* pio_midi_out_create(uint8_t txgpio);
  *
  * @return the number of bytes fetched
  */
-uint8_t pio_midi_uart_poll_rx_buffer(void *midi_port, uint8_t *buffer, RING_BUFFER_SIZE_TYPE buflen);
+RING_BUFFER_SIZE_TYPE pio_midi_uart_poll_rx_buffer(void *midi_port, uint8_t *buffer, RING_BUFFER_SIZE_TYPE buflen);
+
+/**
+ * @brief fetch up to buflen bytes from the MIDI UART RX buffer together with
+ * the time the message each byte belongs to started to arrive
+ *
+ * The RX IRQ handler reads the timer when it takes a byte that starts a
+ * message (a status byte or the first data byte of a running status message)
+ * out of the PIO RX FIFO and stores one timestamp per message next to the RX
+ * buffer. Realtime messages get their own timestamp and do not change the
+ * timestamp of the message they interrupt.
+ *
+ * @param midi_port a pointer to a MIDI port created by pio_midi_uart_create()
+ * @param buffer is a pointer to an array of bytes to receive the message
+ * @param buflen is the the maximum number of bytes in the array
+ * @param timestamps_us receives buflen timestamps in microseconds (time_us_32()), one per byte
+ *
+ * @return the number of bytes fetched
+ * @note with PIO_MIDI_UART_RX_DMA there is no RX IRQ and all bytes get the time of the call
+ */
+RING_BUFFER_SIZE_TYPE pio_midi_uart_poll_rx_buffer_timestamped(void *midi_port, uint8_t *buffer, RING_BUFFER_SIZE_TYPE buflen,
+                                                               uint32_t *timestamps_us);
 
 /**
  * @brief put the bytes in buffer into the MIDI UART TX buffer
@@ -76,7 +191,97 @@ uint8_t pio_midi_uart_poll_rx_buffer(void *midi_port, uint8_t *buffer, RING_BUFF
  * @return the number of bytes loaded; may be less than buflen if the buffer is full
  * @note you must call midi_uart_drain_tx_buffer() to actually send the bytes
  */
-uint8_t pio_midi_uart_write_tx_buffer(void *midi_port, uint8_t *buffer, RING_BUFFER_SIZE_TYPE buflen);
+RING_BUFFER_SIZE_TYPE pio_midi_uart_write_tx_buffer(void *midi_port, uint8_t *buffer, RING_BUFFER_SIZE_TYPE buflen);
+
+/**
+ * @brief send a System Realtime byte ahead of the bytes in the MIDI UART TX buffer
+ *
+ * The byte goes into a small realtime lane that the TX IRQ handler empties
+ * before it takes the next byte out of the TX buffer, so the byte is sent
+ * between two bytes of the normal stream. The normal stream stays intact.
+ * In PIO_MIDI_UART_TX_DMA mode it is sent after the DMA block in progress,
+ * which is at most PIO_MIDI_UART_TX_DMA_MAX_BLOCK bytes.
+ *
+ * @param midi_port a pointer to a MIDI port created by pio_midi_uart_create()
+ * @param val the realtime byte (0xF8-0xFF)
+ * @param tag passed to the TX mark callback when the byte is sent
+ * @param time_us passed to the TX mark callback when the byte is sent
+ *
+ * @return false if the realtime lane is full
+ * @note starts the transmission; there is no need to call pio_midi_uart_drain_tx_buffer()
+ */
+bool pio_midi_uart_write_realtime(void *midi_port, uint8_t val, uint16_t tag, uint32_t time_us);
+
+/**
+ * @brief send a System Realtime byte on several MIDI UARTs in phase
+ *
+ * The TX state machines that wait for a byte with the line idle are stopped,
+ * get the byte in their TX FIFO and are started again together with
+ * pio_enable_sm_mask_in_sync(), which also restarts their clock dividers.
+ * Their start bits line up exactly within a PIO and within a few system
+ * clock cycles across the two PIOs. A port that is still sending gets the
+ * byte in its realtime lane as from pio_midi_uart_write_realtime(), so it
+ * goes out after the bytes already in the TX FIFO.
+ *
+ * @param midi_ports the MIDI UARTs created by pio_midi_uart_create(); NULL entries are skipped
+ * @param nports the number of entries in midi_ports (at most 32)
+ * @param val the realtime byte (0xF8-0xFF)
+ * @param tag passed to the TX mark callback when the byte is sent
+ * @param time_us passed to the TX mark callback when the byte is sent
+ *
+ * @return the bits (1 << index into midi_ports) of the ports whose realtime lane was full
+ * @note call on the core the MIDI UART IRQ handlers run on; interrupts are
+ * disabled for the time it takes to load the TX FIFOs
+ */
+uint32_t pio_midi_uart_broadcast_realtime(void* const midi_ports[], uint8_t nports, uint8_t val, uint16_t tag,
+                                          uint32_t time_us);
+
+/**
+ * @brief get the number of bytes that can be written to the MIDI UART TX buffer
+ *
+ * @param midi_port a pointer to a MIDI port created by pio_midi_uart_create()
+ *
+ * @return the number of free bytes in the TX buffer
+ * @note use this to write complete messages only; the free space can only grow
+ * until the next call to pio_midi_uart_write_tx_buffer()
+ */
+RING_BUFFER_SIZE_TYPE pio_midi_uart_get_tx_buffer_space(void *midi_port);
+
+/**
+ * @brief set the function that reports the TX marks of a MIDI port
+ *
+ * @param midi_port a pointer to a MIDI port created by pio_midi_uart_create()
+ * @param callback the function or NULL to stop accepting TX marks
+ * @param context passed to callback
+ */
+void pio_midi_uart_set_tx_mark_cb(void *midi_port, pio_midi_uart_tx_mark_cb_t callback, void* context);
+
+/**
+ * @brief set the function that reports the RX and TX events of a MIDI port
+ *
+ * @param midi_port a pointer to a MIDI port created by pio_midi_uart_create()
+ * @param callback the function or NULL to stop reporting events
+ * @param context passed to callback
+ */
+void pio_midi_uart_set_event_cb(void *midi_port, pio_midi_uart_event_cb_t callback, void* context);
+
+/**
+ * @brief mark a byte that is about to be written to the MIDI UART TX buffer
+ *
+ * The TX mark callback is called with tag and time_us when the marked byte
+ * leaves the TX buffer for the state machine. Call this before writing the
+ * byte with pio_midi_uart_write_tx_buffer(), in the order of the bytes.
+ *
+ * @param midi_port a pointer to a MIDI port created by pio_midi_uart_create()
+ * @param offset the number of bytes up to and including the marked byte that
+ * will be written to the TX buffer
+ * @param tag passed to the TX mark callback
+ * @param time_us passed to the TX mark callback
+ *
+ * @return false if there is no TX mark callback or no room for the mark
+ * @note in PIO_MIDI_UART_TX_DMA mode, marks are reported when the DMA block holding the byte is done
+ */
+bool pio_midi_uart_mark_tx_buffer(void *midi_port, RING_BUFFER_SIZE_TYPE offset, uint16_t tag, uint32_t time_us);
 
 /**
  * @brief start transmitting bytes from the tx buffer if not already doing so
@@ -87,6 +292,37 @@ uint8_t pio_midi_uart_write_tx_buffer(void *midi_port, uint8_t *buffer, RING_BUF
  */
 void pio_midi_uart_drain_tx_buffer(void *midi_port);
 
+/**
+ * @brief get the transmit statistics of a MIDI port
+ *
+ * @param midi_port a pointer to a MIDI port created by pio_midi_uart_create()
+ * @param stats receives the statistics
+ */
+void pio_midi_uart_get_tx_stats(void *midi_port, pio_midi_uart_tx_stats_t* stats);
+
+/**
+ * @brief clear the transmit statistics of a MIDI port
+ *
+ * @param midi_port a pointer to a MIDI port created by pio_midi_uart_create()
+ */
+void pio_midi_uart_reset_tx_stats(void *midi_port);
+
+/**
+ * @brief get the receive statistics of a MIDI port
+ *
+ * @param midi_port a pointer to a MIDI port created by pio_midi_uart_create()
+ * @param stats receives the statistics
+ * @note in PIO_MIDI_UART_RX_DMA mode the statistics are updated by pio_midi_uart_poll_rx_buffer()
+ */
+void pio_midi_uart_get_rx_stats(void *midi_port, pio_midi_uart_rx_stats_t* stats);
+
+/**
+ * @brief clear the receive statistics of a MIDI port
+ *
+ * @param midi_port a pointer to a MIDI port created by pio_midi_uart_create()
+ */
+void pio_midi_uart_reset_rx_stats(void *midi_port);
+
 /**
  * @brief print out PIO-related info about the MIDI port
  *
@@ -104,7 +340,7 @@ void pio_midi_uart_show_pio_info(void* midi_port);
  * @return the number of bytes loaded; may be less than buflen if the buffer is full
  * @note you must call midi_uart_drain_tx_buffer() to actually send the bytes
  */
-uint8_t pio_midi_out_write_tx_buffer(void *midi_port, uint8_t *buffer, RING_BUFFER_SIZE_TYPE buflen);
+RING_BUFFER_SIZE_TYPE pio_midi_out_write_tx_buffer(void *midi_port, uint8_t *buffer, RING_BUFFER_SIZE_TYPE buflen);
 
 /**
  * @brief start transmitting bytes from the tx buffer if not already doing so
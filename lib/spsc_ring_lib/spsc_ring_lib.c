@@ -0,0 +1,115 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "spsc_ring_lib.h"
+
+bool spsc_ring_init(spsc_ring_t* ring, uint8_t* buf, uint32_t size)
+{
+    if (size == 0 || (size & (size - 1)) != 0) {
+        return false;
+    }
+    ring->buf = buf;
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    return true;
+}
+
+// Copy len bytes to the ring buffer and then publish them
+static void copy_in(spsc_ring_t* ring, const uint8_t* data, uint32_t len)
+{
+    uint32_t head = ring->head;
+    for (uint32_t idx = 0; idx < len; idx++) {
+        ring->buf[(head + idx) & ring->mask] = data[idx];
+    }
+    // the consumer must not see the new head before the bytes
+    SPSC_RING_BARRIER();
+    ring->head = head + len;
+}
+
+uint32_t spsc_ring_push(spsc_ring_t* ring, const uint8_t* data, uint32_t len)
+{
+    uint32_t space = spsc_ring_get_free_space(ring);
+    if (len > space) {
+        len = space;
+    }
+    if (len > 0) {
+        // the bytes the consumer freed must be read before they are overwritten
+        SPSC_RING_BARRIER();
+        copy_in(ring, data, len);
+    }
+    return len;
+}
+
+bool spsc_ring_push_all(spsc_ring_t* ring, const uint8_t* data, uint32_t len)
+{
+    if (len > spsc_ring_get_free_space(ring)) {
+        return false;
+    }
+    SPSC_RING_BARRIER();
+    copy_in(ring, data, len);
+    return true;
+}
+
+uint32_t spsc_ring_pop(spsc_ring_t* ring, uint8_t* data, uint32_t maxlen)
+{
+    uint32_t tail = ring->tail;
+    uint32_t nbytes = ring->head - tail;
+    if (nbytes > maxlen) {
+        nbytes = maxlen;
+    }
+    if (nbytes == 0) {
+        return 0;
+    }
+    // the bytes must not be read before the head that published them
+    SPSC_RING_BARRIER();
+    for (uint32_t idx = 0; idx < nbytes; idx++) {
+        data[idx] = ring->buf[(tail + idx) & ring->mask];
+    }
+    // the producer must not see the new tail before the bytes were read
+    SPSC_RING_BARRIER();
+    ring->tail = tail + nbytes;
+    return nbytes;
+}
+
+uint32_t spsc_ring_peek_contiguous(const spsc_ring_t* ring, const uint8_t** data)
+{
+    uint32_t tail = ring->tail;
+    uint32_t nbytes = ring->head - tail;
+    uint32_t offset = tail & ring->mask;
+    if (nbytes > ring->mask + 1 - offset) {
+        nbytes = ring->mask + 1 - offset; // the rest wraps to the start of the buffer
+    }
+    // the bytes must not be read before the head that published them
+    SPSC_RING_BARRIER();
+    *data = ring->buf + offset;
+    return nbytes;
+}
+
+void spsc_ring_consume(spsc_ring_t* ring, uint32_t len)
+{
+    // the producer must not see the new tail before the bytes were read
+    SPSC_RING_BARRIER();
+    ring->tail += len;
+}
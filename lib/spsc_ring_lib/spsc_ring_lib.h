@@ -0,0 +1,146 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardware/sync.h"
+
+// A single-producer/single-consumer byte ring buffer that needs no critical
+// sections. The producer only ever writes head and the consumer only ever
+// writes tail, so one side may run in an interrupt handler or on the other
+// core while the other side runs in a loop. Both indices run freely and are
+// masked on access, so all of the buffer can be used.
+
+// Memory barrier between accessing the buffer contents and publishing an index
+#ifndef SPSC_RING_BARRIER
+#define SPSC_RING_BARRIER() __dmb()
+#endif
+
+/**
+ * @struct a single-producer/single-consumer ring buffer
+ */
+typedef struct {
+    uint8_t* buf;           // the storage
+    uint32_t mask;          // buffer size - 1; the size is a power of 2
+    volatile uint32_t head; // free-running write index; written by the producer only
+    volatile uint32_t tail; // free-running read index; written by the consumer only
+} spsc_ring_t;
+
+/**
+ * @brief initialize a ring buffer
+ *
+ * @param ring the ring buffer
+ * @param buf the storage
+ * @param size the number of bytes in buf; must be a power of 2
+ * @return false if size is not a power of 2
+ */
+bool spsc_ring_init(spsc_ring_t* ring, uint8_t* buf, uint32_t size);
+
+/**
+ * @brief get the number of bytes waiting in the ring buffer
+ *
+ * Exact when called by the consumer; the producer may see more bytes than
+ * there are if the consumer is popping at the same time.
+ *
+ * @param ring the ring buffer
+ * @return the number of bytes
+ */
+static inline uint32_t spsc_ring_get_num_bytes(const spsc_ring_t* ring)
+{
+    return ring->head - ring->tail;
+}
+
+/**
+ * @brief get the number of bytes that can be pushed
+ *
+ * Exact when called by the producer; the consumer may see less room than
+ * there is if the producer is pushing at the same time.
+ *
+ * @param ring the ring buffer
+ * @return the number of free bytes
+ */
+static inline uint32_t spsc_ring_get_free_space(const spsc_ring_t* ring)
+{
+    return ring->mask + 1 - (ring->head - ring->tail);
+}
+
+static inline bool spsc_ring_is_empty(const spsc_ring_t* ring)
+{
+    return ring->head == ring->tail;
+}
+
+/**
+ * @brief push bytes to the ring buffer; producer only
+ *
+ * @param ring the ring buffer
+ * @param data the bytes to push
+ * @param len the number of bytes in data
+ * @return the number of bytes pushed; less than len if the ring buffer is full
+ */
+uint32_t spsc_ring_push(spsc_ring_t* ring, const uint8_t* data, uint32_t len);
+
+/**
+ * @brief push all bytes or none; producer only
+ *
+ * Use this to pass fixed size records, e.g. USB MIDI event packets, so the
+ * consumer never sees part of a record.
+ *
+ * @param ring the ring buffer
+ * @param data the bytes to push
+ * @param len the number of bytes in data
+ * @return true if the bytes were pushed, false if there was not enough room
+ */
+bool spsc_ring_push_all(spsc_ring_t* ring, const uint8_t* data, uint32_t len);
+
+/**
+ * @brief pop bytes from the ring buffer; consumer only
+ *
+ * @param ring the ring buffer
+ * @param data receives the bytes
+ * @param maxlen the maximum number of bytes to pop
+ * @return the number of bytes popped
+ */
+uint32_t spsc_ring_pop(spsc_ring_t* ring, uint8_t* data, uint32_t maxlen);
+
+/**
+ * @brief get the longest run of waiting bytes that is contiguous in memory;
+ * consumer only
+ *
+ * Use this to hand the bytes to a DMA channel without copying them. Call
+ * spsc_ring_consume() once they are no longer needed.
+ *
+ * @param ring the ring buffer
+ * @param data receives a pointer to the first waiting byte
+ * @return the number of contiguous bytes at data
+ */
+uint32_t spsc_ring_peek_contiguous(const spsc_ring_t* ring, const uint8_t** data);
+
+/**
+ * @brief release bytes returned by spsc_ring_peek_contiguous(); consumer only
+ *
+ * @param ring the ring buffer
+ * @param len the number of bytes to release
+ */
+void spsc_ring_consume(spsc_ring_t* ring, uint32_t len);
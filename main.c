@@ -28,16 +28,22 @@
 #include <string.h>
 
 #include "bsp/board.h"
+#include "hardware/timer.h"
+#include "pico/time.h"
 #include "usb_descriptors.h"
 
 #include "tusb.h"
-#include "pio_midi_uart_lib.h"
-#include "midi_device_multistream.h"
+#include "midi_task.h"
+#include "midi_latency.h"
+#include "midi_clock.h"
+#include "midi_sched.h"
 //--------------------------------------------------------------------+
-// This program routes 5-pin DIN MIDI IN signals A & B to USB MIDI
-// virtual cables 0 & 1 on the USB MIDI Bulk IN endpoint. It also
-// routes MIDI data from USB MIDI virtual cables 0-5 on the USB MIDI
-// Bulk OUT endpoint to the 5-pin DIN MIDI OUT signals A-F.
+// This program routes 5-pin DIN MIDI IN signals A-D and the USB MIDI
+// virtual cables on the USB MIDI Bulk OUT endpoint to any combination of
+// 5-pin DIN MIDI OUT signals A-D and USB MIDI virtual cables on the USB
+// MIDI Bulk IN endpoint (see midi_router.h). By default, DIN MIDI IN n
+// routes to USB MIDI IN cable n and USB MIDI OUT cable n routes to DIN
+// MIDI OUT n. The routing itself is in midi_task.c.
 // The Pico board's LED blinks in a pattern depending on the Pico's
 // USB connection state (See below).
 //--------------------------------------------------------------------+
@@ -59,24 +65,19 @@ enum  {
 };
 
 static uint32_t blink_interval_ms = BLINK_NOT_MOUNTED;
+static uint32_t blink_start_ms = 0;
+
+#define HID_INTERVAL_MS 10
+static uint32_t hid_start_ms = 0;
+
+// Set by the CDC callbacks when the console has input or room for output
+static volatile bool cdc_ready = true;
 
 static void led_blinking_task(void);
-static void midi_task(void);
 static void cdc_task(void);
 static void hid_task(void);
+static void wait_for_event(void);
 
-typedef enum {
-  MIDI_A = 0,
-  MIDI_B = 1,
-  MIDI_C = 2,
-  MIDI_D = 3,
-  NUM_PHY_MIDI_PORT_PAIRS
-} LM_MIDI_PORT;
-
-static void* midi_uarts[NUM_PHY_MIDI_PORT_PAIRS]; // MIDI IN A-D and MIDI OUT A-D
-
-static const size_t MIDI_TX_GPIO[NUM_PHY_MIDI_PORT_PAIRS]   = { 24, 25, 22, 23};
-static const size_t MIDI_RX_GPIO[NUM_PHY_MIDI_PORT_PAIRS]   = { 11, 10,  9,  8};
 static const size_t MIDI_TXEN_GPIO[NUM_PHY_MIDI_PORT_PAIRS] = { 20, 19, 18, 21};
 /*------------- MAIN -------------*/
 int main(void)
@@ -92,22 +93,57 @@ int main(void)
     gpio_set_dir(MIDI_TXEN_GPIO[n], true);
     gpio_put(MIDI_TXEN_GPIO[n], 1);
   }
-  // Create the MIDI UARTs
-  for(size_t n = 0; n < NUM_PHY_MIDI_PORT_PAIRS; n++) {
-    midi_uarts[n] = pio_midi_uart_create(MIDI_TX_GPIO[n], MIDI_RX_GPIO[n]);
-    if(midi_uarts[n] == 0) {
-        printf("Error creating UART %zu\r\n", n);
-    }
-  }
+  midi_task_init();
   printf("Lenkaudio MIDIstributor V1\r\n");
 
+  // The tasks run in a fixed order, MIDI ahead of the housekeeping, and only
+  // when an interrupt made them ready or their time came; in between, the
+  // core sleeps
   while (1)
   {
     tud_task(); // tinyusb device task
-    midi_task();
+    if (midi_task_is_ready()) {
+      midi_task();
+    }
+    if (cdc_ready) {
+      cdc_ready = false;
+      cdc_task(); //LK: ToDo
+    }
     led_blinking_task();
-    cdc_task(); //LK: ToDo
     hid_task(); //LK: ToDo
+    wait_for_event();
+  }
+}
+
+// Time left until a deadline on the board_millis() clock, in microseconds
+static int64_t us_until_ms(uint32_t deadline_ms, uint32_t now_ms)
+{
+  return (int64_t)(int32_t)(deadline_ms - now_ms) * 1000;
+}
+
+// Sleep in WFE until an interrupt or until the next task is due. An interrupt
+// that came in since its task was checked has set the event register, so
+// the core does not sleep through it.
+static void wait_for_event(void)
+{
+  if (tud_task_event_ready() || midi_task_is_ready() || cdc_ready) {
+    return;
+  }
+  uint64_t now_us = time_us_64();
+  uint32_t now_ms = board_millis();
+  int64_t sleep_us = us_until_ms(hid_start_ms + HID_INTERVAL_MS, now_ms);
+  if (blink_interval_ms) {
+    int64_t blink_us = us_until_ms(blink_start_ms + blink_interval_ms, now_ms);
+    if (blink_us < sleep_us) {
+      sleep_us = blink_us;
+    }
+  }
+  uint64_t wake_us = midi_task_get_wake_us();
+  if (wake_us < now_us + (uint64_t)(sleep_us > 0 ? sleep_us : 0)) {
+    sleep_us = (int64_t)(wake_us - now_us);
+  }
+  if (sleep_us > 0) {
+    best_effort_wfe_or_timeout(from_us_since_boot(now_us + (uint64_t)sleep_us));
   }
 }
 
@@ -143,108 +179,902 @@ void tud_resume_cb(void)
 }
 
 //--------------------------------------------------------------------+
-// MIDI Task
+// BLINKING TASK
+//--------------------------------------------------------------------+
+static void led_blinking_task(void)
+{
+  static bool led_state = false;
+
+  // blink is disabled
+  if (!blink_interval_ms) return;
+
+  // Blink every interval ms
+  if ( board_millis() - blink_start_ms < blink_interval_ms) return; // not enough time
+  blink_start_ms += blink_interval_ms;
+
+  board_led_write(led_state);
+  led_state = 1 - led_state; // toggle
+}
+
+
+//--------------------------------------------------------------------+
+// USB CDC
 //--------------------------------------------------------------------+
-static void poll_midi_uarts_rx(bool connected)
+// A line based console. Commands:
+// - latency: print the latency histogram of every route that has samples
+// - latency reset: clear the latency histograms
+// - stats: print the traffic, drop and buffer high-water counters, and the
+//   queue of every source in the DIN MIDI OUT mergers that was used
+// - stats reset: clear them
+// - route: show the destinations of every source
+// - route <A-D|cable> <dests>|off: route a DIN MIDI IN port or USB MIDI OUT
+//   cable to DIN MIDI OUT ports A-D and USB MIDI IN cables 0-3, e.g.
+//   "route A B0" for DIN OUT B and USB IN 0, or to nothing
+// - filter: show the routes that do not pass every message
+// - filter <A-D|cable> <A-D|cable> off|ch <channels>|drop <classes>: set what
+//   the route from a source to a destination passes: everything, only the
+//   MIDI channels in a list like 1-4,10 (or all or none), or everything but
+//   the message classes in a list like clk,as (or none) out of note, pp
+//   (poly pressure), cc, pc, cp (channel pressure), pb, sx (SysEx), sc
+//   (system common), clk, tr (transport), as (Active Sensing) and rst
+// - weight: show how many messages each source may send to each DIN MIDI OUT
+//   port per round robin turn
+// - weight <A-D> <A-D|cable> <1-255>: set it for a DIN MIDI OUT port and a
+//   DIN MIDI IN port or USB MIDI OUT cable
+// - clock: print the clock generator settings and timing
+// - clock on|off: start or stop generating clock ticks
+// - clock start|stop|continue: send Start, Stop or Continue
+// - clock bpm <bpm>: set the tempo, e.g. 120 or 97.5
+// - clock <A-D|cable> <mul>/<div>|off: set the ratio of a DIN MIDI OUT port
+//   or a USB MIDI IN cable
+// - clock sync <A-D|cable>|off: follow the clock of a DIN MIDI IN port or a
+//   USB MIDI OUT cable, or run on the clock's own tempo
+// - clock reset: clear the timing statistics
+// - sched: show the scheduled output state and timing
+// - sched on|off: take scheduled message envelopes or route them as SysEx
+// - sched reset: clear the scheduled output statistics
+// - delay: show the constant latency of the DIN MIDI OUT ports
+// - delay [A-D] <ms>|off: hold the messages to one or all DIN MIDI OUT
+//   ports until the delay has passed since they entered, e.g. 5 or 7.25
+// - rs: show the running status setting of the DIN MIDI OUT ports
+// - rs [A-D] on|off|vel0: use running status on one or all DIN MIDI OUT
+//   ports or not; vel0 also sends Note Off as Note On velocity 0
+#define CONSOLE_LINE_LENGTH 48
+static char console_line[CONSOLE_LINE_LENGTH];
+static uint8_t console_line_len = 0;
+
+// Names of the MIDI_FILTER_* message classes, by bit number
+static const char* const CONSOLE_FILTER_CLASSES[] = {
+  "note", "pp", "cc", "pc", "cp", "pb", "sx", "sc", "clk", "tr", "as", "rst",
+};
+#define CONSOLE_NUM_FILTER_CLASSES (sizeof(CONSOLE_FILTER_CLASSES) / sizeof(CONSOLE_FILTER_CLASSES[0]))
+
+// Format report line item into buf; return the length, 0 to skip the item or -1 when done
+typedef int (*console_report_t)(uint16_t item, char* buf, size_t buflen);
+static console_report_t console_report = NULL;
+static uint16_t console_report_item;
+// Report output not yet written to the CDC FIFO
+static char console_out[384];
+static uint16_t console_out_len = 0;
+static uint16_t console_out_pos = 0;
+
+static int console_source_name(uint8_t src, char* buf, size_t buflen)
+{
+  if (src < MIDI_ROUTER_NUM_DIN_PORTS) {
+    return snprintf(buf, buflen, "DIN IN %c", 'A' + src);
+  }
+  return snprintf(buf, buflen, "USB OUT %u", src - MIDI_ROUTER_NUM_DIN_PORTS);
+}
+
+static int console_route_name(uint8_t src, uint8_t dest, char* buf, size_t buflen)
 {
-    uint8_t rx[48];
-    /* LK: ToDo: dynamic routing, currently static HW IN N -> USB IN N */
-    for (uint8_t cable = 0; cable < NUM_PHY_MIDI_PORT_PAIRS; cable++) {
-        uint8_t nread = pio_midi_uart_poll_rx_buffer(midi_uarts[cable], rx, sizeof(rx));
-        if (nread > 0 && connected)
-        {
-            uint32_t nwritten = tud_midi_stream_write(cable, rx, nread);
-            if (nwritten != nread) {
-                TU_LOG1("Warning: Dropped %lu bytes receiving from UART MIDI In %c\r\n", nread - nwritten, 'A'+cable);
-            }
-        }
+  if (src < MIDI_ROUTER_NUM_DIN_PORTS) {
+    if (dest < MIDI_ROUTER_NUM_DIN_PORTS) {
+      return snprintf(buf, buflen, "DIN IN %c > DIN OUT %c", 'A' + src, 'A' + dest);
     }
-    
+    return snprintf(buf, buflen, "DIN IN %c > USB IN %u", 'A' + src, dest - MIDI_ROUTER_NUM_DIN_PORTS);
+  }
+  if (dest < MIDI_ROUTER_NUM_DIN_PORTS) {
+    return snprintf(buf, buflen, "USB OUT %u > DIN OUT %c", src - MIDI_ROUTER_NUM_DIN_PORTS, 'A' + dest);
+  }
+  return snprintf(buf, buflen, "USB OUT %u > USB IN %u", src - MIDI_ROUTER_NUM_DIN_PORTS, dest - MIDI_ROUTER_NUM_DIN_PORTS);
 }
 
-static void poll_usb_rx(bool connected)
+// Item 0 is the header, item 1 + src * MIDI_ROUTER_NUM_DESTS + dest is a route
+static int console_latency_report(uint16_t item, char* buf, size_t buflen)
 {
-    // device must be attached and have the endpoint ready to receive a message
-    if (!connected) {
-        return;
+  int len = 0;
+  if (item == 0) {
+    len = snprintf(buf, buflen, "route: messages max_us | messages per bucket from (us):");
+    for (uint8_t bucket = 0; bucket < MIDI_LATENCY_NUM_BUCKETS; bucket++) {
+      len += snprintf(buf + len, buflen - (size_t)len, " %lu", (unsigned long)midi_latency_bucket_min_us(bucket));
     }
-    uint8_t rx[48];
-    uint8_t cable_num;
-    uint8_t npushed = 0;
-    uint32_t nread =  tud_midi_demux_stream_read(&cable_num, rx, sizeof(rx));
-    while (nread > 0) {
-        if (cable_num < NUM_PHY_MIDI_PORT_PAIRS) {
-            /* LK: ToDo: dynamic routing, currently static USB OUT N -> HW OUT N */
-            npushed = pio_midi_uart_write_tx_buffer(midi_uarts[cable_num], rx, nread);
-        }
-        else {
-            TU_LOG1("Received a MIDI packet on cable %u", cable_num);
-            npushed = 0;
-            continue;
-        }
-        if (npushed != nread) {
-            TU_LOG1("Warning: Dropped %lu bytes sending to MIDI Out Port %c\r\n", nread - npushed, 'A' + cable_num);
-        }
-        nread =  tud_midi_demux_stream_read(&cable_num, rx, sizeof(rx));
+    return len + snprintf(buf + len, buflen - (size_t)len, "\r\n");
+  }
+  uint16_t route = (uint16_t)(item - 1);
+  if (route >= MIDI_ROUTER_NUM_SOURCES * MIDI_ROUTER_NUM_DESTS) {
+    return -1;
+  }
+  uint8_t src = (uint8_t)(route / MIDI_ROUTER_NUM_DESTS);
+  uint8_t dest = (uint8_t)(route % MIDI_ROUTER_NUM_DESTS);
+  // take a copy; the histogram may be recorded on the other core
+  midi_latency_hist_t hist = midi_latency_hists[src][dest];
+  uint32_t total = 0;
+  uint8_t nbuckets = 0;
+  for (uint8_t bucket = 0; bucket < MIDI_LATENCY_NUM_BUCKETS; bucket++) {
+    total += hist.count[bucket];
+    if (hist.count[bucket]) {
+      nbuckets = (uint8_t)(bucket + 1);
     }
+  }
+  if (total == 0) {
+    return 0;
+  }
+  len = console_route_name(src, dest, buf, buflen);
+  len += snprintf(buf + len, buflen - (size_t)len, ": %lu %lu |", (unsigned long)total, (unsigned long)hist.max_us);
+  for (uint8_t bucket = 0; bucket < nbuckets; bucket++) {
+    len += snprintf(buf + len, buflen - (size_t)len, " %lu", (unsigned long)hist.count[bucket]);
+  }
+  return len + snprintf(buf + len, buflen - (size_t)len, "\r\n");
 }
 
-static void drain_serial_port_tx_buffers()
+// Item n < NUM_PHY_MIDI_PORT_PAIRS is DIN MIDI port n, the next item is USB
+// MIDI, then item NUM_PHY_MIDI_PORT_PAIRS + 1 + port * MIDI_ROUTER_NUM_SOURCES
+// + src is a source in the merger of a DIN MIDI OUT port
+static int console_stats_report(uint16_t item, char* buf, size_t buflen)
 {
-    uint8_t cable;
-    for (cable = 0; cable < NUM_PHY_MIDI_PORT_PAIRS; cable++) {
-        pio_midi_uart_drain_tx_buffer(midi_uarts[cable]);
+  if (item < NUM_PHY_MIDI_PORT_PAIRS) {
+    din_midi_stats_t stats;
+    if (!midi_task_get_din_stats((uint8_t)item, &stats)) {
+      return 0;
     }
+    return snprintf(buf, buflen, "DIN %c: in %lu dropped %lu rx max %lu parse dropped %lu | "
+                    "out %lu rs saved %lu of %lu merge dropped %lu coalesced %lu sysex cut %lu merge max %lu "
+                    "tx rejected %lu tx max %lu rt %lu in phase %lu\r\n",
+                    'A' + item, (unsigned long)stats.rx.bytes, (unsigned long)stats.rx.dropped,
+                    (unsigned long)stats.rx.max_level, (unsigned long)stats.parse_dropped, (unsigned long)stats.tx.bytes,
+                    (unsigned long)stats.out_bytes_saved, (unsigned long)stats.out_bytes_in,
+                    (unsigned long)stats.merge_dropped, (unsigned long)stats.merge_coalesced,
+                    (unsigned long)stats.merge_sysex_cut, (unsigned long)stats.merge_max, (unsigned long)stats.tx.rejected,
+                    (unsigned long)stats.tx.max_level, (unsigned long)stats.tx.rt_bytes,
+                    (unsigned long)stats.tx.rt_in_phase);
+  }
+  if (item == NUM_PHY_MIDI_PORT_PAIRS) {
+    usb_midi_stats_t stats;
+    midi_task_get_usb_stats(&stats);
+    return snprintf(buf, buflen, "USB: out %lu dropped %lu fifo max %lu queue max %lu deferred %lu deferred max %lu "
+                    "stalled %lu | in %lu dropped %lu refused %lu staged max %lu queue max %lu\r\n",
+                    (unsigned long)stats.out_packets, (unsigned long)stats.out_dropped,
+                    (unsigned long)stats.out_fifo_max, (unsigned long)stats.out_queue_max,
+                    (unsigned long)stats.out_deferred, (unsigned long)stats.out_deferred_max,
+                    (unsigned long)stats.out_stalled,
+                    (unsigned long)stats.in_packets, (unsigned long)stats.in_dropped,
+                    (unsigned long)stats.in_refused, (unsigned long)stats.in_staged_max,
+                    (unsigned long)stats.in_queue_max);
+  }
+  uint16_t queue = (uint16_t)(item - NUM_PHY_MIDI_PORT_PAIRS - 1);
+  if (queue >= NUM_PHY_MIDI_PORT_PAIRS * MIDI_ROUTER_NUM_SOURCES) {
+    return -1;
+  }
+  uint8_t port = (uint8_t)(queue / MIDI_ROUTER_NUM_SOURCES);
+  uint8_t src = (uint8_t)(queue % MIDI_ROUTER_NUM_SOURCES);
+  midi_merge_stats_t stats;
+  if (!midi_task_get_merge_stats(port, src, &stats) || (stats.messages == 0 && stats.dropped == 0)) {
+    return 0;
+  }
+  int len = snprintf(buf, buflen, "DIN OUT %c < ", 'A' + port);
+  len += console_source_name(src, buf + len, buflen - (size_t)len);
+  return len + snprintf(buf + len, buflen - (size_t)len, ": weight %u depth %u max %u wait max %lu us | "
+                        "sent %lu dropped %lu coalesced %lu sysex cut %lu\r\n",
+                        midi_task_get_merge_weight(port, src), stats.depth, stats.max_depth,
+                        (unsigned long)stats.max_wait_us, (unsigned long)stats.messages,
+                        (unsigned long)stats.dropped, (unsigned long)stats.coalesced,
+                        (unsigned long)stats.sysex_cut);
 }
 
-static void midi_task(void)
+// Item 0 is the clock, item 1 the clock it follows, item 2 + dest is a
+// destination that gets the clock
+static int console_clock_report(uint16_t item, char* buf, size_t buflen)
 {
-    bool connected = tud_midi_mounted();
-    poll_midi_uarts_rx(connected);
-    poll_usb_rx(connected);
-    drain_serial_port_tx_buffers();
+  static const char* const SYNC_STATES[] = {"idle", "acquire", "locked"};
+  midi_clock_stats_t stats;
+  midi_clock_get_stats(&stats);
+  uint8_t src = midi_clock_get_sync_source();
+  if (item == 0) {
+    // the tempo it runs at, which is the recovered one while following a clock
+    uint32_t bpm_x100 = src == MIDI_CLOCK_INTERNAL ? midi_clock_get_bpm() : stats.bpm_x100;
+    int len = snprintf(buf, buflen, "clock: %s %lu.%02lu bpm | ticks %lu late avg %lu max %lu us dropped %lu",
+                       midi_clock_is_enabled() ? "on" : "off", (unsigned long)(bpm_x100 / 100),
+                       (unsigned long)(bpm_x100 % 100), (unsigned long)stats.ticks,
+                       (unsigned long)(stats.ticks ? stats.late_sum_us / stats.ticks : 0),
+                       (unsigned long)stats.late_max_us, (unsigned long)stats.dropped);
+    return len + snprintf(buf + len, buflen - (size_t)len, "\r\n");
+  }
+  if (item == 1) {
+    if (src == MIDI_CLOCK_INTERNAL) {
+      return 0;
+    }
+    int len;
+    if (src < MIDI_ROUTER_NUM_DIN_PORTS) {
+      len = snprintf(buf, buflen, "sync: DIN IN %c", 'A' + src);
+    }
+    else {
+      len = snprintf(buf, buflen, "sync: USB OUT %u", src - MIDI_ROUTER_NUM_DIN_PORTS);
+    }
+    len += snprintf(buf + len, buflen - (size_t)len, " %s | in %lu relocks %lu",
+                    SYNC_STATES[midi_clock_get_sync_state()], (unsigned long)stats.sync_ticks,
+                    (unsigned long)stats.sync_relocks);
+    if (stats.in_interval_min_us <= stats.in_interval_max_us) {
+      // the jitter before smoothing; the DIN OUT lines have it after
+      len += snprintf(buf + len, buflen - (size_t)len, " interval min %lu max %lu us error max %lu us",
+                      (unsigned long)stats.in_interval_min_us, (unsigned long)stats.in_interval_max_us,
+                      (unsigned long)stats.in_error_max_us);
+    }
+    return len + snprintf(buf + len, buflen - (size_t)len, "\r\n");
+  }
+  uint8_t dest = (uint8_t)(item - 2);
+  if (dest >= MIDI_ROUTER_NUM_DESTS) {
+    return -1;
+  }
+  uint8_t mul;
+  uint8_t div;
+  midi_clock_get_ratio(dest, &mul, &div);
+  if (mul == 0) {
+    return 0;
+  }
+  if (dest >= MIDI_ROUTER_NUM_DIN_PORTS) {
+    return snprintf(buf, buflen, "USB IN %u: %u/%u\r\n", dest - MIDI_ROUTER_NUM_DIN_PORTS, mul, div);
+  }
+  int len = snprintf(buf, buflen, "DIN OUT %c: %u/%u", 'A' + dest, mul, div);
+  if (stats.handoff_min_us[dest] <= stats.handoff_max_us[dest]) {
+    // how much later than due the ticks went into the PIO TX FIFO
+    len += snprintf(buf + len, buflen - (size_t)len, " | to FIFO min %lu max %lu us jitter %lu us",
+                    (unsigned long)stats.handoff_min_us[dest], (unsigned long)stats.handoff_max_us[dest],
+                    (unsigned long)(stats.handoff_max_us[dest] - stats.handoff_min_us[dest]));
+  }
+  if (stats.out_interval_min_us[dest] <= stats.out_interval_max_us[dest]) {
+    // the time between ticks as measured at the FIFO
+    len += snprintf(buf + len, buflen - (size_t)len, " interval min %lu max %lu us",
+                    (unsigned long)stats.out_interval_min_us[dest], (unsigned long)stats.out_interval_max_us[dest]);
+  }
+  return len + snprintf(buf + len, buflen - (size_t)len, "\r\n");
 }
 
-//--------------------------------------------------------------------+
-// BLINKING TASK
-//--------------------------------------------------------------------+
-static void led_blinking_task(void)
+// Item 0 is the USB frame clock and the message counts, item 1 + port a DIN
+// MIDI OUT port that got scheduled messages
+static int console_sched_report(uint16_t item, char* buf, size_t buflen)
 {
-  static uint32_t start_ms = 0;
-  static bool led_state = false;
+  midi_sched_stats_t stats;
+  midi_sched_get_stats(&stats);
+  if (item == 0) {
+    return snprintf(buf, buflen, "sched: %s %s frame %lu.%03lu us | sof %lu relocks %lu | events %lu pending %lu "
+                    "expired %lu held %lu dropped %lu late max %lu us\r\n",
+                    midi_sched_is_enabled() ? "on" : "off", midi_sched_is_locked() ? "locked" : "unlocked",
+                    (unsigned long)(stats.sof_period_ns / 1000), (unsigned long)(stats.sof_period_ns % 1000),
+                    (unsigned long)stats.sof_frames, (unsigned long)stats.sof_relocks,
+                    (unsigned long)stats.events, (unsigned long)midi_sched_get_pending(),
+                    (unsigned long)stats.expired, (unsigned long)stats.held, (unsigned long)stats.dropped,
+                    (unsigned long)stats.late_max_us);
+  }
+  uint8_t port = (uint8_t)(item - 1);
+  if (port >= MIDI_ROUTER_NUM_DIN_PORTS) {
+    return -1;
+  }
+  if (stats.handoff_max_us[port] == 0) {
+    return 0;
+  }
+  // longer than the message takes means it waited behind other bytes
+  return snprintf(buf, buflen, "DIN OUT %c: to FIFO max %lu us\r\n", 'A' + port,
+                  (unsigned long)stats.handoff_max_us[port]);
+}
 
-  // Blink every interval ms
-  if ( board_millis() - start_ms < blink_interval_ms) return; // not enough time
-  start_ms += blink_interval_ms;
+static int console_delay_report(uint16_t item, char* buf, size_t buflen)
+{
+  if (item > 0) {
+    return -1;
+  }
+  int len = snprintf(buf, buflen, "delay:");
+  for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS && len < (int)buflen; port++) {
+    uint32_t delay_us = midi_task_get_out_delay(port);
+    if (delay_us == 0) {
+      len += snprintf(buf + len, buflen - (size_t)len, " %c off", 'A' + port);
+    }
+    else {
+      len += snprintf(buf + len, buflen - (size_t)len, " %c %lu.%03lu ms", 'A' + port,
+                      (unsigned long)(delay_us / 1000), (unsigned long)(delay_us % 1000));
+    }
+  }
+  if (len < (int)buflen) {
+    len += snprintf(buf + len, buflen - (size_t)len, "\r\n");
+  }
+  return len;
+}
 
-  board_led_write(led_state);
-  led_state = 1 - led_state; // toggle
+static int console_rs_report(uint16_t item, char* buf, size_t buflen)
+{
+  if (item > 0) {
+    return -1;
+  }
+  int len = snprintf(buf, buflen, "rs:");
+  for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS && len < (int)buflen; port++) {
+    bool running_status;
+    bool note_off_as_note_on;
+    midi_task_get_out_encoding(port, &running_status, &note_off_as_note_on);
+    len += snprintf(buf + len, buflen - (size_t)len, " %c %s", 'A' + port,
+                    !running_status ? "off" : note_off_as_note_on ? "vel0" : "on");
+  }
+  if (len < (int)buflen) {
+    len += snprintf(buf + len, buflen - (size_t)len, "\r\n");
+  }
+  return len;
 }
 
+// Item n is route source n
+static int console_route_report(uint16_t item, char* buf, size_t buflen)
+{
+  if (item >= MIDI_ROUTER_NUM_SOURCES) {
+    return -1;
+  }
+  uint32_t dest_mask = midi_router_get_route((uint8_t)item);
+  int len = console_source_name((uint8_t)item, buf, buflen);
+  len += snprintf(buf + len, buflen - (size_t)len, " >");
+  if (dest_mask == 0) {
+    len += snprintf(buf + len, buflen - (size_t)len, " none");
+  }
+  for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS && len < (int)buflen; dest++) {
+    if (!(dest_mask & MIDI_ROUTER_DEST_BIT(dest))) {
+      continue;
+    }
+    if (dest < MIDI_ROUTER_NUM_DIN_PORTS) {
+      len += snprintf(buf + len, buflen - (size_t)len, " DIN OUT %c", 'A' + dest);
+    }
+    else {
+      len += snprintf(buf + len, buflen - (size_t)len, " USB IN %u", dest - MIDI_ROUTER_NUM_DIN_PORTS);
+    }
+  }
+  if (len < (int)buflen) {
+    len += snprintf(buf + len, buflen - (size_t)len, "\r\n");
+  }
+  return len;
+}
+
+// Item src * MIDI_ROUTER_NUM_DESTS + dest is the filter of a route
+static int console_filter_report(uint16_t item, char* buf, size_t buflen)
+{
+  if (item >= MIDI_ROUTER_NUM_SOURCES * MIDI_ROUTER_NUM_DESTS) {
+    return -1;
+  }
+  uint8_t src = (uint8_t)(item / MIDI_ROUTER_NUM_DESTS);
+  uint8_t dest = (uint8_t)(item % MIDI_ROUTER_NUM_DESTS);
+  midi_filter_t filter;
+  midi_router_get_filter(src, dest, &filter);
+  if (filter.channels == MIDI_FILTER_ALL_CHANNELS && filter.blocked == 0) {
+    return 0;
+  }
+  int len = console_route_name(src, dest, buf, buflen);
+  len += snprintf(buf + len, buflen - (size_t)len, ": ch");
+  if (filter.channels == MIDI_FILTER_ALL_CHANNELS || filter.channels == 0) {
+    len += snprintf(buf + len, buflen - (size_t)len, filter.channels ? " all" : " none");
+  }
+  char sep = ' ';
+  for (uint8_t ch = 0; ch < 16 && filter.channels != MIDI_FILTER_ALL_CHANNELS; ch++) {
+    if (!(filter.channels & (1u << ch))) {
+      continue;
+    }
+    uint8_t first = ch;
+    while (ch + 1 < 16 && (filter.channels & (1u << (ch + 1)))) {
+      ++ch;
+    }
+    if (ch == first) {
+      len += snprintf(buf + len, buflen - (size_t)len, "%c%u", sep, first + 1);
+    }
+    else {
+      len += snprintf(buf + len, buflen - (size_t)len, "%c%u-%u", sep, first + 1, ch + 1);
+    }
+    sep = ',';
+  }
+  len += snprintf(buf + len, buflen - (size_t)len, " drop");
+  sep = ' ';
+  for (uint8_t n = 0; n < CONSOLE_NUM_FILTER_CLASSES; n++) {
+    if (filter.blocked & (1u << n)) {
+      len += snprintf(buf + len, buflen - (size_t)len, "%c%s", sep, CONSOLE_FILTER_CLASSES[n]);
+      sep = ',';
+    }
+  }
+  if (filter.blocked == 0) {
+    len += snprintf(buf + len, buflen - (size_t)len, " none");
+  }
+  return len + snprintf(buf + len, buflen - (size_t)len, "\r\n");
+}
+
+// Item n is DIN MIDI OUT port n
+static int console_weight_report(uint16_t item, char* buf, size_t buflen)
+{
+  if (item >= NUM_PHY_MIDI_PORT_PAIRS) {
+    return -1;
+  }
+  int len = snprintf(buf, buflen, "DIN OUT %c:", 'A' + item);
+  for (uint8_t src = 0; src < MIDI_ROUTER_NUM_SOURCES && len < (int)buflen; src++) {
+    len += snprintf(buf + len, buflen - (size_t)len, " %c %u",
+                    src < MIDI_ROUTER_NUM_DIN_PORTS ? 'A' + src : '0' + src - MIDI_ROUTER_NUM_DIN_PORTS,
+                    midi_task_get_merge_weight((uint8_t)item, src));
+  }
+  if (len < (int)buflen) {
+    len += snprintf(buf + len, buflen - (size_t)len, "\r\n");
+  }
+  return len;
+}
+
+static void console_print(const char* str)
+{
+  console_report = NULL;
+  console_out_len = (uint16_t)snprintf(console_out, sizeof(console_out), "%s\r\n", str);
+  console_out_pos = 0;
+  cdc_ready = true;
+}
+
+static void console_start_report(console_report_t report)
+{
+  console_report = report;
+  console_report_item = 0;
+  console_out_len = 0;
+  console_out_pos = 0;
+  cdc_ready = true;
+}
+
+// Parse a tempo like "120" or "97.5" into beats per minute times 100
+static bool console_parse_bpm(const char* str, uint32_t* bpm_x100)
+{
+  char* end;
+  unsigned long bpm = strtoul(str, &end, 10);
+  if (end == str || bpm > MIDI_CLOCK_MAX_BPM_X100 / 100) {
+    return false;
+  }
+  unsigned long hundredths = 0;
+  if (*end == '.') {
+    const char* frac = end + 1;
+    for (uint8_t digit = 0; digit < 2; digit++) {
+      hundredths *= 10;
+      if (*frac >= '0' && *frac <= '9') {
+        hundredths += (unsigned long)(*frac++ - '0');
+      }
+    }
+    end = (char*)frac;
+  }
+  if (*end != '\0') {
+    return false;
+  }
+  *bpm_x100 = (uint32_t)(bpm * 100 + hundredths);
+  return true;
+}
+
+// Parse a delay like "5" or "7.25" milliseconds, or "off", into microseconds
+static bool console_parse_delay(const char* str, uint32_t* delay_us)
+{
+  if (strcmp(str, "off") == 0) {
+    *delay_us = 0;
+    return true;
+  }
+  char* end;
+  unsigned long ms = strtoul(str, &end, 10);
+  if (end == str || ms > MIDI_TASK_MAX_OUT_DELAY_US / 1000) {
+    return false;
+  }
+  unsigned long us = 0;
+  if (*end == '.') {
+    const char* frac = end + 1;
+    for (uint8_t digit = 0; digit < 3; digit++) {
+      us *= 10;
+      if (*frac >= '0' && *frac <= '9') {
+        us += (unsigned long)(*frac++ - '0');
+      }
+    }
+    end = (char*)frac;
+  }
+  if (*end != '\0') {
+    return false;
+  }
+  *delay_us = (uint32_t)(ms * 1000 + us);
+  return true;
+}
+
+// Parse "<A-D|cable> <mul>/<div>|off" and set the clock ratio of the destination
+static bool console_set_clock_ratio(const char* args)
+{
+  uint8_t dest;
+  if (args[0] >= 'A' && args[0] < 'A' + MIDI_ROUTER_NUM_DIN_PORTS) {
+    dest = MIDI_ROUTER_DEST_DIN_OUT(args[0] - 'A');
+  }
+  else if (args[0] >= '0' && args[0] < '0' + MIDI_ROUTER_NUM_USB_IN_CABLES) {
+    dest = MIDI_ROUTER_DEST_USB_IN(args[0] - '0');
+  }
+  else {
+    return false;
+  }
+  if (args[1] != ' ') {
+    return false;
+  }
+  if (strcmp(args + 2, "off") == 0) {
+    return midi_clock_set_ratio(dest, 0, 1);
+  }
+  unsigned mul;
+  unsigned div;
+  char extra;
+  if (sscanf(args + 2, "%u/%u%c", &mul, &div, &extra) != 2 || mul == 0 || mul > UINT8_MAX || div > UINT8_MAX) {
+    return false;
+  }
+  return midi_clock_set_ratio(dest, (uint8_t)mul, (uint8_t)div);
+}
+
+// Parse a route source, "A"-"D" for a DIN MIDI IN port or a USB MIDI OUT
+// cable number, at the start of str
+static bool console_parse_source(const char* str, uint8_t* src)
+{
+  if (str[0] >= 'A' && str[0] < 'A' + MIDI_ROUTER_NUM_DIN_PORTS) {
+    *src = MIDI_ROUTER_SRC_DIN_IN(str[0] - 'A');
+    return true;
+  }
+  if (str[0] >= '0' && str[0] < '0' + MIDI_ROUTER_NUM_USB_OUT_CABLES) {
+    *src = MIDI_ROUTER_SRC_USB_OUT(str[0] - '0');
+    return true;
+  }
+  return false;
+}
+
+// Parse a route destination, "A"-"D" for a DIN MIDI OUT port or a USB MIDI IN
+// cable number, at the start of str
+static bool console_parse_dest(const char* str, uint8_t* dest)
+{
+  if (str[0] >= 'A' && str[0] < 'A' + MIDI_ROUTER_NUM_DIN_PORTS) {
+    *dest = MIDI_ROUTER_DEST_DIN_OUT(str[0] - 'A');
+    return true;
+  }
+  if (str[0] >= '0' && str[0] < '0' + MIDI_ROUTER_NUM_USB_IN_CABLES) {
+    *dest = MIDI_ROUTER_DEST_USB_IN(str[0] - '0');
+    return true;
+  }
+  return false;
+}
+
+// Parse MIDI channels and ranges like "1-4,10", "all" or "none" into a channel mask
+static bool console_parse_channels(const char* str, uint16_t* channels)
+{
+  if (strcmp(str, "all") == 0 || strcmp(str, "none") == 0) {
+    *channels = str[0] == 'a' ? MIDI_FILTER_ALL_CHANNELS : 0;
+    return true;
+  }
+  uint16_t mask = 0;
+  for (;;) {
+    char* end;
+    unsigned long first = strtoul(str, &end, 10);
+    unsigned long last = first;
+    if (end == str) {
+      return false;
+    }
+    if (*end == '-') {
+      str = end + 1;
+      last = strtoul(str, &end, 10);
+      if (end == str) {
+        return false;
+      }
+    }
+    if (first < 1 || first > last || last > 16) {
+      return false;
+    }
+    for (unsigned long ch = first; ch <= last; ch++) {
+      mask |= (uint16_t)(1u << (ch - 1));
+    }
+    if (*end == '\0') {
+      break;
+    }
+    if (*end != ',') {
+      return false;
+    }
+    str = end + 1;
+  }
+  *channels = mask;
+  return true;
+}
+
+// Parse message classes like "clk,as" (see CONSOLE_FILTER_CLASSES) or "none"
+// into MIDI_FILTER_* bits
+static bool console_parse_classes(const char* str, uint16_t* blocked)
+{
+  if (strcmp(str, "none") == 0) {
+    *blocked = 0;
+    return true;
+  }
+  uint16_t mask = 0;
+  do {
+    size_t len = strcspn(str, ",");
+    uint8_t n = 0;
+    while (n < CONSOLE_NUM_FILTER_CLASSES &&
+           (strlen(CONSOLE_FILTER_CLASSES[n]) != len || strncmp(str, CONSOLE_FILTER_CLASSES[n], len) != 0)) {
+      ++n;
+    }
+    if (n == CONSOLE_NUM_FILTER_CLASSES) {
+      return false;
+    }
+    mask |= (uint16_t)(1u << n);
+    str += len;
+  } while (*str++ == ',');
+  *blocked = mask;
+  return true;
+}
+
+// Parse "<A-D|cable>|off" and set the source the clock follows
+static bool console_set_clock_sync(const char* args)
+{
+  if (strcmp(args, "off") == 0) {
+    return midi_clock_set_sync_source(MIDI_CLOCK_INTERNAL);
+  }
+  uint8_t src;
+  if (!console_parse_source(args, &src) || args[1] != '\0') {
+    return false;
+  }
+  return midi_clock_set_sync_source(src);
+}
+
+static void console_execute_clock(const char* args)
+{
+  uint32_t bpm_x100;
+  bool ok;
+  if (*args == '\0') {
+    console_start_report(console_clock_report);
+    return;
+  }
+  if (strcmp(args, "on") == 0 || strcmp(args, "off") == 0) {
+    midi_clock_set_enabled(args[1] == 'n');
+    ok = true;
+  }
+  else if (strcmp(args, "start") == 0) {
+    ok = midi_clock_send_transport(0xFA);
+  }
+  else if (strcmp(args, "continue") == 0) {
+    ok = midi_clock_send_transport(0xFB);
+  }
+  else if (strcmp(args, "stop") == 0) {
+    ok = midi_clock_send_transport(0xFC);
+  }
+  else if (strcmp(args, "reset") == 0) {
+    midi_clock_reset_stats();
+    ok = true;
+  }
+  else if (strncmp(args, "bpm ", 4) == 0) {
+    ok = console_parse_bpm(args + 4, &bpm_x100) && midi_clock_set_bpm(bpm_x100);
+  }
+  else if (strncmp(args, "sync ", 5) == 0) {
+    ok = console_set_clock_sync(args + 5);
+  }
+  else {
+    ok = console_set_clock_ratio(args);
+  }
+  console_print(ok ? "ok" : "clock: on, off, start, stop, continue, bpm <20-300>, sync <A-D|cable>|off, "
+                            "<A-D|cable> <mul>/<div>|off, reset");
+}
+
+static void console_execute_sched(const char* args)
+{
+  if (*args == '\0') {
+    console_start_report(console_sched_report);
+    return;
+  }
+  bool ok = true;
+  if (strcmp(args, "on") == 0 || strcmp(args, "off") == 0) {
+    midi_sched_set_enabled(args[1] == 'n');
+  }
+  else if (strcmp(args, "reset") == 0) {
+    midi_sched_reset_stats();
+  }
+  else {
+    ok = false;
+  }
+  console_print(ok ? "ok" : "sched: on, off, reset");
+}
+
+static void console_execute_delay(const char* args)
+{
+  if (*args == '\0') {
+    console_start_report(console_delay_report);
+    return;
+  }
+  uint8_t first = 0;
+  uint8_t last = NUM_PHY_MIDI_PORT_PAIRS - 1;
+  if (args[0] >= 'A' && args[0] < 'A' + NUM_PHY_MIDI_PORT_PAIRS && args[1] == ' ') {
+    first = last = (uint8_t)(args[0] - 'A');
+    args += 2;
+  }
+  uint32_t delay_us;
+  bool ok = console_parse_delay(args, &delay_us);
+  for (uint8_t port = first; ok && port <= last; port++) {
+    ok = midi_task_set_out_delay(port, delay_us);
+  }
+  console_print(ok ? "ok" : "delay: [A-D] <0-100 ms>|off");
+}
+
+static void console_execute_rs(const char* args)
+{
+  if (*args == '\0') {
+    console_start_report(console_rs_report);
+    return;
+  }
+  uint8_t first = 0;
+  uint8_t last = NUM_PHY_MIDI_PORT_PAIRS - 1;
+  if (args[0] >= 'A' && args[0] < 'A' + NUM_PHY_MIDI_PORT_PAIRS && args[1] == ' ') {
+    first = last = (uint8_t)(args[0] - 'A');
+    args += 2;
+  }
+  bool running_status = strcmp(args, "on") == 0 || strcmp(args, "vel0") == 0;
+  bool ok = running_status || strcmp(args, "off") == 0;
+  for (uint8_t port = first; ok && port <= last; port++) {
+    ok = midi_task_set_out_encoding(port, running_status, strcmp(args, "vel0") == 0);
+  }
+  console_print(ok ? "ok" : "rs: [A-D] on|off|vel0");
+}
+
+static void console_execute_route(const char* args)
+{
+  if (*args == '\0') {
+    console_start_report(console_route_report);
+    return;
+  }
+  uint8_t src;
+  if (!console_parse_source(args, &src) || args[1] != ' ') {
+    console_print("route: <A-D|cable> <A-D and cables, e.g. B0>|off");
+    return;
+  }
+  uint32_t dest_mask = 0;
+  if (strcmp(args + 2, "off") != 0) {
+    for (const char* str = args + 2; *str != '\0'; str++) {
+      uint8_t dest;
+      if (!console_parse_dest(str, &dest)) {
+        console_print("route: <A-D|cable> <A-D and cables, e.g. B0>|off");
+        return;
+      }
+      dest_mask |= MIDI_ROUTER_DEST_BIT(dest);
+    }
+  }
+  console_print(midi_task_set_route(src, dest_mask) ? "ok" : "route: busy, try again");
+}
+
+static void console_execute_filter(const char* args)
+{
+  if (*args == '\0') {
+    console_start_report(console_filter_report);
+    return;
+  }
+  uint8_t src;
+  uint8_t dest;
+  midi_filter_t filter;
+  bool ok = console_parse_source(args, &src) && args[1] == ' ' && console_parse_dest(args + 2, &dest) &&
+            args[3] == ' ' && midi_router_get_filter(src, dest, &filter);
+  if (ok && strcmp(args + 4, "off") == 0) {
+    midi_filter_init(&filter);
+  }
+  else if (ok && strncmp(args + 4, "ch ", 3) == 0) {
+    ok = console_parse_channels(args + 7, &filter.channels);
+  }
+  else if (ok && strncmp(args + 4, "drop ", 5) == 0) {
+    ok = console_parse_classes(args + 9, &filter.blocked);
+  }
+  else {
+    ok = false;
+  }
+  if (!ok) {
+    console_print("filter: <A-D|cable> <A-D|cable> off|ch <e.g. 1-4,10>|all|none|"
+                  "drop <note,pp,cc,pc,cp,pb,sx,sc,clk,tr,as,rst>|none");
+    return;
+  }
+  console_print(midi_task_set_filter(src, dest, &filter) ? "ok" : "filter: busy, try again");
+}
+
+static void console_execute_weight(const char* args)
+{
+  if (*args == '\0') {
+    console_start_report(console_weight_report);
+    return;
+  }
+  uint8_t src;
+  unsigned weight;
+  char extra;
+  bool ok = args[0] >= 'A' && args[0] < 'A' + NUM_PHY_MIDI_PORT_PAIRS && args[1] == ' ' &&
+            console_parse_source(args + 2, &src) && args[3] == ' ' &&
+            sscanf(args + 4, "%u%c", &weight, &extra) == 1 && weight <= UINT8_MAX &&
+            midi_task_set_merge_weight((uint8_t)(args[0] - 'A'), src, (uint8_t)weight);
+  console_print(ok ? "ok" : "weight: <A-D> <A-D|cable> <1-255>");
+}
+
+static void console_execute(const char* line)
+{
+  if (strcmp(line, "latency") == 0) {
+    console_start_report(console_latency_report);
+  }
+  else if (strcmp(line, "stats") == 0) {
+    console_start_report(console_stats_report);
+  }
+  else if (strcmp(line, "latency reset") == 0) {
+    midi_latency_reset();
+    console_print("ok");
+  }
+  else if (strcmp(line, "stats reset") == 0) {
+    midi_task_reset_stats();
+    console_print("ok");
+  }
+  else if (strcmp(line, "clock") == 0 || strncmp(line, "clock ", 6) == 0) {
+    console_execute_clock(line[5] == ' ' ? line + 6 : line + 5);
+  }
+  else if (strcmp(line, "sched") == 0 || strncmp(line, "sched ", 6) == 0) {
+    console_execute_sched(line[5] == ' ' ? line + 6 : line + 5);
+  }
+  else if (strcmp(line, "delay") == 0 || strncmp(line, "delay ", 6) == 0) {
+    console_execute_delay(line[5] == ' ' ? line + 6 : line + 5);
+  }
+  else if (strcmp(line, "rs") == 0 || strncmp(line, "rs ", 3) == 0) {
+    console_execute_rs(line[2] == ' ' ? line + 3 : line + 2);
+  }
+  else if (strcmp(line, "route") == 0 || strncmp(line, "route ", 6) == 0) {
+    console_execute_route(line[5] == ' ' ? line + 6 : line + 5);
+  }
+  else if (strcmp(line, "filter") == 0 || strncmp(line, "filter ", 7) == 0) {
+    console_execute_filter(line[6] == ' ' ? line + 7 : line + 6);
+  }
+  else if (strcmp(line, "weight") == 0 || strncmp(line, "weight ", 7) == 0) {
+    console_execute_weight(line[6] == ' ' ? line + 7 : line + 6);
+  }
+  else {
+    console_print("commands: latency, latency reset, stats, stats reset, clock, sched, delay, rs, route, filter, weight");
+  }
+}
 
-//--------------------------------------------------------------------+
-// USB CDC
-//--------------------------------------------------------------------+
-/* LK: ToDo: Console */
 void cdc_task(void) {
-  // connected() check for DTR bit
-  // Most but not all terminal client set this when making connection
-  // if ( tud_cdc_connected() )
-  {
-    // connected and there are data available
-    if (tud_cdc_available()) {
-      // read data
-      char buf[64];
-      uint32_t count = tud_cdc_read(buf, sizeof(buf));
-      (void) count;
+  // write as much of the report in progress as fits in the CDC TX FIFO
+  bool written = false;
+  while (console_out_pos < console_out_len || console_report) {
+    if (console_out_pos == console_out_len) {
+      int len = console_report(console_report_item++, console_out, sizeof(console_out));
+      if (len < 0) {
+        console_report = NULL;
+      }
+      console_out_len = len > 0 ? (uint16_t)tu_min32((uint32_t)len, sizeof(console_out) - 1) : 0;
+      console_out_pos = 0;
+      continue;
+    }
+    uint32_t count = tud_cdc_write(console_out + console_out_pos, console_out_len - console_out_pos);
+    if (count == 0) {
+      break;
+    }
+    console_out_pos = (uint16_t)(console_out_pos + count);
+    written = true;
+  }
+  if (written) {
+    tud_cdc_write_flush();
+  }
 
-      // Echo back
-      // Note: Skip echo by commenting out write() and write_flush()
-      // for throughput test e.g
-      //    $ dd if=/dev/zero of=/dev/ttyACM0 count=10000
-      tud_cdc_write(buf, count);
-      tud_cdc_write_flush();
+  // collect a command line; echo it back for terminal programs
+  while (tud_cdc_available()) {
+    char ch;
+    if (tud_cdc_read(&ch, 1) != 1) {
+      break;
+    }
+    if (ch == '\r' || ch == '\n') {
+      if (console_line_len > 0) {
+        tud_cdc_write("\r\n", 2);
+        console_line[console_line_len] = '\0';
+        console_line_len = 0;
+        console_execute(console_line);
+      }
     }
+    else if (ch == '\b' || ch == 0x7f) {
+      if (console_line_len > 0) {
+        --console_line_len;
+        tud_cdc_write("\b \b", 3);
+      }
+    }
+    else if (console_line_len < CONSOLE_LINE_LENGTH - 1) {
+      console_line[console_line_len++] = ch;
+      tud_cdc_write(&ch, 1);
+    }
+    tud_cdc_write_flush();
   }
 }
 
@@ -252,6 +1082,7 @@ void cdc_task(void) {
 void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts) {
   (void) itf;
   (void) rts;
+  cdc_ready = true;
 
   // TODO set some indicator
   if (dtr) {
@@ -264,6 +1095,15 @@ void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts) {
 // Invoked when CDC interface received data from host
 void tud_cdc_rx_cb(uint8_t itf) {
   (void) itf;
+  cdc_ready = true;
+}
+
+// Invoked when the host took data; a report may be waiting for room
+void tud_cdc_tx_complete_cb(uint8_t itf) {
+  (void) itf;
+  if (console_report || console_out_pos < console_out_len) {
+    cdc_ready = true;
+  }
 }
 
 
@@ -367,11 +1207,8 @@ static void send_hid_report(uint8_t report_id, uint32_t btn)
 void hid_task(void)
 {
   // Poll every 10ms
-  const uint32_t interval_ms = 10;
-  static uint32_t start_ms = 0;
-
-  if ( board_millis() - start_ms < interval_ms) return; // not enough time
-  start_ms += interval_ms;
+  if ( board_millis() - hid_start_ms < HID_INTERVAL_MS) return; // not enough time
+  hid_start_ms += HID_INTERVAL_MS;
 
   uint32_t const btn = board_button_read();
 
@@ -0,0 +1,711 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include <string.h>
+#include "hardware/timer.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "pico/stdlib.h"
+#include "pio_midi_uart_lib.h"
+#include "spsc_ring_lib.h"
+#include "midi_clock.h"
+
+// Tick times are kept in 1/256 us, so the periods of all tempos and ratios
+// add up without rounding drift. A period of the slowest tempo still fits
+// in 32 bits.
+#define CLOCK_FP_SHIFT 8
+
+#define CLOCK_RATIO(_mul, _div) ((uint16_t)(((_mul) << 8) | (_div)))
+#define CLOCK_RATIO_MUL(_ratio) ((uint8_t)((_ratio) >> 8))
+#define CLOCK_RATIO_DIV(_ratio) ((uint8_t)(_ratio))
+
+// PLL gains as right shifts of the phase error: the period follows the error
+// by 1/2^KP for one tick and by 1/2^KI for good. Both gear sets are damped
+// with a damping ratio of 0.5.
+#define SYNC_FAST_KP_SHIFT 3
+#define SYNC_FAST_KI_SHIFT 6
+#define SYNC_SLOW_KP_SHIFT 6
+#define SYNC_SLOW_KI_SHIFT 12
+// A locked PLL gives up on an incoming tick further than a quarter period
+// and at least this far from where it expected it
+#define SYNC_LOCK_LIMIT_US 2000
+
+/**
+ * @struct the clock of one destination
+ */
+typedef struct {
+    volatile uint16_t ratio; // requested CLOCK_RATIO(mul, div); mul 0 sends nothing
+    uint16_t active_ratio;   // the ratio the tick times are computed with
+    uint64_t next_tick;      // number of the next tick since the last Start
+    uint64_t due_fp;         // when the next tick is due
+} clock_dest_t;
+
+/**
+ * @struct a clock or transport message of the followed source
+ */
+typedef struct {
+    uint32_t time_us;
+    uint8_t status;
+} clock_sync_event_t;
+
+static void* clock_uarts[MIDI_ROUTER_NUM_DIN_PORTS];
+static clock_dest_t clock_dests[MIDI_ROUTER_NUM_DESTS];
+static midi_clock_usb_cb_t clock_usb_cb = NULL;
+static void* clock_usb_context = NULL;
+static int clock_alarm = -1;
+
+static spsc_ring_t clock_usb_queue;
+static uint8_t clock_usb_queue_buf[MIDI_CLOCK_USB_QUEUE_LENGTH * sizeof(midi_packet_t)];
+static spsc_ring_t clock_sync_queue;
+static uint8_t clock_sync_queue_buf[MIDI_CLOCK_SYNC_QUEUE_LENGTH * sizeof(clock_sync_event_t)];
+
+// Requests from the main loop; the alarm IRQ handler takes them at a master tick
+static volatile bool clock_enabled = false;
+static volatile uint32_t clock_bpm_x100 = MIDI_CLOCK_DEFAULT_BPM_X100;
+static volatile uint32_t clock_transport = 0; // request count << 8 | status byte
+static volatile uint8_t clock_sync_source = MIDI_CLOCK_INTERNAL;
+
+// State of the alarm IRQ handler. Tick n of the master clock is due at
+// clock_anchor_fp + (n - clock_anchor_tick) * clock_period_fp; a Start or a
+// tempo change moves the anchor to the master tick it takes effect at.
+static volatile bool clock_running = false; // the alarm is set for the next tick or poll
+static uint8_t clock_active_source;          // the clock_sync_source in effect
+static bool clock_ticking;                   // false while a followed clock is idle or restarting
+static uint32_t clock_transport_handled = 0;
+static uint32_t clock_active_bpm_x100;
+static uint32_t clock_internal_period_fp;    // the period of clock_active_bpm_x100
+static volatile uint32_t clock_period_fp;    // the period in effect
+static uint64_t clock_anchor_fp;
+static uint64_t clock_anchor_tick;
+static uint64_t clock_master_tick;           // number of the next master tick since the last Start
+static uint64_t clock_master_due_fp;
+static uint64_t clock_hold_tick;             // no master tick from here on is sent before its input arrives
+static uint64_t clock_alarm_target_us = UINT64_MAX;
+// Per DIN MIDI OUT port, the last tick that went into the PIO TX FIFO and
+// how long after the tick before it it was due; 0 for none
+static uint32_t handoff_last_due_us[MIDI_ROUTER_NUM_DIN_PORTS];
+static uint32_t handoff_last_sent_us[MIDI_ROUTER_NUM_DIN_PORTS];
+static uint32_t handoff_last_interval_us[MIDI_ROUTER_NUM_DIN_PORTS];
+
+// State of the clock recovery, also kept by the alarm IRQ handler
+static volatile uint8_t sync_state = MIDI_CLOCK_SYNC_IDLE;
+static bool sync_period_known;   // sync_period_cmd_fp holds a locked tempo
+static uint64_t sync_tick;       // number of the next incoming tick since the last Start
+static uint64_t sync_last_us;    // when the last tick came in; 0 for none
+static uint32_t sync_last_interval_us;
+static int64_t sync_integral_fp; // the period the PLL settled on
+static uint32_t sync_period_cmd_fp;
+static uint32_t sync_fast_ticks; // ticks left with the fast gains
+
+static midi_clock_stats_t clock_stats;
+
+static inline uint32_t clock_period_of(uint32_t bpm_x100)
+{
+    // 60 s / (MIDI_CLOCK_PPQN * bpm_x100 / 100)
+    return (uint32_t)(((uint64_t)(60000000ull * 100 / MIDI_CLOCK_PPQN) << CLOCK_FP_SHIFT) / bpm_x100);
+}
+
+static inline void schedule_master(void)
+{
+    clock_master_due_fp = clock_anchor_fp + (clock_master_tick - clock_anchor_tick) * clock_period_fp;
+}
+
+// Tick n of a destination is n * div / mul master ticks after the last Start
+static void schedule_dest(clock_dest_t* dest)
+{
+    uint8_t mul = CLOCK_RATIO_MUL(dest->active_ratio);
+    uint8_t div = CLOCK_RATIO_DIV(dest->active_ratio);
+    // in 1/mul master ticks since the anchor; never negative because every
+    // tick due before the anchor has been sent or skipped
+    uint64_t pos = dest->next_tick * div - clock_anchor_tick * mul;
+    dest->due_fp = clock_anchor_fp + pos * clock_period_fp / mul;
+}
+
+// Continue a destination with its first tick at or after the next master
+// tick, so a divided clock stays on the beats counted from the last Start
+static void resync_dest(clock_dest_t* dest)
+{
+    uint8_t mul = CLOCK_RATIO_MUL(dest->active_ratio);
+    uint8_t div = CLOCK_RATIO_DIV(dest->active_ratio);
+    if (mul > 0) {
+        dest->next_tick = (clock_master_tick * mul + div - 1) / div;
+        schedule_dest(dest);
+    }
+}
+
+// Take a ratio change at the master tick due now
+static void update_dest_ratio(clock_dest_t* dest, bool restart)
+{
+    uint16_t ratio = dest->ratio;
+    if (ratio == dest->active_ratio && !restart) {
+        return;
+    }
+    dest->active_ratio = ratio;
+    resync_dest(dest);
+}
+
+// Move the anchor to the master tick due at anchor_fp and run on period_fp from there
+static void set_anchor(uint64_t anchor_fp, uint32_t period_fp)
+{
+    clock_anchor_fp = anchor_fp;
+    clock_anchor_tick = clock_master_tick;
+    clock_period_fp = period_fp;
+}
+
+// Send a byte to every destination in dest_mask; the idle DIN MIDI OUT
+// ports start it in phase
+static void send_byte(uint32_t dest_mask, uint8_t val, uint32_t due_us, bool* usb_queued)
+{
+    void* uarts[MIDI_ROUTER_NUM_DIN_PORTS];
+    uint8_t nuarts = 0;
+    while (dest_mask) {
+        uint8_t dest = (uint8_t)__builtin_ctz(dest_mask);
+        dest_mask &= dest_mask - 1;
+        if (dest < MIDI_ROUTER_NUM_DIN_PORTS) {
+            if (clock_uarts[dest] != NULL) {
+                uarts[nuarts++] = clock_uarts[dest];
+            }
+            continue;
+        }
+        midi_packet_t packet = {{(uint8_t)(((dest - MIDI_ROUTER_NUM_DIN_PORTS) << 4) | 0xF), val, 0, 0}};
+        if (spsc_ring_push_all(&clock_usb_queue, packet.bytes, sizeof(packet.bytes))) {
+            *usb_queued = true;
+        }
+        else {
+            ++clock_stats.dropped;
+        }
+    }
+    if (nuarts > 0) {
+        uint16_t tag = val == 0xF8 ? MIDI_CLOCK_TAG : MIDI_CLOCK_TRANSPORT_TAG;
+        uint32_t full = pio_midi_uart_broadcast_realtime(uarts, nuarts, val, tag, due_us);
+        clock_stats.dropped += (uint32_t)__builtin_popcount(full);
+    }
+}
+
+static void send_to_all(uint8_t val, uint32_t due_us, bool* usb_queued)
+{
+    uint32_t dest_mask = 0;
+    for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS; dest++) {
+        if (CLOCK_RATIO_MUL(clock_dests[dest].active_ratio) > 0) {
+            dest_mask |= MIDI_ROUTER_DEST_BIT(dest);
+        }
+    }
+    send_byte(dest_mask, val, due_us, usb_queued);
+}
+
+// Handle the requests from the main loop at the master tick due now
+static void run_master_tick(uint32_t due_us, bool* usb_queued)
+{
+    uint8_t status = 0;
+    uint32_t transport = clock_transport;
+    if ((transport >> 8) != clock_transport_handled) {
+        clock_transport_handled = transport >> 8;
+        status = (uint8_t)transport;
+    }
+    // a followed clock counts its ticks from the Start of its source
+    bool restart = status == 0xFA && clock_active_source == MIDI_CLOCK_INTERNAL;
+    if (restart) {
+        clock_master_tick = 0;
+    }
+    uint32_t period_fp = clock_period_fp;
+    if (clock_active_source != MIDI_CLOCK_INTERNAL) {
+        period_fp = sync_period_cmd_fp;
+    }
+    else if (clock_bpm_x100 != clock_active_bpm_x100) {
+        clock_active_bpm_x100 = clock_bpm_x100;
+        clock_internal_period_fp = clock_period_of(clock_active_bpm_x100);
+        period_fp = clock_internal_period_fp;
+    }
+    if (restart || period_fp != clock_period_fp) {
+        set_anchor(clock_master_due_fp, period_fp);
+        for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS; dest++) {
+            if (CLOCK_RATIO_MUL(clock_dests[dest].active_ratio) > 0 && !restart) {
+                schedule_dest(clock_dests + dest);
+            }
+        }
+    }
+    for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS; dest++) {
+        update_dest_ratio(clock_dests + dest, restart);
+    }
+    if (status) {
+        send_to_all(status, due_us, usb_queued);
+    }
+    ++clock_master_tick;
+    schedule_master();
+}
+
+// Send everything due at due_fp; transport messages go ahead of the clock
+static void run_ticks(uint64_t due_fp)
+{
+    uint32_t due_us = (uint32_t)(due_fp >> CLOCK_FP_SHIFT);
+    bool usb_queued = false;
+    if (clock_master_due_fp <= due_fp && clock_master_tick < clock_hold_tick) {
+        run_master_tick(due_us, &usb_queued);
+    }
+    uint32_t dest_mask = 0;
+    for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS; dest++) {
+        clock_dest_t* clock_dest = clock_dests + dest;
+        if (CLOCK_RATIO_MUL(clock_dest->active_ratio) > 0 && clock_dest->due_fp <= due_fp) {
+            dest_mask |= MIDI_ROUTER_DEST_BIT(dest);
+            ++clock_dest->next_tick;
+            schedule_dest(clock_dest);
+        }
+    }
+    send_byte(dest_mask, 0xF8, due_us, &usb_queued);
+    if (usb_queued && clock_usb_cb) {
+        clock_usb_cb(clock_usb_context);
+    }
+}
+
+// Get when the next tick is due or UINT64_MAX if none is
+static uint64_t next_due_fp(void)
+{
+    if (!clock_ticking) {
+        return UINT64_MAX;
+    }
+    uint64_t due_fp = clock_master_tick < clock_hold_tick ? clock_master_due_fp : UINT64_MAX;
+    for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS; dest++) {
+        const clock_dest_t* clock_dest = clock_dests + dest;
+        uint8_t mul = CLOCK_RATIO_MUL(clock_dest->active_ratio);
+        if (mul > 0 && clock_dest->due_fp < due_fp &&
+            (clock_hold_tick == UINT64_MAX ||
+             clock_dest->next_tick * CLOCK_RATIO_DIV(clock_dest->active_ratio) < clock_hold_tick * mul)) {
+            due_fp = clock_dest->due_fp;
+        }
+    }
+    return due_fp;
+}
+
+// Put master tick 0 and tick 0 of every destination at start_us; a followed
+// clock waits for its first incoming tick instead
+static void start_clock(uint64_t start_us)
+{
+    clock_active_source = clock_sync_source;
+    clock_master_tick = 0;
+    clock_hold_tick = UINT64_MAX;
+    clock_active_bpm_x100 = clock_bpm_x100;
+    clock_internal_period_fp = clock_period_of(clock_active_bpm_x100);
+    set_anchor(start_us << CLOCK_FP_SHIFT, clock_internal_period_fp);
+    for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS; dest++) {
+        update_dest_ratio(clock_dests + dest, true);
+    }
+    schedule_master();
+    clock_ticking = clock_active_source == MIDI_CLOCK_INTERNAL;
+    sync_state = MIDI_CLOCK_SYNC_IDLE;
+    sync_period_known = false;
+    sync_period_cmd_fp = clock_internal_period_fp;
+    sync_tick = 0;
+    sync_last_us = 0;
+    sync_last_interval_us = 0;
+    clock_running = true;
+}
+
+//--------------------------------------------------------------------+
+// Clock recovery
+//--------------------------------------------------------------------+
+
+// Send master tick k of the followed clock now, as it came in at time_fp, and
+// schedule the ticks after it on the current period estimate. Unless the
+// PLL is locked, master tick k + 1 waits for its incoming tick.
+static void snap_to_input(uint64_t k, uint64_t time_fp, bool locked)
+{
+    clock_ticking = true;
+    clock_master_tick = k;
+    clock_hold_tick = locked ? UINT64_MAX : k + 1;
+    set_anchor(time_fp, sync_period_cmd_fp);
+    schedule_master();
+    for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS; dest++) {
+        // ticks of a multiplied clock the input overtook are skipped
+        update_dest_ratio(clock_dests + dest, true);
+    }
+    run_ticks(time_fp);
+}
+
+static void lock(uint32_t period_fp)
+{
+    sync_state = MIDI_CLOCK_SYNC_LOCKED;
+    sync_period_known = true;
+    sync_integral_fp = period_fp;
+    sync_period_cmd_fp = period_fp;
+    sync_fast_ticks = MIDI_CLOCK_SYNC_FAST_TICKS;
+}
+
+static void on_sync_tick(uint64_t time_us)
+{
+    uint64_t k = sync_tick++;
+    uint64_t time_fp = time_us << CLOCK_FP_SHIFT;
+    uint32_t interval_us = 0;
+    ++clock_stats.sync_ticks;
+    if (sync_last_us > 0) {
+        interval_us = (uint32_t)(time_us - sync_last_us);
+        if (interval_us < clock_stats.in_interval_min_us) {
+            clock_stats.in_interval_min_us = interval_us;
+        }
+        if (interval_us > clock_stats.in_interval_max_us) {
+            clock_stats.in_interval_max_us = interval_us;
+        }
+    }
+    sync_last_us = time_us;
+    if (sync_state == MIDI_CLOCK_SYNC_LOCKED && !clock_ticking) {
+        // going on after Start or Continue
+        snap_to_input(k, time_fp, true);
+        return;
+    }
+    if (sync_state == MIDI_CLOCK_SYNC_LOCKED) {
+        // compare with when the regenerated clock sends (or sent) tick k
+        int64_t expected_fp = (int64_t)clock_anchor_fp + ((int64_t)k - (int64_t)clock_anchor_tick) * clock_period_fp;
+        int64_t error_fp = (int64_t)time_fp - expected_fp;
+        int64_t limit_fp = clock_period_fp / 4;
+        if (limit_fp < ((int64_t)SYNC_LOCK_LIMIT_US << CLOCK_FP_SHIFT)) {
+            limit_fp = (int64_t)SYNC_LOCK_LIMIT_US << CLOCK_FP_SHIFT;
+        }
+        if (error_fp <= limit_fp && error_fp >= -limit_fp) {
+            uint32_t error_us = (uint32_t)((error_fp < 0 ? -error_fp : error_fp) >> CLOCK_FP_SHIFT);
+            if (error_us > clock_stats.in_error_max_us) {
+                clock_stats.in_error_max_us = error_us;
+            }
+            bool fast = sync_fast_ticks > 0;
+            if (fast) {
+                --sync_fast_ticks;
+            }
+            // a later tick than expected means the period is too short
+            sync_integral_fp += error_fp >> (fast ? SYNC_FAST_KI_SHIFT : SYNC_SLOW_KI_SHIFT);
+            int64_t period_fp = sync_integral_fp + (error_fp >> (fast ? SYNC_FAST_KP_SHIFT : SYNC_SLOW_KP_SHIFT));
+            int64_t min_fp = clock_period_of(MIDI_CLOCK_MAX_BPM_X100);
+            int64_t max_fp = clock_period_of(MIDI_CLOCK_MIN_BPM_X100);
+            sync_period_cmd_fp = (uint32_t)(period_fp < min_fp ? min_fp : period_fp > max_fp ? max_fp : period_fp);
+            return;
+        }
+        // lost it, e.g. to a tempo jump
+        ++clock_stats.sync_relocks;
+        sync_state = MIDI_CLOCK_SYNC_ACQUIRE;
+        sync_period_known = false;
+        sync_last_interval_us = 0;
+    }
+    if (sync_period_known) {
+        // restarting after Start or Continue or coming back from idle
+        lock(sync_period_cmd_fp);
+        snap_to_input(k, time_fp, true);
+        return;
+    }
+    sync_state = MIDI_CLOCK_SYNC_ACQUIRE;
+    if (interval_us > 0) {
+        uint32_t period_fp = interval_us << CLOCK_FP_SHIFT;
+        uint32_t period_min_fp = clock_period_of(MIDI_CLOCK_MAX_BPM_X100);
+        uint32_t period_max_fp = clock_period_of(MIDI_CLOCK_MIN_BPM_X100);
+        if (period_fp >= period_min_fp && period_fp <= period_max_fp) {
+            // schedule the ticks of multiplied clocks on the last interval
+            sync_period_cmd_fp = period_fp;
+        }
+        uint32_t diff_us = interval_us > sync_last_interval_us ? interval_us - sync_last_interval_us
+                                                               : sync_last_interval_us - interval_us;
+        if (sync_last_interval_us > 0 && diff_us <= interval_us / 8 && period_fp >= period_min_fp &&
+            period_fp <= period_max_fp) {
+            lock(((interval_us + sync_last_interval_us) << CLOCK_FP_SHIFT) / 2);
+            snap_to_input(k, time_fp, true);
+            sync_last_interval_us = interval_us;
+            return;
+        }
+    }
+    sync_last_interval_us = interval_us;
+    snap_to_input(k, time_fp, false);
+}
+
+// Take the clock and transport messages the routing loop passed on
+static void poll_sync_input(uint64_t now_us)
+{
+    clock_sync_event_t event;
+    while (spsc_ring_pop(&clock_sync_queue, (uint8_t*)&event, sizeof(event)) == sizeof(event)) {
+        if (clock_active_source == MIDI_CLOCK_INTERNAL) {
+            continue;
+        }
+        // the event is in the past; widen its time
+        uint64_t time_us = now_us - (uint32_t)((uint32_t)now_us - event.time_us);
+        if (event.status == 0xF8) {
+            on_sync_tick(time_us);
+            continue;
+        }
+        bool usb_queued = false;
+        send_to_all(event.status, (uint32_t)now_us, &usb_queued);
+        if (usb_queued && clock_usb_cb) {
+            clock_usb_cb(clock_usb_context);
+        }
+        if (event.status != 0xFC) {
+            // the ticks go on with the next incoming one; after Start, that is tick 0
+            clock_ticking = false;
+            if (event.status == 0xFA) {
+                sync_tick = 0;
+            }
+            if (sync_state != MIDI_CLOCK_SYNC_LOCKED) {
+                sync_last_interval_us = 0;
+            }
+            sync_last_us = 0;
+        }
+    }
+    if (clock_active_source != MIDI_CLOCK_INTERNAL && clock_ticking && sync_last_us > 0 &&
+        now_us - sync_last_us > (uint64_t)MIDI_CLOCK_SYNC_TIMEOUT_TICKS * (clock_period_fp >> CLOCK_FP_SHIFT)) {
+        // the clock stopped coming in
+        clock_ticking = false;
+        sync_state = MIDI_CLOCK_SYNC_IDLE;
+        sync_last_us = 0;
+        sync_last_interval_us = 0;
+    }
+}
+
+//--------------------------------------------------------------------+
+// Alarm IRQ handler
+//--------------------------------------------------------------------+
+
+static void on_clock_alarm(uint alarm)
+{
+    clock_alarm_target_us = UINT64_MAX;
+    for (;;) {
+        while (clock_enabled) {
+            uint64_t now_us = time_us_64();
+            if (!clock_running || clock_sync_source != clock_active_source) {
+                // leave the alarm time to fire ahead of the first tick
+                start_clock(now_us + 2 * MIDI_CLOCK_LEAD_US);
+            }
+            poll_sync_input(now_us);
+            uint64_t due_fp = next_due_fp();
+            uint64_t due_us = due_fp == UINT64_MAX ? now_us + MIDI_CLOCK_IDLE_POLL_US + MIDI_CLOCK_LEAD_US
+                                                   : due_fp >> CLOCK_FP_SHIFT;
+            if (now_us + MIDI_CLOCK_LEAD_US < due_us) {
+                clock_alarm_target_us = due_us - MIDI_CLOCK_LEAD_US;
+                if (!hardware_alarm_set_target(alarm, from_us_since_boot(clock_alarm_target_us))) {
+                    return;
+                }
+                clock_alarm_target_us = UINT64_MAX;
+                continue;
+            }
+            // the alarm fired early on purpose; wait for the exact time
+            while ((now_us = time_us_64()) < due_us) {
+                tight_loop_contents();
+            }
+            uint32_t late_us = (uint32_t)(now_us - due_us);
+            ++clock_stats.ticks;
+            clock_stats.late_sum_us += late_us;
+            if (late_us > clock_stats.late_max_us) {
+                clock_stats.late_max_us = late_us;
+            }
+            run_ticks(due_fp);
+        }
+        clock_running = false;
+        // midi_clock_set_enabled() only sets the alarm if it sees the clock
+        // not running, so check again after saying so
+        __dmb();
+        if (!clock_enabled) {
+            return;
+        }
+    }
+}
+
+void midi_clock_init(void* const midi_uarts[MIDI_ROUTER_NUM_DIN_PORTS], midi_clock_usb_cb_t usb_cb, void* usb_context)
+{
+    memcpy(clock_uarts, midi_uarts, sizeof(clock_uarts));
+    clock_usb_cb = usb_cb;
+    clock_usb_context = usb_context;
+    spsc_ring_init(&clock_usb_queue, clock_usb_queue_buf, sizeof(clock_usb_queue_buf));
+    spsc_ring_init(&clock_sync_queue, clock_sync_queue_buf, sizeof(clock_sync_queue_buf));
+    for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS; dest++) {
+        clock_dests[dest].ratio = dest < MIDI_ROUTER_NUM_DIN_PORTS ? CLOCK_RATIO(1, 1) : CLOCK_RATIO(0, 1);
+        clock_dests[dest].active_ratio = CLOCK_RATIO(0, 1);
+    }
+    clock_period_fp = clock_period_of(clock_bpm_x100);
+    midi_clock_reset_stats();
+    // the alarm IRQ is enabled on the calling core
+    clock_alarm = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback((uint)clock_alarm, on_clock_alarm);
+}
+
+void midi_clock_block_alarm(bool blocked)
+{
+    // alarm n raises TIMER_IRQ_n on the core that claimed it
+    irq_set_enabled(TIMER_IRQ_0 + (uint)clock_alarm, !blocked);
+}
+
+void midi_clock_set_enabled(bool enabled)
+{
+    clock_enabled = enabled;
+    __dmb();
+    if (enabled && !clock_running && clock_alarm >= 0) {
+        // the alarm IRQ handler starts the clock; a time that passed before
+        // the alarm was set does not fire it
+        uint64_t start_us = time_us_64();
+        do {
+            start_us += MIDI_CLOCK_LEAD_US + 1;
+        } while (hardware_alarm_set_target((uint)clock_alarm, from_us_since_boot(start_us)));
+    }
+}
+
+bool midi_clock_is_enabled(void)
+{
+    return clock_enabled;
+}
+
+bool midi_clock_set_bpm(uint32_t bpm_x100)
+{
+    if (bpm_x100 < MIDI_CLOCK_MIN_BPM_X100 || bpm_x100 > MIDI_CLOCK_MAX_BPM_X100) {
+        return false;
+    }
+    clock_bpm_x100 = bpm_x100;
+    return true;
+}
+
+uint32_t midi_clock_get_bpm(void)
+{
+    return clock_bpm_x100;
+}
+
+bool midi_clock_set_ratio(uint8_t dest, uint8_t mul, uint8_t div)
+{
+    if (dest >= MIDI_ROUTER_NUM_DESTS || mul > MIDI_CLOCK_MAX_RATIO || div == 0 || div > MIDI_CLOCK_MAX_RATIO) {
+        return false;
+    }
+    clock_dests[dest].ratio = CLOCK_RATIO(mul, div);
+    return true;
+}
+
+void midi_clock_get_ratio(uint8_t dest, uint8_t* mul, uint8_t* div)
+{
+    uint16_t ratio = dest < MIDI_ROUTER_NUM_DESTS ? clock_dests[dest].ratio : CLOCK_RATIO(0, 1);
+    *mul = CLOCK_RATIO_MUL(ratio);
+    *div = CLOCK_RATIO_DIV(ratio);
+}
+
+uint32_t midi_clock_get_dest_mask(void)
+{
+    uint32_t dest_mask = 0;
+    for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS; dest++) {
+        if (CLOCK_RATIO_MUL(clock_dests[dest].ratio) > 0) {
+            dest_mask |= MIDI_ROUTER_DEST_BIT(dest);
+        }
+    }
+    return dest_mask;
+}
+
+bool midi_clock_send_transport(uint8_t status)
+{
+    if (status != 0xFA && status != 0xFB && status != 0xFC) {
+        return false;
+    }
+    // one store, so the alarm IRQ handler never sees a count with the wrong status
+    clock_transport = ((clock_transport + 0x100) & ~0xFFul) | status;
+    return true;
+}
+
+bool midi_clock_set_sync_source(uint8_t src)
+{
+    if (src >= MIDI_ROUTER_NUM_SOURCES && src != MIDI_CLOCK_INTERNAL) {
+        return false;
+    }
+    clock_sync_source = src;
+    return true;
+}
+
+uint8_t midi_clock_get_sync_source(void)
+{
+    return clock_sync_source;
+}
+
+midi_clock_sync_state_t midi_clock_get_sync_state(void)
+{
+    return clock_sync_source == MIDI_CLOCK_INTERNAL ? MIDI_CLOCK_SYNC_IDLE : (midi_clock_sync_state_t)sync_state;
+}
+
+void midi_clock_sync_input(uint8_t status, uint32_t time_us)
+{
+    clock_sync_event_t event = {.time_us = time_us, .status = status};
+    if (!clock_enabled || !spsc_ring_push_all(&clock_sync_queue, (const uint8_t*)&event, sizeof(event))) {
+        return;
+    }
+    // Have the alarm IRQ handler take it now. It runs on this core, so
+    // blocking it keeps it from setting the alarm meanwhile.
+    midi_clock_block_alarm(true);
+    uint64_t target_us = time_us_64() + MIDI_CLOCK_LEAD_US + 1;
+    if (target_us < clock_alarm_target_us) {
+        while (hardware_alarm_set_target((uint)clock_alarm, from_us_since_boot(target_us))) {
+            target_us += MIDI_CLOCK_LEAD_US + 1;
+        }
+        clock_alarm_target_us = target_us;
+    }
+    midi_clock_block_alarm(false);
+}
+
+bool midi_clock_read_usb_packet(midi_packet_t* packet)
+{
+    return spsc_ring_pop(&clock_usb_queue, packet->bytes, sizeof(packet->bytes)) == sizeof(packet->bytes);
+}
+
+void midi_clock_record_handoff(uint8_t port, uint16_t tag, uint32_t due_us, uint32_t sent_us)
+{
+    if (port >= MIDI_ROUTER_NUM_DIN_PORTS) {
+        return;
+    }
+    uint32_t handoff_us = sent_us - due_us;
+    if (handoff_us < clock_stats.handoff_min_us[port]) {
+        clock_stats.handoff_min_us[port] = handoff_us;
+    }
+    if (handoff_us > clock_stats.handoff_max_us[port]) {
+        clock_stats.handoff_max_us[port] = handoff_us;
+    }
+    // Start, Stop and Continue are not on the tick grid
+    if (tag != MIDI_CLOCK_TAG) {
+        return;
+    }
+    // Measure the interval the port sent when the PLL or the tempo spaced it
+    // like the one before, within 1/8; the first after the clock started,
+    // after a Start or after a snap to the followed clock is not regenerated
+    uint32_t due_interval_us = due_us - handoff_last_due_us[port];
+    uint32_t last_interval_us = handoff_last_interval_us[port];
+    if (last_interval_us > 0 && due_interval_us + last_interval_us / 8 - last_interval_us <= last_interval_us / 4) {
+        uint32_t interval_us = sent_us - handoff_last_sent_us[port];
+        if (interval_us < clock_stats.out_interval_min_us[port]) {
+            clock_stats.out_interval_min_us[port] = interval_us;
+        }
+        if (interval_us > clock_stats.out_interval_max_us[port]) {
+            clock_stats.out_interval_max_us[port] = interval_us;
+        }
+    }
+    handoff_last_due_us[port] = due_us;
+    handoff_last_sent_us[port] = sent_us;
+    handoff_last_interval_us[port] = due_interval_us;
+}
+
+void midi_clock_get_stats(midi_clock_stats_t* stats)
+{
+    *stats = clock_stats;
+    uint32_t period_fp = clock_period_fp;
+    stats->bpm_x100 = (uint32_t)(((uint64_t)(60000000ull * 100 / MIDI_CLOCK_PPQN) << CLOCK_FP_SHIFT) / period_fp);
+}
+
+void midi_clock_reset_stats(void)
+{
+    memset(&clock_stats, 0, sizeof(clock_stats));
+    for (uint8_t port = 0; port < MIDI_ROUTER_NUM_DIN_PORTS; port++) {
+        clock_stats.handoff_min_us[port] = UINT32_MAX;
+        clock_stats.out_interval_min_us[port] = UINT32_MAX;
+    }
+    clock_stats.in_interval_min_us = UINT32_MAX;
+}
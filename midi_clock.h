@@ -0,0 +1,317 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "midi_parser.h"
+#include "midi_router.h"
+
+// The internal MIDI clock generator sends Timing Clock (0xF8) at 24 PPQN and
+// Start, Stop and Continue to any of the router destinations. A hardware
+// alarm schedules every tick, so the tick times do not depend on how busy
+// the main loop is. The alarm IRQ handler sends the bytes for the DIN MIDI
+// OUT ports itself with pio_midi_uart_broadcast_realtime(), so the idle ports
+// start them in phase and the busy ones take them in their realtime lanes;
+// the packets for the USB MIDI IN cables wait in a queue the routing loop
+// empties.
+//
+// Each destination ticks at the master clock rate times mul / div. All tick
+// times are computed from the time of the last Start, so they do not drift
+// against each other, and a Start puts every destination on the downbeat.
+// Tempo and ratio changes take effect at the next master clock tick.
+//
+// The clock keeps ticking while stopped; Start, Stop and Continue are sent
+// with the next master clock tick.
+//
+// The clock can also follow the Timing Clock of a router source instead of
+// its own tempo (clock recovery). The routing loop passes the source's
+// clock and transport messages with their arrival times to
+// midi_clock_sync_input(), and a software PLL in the alarm IRQ handler
+// steers the tick period so the regenerated ticks line up with the incoming
+// ones on average, without their jitter (e.g. USB MIDI clock arriving in
+// bursts once per 1 ms USB frame):
+// - idle: no clock came in for MIDI_CLOCK_SYNC_TIMEOUT_TICKS; no ticks go out
+// - acquire: every incoming tick goes out as it arrives until two intervals
+//   in a row agree on the tempo
+// - locked: the ticks are regenerated; the PLL starts with fast gains for
+//   MIDI_CLOCK_SYNC_FAST_TICKS ticks and then settles to slow, smooth ones.
+//   An incoming tick too far from where the PLL expects it (a tempo jump)
+//   starts over with acquire.
+// Start, Stop and Continue from the source go out right away. Start and
+// Continue wait for the next incoming tick to restart the ticks, and Start
+// puts every destination on the downbeat again.
+
+#define MIDI_CLOCK_PPQN 24
+#define MIDI_CLOCK_MIN_BPM_X100 2000
+#define MIDI_CLOCK_MAX_BPM_X100 30000
+#define MIDI_CLOCK_DEFAULT_BPM_X100 12000
+// Largest multiplier and divider of a destination
+#define MIDI_CLOCK_MAX_RATIO 16
+// The TX mark tags of the ticks and of the Start, Stop and Continue bytes the
+// clock sends to the DIN MIDI OUT ports
+#define MIDI_CLOCK_TAG 0xFFFF
+#define MIDI_CLOCK_TRANSPORT_TAG 0xFFFD
+
+// The alarm fires this long before a tick and the handler waits out the
+// rest, so another IRQ handler delaying the alarm IRQ does not delay the tick
+#ifndef MIDI_CLOCK_LEAD_US
+#define MIDI_CLOCK_LEAD_US 20
+#endif
+
+// The router source whose clock the clock follows, or none
+#define MIDI_CLOCK_INTERNAL 0xFF
+
+// How long a followed clock may stay away before the ticks stop, in ticks
+#ifndef MIDI_CLOCK_SYNC_TIMEOUT_TICKS
+#define MIDI_CLOCK_SYNC_TIMEOUT_TICKS 4
+#endif
+// Ticks the PLL uses fast gains for after locking
+#ifndef MIDI_CLOCK_SYNC_FAST_TICKS
+#define MIDI_CLOCK_SYNC_FAST_TICKS 48
+#endif
+
+// Clock and transport messages from the followed source that can wait for
+// the alarm IRQ handler; must be a power of 2
+#ifndef MIDI_CLOCK_SYNC_QUEUE_LENGTH
+#define MIDI_CLOCK_SYNC_QUEUE_LENGTH 16
+#endif
+
+// How often the alarm IRQ handler looks for requests while no tick is due
+#ifndef MIDI_CLOCK_IDLE_POLL_US
+#define MIDI_CLOCK_IDLE_POLL_US 10000
+#endif
+
+// Packets for the USB MIDI IN cables that can wait for the routing loop;
+// must be a power of 2
+#ifndef MIDI_CLOCK_USB_QUEUE_LENGTH
+#define MIDI_CLOCK_USB_QUEUE_LENGTH 16
+#endif
+
+/**
+ * @struct how precisely the clock keeps time
+ */
+typedef struct {
+    uint32_t ticks;       // times the alarm IRQ handler sent what was due
+    uint32_t late_max_us; // longest time a tick was sent after it was due
+    uint32_t late_sum_us; // sum of the times ticks were sent after they were due
+    uint32_t dropped;     // bytes that found the realtime lane or the USB queue full
+    // Per DIN MIDI OUT port, the shortest and longest time from a tick being
+    // due to its byte going into the PIO TX FIFO
+    uint32_t handoff_min_us[MIDI_ROUTER_NUM_DIN_PORTS];
+    uint32_t handoff_max_us[MIDI_ROUTER_NUM_DIN_PORTS];
+    // Per DIN MIDI OUT port, the shortest and longest time between two ticks
+    // going into the PIO TX FIFO: the outgoing clock after smoothing
+    uint32_t out_interval_min_us[MIDI_ROUTER_NUM_DIN_PORTS];
+    uint32_t out_interval_max_us[MIDI_ROUTER_NUM_DIN_PORTS];
+    uint32_t bpm_x100;            // the tempo the clock runs at now, times 100
+    // While following a clock
+    uint32_t sync_ticks;          // ticks that came in
+    uint32_t sync_relocks;        // times the PLL lost the incoming clock
+    uint32_t in_interval_min_us;  // shortest time between two incoming ticks
+    uint32_t in_interval_max_us;  // longest time between two incoming ticks
+    uint32_t in_error_max_us;     // furthest an incoming tick was from where the locked PLL expected it
+} midi_clock_stats_t;
+
+typedef enum {
+    MIDI_CLOCK_SYNC_IDLE = 0,
+    MIDI_CLOCK_SYNC_ACQUIRE,
+    MIDI_CLOCK_SYNC_LOCKED,
+} midi_clock_sync_state_t;
+
+/**
+ * @brief called from the alarm IRQ handler after it queued packets for the
+ * USB MIDI IN cables
+ */
+typedef void (*midi_clock_usb_cb_t)(void* context);
+
+/**
+ * @brief claim a hardware alarm and set up the clock generator; it starts
+ * disabled at MIDI_CLOCK_DEFAULT_BPM_X100, with ratio 1/1 at the DIN MIDI OUT
+ * ports and off at the USB MIDI IN cables
+ *
+ * @param midi_uarts the MIDI UARTs of DIN MIDI OUT A-D; NULL for a missing one
+ * @param usb_cb called when packets wait in the USB queue; may be NULL
+ * @param usb_context passed to usb_cb
+ * @note call on the core that writes to the MIDI UARTs; the alarm IRQ runs there
+ */
+void midi_clock_init(void* const midi_uarts[MIDI_ROUTER_NUM_DIN_PORTS], midi_clock_usb_cb_t usb_cb, void* usb_context);
+
+/**
+ * @brief keep the alarm IRQ handler out of the realtime lanes and the TX DMA
+ * of DIN MIDI OUT A-D, or let it in again; only the alarm IRQ is masked, and
+ * a pending alarm runs as soon as it is let in
+ *
+ * @param blocked true to keep it out
+ * @note call on the core the alarm IRQ runs on (see midi_clock_init()); the
+ * calls do not nest
+ */
+void midi_clock_block_alarm(bool blocked);
+
+/**
+ * @brief start or stop generating ticks
+ *
+ * @param enabled true to generate ticks
+ */
+void midi_clock_set_enabled(bool enabled);
+
+/**
+ * @brief check if the clock generates ticks
+ *
+ * @return true if it does
+ */
+bool midi_clock_is_enabled(void);
+
+/**
+ * @brief set the tempo
+ *
+ * @param bpm_x100 beats per minute times 100
+ * @return false if the tempo is outside MIDI_CLOCK_MIN_BPM_X100 to MIDI_CLOCK_MAX_BPM_X100
+ */
+bool midi_clock_set_bpm(uint32_t bpm_x100);
+
+/**
+ * @brief get the tempo
+ *
+ * @return beats per minute times 100
+ */
+uint32_t midi_clock_get_bpm(void);
+
+/**
+ * @brief set how fast a destination ticks relative to the master clock
+ *
+ * @param dest the destination number
+ * @param mul the multiplier, 1 to MIDI_CLOCK_MAX_RATIO, or 0 to send nothing
+ * @param div the divider, 1 to MIDI_CLOCK_MAX_RATIO
+ * @return false if the destination or the ratio is invalid
+ */
+bool midi_clock_set_ratio(uint8_t dest, uint8_t mul, uint8_t div);
+
+/**
+ * @brief get the ratio of a destination
+ *
+ * @param dest the destination number
+ * @param mul receives the multiplier; 0 if the destination gets no clock
+ * @param div receives the divider
+ */
+void midi_clock_get_ratio(uint8_t dest, uint8_t* mul, uint8_t* div);
+
+/**
+ * @brief send Start (0xFA), Continue (0xFB) or Stop (0xFC) to every
+ * destination with the next master clock tick; Start restarts the tick count
+ * unless the clock follows a source
+ *
+ * @param status the status byte
+ * @return false if status is none of them
+ * @note a second request before the next tick replaces the first
+ */
+bool midi_clock_send_transport(uint8_t status);
+
+/**
+ * @brief follow the clock of a router source or run on the clock's own tempo;
+ * takes effect within MIDI_CLOCK_IDLE_POLL_US or the next tick
+ *
+ * @param src the source index or MIDI_CLOCK_INTERNAL
+ * @return false if the source does not exist
+ */
+bool midi_clock_set_sync_source(uint8_t src);
+
+/**
+ * @brief get the source the clock follows
+ *
+ * @return the source index or MIDI_CLOCK_INTERNAL
+ */
+uint8_t midi_clock_get_sync_source(void);
+
+/**
+ * @brief get how well the clock follows its source
+ *
+ * @return the state of the clock recovery
+ */
+midi_clock_sync_state_t midi_clock_get_sync_state(void);
+
+/**
+ * @brief check if a message is one the clock regenerates when it follows a
+ * source: Timing Clock, Start, Continue or Stop
+ *
+ * @param packet the message
+ * @return true if it is
+ */
+static inline bool midi_clock_is_sync_message(const midi_packet_t* packet)
+{
+    return MIDI_PACKET_CIN(packet) == 0xF &&
+           (packet->bytes[1] == 0xF8 || (packet->bytes[1] >= 0xFA && packet->bytes[1] <= 0xFC));
+}
+
+/**
+ * @brief pass a clock or transport message from the followed source to the
+ * clock; call from the routing loop
+ *
+ * @param status the status byte (see midi_clock_is_sync_message())
+ * @param time_us when the message arrived at the device
+ * @note call on the core the alarm IRQ runs on (see midi_clock_init())
+ */
+void midi_clock_sync_input(uint8_t status, uint32_t time_us);
+
+/**
+ * @brief get the destinations the clock sends to
+ *
+ * @return the destination bits (see MIDI_ROUTER_DEST_BIT()) of every
+ * destination with a multiplier above 0
+ */
+uint32_t midi_clock_get_dest_mask(void);
+
+/**
+ * @brief take the next packet for the USB MIDI IN cables; call from the routing loop
+ *
+ * @param packet receives the packet
+ * @return false if the queue is empty
+ */
+bool midi_clock_read_usb_packet(midi_packet_t* packet);
+
+/**
+ * @brief record when a tick or a transport byte went into a PIO TX FIFO;
+ * call from the TX mark callback for the bytes tagged MIDI_CLOCK_TAG or
+ * MIDI_CLOCK_TRANSPORT_TAG
+ *
+ * @param port the DIN MIDI OUT port
+ * @param tag the tag of the byte
+ * @param due_us when the byte was due
+ * @param sent_us when the byte went into the FIFO
+ */
+void midi_clock_record_handoff(uint8_t port, uint16_t tag, uint32_t due_us, uint32_t sent_us);
+
+/**
+ * @brief get the timing statistics
+ *
+ * @param stats receives the statistics
+ */
+void midi_clock_get_stats(midi_clock_stats_t* stats);
+
+/**
+ * @brief clear the timing statistics
+ *
+ * @note a sample recorded while resetting may survive the reset
+ */
+void midi_clock_reset_stats(void);
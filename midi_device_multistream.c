@@ -117,4 +117,22 @@ uint32_t tud_midi_demux_stream_read (uint8_t* cable_num, void* buffer, uint32_t
     }
   }
   return nread;
-}
\ No newline at end of file
+}
+
+uint32_t tud_midi_n_demux_dispatch(uint8_t itf, uint32_t max_packets, tud_midi_demux_cb_t dispatch, void* context)
+{
+  uint32_t ndispatched = 0;
+  uint8_t rx_packet[4];
+  while (ndispatched < max_packets && tud_midi_n_packet_read(itf, rx_packet))
+  {
+    uint8_t const code_index = rx_packet[0] & 0x0f;
+    if (code_index == MIDI_CIN_MISC || code_index == MIDI_CIN_CABLE_EVENT)
+    {
+      // These are reserved and unused, skip this packet
+      continue;
+    }
+    dispatch((rx_packet[0] >> 4) & 0xf, rx_packet, context);
+    ++ndispatched;
+  }
+  return ndispatched;
+}
@@ -121,4 +121,19 @@
 // Return the number of bytes read in the stream and set *cable_num to the cable number in the stream.
 // Return 0 when when there are no more streams or stream fragments in the receive FIFO
 // If cable_num is NULL, then this function behaves like to tud_midi_stream_read()
-uint32_t tud_midi_demux_stream_read  (uint8_t* cable_num, void* buffer, uint32_t bufsize);
\ No newline at end of file
+uint32_t tud_midi_demux_stream_read  (uint8_t* cable_num, void* buffer, uint32_t bufsize);
+
+// Called by tud_midi_n_demux_dispatch() for every packet read from the receive FIFO.
+// - cable_num is the virtual cable number of the packet
+// - packet is the 4-byte USB MIDI event packet
+// - context is the context pointer passed to tud_midi_n_demux_dispatch()
+typedef void (*tud_midi_demux_cb_t)(uint8_t cable_num, uint8_t const packet[4], void* context);
+
+// Read the packets in the receive FIFO of MIDI interface itf and pass each one to
+// dispatch in the order received, up to max_packets. Packets with a reserved code
+// index number are skipped. Packets left in the FIFO stay there, and once the FIFO
+// is full the host sees NAKs. Unlike tud_midi_demux_stream_read(), this function
+// keeps no state between calls, so it does not return each time the cable number
+// changes and may be used with more than one interface. Return the number of
+// packets passed to dispatch.
+uint32_t tud_midi_n_demux_dispatch(uint8_t itf, uint32_t max_packets, tud_midi_demux_cb_t dispatch, void* context);
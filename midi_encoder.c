@@ -0,0 +1,82 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "midi_encoder.h"
+
+void midi_encoder_init(midi_encoder_t* encoder, bool running_status, bool note_off_as_note_on)
+{
+    encoder->running_status_enabled = running_status;
+    encoder->note_off_as_note_on = note_off_as_note_on;
+    encoder->running_status = 0;
+    encoder->in_sysex = false;
+    encoder->bytes_in = 0;
+    encoder->bytes_saved = 0;
+}
+
+uint8_t midi_encoder_encode(midi_encoder_t* encoder, const midi_packet_t* packet, uint8_t* buffer)
+{
+    uint8_t nbytes = midi_packet_length(packet);
+    uint8_t status = packet->bytes[1];
+    uint8_t cin = MIDI_PACKET_CIN(packet);
+    encoder->bytes_in += nbytes;
+    if (cin == 0xF || nbytes == 0) {
+        // a single byte; realtime may appear anywhere and leaves the running status alone
+        if (status >= 0x80 && status < 0xF8) {
+            encoder->running_status = 0;
+            encoder->in_sysex = status == 0xF0;
+        }
+        buffer[0] = status;
+        return nbytes;
+    }
+    if (cin < 0x8) {
+        // System Common or SysEx (the packet may not even start with a status byte)
+        encoder->running_status = 0;
+        // any status byte but realtime ends a SysEx message
+        encoder->in_sysex = cin == 0x4;
+        for (uint8_t idx = 0; idx < nbytes; idx++) {
+            buffer[idx] = packet->bytes[idx + 1];
+        }
+        return nbytes;
+    }
+    encoder->in_sysex = false;
+    uint8_t data2 = packet->bytes[3];
+    if (encoder->note_off_as_note_on && (status & 0xF0) == 0x80 &&
+        encoder->running_status == (uint8_t)(status | 0x10)) {
+        status |= 0x10;
+        data2 = 0;
+    }
+    uint8_t nout = 0;
+    if (!encoder->running_status_enabled || status != encoder->running_status) {
+        buffer[nout++] = status;
+        encoder->running_status = encoder->running_status_enabled ? status : 0;
+    }
+    else {
+        ++encoder->bytes_saved;
+    }
+    buffer[nout++] = packet->bytes[2];
+    if (nbytes == 3) {
+        buffer[nout++] = data2;
+    }
+    return nout;
+}
@@ -0,0 +1,105 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "midi_parser.h"
+
+// The encoder turns the complete messages a DIN MIDI OUT port sends into
+// the bytes that go on the wire. With running status enabled, the status
+// byte of a channel voice message is left out when it is the same as the
+// status byte of the previous channel voice message. Optionally, Note Off
+// is sent as Note On with velocity 0 while Note On is the running status.
+
+/**
+ * @struct state and statistics of a DIN MIDI OUT encoder
+ */
+typedef struct {
+    bool running_status_enabled;
+    bool note_off_as_note_on;
+    uint8_t running_status;  // status byte the receiver applies to data bytes, 0 if none
+    bool in_sysex;           // a SysEx message went out without its end yet
+    uint32_t bytes_in;       // bytes of the messages before encoding
+    uint32_t bytes_saved;    // status bytes left out
+} midi_encoder_t;
+
+/**
+ * @brief initialize an encoder
+ *
+ * @param encoder the encoder
+ * @param running_status true to leave out repeated status bytes
+ * @param note_off_as_note_on true to send Note Off as Note On velocity 0
+ * when that keeps the running status
+ */
+void midi_encoder_init(midi_encoder_t* encoder, bool running_status, bool note_off_as_note_on);
+
+/**
+ * @brief change how an encoder encodes the messages after this
+ *
+ * @param encoder the encoder
+ * @param running_status true to leave out repeated status bytes
+ * @param note_off_as_note_on true to send Note Off as Note On velocity 0
+ * when that keeps the running status
+ */
+static inline void midi_encoder_set_options(midi_encoder_t* encoder, bool running_status, bool note_off_as_note_on)
+{
+    encoder->running_status_enabled = running_status;
+    encoder->note_off_as_note_on = note_off_as_note_on;
+}
+
+/**
+ * @brief forget the running status, e.g. after the receiver may have lost it
+ *
+ * @param encoder the encoder
+ */
+static inline void midi_encoder_reset(midi_encoder_t* encoder)
+{
+    encoder->running_status = 0;
+}
+
+/**
+ * @brief check if the receiver is in the middle of a SysEx message
+ *
+ * @param encoder the encoder
+ * @return true if the last non-realtime bytes encoded started or continued a
+ * SysEx message without ending it
+ */
+static inline bool midi_encoder_in_sysex(const midi_encoder_t* encoder)
+{
+    return encoder->in_sysex;
+}
+
+/**
+ * @brief encode one message for transmission
+ *
+ * Realtime messages do not change the running status. System Common and
+ * SysEx messages cancel it.
+ *
+ * @param encoder the encoder
+ * @param packet the message
+ * @param buffer receives up to 3 bytes to transmit
+ * @return the number of bytes in buffer
+ */
+uint8_t midi_encoder_encode(midi_encoder_t* encoder, const midi_packet_t* packet, uint8_t* buffer);
@@ -0,0 +1,90 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "midi_filter.h"
+
+// Message class of each channel voice status nibble 0x8-0xE
+static const uint16_t channel_msg_class[7] = {
+    MIDI_FILTER_NOTE,
+    MIDI_FILTER_NOTE,
+    MIDI_FILTER_POLY_PRESSURE,
+    MIDI_FILTER_CONTROL_CHANGE,
+    MIDI_FILTER_PROGRAM_CHANGE,
+    MIDI_FILTER_CHANNEL_PRESSURE,
+    MIDI_FILTER_PITCH_BEND,
+};
+
+// Message class of each system status byte 0xF0-0xFF; 0 for undefined status bytes
+static const uint16_t system_msg_class[16] = {
+    MIDI_FILTER_SYSEX,          // 0xF0 SysEx start
+    MIDI_FILTER_SYSTEM_COMMON,  // 0xF1 MTC quarter frame
+    MIDI_FILTER_SYSTEM_COMMON,  // 0xF2 Song position pointer
+    MIDI_FILTER_SYSTEM_COMMON,  // 0xF3 Song select
+    MIDI_FILTER_SYSTEM_COMMON,  // 0xF4 undefined
+    MIDI_FILTER_SYSTEM_COMMON,  // 0xF5 undefined
+    MIDI_FILTER_SYSTEM_COMMON,  // 0xF6 Tune request
+    MIDI_FILTER_SYSEX,          // 0xF7 SysEx end
+    MIDI_FILTER_CLOCK,          // 0xF8 Timing clock
+    0,                          // 0xF9 undefined
+    MIDI_FILTER_TRANSPORT,      // 0xFA Start
+    MIDI_FILTER_TRANSPORT,      // 0xFB Continue
+    MIDI_FILTER_TRANSPORT,      // 0xFC Stop
+    0,                          // 0xFD undefined
+    MIDI_FILTER_ACTIVE_SENSING, // 0xFE Active sensing
+    MIDI_FILTER_SYSTEM_RESET,   // 0xFF System reset
+};
+
+void midi_filter_init(midi_filter_t* filter)
+{
+    filter->channels = MIDI_FILTER_ALL_CHANNELS;
+    filter->blocked = 0;
+}
+
+bool midi_filter_passes(const midi_filter_t* filter, uint8_t status)
+{
+    if (status < 0x80) {
+        return true; // data bytes belong to the message of the last status byte
+    }
+    if (status >= 0xF0) {
+        return (filter->blocked & system_msg_class[status & 0x0F]) == 0;
+    }
+    if (filter->blocked & channel_msg_class[(status >> 4) - 8]) {
+        return false;
+    }
+    return (filter->channels & (1u << (status & 0x0F))) != 0;
+}
+
+void midi_filter_compile(uint32_t dest_mask, const midi_filter_t* filters, uint8_t nfilters, uint32_t* status_route)
+{
+    for (uint16_t status = 0; status < 256; status++) {
+        uint32_t route = 0;
+        for (uint8_t dest = 0; dest < nfilters; dest++) {
+            uint32_t bit = 1ul << dest;
+            if ((dest_mask & bit) && midi_filter_passes(filters + dest, (uint8_t)status)) {
+                route |= bit;
+            }
+        }
+        status_route[status] = route;
+    }
+}
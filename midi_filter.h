@@ -0,0 +1,83 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Message classes a route filter can drop
+#define MIDI_FILTER_NOTE             (1u << 0)  // 0x8n Note Off, 0x9n Note On
+#define MIDI_FILTER_POLY_PRESSURE    (1u << 1)  // 0xAn
+#define MIDI_FILTER_CONTROL_CHANGE   (1u << 2)  // 0xBn
+#define MIDI_FILTER_PROGRAM_CHANGE   (1u << 3)  // 0xCn
+#define MIDI_FILTER_CHANNEL_PRESSURE (1u << 4)  // 0xDn
+#define MIDI_FILTER_PITCH_BEND       (1u << 5)  // 0xEn
+#define MIDI_FILTER_SYSEX            (1u << 6)  // 0xF0 ... 0xF7
+#define MIDI_FILTER_SYSTEM_COMMON    (1u << 7)  // 0xF1 - 0xF6
+#define MIDI_FILTER_CLOCK            (1u << 8)  // 0xF8
+#define MIDI_FILTER_TRANSPORT        (1u << 9)  // 0xFA Start, 0xFB Continue, 0xFC Stop
+#define MIDI_FILTER_ACTIVE_SENSING   (1u << 10) // 0xFE
+#define MIDI_FILTER_SYSTEM_RESET     (1u << 11) // 0xFF
+
+#define MIDI_FILTER_ALL_CHANNELS 0xFFFF
+
+/**
+ * @struct the filter of a single route
+ */
+typedef struct {
+    uint16_t channels; // bit n set: pass channel messages on MIDI channel n+1
+    uint16_t blocked;  // MIDI_FILTER_* message classes to drop
+} midi_filter_t;
+
+/**
+ * @brief set a filter to pass every message
+ *
+ * @param filter the filter to initialize
+ */
+void midi_filter_init(midi_filter_t* filter);
+
+/**
+ * @brief check if a message with a given status byte passes a filter
+ *
+ * This is the slow reference decision used to build the compiled
+ * lookup table. The routing hot path never calls it.
+ *
+ * @param filter the filter to check
+ * @param status the message status byte (0x80-0xFF)
+ * @return true if the message passes
+ */
+bool midi_filter_passes(const midi_filter_t* filter, uint8_t status);
+
+/**
+ * @brief compile the filters of all routes of a source into a status lookup table
+ *
+ * After compiling, status_route[status] is the set of destinations that receive
+ * a message beginning with that status byte.
+ *
+ * @param dest_mask the destinations the source is routed to
+ * @param filters the filter of each destination, indexed by destination number
+ * @param nfilters the number of entries in filters
+ * @param status_route the 256-entry table to fill
+ */
+void midi_filter_compile(uint32_t dest_mask, const midi_filter_t* filters, uint8_t nfilters, uint32_t* status_route);
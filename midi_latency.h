@@ -0,0 +1,87 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include "midi_router.h"
+
+// End-to-end latency of every route as a histogram with power of 2 buckets.
+// A message is timestamped when it enters the device (the DIN MIDI IN RX IRQ
+// or the USB MIDI OUT endpoint read) and recorded when it leaves it (queued
+// for the USB MIDI IN endpoint or the last byte taken out of the DIN MIDI OUT
+// TX buffer). Each histogram must be recorded by a single core or IRQ handler.
+
+// Bucket 0 counts latencies of 0 us, bucket n > 0 counts latencies of
+// 2^(n-1) to 2^n - 1 us, and the last bucket counts everything longer
+#ifndef MIDI_LATENCY_NUM_BUCKETS
+#define MIDI_LATENCY_NUM_BUCKETS 20
+#endif
+
+/**
+ * @struct the latency histogram of one route
+ */
+typedef struct {
+    uint32_t count[MIDI_LATENCY_NUM_BUCKETS];
+    uint32_t max_us; // longest latency recorded
+} midi_latency_hist_t;
+
+extern midi_latency_hist_t midi_latency_hists[MIDI_ROUTER_NUM_SOURCES][MIDI_ROUTER_NUM_DESTS];
+
+/**
+ * @brief clear all latency histograms
+ *
+ * @note a sample recorded while resetting may survive the reset
+ */
+void midi_latency_reset(void);
+
+/**
+ * @brief get the lowest latency that counts in a histogram bucket
+ *
+ * @param bucket the bucket number
+ * @return the latency in microseconds
+ */
+static inline uint32_t midi_latency_bucket_min_us(uint8_t bucket)
+{
+    return bucket == 0 ? 0 : 1ul << (bucket - 1);
+}
+
+/**
+ * @brief record the latency of one message
+ *
+ * @param src the source index of the route
+ * @param dest the destination number of the route
+ * @param latency_us the time between the message entering and leaving the device
+ */
+static inline void midi_latency_record(uint8_t src, uint8_t dest, uint32_t latency_us)
+{
+    midi_latency_hist_t* hist = &midi_latency_hists[src][dest];
+    uint32_t bucket = latency_us == 0 ? 0 : 32 - (uint32_t)__builtin_clz(latency_us);
+    if (bucket >= MIDI_LATENCY_NUM_BUCKETS) {
+        bucket = MIDI_LATENCY_NUM_BUCKETS - 1;
+    }
+    ++hist->count[bucket];
+    if (latency_us > hist->max_us) {
+        hist->max_us = latency_us;
+    }
+}
@@ -0,0 +1,397 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include <string.h>
+#include "midi_merge.h"
+
+#define QUEUE_MASK (MIDI_MERGE_QUEUE_LENGTH - 1)
+#define RT_QUEUE_MASK (MIDI_MERGE_RT_QUEUE_LENGTH - 1)
+
+static inline uint8_t input_depth(const midi_merge_input_t* input)
+{
+    return (uint8_t)(input->head - input->tail);
+}
+
+// Check if a SysEx packet is a later part of its message rather than its start
+static inline bool is_sysex_continuation(const midi_packet_t* packet)
+{
+    return midi_packet_is_sysex(packet) && packet->bytes[1] != 0xF0;
+}
+
+// Check if a SysEx packet ends its message
+static inline bool is_sysex_end(const midi_packet_t* packet)
+{
+    return midi_packet_is_sysex(packet) && MIDI_PACKET_CIN(packet) != 0x4;
+}
+
+void midi_merge_init(midi_merge_t* merge)
+{
+    memset(merge, 0, sizeof(midi_merge_t));
+    for (uint8_t src = 0; src < MIDI_ROUTER_NUM_SOURCES; src++) {
+        merge->inputs[src].weight = 1;
+        merge->inputs[src].credit = 1;
+    }
+    merge->sysex_owner = MIDI_MERGE_NO_SOURCE;
+}
+
+void midi_merge_set_weight(midi_merge_t* merge, uint8_t src, uint8_t weight)
+{
+    if (src < MIDI_ROUTER_NUM_SOURCES && weight > 0) {
+        merge->inputs[src].weight = weight;
+        merge->inputs[src].credit = weight;
+    }
+}
+
+void midi_merge_set_delay(midi_merge_t* merge, uint32_t delay_us)
+{
+    merge->delay_us = delay_us;
+}
+
+// Check if a message only sets a state that a newer message for the same
+// target overrides: Control Change, Pitch Bend, Channel Pressure and
+// Polyphonic Key Pressure. Data entry, data increment/decrement and the
+// (N)RPN numbers only mean something in sequence, and the channel mode
+// messages are commands, so those Control Changes are not.
+static bool is_state_message(const midi_packet_t* packet)
+{
+    switch (MIDI_PACKET_CIN(packet)) {
+    case 0xA:
+    case 0xD:
+    case 0xE:
+        return true;
+    case 0xB: {
+        uint8_t controller = packet->bytes[2];
+        return controller != 6 && controller != 38 && (controller < 96 || controller > 101) && controller < 120;
+    }
+    default:
+        return false;
+    }
+}
+
+// Find the message waiting in an input's queue that packet can replace: the
+// newest one for the same channel and controller or note, with only state
+// messages after it. It must be one that was due to go out before packet was
+// written, so only a backlog is thinned out. Return false if there is none.
+static bool find_replaceable(const midi_merge_t* merge, const midi_merge_input_t* input, const midi_packet_t* packet,
+                             uint32_t now_us, uint8_t* slot)
+{
+    if (!is_state_message(packet)) {
+        return false;
+    }
+    // Control Change and Polyphonic Key Pressure also name a controller or note
+    bool has_key = MIDI_PACKET_CIN(packet) == 0xA || MIDI_PACKET_CIN(packet) == 0xB;
+    for (uint8_t idx = input->head; idx != input->tail;) {
+        --idx;
+        const midi_packet_t* queued = input->queue + (idx & QUEUE_MASK);
+        if (!is_state_message(queued)) {
+            return false;
+        }
+        if (queued->bytes[1] == packet->bytes[1] && (!has_key || queued->bytes[2] == packet->bytes[2])) {
+            if ((int32_t)(now_us - input->queue_us[idx & QUEUE_MASK]) < (int32_t)merge->delay_us) {
+                return false;
+            }
+            *slot = idx & QUEUE_MASK;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool queue_packet(midi_merge_t* merge, uint8_t src, const midi_packet_t* packet, uint32_t now_us)
+{
+    if (midi_packet_is_realtime(packet)) {
+        if ((uint8_t)(merge->rt_head - merge->rt_tail) >= MIDI_MERGE_RT_QUEUE_LENGTH) {
+            return false;
+        }
+        merge->rt_queue[merge->rt_head & RT_QUEUE_MASK] = *packet;
+        merge->rt_origin[merge->rt_head & RT_QUEUE_MASK].src = src;
+        merge->rt_origin[merge->rt_head++ & RT_QUEUE_MASK].time_us = now_us;
+        return true;
+    }
+    midi_merge_input_t* input = merge->inputs + src;
+    uint8_t slot;
+    if (find_replaceable(merge, input, packet, now_us, &slot)) {
+        // the message keeps its place and write time, so it goes out no later
+        input->queue[slot] = *packet;
+        ++input->stats.coalesced;
+        return true;
+    }
+    uint8_t depth = input_depth(input);
+    if (depth >= MIDI_MERGE_QUEUE_LENGTH) {
+        return false;
+    }
+    if (depth == 0) {
+        input->ready_since_us = now_us;
+    }
+    input->queue[input->head & QUEUE_MASK] = *packet;
+    input->queue_us[input->head++ & QUEUE_MASK] = now_us;
+    if (++depth > input->stats.max_depth) {
+        input->stats.max_depth = depth;
+    }
+    return true;
+}
+
+bool midi_merge_write_packet(midi_merge_t* merge, uint8_t src, const midi_packet_t* packet, uint32_t now_us)
+{
+    if (src >= MIDI_ROUTER_NUM_SOURCES) {
+        return false;
+    }
+    midi_merge_input_t* input = merge->inputs + src;
+    if (input->sysex_skip && !midi_packet_is_realtime(packet)) {
+        if (is_sysex_continuation(packet)) {
+            // the rest of a SysEx message that was cut short
+            input->sysex_skip = !is_sysex_end(packet);
+            ++input->stats.dropped;
+            return false;
+        }
+        input->sysex_skip = false;
+    }
+    if (!queue_packet(merge, src, packet, now_us)) {
+        ++input->stats.dropped;
+        if (midi_packet_is_sysex(packet)) {
+            // the rest of the message would continue something else, and the
+            // part already queued will not end
+            input->sysex_skip = !is_sysex_end(packet);
+            input->sysex_lost_end |= is_sysex_continuation(packet);
+        }
+        return false;
+    }
+    return true;
+}
+
+bool midi_merge_can_write_packet(const midi_merge_t* merge, uint8_t src, const midi_packet_t* packet, uint32_t now_us)
+{
+    if (src >= MIDI_ROUTER_NUM_SOURCES) {
+        return false;
+    }
+    if (midi_packet_is_realtime(packet)) {
+        return (uint8_t)(merge->rt_head - merge->rt_tail) < MIDI_MERGE_RT_QUEUE_LENGTH;
+    }
+    uint8_t slot;
+    return input_depth(merge->inputs + src) < MIDI_MERGE_QUEUE_LENGTH ||
+           find_replaceable(merge, merge->inputs + src, packet, now_us, &slot);
+}
+
+// Take the packet at the head of an input's queue
+static void pop_input(midi_merge_t* merge, uint8_t src, uint32_t now_us, midi_packet_t* packet, midi_merge_origin_t* origin)
+{
+    midi_merge_input_t* input = merge->inputs + src;
+    if (origin) {
+        origin->src = src;
+        origin->time_us = input->queue_us[input->tail & QUEUE_MASK];
+    }
+    *packet = input->queue[input->tail++ & QUEUE_MASK];
+    uint32_t wait_us = now_us - input->ready_since_us;
+    if (wait_us > input->stats.max_wait_us) {
+        input->stats.max_wait_us = wait_us;
+    }
+    // the next message had to wait for this one; it becomes ready now
+    input->ready_since_us = now_us;
+    ++input->stats.messages;
+}
+
+static void pop_realtime(midi_merge_t* merge, midi_packet_t* packet, midi_merge_origin_t* origin)
+{
+    if (origin) {
+        *origin = merge->rt_origin[merge->rt_tail & RT_QUEUE_MASK];
+    }
+    *packet = merge->rt_queue[merge->rt_tail++ & RT_QUEUE_MASK];
+}
+
+// Check if the SysEx owner has nothing queued and either lost the end of its
+// message or has sent nothing for MIDI_MERGE_SYSEX_TIMEOUT_US; a source that
+// stopped, was unrouted or was unplugged would hold the output forever
+static bool is_sysex_stalled(const midi_merge_t* merge, uint32_t now_us)
+{
+    if (merge->sysex_owner == MIDI_MERGE_NO_SOURCE) {
+        return false;
+    }
+    const midi_merge_input_t* owner = merge->inputs + merge->sysex_owner;
+    return input_depth(owner) == 0 &&
+           (owner->sysex_lost_end || now_us - merge->sysex_us >= MIDI_MERGE_SYSEX_TIMEOUT_US);
+}
+
+// End the message of a stalled SysEx owner with an F7 and give up the output.
+// Whatever else of the message the source sends later is dropped.
+static void end_stalled_sysex(midi_merge_t* merge, uint32_t now_us, midi_packet_t* packet, midi_merge_origin_t* origin)
+{
+    midi_merge_input_t* owner = merge->inputs + merge->sysex_owner;
+    if (origin) {
+        origin->src = merge->sysex_owner;
+        origin->time_us = now_us;
+    }
+    packet->bytes[0] = 0x05;
+    packet->bytes[1] = 0xF7;
+    packet->bytes[2] = 0;
+    packet->bytes[3] = 0;
+    if (!owner->sysex_lost_end) {
+        owner->sysex_skip = true;
+    }
+    owner->sysex_lost_end = false;
+    ++owner->stats.sysex_cut;
+    merge->sysex_owner = MIDI_MERGE_NO_SOURCE;
+}
+
+// Find the message written first among those that may go next: the head of
+// the realtime queue (*src is MIDI_MERGE_NO_SOURCE then) and the heads of the
+// input queues, only that of the SysEx owner if there is one
+static bool find_oldest(const midi_merge_t* merge, uint8_t* src, uint32_t* time_us)
+{
+    bool found = false;
+    if (merge->rt_head != merge->rt_tail) {
+        *src = MIDI_MERGE_NO_SOURCE;
+        *time_us = merge->rt_origin[merge->rt_tail & RT_QUEUE_MASK].time_us;
+        found = true;
+    }
+    for (uint8_t n = 0; n < MIDI_ROUTER_NUM_SOURCES; n++) {
+        const midi_merge_input_t* input = merge->inputs + n;
+        if ((merge->sysex_owner != MIDI_MERGE_NO_SOURCE && n != merge->sysex_owner) || input_depth(input) == 0) {
+            continue;
+        }
+        uint32_t queued_us = input->queue_us[input->tail & QUEUE_MASK];
+        if (!found || (int32_t)(queued_us - *time_us) < 0) {
+            *src = n;
+            *time_us = queued_us;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Constant latency: send the message written first once it is due
+static bool pop_delayed(midi_merge_t* merge, uint32_t now_us, midi_packet_t* packet, midi_merge_origin_t* origin)
+{
+    if (is_sysex_stalled(merge, now_us)) {
+        end_stalled_sysex(merge, now_us, packet, origin);
+        return true;
+    }
+    uint8_t src;
+    uint32_t time_us = 0;
+    if (!find_oldest(merge, &src, &time_us) || (int32_t)(now_us - time_us) < (int32_t)merge->delay_us) {
+        return false;
+    }
+    if (src == MIDI_MERGE_NO_SOURCE) {
+        pop_realtime(merge, packet, origin);
+    }
+    else {
+        pop_input(merge, src, now_us, packet, origin);
+        if (merge->sysex_owner == src && MIDI_PACKET_CIN(packet) != 0x4) {
+            merge->inputs[src].sysex_lost_end = false;
+        }
+        merge->sysex_owner = MIDI_PACKET_CIN(packet) == 0x4 ? src : MIDI_MERGE_NO_SOURCE;
+        merge->sysex_us = now_us;
+    }
+    return true;
+}
+
+bool midi_merge_pop(midi_merge_t* merge, uint32_t now_us, midi_packet_t* packet, midi_merge_origin_t* origin)
+{
+    if (merge->delay_us > 0) {
+        return pop_delayed(merge, now_us, packet, origin);
+    }
+    if (merge->rt_head != merge->rt_tail) {
+        pop_realtime(merge, packet, origin);
+        return true;
+    }
+    if (is_sysex_stalled(merge, now_us)) {
+        end_stalled_sysex(merge, now_us, packet, origin);
+        return true;
+    }
+    if (merge->sysex_owner != MIDI_MERGE_NO_SOURCE) {
+        // no other source may interleave with a SysEx message
+        midi_merge_input_t* owner = merge->inputs + merge->sysex_owner;
+        if (input_depth(owner) == 0) {
+            return false;
+        }
+        pop_input(merge, merge->sysex_owner, now_us, packet, origin);
+        merge->sysex_us = now_us;
+        if (MIDI_PACKET_CIN(packet) != 0x4) {
+            merge->sysex_owner = MIDI_MERGE_NO_SOURCE;
+            owner->sysex_lost_end = false;
+        }
+        return true;
+    }
+    for (uint8_t n = 0; n < MIDI_ROUTER_NUM_SOURCES; n++) {
+        uint8_t src = merge->current;
+        midi_merge_input_t* input = merge->inputs + src;
+        if (input_depth(input) > 0) {
+            pop_input(merge, src, now_us, packet, origin);
+            if (MIDI_PACKET_CIN(packet) == 0x4) {
+                merge->sysex_owner = src;
+                merge->sysex_us = now_us;
+            }
+            if (--input->credit == 0 || input_depth(input) == 0) {
+                input->credit = input->weight;
+                merge->current = (uint8_t)((src + 1) % MIDI_ROUTER_NUM_SOURCES);
+            }
+            return true;
+        }
+        // nothing to send; the turn passes to the next input
+        input->credit = input->weight;
+        merge->current = (uint8_t)((src + 1) % MIDI_ROUTER_NUM_SOURCES);
+    }
+    return false;
+}
+
+bool midi_merge_get_wait(const midi_merge_t* merge, uint32_t now_us, uint32_t* wait_us)
+{
+    bool found = false;
+    if (merge->sysex_owner != MIDI_MERGE_NO_SOURCE && input_depth(merge->inputs + merge->sysex_owner) == 0) {
+        // when a stalled SysEx owner gives up the output
+        int32_t left_us = merge->inputs[merge->sysex_owner].sysex_lost_end
+                              ? 0
+                              : (int32_t)(merge->sysex_us + MIDI_MERGE_SYSEX_TIMEOUT_US - now_us);
+        *wait_us = left_us > 0 ? (uint32_t)left_us : 0;
+        found = true;
+    }
+    uint8_t src;
+    uint32_t time_us = 0;
+    if (merge->delay_us > 0 && find_oldest(merge, &src, &time_us)) {
+        int32_t left_us = (int32_t)(time_us + merge->delay_us - now_us);
+        uint32_t due_us = left_us > 0 ? (uint32_t)left_us : 0;
+        if (!found || due_us < *wait_us) {
+            *wait_us = due_us;
+        }
+        found = true;
+    }
+    return found;
+}
+
+void midi_merge_get_stats(const midi_merge_t* merge, uint8_t src, midi_merge_stats_t* stats)
+{
+    if (src >= MIDI_ROUTER_NUM_SOURCES) {
+        memset(stats, 0, sizeof(midi_merge_stats_t));
+        return;
+    }
+    const midi_merge_input_t* input = merge->inputs + src;
+    *stats = input->stats;
+    stats->depth = input_depth(input);
+}
+
+void midi_merge_reset_stats(midi_merge_t* merge)
+{
+    for (uint8_t src = 0; src < MIDI_ROUTER_NUM_SOURCES; src++) {
+        memset(&merge->inputs[src].stats, 0, sizeof(midi_merge_stats_t));
+    }
+}
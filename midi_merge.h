@@ -0,0 +1,204 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "midi_parser.h"
+#include "midi_router.h"
+
+// A merger combines the MIDI streams that all route sources send to one
+// DIN MIDI OUT port into a single stream. Every source has its own message
+// queue, so streams are only interleaved at message boundaries.
+// A SysEx message owns the output until it ends, or until its source stalls
+// for MIDI_MERGE_SYSEX_TIMEOUT_US or loses part of it; then the merger ends
+// the message with an F7 and drops the rest of it. Realtime messages bypass
+// the queues and may be sent in the middle of any message. When the output
+// falls behind, a Control Change, Pitch Bend or aftertouch message replaces
+// one for the same target still waiting in its source's queue, so the output
+// sends the latest state instead of working through the stale ones.
+//
+// With a delay set, the merger works at constant latency instead: it holds
+// every message until the delay has passed since it was written and sends
+// the messages of all inputs in the order they were written.
+
+// Number of packets each source can queue; must be a power of 2 <= 128
+#ifndef MIDI_MERGE_QUEUE_LENGTH
+#define MIDI_MERGE_QUEUE_LENGTH 16
+#endif
+// Number of realtime packets the merger can queue; must be a power of 2 <= 128
+#ifndef MIDI_MERGE_RT_QUEUE_LENGTH
+#define MIDI_MERGE_RT_QUEUE_LENGTH 8
+#endif
+
+// Time a SysEx owner may send nothing before the merger ends its message
+#ifndef MIDI_MERGE_SYSEX_TIMEOUT_US
+#define MIDI_MERGE_SYSEX_TIMEOUT_US 250000
+#endif
+
+#define MIDI_MERGE_NO_SOURCE 0xFF
+
+/**
+ * @struct per-source merge statistics
+ */
+typedef struct {
+    uint8_t depth;        // packets waiting in the queue now
+    uint8_t max_depth;    // most packets ever waiting in the queue
+    uint32_t max_wait_us; // longest time a message waited at the head of the queue
+    uint32_t messages;    // packets sent to the output
+    uint32_t dropped;     // packets dropped because the queue was full
+    uint32_t coalesced;   // packets that replaced an older one for the same target in the queue
+    uint32_t sysex_cut;   // SysEx messages the merger ended because the source stalled or lost a part
+} midi_merge_stats_t;
+
+/**
+ * @struct where a message sent to the output came from
+ */
+typedef struct {
+    uint8_t src;      // the input (a route source index)
+    uint32_t time_us; // the now_us the message was written with
+} midi_merge_origin_t;
+
+/**
+ * @struct one input of a merger
+ */
+typedef struct {
+    midi_packet_t queue[MIDI_MERGE_QUEUE_LENGTH];
+    uint32_t queue_us[MIDI_MERGE_QUEUE_LENGTH]; // when each message was written
+    uint8_t head;            // free-running write index
+    uint8_t tail;            // free-running read index
+    uint8_t weight;          // messages sent per round robin turn
+    uint8_t credit;          // messages left in the current turn
+    uint32_t ready_since_us; // when the message at the head of the queue became ready
+    bool sysex_skip;         // drop SysEx parts until the message that was cut short ends
+    bool sysex_lost_end;     // the queue holds a SysEx message whose end was dropped
+    midi_merge_stats_t stats;
+} midi_merge_input_t;
+
+/**
+ * @struct a merger for one output
+ */
+typedef struct {
+    midi_merge_input_t inputs[MIDI_ROUTER_NUM_SOURCES];
+    midi_packet_t rt_queue[MIDI_MERGE_RT_QUEUE_LENGTH];
+    midi_merge_origin_t rt_origin[MIDI_MERGE_RT_QUEUE_LENGTH];
+    uint8_t rt_head;
+    uint8_t rt_tail;
+    uint8_t current;     // input whose round robin turn it is
+    uint8_t sysex_owner; // input sending a SysEx message or MIDI_MERGE_NO_SOURCE
+    uint32_t sysex_us;   // when the SysEx owner last sent a part
+    uint32_t delay_us;   // how long each message is held or 0
+} midi_merge_t;
+
+/**
+ * @brief initialize a merger; all inputs get weight 1
+ *
+ * @param merge the merger
+ */
+void midi_merge_init(midi_merge_t* merge);
+
+/**
+ * @brief set how many messages an input may send per round robin turn
+ *
+ * @param merge the merger
+ * @param src the input (a route source index)
+ * @param weight the number of messages per turn (at least 1)
+ */
+void midi_merge_set_weight(midi_merge_t* merge, uint8_t src, uint8_t weight);
+
+/**
+ * @brief set how long after it was written each message goes to the output
+ *
+ * @param merge the merger
+ * @param delay_us the delay in microseconds; 0 sends the messages as soon
+ * as possible, in round robin order
+ */
+void midi_merge_set_delay(midi_merge_t* merge, uint32_t delay_us);
+
+/**
+ * @brief queue a complete message a source sends to the output
+ *
+ * @param merge the merger
+ * @param src the input (a route source index)
+ * @param packet the message; SysEx packets must arrive in order
+ * @param now_us the current time in microseconds
+ * @return false if the message was dropped because the queue was full or
+ * it is part of a SysEx message that was cut short
+ */
+bool midi_merge_write_packet(midi_merge_t* merge, uint8_t src, const midi_packet_t* packet, uint32_t now_us);
+
+/**
+ * @brief check if an input can queue a message
+ *
+ * @param merge the merger
+ * @param src the input (a route source index)
+ * @param packet the message
+ * @param now_us the now_us the message would be written with
+ * @return true if midi_merge_write_packet() would not drop the message
+ */
+bool midi_merge_can_write_packet(const midi_merge_t* merge, uint8_t src, const midi_packet_t* packet, uint32_t now_us);
+
+/**
+ * @brief get the next message to send to the output
+ *
+ * Queued realtime messages come first. A source sending a SysEx message
+ * keeps the output until the SysEx message ends; if the source stalls or
+ * lost part of the message, an F7 ends it early. Otherwise the sources
+ * take turns, each sending up to its weight in messages per turn. With a
+ * delay set, the message written first comes next, once it is due.
+ *
+ * @param merge the merger
+ * @param now_us the current time in microseconds
+ * @param packet receives the message
+ * @param origin receives the input and write time of the message; may be NULL
+ * @return true if a message was returned
+ */
+bool midi_merge_pop(midi_merge_t* merge, uint32_t now_us, midi_packet_t* packet, midi_merge_origin_t* origin);
+
+/**
+ * @brief get how long until midi_merge_pop() has a held message to return or
+ * ends a stalled SysEx message
+ *
+ * @param merge the merger
+ * @param now_us the current time in microseconds
+ * @param wait_us receives the time until then; 0 if it is now
+ * @return false if midi_merge_pop() only gets something new when a message is written
+ */
+bool midi_merge_get_wait(const midi_merge_t* merge, uint32_t now_us, uint32_t* wait_us);
+
+/**
+ * @brief get the merge statistics of an input
+ *
+ * @param merge the merger
+ * @param src the input (a route source index)
+ * @param stats receives the statistics
+ */
+void midi_merge_get_stats(const midi_merge_t* merge, uint8_t src, midi_merge_stats_t* stats);
+
+/**
+ * @brief clear the maximum and counter statistics of all inputs
+ *
+ * @param merge the merger
+ */
+void midi_merge_reset_stats(midi_merge_t* merge);
@@ -0,0 +1,147 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "midi_parser.h"
+
+// MIDI 1.0 Table 4-1: Code Index Number Classifications
+static const uint8_t cin_length[16] = {
+    0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1
+};
+
+// Length of the system common messages 0xF1-0xF6 including the status byte
+static const uint8_t syscom_length[6] = {
+    2, 3, 2, 1, 1, 1
+};
+
+uint8_t midi_packet_length(const midi_packet_t* packet)
+{
+    return cin_length[packet->bytes[0] & 0x0f];
+}
+
+static inline void make_packet(midi_packet_t* packet, uint8_t cin, const uint8_t* buf, uint8_t count)
+{
+    packet->bytes[0] = cin;
+    packet->bytes[1] = buf[0];
+    packet->bytes[2] = count > 1 ? buf[1] : 0;
+    packet->bytes[3] = count > 2 ? buf[2] : 0;
+}
+
+void midi_parser_init(midi_parser_t* parser)
+{
+    parser->running_status = 0;
+    parser->count = 0;
+    parser->expected = 0;
+    parser->in_sysex = false;
+    parser->dropped = 0;
+}
+
+uint8_t midi_parser_parse(midi_parser_t* parser, uint8_t val, midi_packet_t* packets)
+{
+    uint8_t npackets = 0;
+    if (val >= 0xF8) {
+        // System Realtime: may appear anywhere and changes no state
+        make_packet(packets, 0x0F, &val, 1);
+        return 1;
+    }
+    if (val >= 0x80) {
+        if (parser->in_sysex) {
+            // EOX or any other status byte ends the SysEx message
+            parser->buf[parser->count++] = 0xF7;
+            make_packet(packets, (uint8_t)(0x04 + parser->count), parser->buf, parser->count);
+            npackets = 1;
+            parser->in_sysex = false;
+            parser->count = 0;
+            if (val == 0xF7) {
+                return npackets;
+            }
+        }
+        else {
+            // an incomplete message ends here
+            parser->dropped += parser->count;
+        }
+        if (val == 0xF0) {
+            parser->running_status = 0;
+            parser->in_sysex = true;
+            parser->buf[0] = val;
+            parser->count = 1;
+        }
+        else if (val == 0xF7) {
+            // EOX without a SysEx message; ignore it
+            ++parser->dropped;
+            parser->count = 0;
+        }
+        else if (val > 0xF0) {
+            // System Common cancels running status
+            parser->running_status = 0;
+            parser->expected = syscom_length[val - 0xF1];
+            if (parser->expected == 1) {
+                make_packet(packets + npackets, 0x05, &val, 1);
+                parser->count = 0;
+                return npackets + 1;
+            }
+            parser->buf[0] = val;
+            parser->count = 1;
+        }
+        else {
+            parser->running_status = val;
+            parser->expected = ((val & 0xE0) == 0xC0) ? 2 : 3;
+            parser->buf[0] = val;
+            parser->count = 1;
+        }
+        return npackets;
+    }
+    // data byte
+    if (parser->in_sysex) {
+        parser->buf[parser->count++] = val;
+        if (parser->count == 3) {
+            make_packet(packets, 0x04, parser->buf, 3);
+            parser->count = 0;
+            return 1;
+        }
+        return 0;
+    }
+    if (parser->count == 0) {
+        if (parser->running_status == 0) {
+            ++parser->dropped;
+            return 0; // no status byte to attach this data byte to
+        }
+        parser->buf[0] = parser->running_status;
+        parser->expected = ((parser->running_status & 0xE0) == 0xC0) ? 2 : 3;
+        parser->count = 1;
+    }
+    parser->buf[parser->count++] = val;
+    if (parser->count < parser->expected) {
+        return 0;
+    }
+    uint8_t cin;
+    if (parser->buf[0] < 0xF0) {
+        cin = parser->buf[0] >> 4;
+    }
+    else {
+        cin = parser->expected == 2 ? 0x02 : 0x03;
+    }
+    make_packet(packets, cin, parser->buf, parser->count);
+    parser->count = 0;
+    return 1;
+}
@@ -0,0 +1,108 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Complete MIDI messages are passed around as USB-MIDI 1.0 event packets:
+// byte 0 holds the cable number (upper nibble) and the Code Index Number
+// (lower nibble), bytes 1-3 hold the MIDI message. SysEx messages are split
+// into packets of up to 3 bytes each.
+typedef struct {
+    uint8_t bytes[4];
+} midi_packet_t;
+
+#define MIDI_PACKET_CIN(_packet)   ((_packet)->bytes[0] & 0x0f)
+#define MIDI_PACKET_CABLE(_packet) ((_packet)->bytes[0] >> 4)
+
+/**
+ * @brief get the number of MIDI bytes in a packet
+ *
+ * @param packet the packet
+ * @return 1-3 or 0 if the Code Index Number is reserved
+ */
+uint8_t midi_packet_length(const midi_packet_t* packet);
+
+/**
+ * @brief check if a packet is a System Realtime message
+ *
+ * @param packet the packet
+ * @return true if the packet holds a single realtime status byte
+ */
+static inline bool midi_packet_is_realtime(const midi_packet_t* packet)
+{
+    return (packet->bytes[0] & 0x0f) == 0x0f && packet->bytes[1] >= 0xf8;
+}
+
+/**
+ * @brief check if a packet belongs to a SysEx message
+ *
+ * @param packet the packet
+ * @return true if the packet starts, continues or ends a SysEx message
+ * @note a single byte system common message (CIN 0x5) is not SysEx
+ */
+static inline bool midi_packet_is_sysex(const midi_packet_t* packet)
+{
+    uint8_t cin = packet->bytes[0] & 0x0f;
+    return cin == 0x4 || cin == 0x6 || cin == 0x7 ||
+           (cin == 0x5 && packet->bytes[1] == 0xf7);
+}
+
+/**
+ * @struct state of an incremental MIDI 1.0 byte stream parser
+ */
+typedef struct {
+    uint8_t running_status; // last channel voice status byte or 0 if none
+    uint8_t buf[3];         // bytes of the message in progress
+    uint8_t count;          // number of bytes in buf
+    uint8_t expected;       // total number of bytes of the message in progress
+    bool in_sysex;          // true while inside a SysEx message
+    uint32_t dropped;       // bytes that did not end up in a packet
+} midi_parser_t;
+
+/**
+ * @brief reset a parser to the idle state
+ *
+ * @param parser the parser
+ */
+void midi_parser_init(midi_parser_t* parser);
+
+/**
+ * @brief feed one byte of a MIDI stream to the parser
+ *
+ * Running status is expanded so every channel voice packet contains its
+ * status byte. Realtime bytes produce a packet immediately, even in the
+ * middle of another message. Any status byte other than realtime and EOX
+ * terminates a SysEx message in progress and the parser appends the
+ * missing EOX. Data bytes without a status byte and incomplete messages are
+ * dropped and counted.
+ *
+ * @param parser the parser
+ * @param val the next byte in the stream
+ * @param packets receives the completed packets; must have room for 2 packets.
+ * The cable number of each packet is 0.
+ * @return the number of completed packets (0-2)
+ */
+uint8_t midi_parser_parse(midi_parser_t* parser, uint8_t val, midi_packet_t* packets);
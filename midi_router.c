@@ -0,0 +1,141 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include <string.h>
+#include "hardware/sync.h"
+#include "tusb.h"
+#include "midi_router.h"
+
+/**
+ * @struct per-source routing state
+ */
+typedef struct {
+    uint32_t msg_mask;   // destinations of the message in progress
+} midi_router_source_t;
+
+// The active table is only ever read by the router. Edits go to the other
+// table, which becomes active by swapping a single pointer.
+static midi_router_table_t tables[2];
+static midi_router_table_t* volatile active_table = tables;
+static midi_router_source_t sources[MIDI_ROUTER_NUM_SOURCES];
+// generation of the table the routing loop last synchronized to
+static volatile uint32_t synced_generation;
+
+static void midi_router_compile(midi_router_table_t* table)
+{
+    for (uint8_t src = 0; src < MIDI_ROUTER_NUM_SOURCES; src++) {
+        midi_filter_compile(table->dest_mask[src], table->filter[src], MIDI_ROUTER_NUM_DESTS, table->status_route[src]);
+    }
+}
+
+void midi_router_init(void)
+{
+    memset(tables, 0, sizeof(tables));
+    for (uint8_t src = 0; src < MIDI_ROUTER_NUM_SOURCES; src++) {
+        for (uint8_t dest = 0; dest < MIDI_ROUTER_NUM_DESTS; dest++) {
+            midi_filter_init(&tables[0].filter[src][dest]);
+        }
+    }
+    for (uint8_t n = 0; n < MIDI_ROUTER_NUM_DIN_PORTS; n++) {
+        if (n < MIDI_ROUTER_NUM_USB_IN_CABLES) {
+            tables[0].dest_mask[MIDI_ROUTER_SRC_DIN_IN(n)] = MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_USB_IN(n));
+        }
+        if (n < MIDI_ROUTER_NUM_USB_OUT_CABLES) {
+            tables[0].dest_mask[MIDI_ROUTER_SRC_USB_OUT(n)] = MIDI_ROUTER_DEST_BIT(MIDI_ROUTER_DEST_DIN_OUT(n));
+        }
+    }
+    midi_router_compile(tables);
+    tables[0].generation = 1;
+    memset(sources, 0, sizeof(sources));
+    active_table = tables;
+    synced_generation = 1;
+}
+
+midi_router_table_t* midi_router_edit(void)
+{
+    if (synced_generation != active_table->generation) {
+        return NULL; // the inactive table may still be in use
+    }
+    midi_router_table_t* edit_table = (active_table == tables) ? tables + 1 : tables;
+    memcpy(edit_table, active_table, sizeof(midi_router_table_t));
+    return edit_table;
+}
+
+void midi_router_commit(void)
+{
+    midi_router_table_t* edit_table = (active_table == tables) ? tables + 1 : tables;
+    midi_router_compile(edit_table);
+    edit_table->generation = active_table->generation + 1;
+    if (edit_table->generation == 0) {
+        edit_table->generation = 1;
+    }
+    // make sure the table contents are visible before the new table pointer
+    __dmb();
+    active_table = edit_table;
+}
+
+void midi_router_sync(void)
+{
+    // finish all reads of the previous table before releasing it
+    __dmb();
+    synced_generation = active_table->generation;
+}
+
+uint32_t midi_router_get_route(uint8_t src)
+{
+    if (src >= MIDI_ROUTER_NUM_SOURCES) {
+        return 0;
+    }
+    return active_table->dest_mask[src];
+}
+
+bool midi_router_get_filter(uint8_t src, uint8_t dest, midi_filter_t* filter)
+{
+    if (src >= MIDI_ROUTER_NUM_SOURCES || dest >= MIDI_ROUTER_NUM_DESTS) {
+        return false;
+    }
+    *filter = active_table->filter[src][dest];
+    return true;
+}
+
+uint32_t midi_router_route_packet(uint8_t src, const midi_packet_t* packet)
+{
+    if (src >= MIDI_ROUTER_NUM_SOURCES) {
+        return 0;
+    }
+    midi_router_source_t* source = sources + src;
+    const midi_router_table_t* table = active_table;
+    uint8_t status = packet->bytes[1];
+    if (midi_packet_is_realtime(packet)) {
+        return table->status_route[src][status];
+    }
+    if (midi_packet_is_sysex(packet) && status != MIDI_STATUS_SYSEX_START) {
+        return source->msg_mask; // the rest of a SysEx message
+    }
+    if (status < 0x80) {
+        return 0; // malformed packet
+    }
+    source->msg_mask = table->status_route[src][status];
+    return source->msg_mask;
+}
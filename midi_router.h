@@ -0,0 +1,139 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "tusb_config.h"
+#include "midi_filter.h"
+#include "midi_parser.h"
+
+// A route source is either a 5-pin DIN MIDI IN port or a virtual cable on the
+// USB MIDI Bulk OUT endpoint. Every source owns one fan-out bitmask that
+// selects the destinations its messages are copied to. A destination is
+// either a 5-pin DIN MIDI OUT port or a virtual cable on the USB MIDI Bulk IN
+// endpoint.
+#define MIDI_ROUTER_NUM_DIN_PORTS     4
+#define MIDI_ROUTER_NUM_USB_OUT_CABLES CFG_TUD_MIDI_NUMCABLES_OUT
+#define MIDI_ROUTER_NUM_USB_IN_CABLES  CFG_TUD_MIDI_NUMCABLES_IN
+
+#define MIDI_ROUTER_NUM_SOURCES (MIDI_ROUTER_NUM_DIN_PORTS + MIDI_ROUTER_NUM_USB_OUT_CABLES)
+#define MIDI_ROUTER_NUM_DESTS   (MIDI_ROUTER_NUM_DIN_PORTS + MIDI_ROUTER_NUM_USB_IN_CABLES)
+
+// Source index of DIN MIDI IN port _n and of USB MIDI OUT cable _n
+#define MIDI_ROUTER_SRC_DIN_IN(_n)  ((uint8_t)(_n))
+#define MIDI_ROUTER_SRC_USB_OUT(_n) ((uint8_t)(MIDI_ROUTER_NUM_DIN_PORTS + (_n)))
+
+// Destination bit number of DIN MIDI OUT port _n and of USB MIDI IN cable _n
+#define MIDI_ROUTER_DEST_DIN_OUT(_n) ((uint8_t)(_n))
+#define MIDI_ROUTER_DEST_USB_IN(_n)  ((uint8_t)(MIDI_ROUTER_NUM_DIN_PORTS + (_n)))
+
+#define MIDI_ROUTER_DEST_BIT(_dest)  (1ul << (_dest))
+#define MIDI_ROUTER_DIN_OUT_MASK     ((1ul << MIDI_ROUTER_NUM_DIN_PORTS) - 1)
+#define MIDI_ROUTER_USB_IN_MASK      (((1ul << MIDI_ROUTER_NUM_USB_IN_CABLES) - 1) << MIDI_ROUTER_NUM_DIN_PORTS)
+
+#if MIDI_ROUTER_NUM_DESTS > 32
+#error "The routing fan-out bitmask supports at most 32 destinations"
+#endif
+
+/**
+ * @struct the routing table: one fan-out bitmask per source and one
+ * message filter per route
+ */
+typedef struct {
+    uint32_t generation;                         // incremented on every commit
+    uint32_t dest_mask[MIDI_ROUTER_NUM_SOURCES]; // bit n set: route to destination n
+    midi_filter_t filter[MIDI_ROUTER_NUM_SOURCES][MIDI_ROUTER_NUM_DESTS];
+    // The following are compiled from dest_mask and filter by midi_router_commit()
+    uint32_t status_route[MIDI_ROUTER_NUM_SOURCES][256]; // destinations per status byte
+} midi_router_table_t;
+
+/**
+ * @brief initialize the routing engine with the default static routing:
+ * DIN MIDI IN n to USB MIDI IN cable n and USB MIDI OUT cable n to DIN MIDI OUT n.
+ * All routes pass all messages.
+ */
+void midi_router_init(void);
+
+/**
+ * @brief start editing the routing table
+ *
+ * @return a pointer to a private copy of the active routing table. Modify
+ * dest_mask and filter and then call midi_router_commit() to make it active.
+ * Returns NULL while the routing loop may still use the table that was
+ * active before the last commit; try again after midi_router_sync() ran.
+ * @note only one edit may be in progress at a time
+ */
+midi_router_table_t* midi_router_edit(void);
+
+/**
+ * @brief compile the edited routing table filters and atomically replace the
+ * active routing table with it
+ *
+ * Each source switches to the new table at the next status byte it receives,
+ * so a message that is in progress when the table changes (including a long
+ * SysEx message) is never split between the old and the new destinations.
+ */
+void midi_router_commit(void);
+
+/**
+ * @brief tell the router that the routing loop holds no pointer to a table
+ * that is no longer active
+ *
+ * Call from the routing loop between messages. This allows routing to run on
+ * one core while the routing table is edited on the other.
+ */
+void midi_router_sync(void);
+
+/**
+ * @brief get the destination mask of a source in the active routing table
+ *
+ * @param src the source index
+ * @return the destination mask or 0 if src is not a valid source
+ */
+uint32_t midi_router_get_route(uint8_t src);
+
+/**
+ * @brief get the filter of a route in the active routing table
+ *
+ * @param src the source index
+ * @param dest the destination number
+ * @param filter receives the filter
+ * @return false if src or dest is not valid
+ */
+bool midi_router_get_filter(uint8_t src, uint8_t dest, midi_filter_t* filter);
+
+/**
+ * @brief route one complete message received from a source
+ *
+ * The message goes to the destinations of the source that pass the route
+ * filter; the route lookup and filter decision happen once per message.
+ * SysEx continuation packets follow the decision made for the packet that
+ * started the SysEx message.
+ *
+ * @param src the source index
+ * @param packet the message
+ * @return the destinations of the message
+ */
+uint32_t midi_router_route_packet(uint8_t src, const midi_packet_t* packet);
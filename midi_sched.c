@@ -0,0 +1,616 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include <string.h>
+#include "hardware/timer.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "pico/stdlib.h"
+#include "tusb.h"
+#include "pio_midi_uart_lib.h"
+#include "midi_sched.h"
+
+// The USB frame clock is kept in 1/65536 us, so a frame period measured over
+// MIDI_SCHED_SOF_WINDOW_FRAMES frames keeps its fraction
+#define SOF_FP_SHIFT 16
+#define SOF_NOMINAL_PERIOD_FP (1000ul << SOF_FP_SHIFT)
+// The measured period may differ from 1 ms by this much, in 1/65536 us
+#define SOF_PERIOD_LIMIT_FP (1ul << SOF_FP_SHIFT) // 1000 ppm
+// After SOF_LATE_FRAMES reports in a row this much later than expected, the
+// clock starts over
+#define SOF_LATE_LIMIT_US 200
+#define SOF_LATE_FRAMES 64
+// A gap of more SOFs than this starts the clock over, e.g. after a suspend
+#define SOF_GAP_FRAMES 64
+
+#define SCHED_NO_EVENT 0xFF
+
+/**
+ * @struct a message waiting in the timing wheel
+ */
+typedef struct {
+    uint64_t due_us;
+    midi_packet_t message;
+    uint8_t dest_mask; // DIN MIDI OUT destination bits
+    uint8_t next;      // the next event in the slot or the free list
+} sched_event_t;
+
+static void* sched_uarts[MIDI_ROUTER_NUM_DIN_PORTS];
+static midi_encoder_t* sched_encoders = NULL;
+static int sched_alarm = -1;
+static volatile bool sched_enabled = false;
+
+// The USB frame clock: the SOF of frame sof_frame (the 11-bit frame number
+// counted on) was at sof_phase_fp on the device clock, and a frame takes
+// sof_period_fp. midi_sched_sof() updates it, maybe on the other core, so
+// readers retry while sof_seq is odd or changed under them.
+static volatile uint32_t sof_seq = 0;
+static uint64_t sof_phase_fp;
+static uint32_t sof_frame;
+static uint32_t sof_period_fp = SOF_NOMINAL_PERIOD_FP;
+static uint32_t sof_count = 0; // SOFs since the clock started over
+
+// State only midi_sched_sof() uses: the report with the least delay in the
+// window of MIDI_SCHED_SOF_WINDOW_FRAMES frames in progress and in the last one
+typedef struct {
+    uint64_t time_fp;
+    uint32_t frame;
+} sof_report_t;
+static uint32_t sof_window_frame;  // the frame the window started at
+static int64_t sof_best_error_fp;  // the error of sof_best against the clock
+static sof_report_t sof_best;
+static sof_report_t sof_last_best;
+static bool sof_last_best_valid;
+static uint32_t sof_late_frames;
+
+// The timing wheel. Each slot holds the events due in its MIDI_SCHED_SLOT_US
+// in due order, those of later turns of the wheel after them. The alarm IRQ
+// handler and midi_sched_submit() use it on the same core; the latter masks
+// interrupts.
+static sched_event_t sched_events[MIDI_SCHED_NUM_EVENTS];
+static uint8_t sched_wheel[MIDI_SCHED_WHEEL_SLOTS];
+static uint8_t sched_free;             // first unused event
+static volatile uint32_t sched_npending = 0;
+static uint64_t sched_cursor_us;       // start of the slot the alarm IRQ handler is at
+static uint64_t sched_alarm_target_us = UINT64_MAX;
+// Events that came due while some of their ports were in the middle of a
+// SysEx message, in due order; their dest_mask holds the ports still to go
+static uint8_t sched_held = SCHED_NO_EVENT;
+static volatile uint8_t sched_held_ports = 0;
+static volatile uint32_t sched_nheld = 0;
+
+static midi_sched_stats_t sched_stats;
+
+static inline uint8_t* wheel_slot(uint64_t time_us)
+{
+    return sched_wheel + ((time_us / MIDI_SCHED_SLOT_US) & (MIDI_SCHED_WHEEL_SLOTS - 1));
+}
+
+//--------------------------------------------------------------------+
+// USB frame clock
+//--------------------------------------------------------------------+
+
+// Start the clock over at a SOF
+static void restart_sof_clock(uint32_t frame, uint64_t time_fp)
+{
+    sof_phase_fp = time_fp;
+    sof_frame = frame;
+    sof_count = 1;
+    sof_window_frame = frame;
+    sof_best_error_fp = 0;
+    sof_best.time_fp = time_fp;
+    sof_best.frame = frame;
+    sof_last_best_valid = false;
+    sof_late_frames = 0;
+}
+
+// Measure the period between the best reports of the last two windows and
+// carry the phase on from the best report of the one that ended
+static void end_sof_window(void)
+{
+    if (sof_last_best_valid) {
+        uint32_t nframes = sof_best.frame - sof_last_best.frame;
+        uint64_t period_fp = (sof_best.time_fp - sof_last_best.time_fp) / nframes;
+        if (period_fp <= SOF_NOMINAL_PERIOD_FP + SOF_PERIOD_LIMIT_FP &&
+            period_fp >= SOF_NOMINAL_PERIOD_FP - SOF_PERIOD_LIMIT_FP) {
+            sof_period_fp = (uint32_t)period_fp;
+        }
+    }
+    sof_last_best = sof_best;
+    sof_last_best_valid = true;
+    sof_phase_fp = sof_best.time_fp + (uint64_t)(sof_frame - sof_best.frame) * sof_period_fp;
+    sof_window_frame = sof_frame;
+    sof_best_error_fp = INT64_MAX;
+}
+
+void midi_sched_sof(uint32_t frame, uint64_t time_us)
+{
+    if (!sched_enabled) {
+        return;
+    }
+    ++sched_stats.sof_frames;
+    uint64_t time_fp = time_us << SOF_FP_SHIFT;
+    // frames the USB stack reported late may come in a burst
+    uint32_t nframes = (frame - sof_frame) & 0x7FF;
+    ++sof_seq;
+    __dmb();
+    if (sof_count == 0 || nframes == 0 || nframes > SOF_GAP_FRAMES) {
+        if (sof_count > 0) {
+            ++sched_stats.sof_relocks;
+        }
+        restart_sof_clock(frame & 0x7FF, time_fp);
+    }
+    else {
+        uint64_t expected_fp = sof_phase_fp + (uint64_t)nframes * sof_period_fp;
+        int64_t error_fp = (int64_t)(time_fp - expected_fp);
+        sof_frame += nframes;
+        ++sof_count;
+        // Every report comes late by a varying amount, so one earlier than
+        // expected is closer to the SOF and the best of the window so far
+        sof_phase_fp = expected_fp;
+        if (error_fp < 0) {
+            sof_phase_fp = time_fp;
+            sof_best_error_fp = INT64_MAX;
+            error_fp = 0;
+        }
+        if (error_fp < sof_best_error_fp) {
+            sof_best_error_fp = error_fp;
+            sof_best.time_fp = time_fp;
+            sof_best.frame = sof_frame;
+        }
+        sof_late_frames = error_fp > ((int64_t)SOF_LATE_LIMIT_US << SOF_FP_SHIFT) ? sof_late_frames + 1 : 0;
+        if (sof_late_frames >= SOF_LATE_FRAMES) {
+            ++sched_stats.sof_relocks;
+            restart_sof_clock(frame & 0x7FF, time_fp);
+        }
+        else if (sof_frame - sof_window_frame >= MIDI_SCHED_SOF_WINDOW_FRAMES) {
+            end_sof_window();
+        }
+    }
+    __dmb();
+    ++sof_seq;
+}
+
+// Turn a presentation time into a time on the device clock; return false if
+// the clock is not locked or the time is too far ahead to be meant so
+static bool sched_time_to_us(uint32_t sched_time, uint64_t* due_us)
+{
+    uint32_t seq;
+    uint64_t phase_fp;
+    uint32_t frame;
+    uint32_t period_fp;
+    uint32_t count;
+    do {
+        seq = sof_seq;
+        __dmb();
+        phase_fp = sof_phase_fp;
+        frame = sof_frame;
+        period_fp = sof_period_fp;
+        count = sof_count;
+        __dmb();
+    } while ((seq & 1) || seq != sof_seq);
+    if (count < MIDI_SCHED_SOF_LOCK_FRAMES) {
+        return false;
+    }
+    uint32_t offset_us = sched_time & 0x3FF;
+    if (offset_us > 999) {
+        offset_us = 999;
+    }
+    // frames after the last SOF; the frame number wraps every 2048 frames
+    int32_t nframes = (int32_t)(((sched_time >> 10) - frame + 1024) & 0x7FF) - 1024;
+    if (nframes > MIDI_SCHED_MAX_AHEAD_FRAMES) {
+        return false;
+    }
+    int64_t due_fp = (int64_t)phase_fp + (int64_t)nframes * period_fp + (int64_t)offset_us * period_fp / 1000;
+    *due_us = due_fp < 0 ? 0 : (uint64_t)due_fp >> SOF_FP_SHIFT;
+    return true;
+}
+
+//--------------------------------------------------------------------+
+// Timing wheel
+//--------------------------------------------------------------------+
+
+// Write a message to the TX buffers of its DIN MIDI OUT ports; *held_mask
+// receives the ports in the middle of a SysEx message, which cannot take it
+// before its end. Return false if a port had no room for it.
+static bool send_message(uint8_t dest_mask, const midi_packet_t* message, uint64_t due_us, uint8_t* held_mask)
+{
+    uint64_t now_us = time_us_64();
+    if (now_us > due_us && now_us - due_us > sched_stats.late_max_us) {
+        sched_stats.late_max_us = (uint32_t)(now_us - due_us);
+    }
+    bool sent = true;
+    *held_mask = 0;
+    while (dest_mask) {
+        uint8_t port = (uint8_t)__builtin_ctz(dest_mask);
+        dest_mask &= (uint8_t)(dest_mask - 1);
+        void* uart = sched_uarts[port];
+        if (uart == NULL) {
+            continue;
+        }
+        if (midi_encoder_in_sysex(sched_encoders + port)) {
+            *held_mask |= (uint8_t)(1u << port);
+            continue;
+        }
+        if (pio_midi_uart_get_tx_buffer_space(uart) < 3) {
+            sent = false;
+            continue;
+        }
+        uint8_t bytes[3];
+        uint8_t nbytes = midi_encoder_encode(sched_encoders + port, message, bytes);
+        if (nbytes > 0) {
+            pio_midi_uart_mark_tx_buffer(uart, nbytes, MIDI_SCHED_TAG, (uint32_t)due_us);
+            pio_midi_uart_write_tx_buffer(uart, bytes, nbytes);
+            pio_midi_uart_drain_tx_buffer(uart);
+        }
+    }
+    if (!sent) {
+        ++sched_stats.dropped;
+    }
+    return sent;
+}
+
+// Keep an event until the SysEx messages on its held ports have ended
+static void hold_event(uint8_t idx, uint8_t held_mask)
+{
+    uint8_t* link = &sched_held;
+    while (*link != SCHED_NO_EVENT) {
+        link = &sched_events[*link].next;
+    }
+    sched_events[idx].dest_mask = held_mask;
+    sched_events[idx].next = SCHED_NO_EVENT;
+    *link = idx;
+    sched_held_ports |= held_mask;
+    ++sched_nheld;
+    ++sched_stats.held;
+}
+
+void midi_sched_block_alarm(bool blocked)
+{
+    // alarm n raises TIMER_IRQ_n on the core that claimed it
+    irq_set_enabled(TIMER_IRQ_0 + (uint)sched_alarm, !blocked);
+}
+
+bool midi_sched_is_held(uint8_t port)
+{
+    return (sched_held_ports & (1u << port)) != 0;
+}
+
+void midi_sched_send_held(uint8_t port)
+{
+    uint8_t port_bit = (uint8_t)(1u << port);
+    if (!(sched_held_ports & port_bit) || midi_encoder_in_sysex(sched_encoders + port)) {
+        return;
+    }
+    midi_sched_block_alarm(true);
+    sched_held_ports = 0;
+    for (uint8_t* link = &sched_held; *link != SCHED_NO_EVENT;) {
+        uint8_t idx = *link;
+        sched_event_t* event = sched_events + idx;
+        // what does not fit in the TX buffer now waits for the next pass
+        if ((event->dest_mask & port_bit) && pio_midi_uart_get_tx_buffer_space(sched_uarts[port]) >= 3) {
+            uint8_t held_mask;
+            send_message(port_bit, &event->message, event->due_us, &held_mask);
+            event->dest_mask &= (uint8_t)~port_bit;
+        }
+        if (event->dest_mask == 0) {
+            *link = event->next;
+            event->next = sched_free;
+            sched_free = idx;
+            --sched_nheld;
+        }
+        else {
+            sched_held_ports |= event->dest_mask;
+            link = &event->next;
+        }
+    }
+    midi_sched_block_alarm(false);
+}
+
+// Find the next event to send, moving the cursor up to the slot of now_us.
+// Return when it is due, or when the handler has to look again if no event
+// is due within a turn of the wheel; *idx receives SCHED_NO_EVENT then.
+static uint64_t next_event(uint64_t now_us, uint8_t* idx)
+{
+    *idx = SCHED_NO_EVENT;
+    if (sched_npending == 0) {
+        return UINT64_MAX;
+    }
+    for (;;) {
+        uint8_t head = *wheel_slot(sched_cursor_us);
+        if (head != SCHED_NO_EVENT && sched_events[head].due_us < sched_cursor_us + MIDI_SCHED_SLOT_US) {
+            *idx = head;
+            return sched_events[head].due_us;
+        }
+        if (sched_cursor_us + MIDI_SCHED_SLOT_US > now_us) {
+            break;
+        }
+        sched_cursor_us += MIDI_SCHED_SLOT_US;
+    }
+    // look ahead without moving the cursor
+    for (uint32_t n = 1; n < MIDI_SCHED_WHEEL_SLOTS; n++) {
+        uint64_t slot_us = sched_cursor_us + n * MIDI_SCHED_SLOT_US;
+        uint8_t head = *wheel_slot(slot_us);
+        if (head != SCHED_NO_EVENT && sched_events[head].due_us < slot_us + MIDI_SCHED_SLOT_US) {
+            *idx = head;
+            return sched_events[head].due_us;
+        }
+    }
+    return sched_cursor_us + MIDI_SCHED_WHEEL_SLOTS * MIDI_SCHED_SLOT_US;
+}
+
+static void on_sched_alarm(uint alarm)
+{
+    sched_alarm_target_us = UINT64_MAX;
+    for (;;) {
+        uint64_t now_us = time_us_64();
+        uint8_t idx;
+        uint64_t due_us = next_event(now_us, &idx);
+        if (due_us == UINT64_MAX) {
+            return;
+        }
+        if (now_us + MIDI_SCHED_LEAD_US < due_us) {
+            sched_alarm_target_us = due_us - MIDI_SCHED_LEAD_US;
+            if (!hardware_alarm_set_target(alarm, from_us_since_boot(sched_alarm_target_us))) {
+                return;
+            }
+            sched_alarm_target_us = UINT64_MAX;
+            continue;
+        }
+        // the alarm fired early on purpose; wait for the exact time
+        while (time_us_64() < due_us) {
+            tight_loop_contents();
+        }
+        sched_event_t* event = sched_events + idx;
+        *wheel_slot(due_us) = event->next;
+        --sched_npending;
+        uint8_t held_mask;
+        send_message(event->dest_mask, &event->message, due_us, &held_mask);
+        if (held_mask) {
+            hold_event(idx, held_mask);
+        }
+        else {
+            event->next = sched_free;
+            sched_free = idx;
+        }
+    }
+}
+
+// Put an event into its slot behind the events due before it
+static void insert_event(uint8_t idx)
+{
+    uint8_t* link = wheel_slot(sched_events[idx].due_us);
+    while (*link != SCHED_NO_EVENT && sched_events[*link].due_us <= sched_events[idx].due_us) {
+        link = &sched_events[*link].next;
+    }
+    sched_events[idx].next = *link;
+    *link = idx;
+}
+
+bool midi_sched_submit(uint32_t dest_mask, const midi_packet_t* message, uint32_t sched_time)
+{
+    dest_mask &= MIDI_ROUTER_DIN_OUT_MASK;
+    if (dest_mask == 0) {
+        return true;
+    }
+    ++sched_stats.events;
+    uint64_t due_us;
+    bool timed = sched_time_to_us(sched_time, &due_us);
+    // the alarm IRQ handler runs on this core; the other IRQs stay enabled
+    midi_sched_block_alarm(true);
+    uint64_t now_us = time_us_64();
+    bool queued = true;
+    if (!timed || due_us <= now_us) {
+        ++sched_stats.expired;
+        uint8_t held_mask;
+        queued = send_message((uint8_t)dest_mask, message, now_us, &held_mask);
+        if (held_mask && sched_free == SCHED_NO_EVENT) {
+            ++sched_stats.dropped;
+            queued = false;
+        }
+        else if (held_mask) {
+            uint8_t idx = sched_free;
+            sched_free = sched_events[idx].next;
+            sched_events[idx].due_us = now_us;
+            sched_events[idx].message = *message;
+            hold_event(idx, held_mask);
+        }
+    }
+    else if (sched_free == SCHED_NO_EVENT) {
+        ++sched_stats.dropped;
+        queued = false;
+    }
+    else {
+        uint8_t idx = sched_free;
+        sched_event_t* event = sched_events + idx;
+        sched_free = event->next;
+        event->due_us = due_us;
+        event->message = *message;
+        event->dest_mask = (uint8_t)dest_mask;
+        if (sched_npending++ == 0) {
+            sched_cursor_us = now_us - now_us % MIDI_SCHED_SLOT_US;
+        }
+        insert_event(idx);
+        // have the alarm IRQ handler take it if it is the next one due; a
+        // time that passed before the alarm was set does not fire it
+        uint64_t target_us = due_us > now_us + MIDI_SCHED_LEAD_US ? due_us - MIDI_SCHED_LEAD_US : now_us + 1;
+        if (target_us < sched_alarm_target_us) {
+            while (hardware_alarm_set_target((uint)sched_alarm, from_us_since_boot(target_us))) {
+                target_us = time_us_64() + 1;
+            }
+            sched_alarm_target_us = target_us;
+        }
+    }
+    midi_sched_block_alarm(false);
+    return queued;
+}
+
+//--------------------------------------------------------------------+
+// Envelopes
+//--------------------------------------------------------------------+
+
+// Turn the bytes of a complete envelope into the message; return false if
+// they do not hold one
+static bool unwrap_envelope(const midi_sched_envelope_t* envelope, uint8_t cable, midi_packet_t* message,
+                            uint32_t* sched_time)
+{
+    if (envelope->len < 6 || envelope->len > MIDI_SCHED_ENVELOPE_LENGTH) {
+        return false;
+    }
+    const uint8_t* bytes = envelope->bytes;
+    *sched_time = (uint32_t)bytes[2] | ((uint32_t)bytes[3] << 7) | ((uint32_t)bytes[4] << 14);
+    uint8_t status = (uint8_t)(bytes[5] | 0x80);
+    if (status == 0xF0 || status == 0xF7) {
+        return false;
+    }
+    // exactly one message, completed by the last byte
+    midi_parser_t parser;
+    midi_parser_init(&parser);
+    midi_packet_t packets[2];
+    uint8_t npackets = 0;
+    for (uint8_t idx = 5; idx < envelope->len; idx++) {
+        uint8_t val = idx == 5 ? status : bytes[idx];
+        npackets = midi_parser_parse(&parser, val, packets);
+        if (npackets > 0 && idx + 1 < envelope->len) {
+            return false;
+        }
+    }
+    if (npackets != 1) {
+        return false;
+    }
+    *message = packets[0];
+    message->bytes[0] = (uint8_t)((cable << 4) | MIDI_PACKET_CIN(packets));
+    return true;
+}
+
+midi_sched_packet_t midi_sched_take_packet(midi_sched_envelope_t* envelope, const midi_packet_t* packet,
+                                           midi_packet_t* message, uint32_t* sched_time)
+{
+    if (!envelope->active) {
+        if (!sched_enabled || MIDI_PACKET_CIN(packet) != 0x4 || packet->bytes[1] != 0xF0 ||
+            packet->bytes[2] != MIDI_SCHED_SYSEX_ID || packet->bytes[3] != MIDI_SCHED_SYSEX_TYPE) {
+            return MIDI_SCHED_PACKET_OTHER;
+        }
+        envelope->bytes[0] = MIDI_SCHED_SYSEX_ID;
+        envelope->bytes[1] = MIDI_SCHED_SYSEX_TYPE;
+        envelope->len = 2;
+        envelope->active = true;
+        return MIDI_SCHED_PACKET_TAKEN;
+    }
+    if (midi_packet_is_realtime(packet)) {
+        // realtime messages may come in the middle of the envelope
+        return MIDI_SCHED_PACKET_OTHER;
+    }
+    if (!midi_packet_is_sysex(packet)) {
+        // another message cut the envelope short
+        envelope->active = false;
+        ++sched_stats.dropped;
+        return MIDI_SCHED_PACKET_OTHER;
+    }
+    uint8_t nbytes = midi_packet_length(packet);
+    for (uint8_t idx = 1; idx <= nbytes; idx++) {
+        uint8_t val = packet->bytes[idx];
+        if (val == 0xF7) {
+            envelope->active = false;
+            if (!unwrap_envelope(envelope, MIDI_PACKET_CABLE(packet), message, sched_time)) {
+                ++sched_stats.dropped;
+                return MIDI_SCHED_PACKET_TAKEN;
+            }
+            return MIDI_SCHED_PACKET_MESSAGE;
+        }
+        if (val >= 0x80 || envelope->len >= MIDI_SCHED_ENVELOPE_LENGTH) {
+            // not a message the envelope can hold; drop the rest of it
+            envelope->len = MIDI_SCHED_ENVELOPE_LENGTH + 1;
+            continue;
+        }
+        envelope->bytes[envelope->len++] = val;
+    }
+    return MIDI_SCHED_PACKET_TAKEN;
+}
+
+//--------------------------------------------------------------------+
+// Setup and statistics
+//--------------------------------------------------------------------+
+
+void midi_sched_init(void* const midi_uarts[MIDI_ROUTER_NUM_DIN_PORTS], midi_encoder_t* encoders)
+{
+    memcpy(sched_uarts, midi_uarts, sizeof(sched_uarts));
+    sched_encoders = encoders;
+    memset(sched_wheel, SCHED_NO_EVENT, sizeof(sched_wheel));
+    for (uint8_t idx = 0; idx < MIDI_SCHED_NUM_EVENTS; idx++) {
+        sched_events[idx].next = idx + 1 < MIDI_SCHED_NUM_EVENTS ? idx + 1 : SCHED_NO_EVENT;
+    }
+    sched_free = 0;
+    midi_sched_reset_stats();
+    // the alarm IRQ is enabled on the calling core
+    sched_alarm = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback((uint)sched_alarm, on_sched_alarm);
+}
+
+void midi_sched_set_enabled(bool enabled)
+{
+    sched_enabled = enabled;
+    if (!enabled) {
+        // lock again when enabled again
+        ++sof_seq;
+        __dmb();
+        sof_count = 0;
+        __dmb();
+        ++sof_seq;
+    }
+    tud_sof_cb_enable(enabled);
+}
+
+bool midi_sched_is_enabled(void)
+{
+    return sched_enabled;
+}
+
+bool midi_sched_is_locked(void)
+{
+    return sched_enabled && sof_count >= MIDI_SCHED_SOF_LOCK_FRAMES;
+}
+
+void midi_sched_record_handoff(uint8_t port, uint32_t handoff_us)
+{
+    if (port < MIDI_ROUTER_NUM_DIN_PORTS && handoff_us > sched_stats.handoff_max_us[port]) {
+        sched_stats.handoff_max_us[port] = handoff_us;
+    }
+}
+
+uint32_t midi_sched_get_pending(void)
+{
+    return sched_npending + sched_nheld;
+}
+
+void midi_sched_get_stats(midi_sched_stats_t* stats)
+{
+    *stats = sched_stats;
+    stats->sof_period_ns = (uint32_t)(((uint64_t)sof_period_fp * 1000) >> SOF_FP_SHIFT);
+}
+
+void midi_sched_reset_stats(void)
+{
+    memset(&sched_stats, 0, sizeof(sched_stats));
+}
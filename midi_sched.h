@@ -0,0 +1,260 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "midi_parser.h"
+#include "midi_encoder.h"
+#include "midi_router.h"
+
+// Scheduled output sends messages from the USB host to the DIN MIDI OUT
+// ports at a time the host chose, instead of whenever the routing loop gets
+// to them. The host wraps each message in a SysEx envelope that carries its
+// presentation time:
+//
+//   F0 7D 01 t0 t1 t2 ss [d1 [d2]] F7
+//
+// 7D is the non-commercial SysEx ID and 01 the envelope type. t0-t2 hold a
+// 21-bit time, 7 bits each, least significant first: bits 0-9 are the
+// microsecond within the USB frame (0-999) and bits 10-20 the USB frame
+// number the host sees in the SOF packets. ss is the status byte of the
+// message with its top bit cleared and d1 and d2 are its data bytes. The
+// time may be up to MIDI_SCHED_MAX_AHEAD_FRAMES frames ahead; a time that
+// has passed sends the message at once.
+//
+// The device keeps the time of every SOF on its own clock. The SOF times are
+// taken when the USB stack reports the SOF, so they come late by a varying
+// amount; the report with the least delay in each window of
+// MIDI_SCHED_SOF_WINDOW_FRAMES frames anchors the frame clock, and the frame
+// period is measured between the anchors of two windows in a row. A hardware
+// alarm serves a timing wheel of MIDI_SCHED_WHEEL_SLOTS slots of
+// MIDI_SCHED_SLOT_US each; its IRQ handler writes every message into the TX
+// buffers of its DIN MIDI OUT ports when its time comes. On an idle port the
+// message starts on the wire then; on a busy one it waits for the bytes
+// already in the TX buffer. A port in the middle of a SysEx message cannot
+// take it, so the message is held until the routing loop has sent the end of
+// the SysEx message (see midi_sched_send_held()).
+//
+// The envelope goes through the routing matrix of the USB MIDI OUT cable it
+// arrives on: the DIN MIDI OUT ports it routes to get the message on time,
+// the USB MIDI IN cables get it at once.
+
+// SysEx ID and envelope type of a scheduled message
+#define MIDI_SCHED_SYSEX_ID 0x7D
+#define MIDI_SCHED_SYSEX_TYPE 0x01
+// Longest envelope, without F0 and F7
+#define MIDI_SCHED_ENVELOPE_LENGTH 8
+
+// The TX mark tag of the scheduled bytes sent to the DIN MIDI OUT ports
+#define MIDI_SCHED_TAG 0xFFFE
+
+// Messages that can wait to be sent
+#ifndef MIDI_SCHED_NUM_EVENTS
+#define MIDI_SCHED_NUM_EVENTS 64
+#endif
+// Slots of the timing wheel and the time each slot covers; powers of 2
+#ifndef MIDI_SCHED_WHEEL_SLOTS
+#define MIDI_SCHED_WHEEL_SLOTS 64
+#endif
+#ifndef MIDI_SCHED_SLOT_US
+#define MIDI_SCHED_SLOT_US 1024
+#endif
+// Furthest ahead a presentation time may be, in USB frames
+#define MIDI_SCHED_MAX_AHEAD_FRAMES 1000
+
+// The alarm fires this long before a message is due and the handler waits
+// out the rest, so another IRQ handler delaying the alarm IRQ does not delay
+// the message
+#ifndef MIDI_SCHED_LEAD_US
+#define MIDI_SCHED_LEAD_US 20
+#endif
+
+// Frames the period of the USB frame clock is measured over
+#ifndef MIDI_SCHED_SOF_WINDOW_FRAMES
+#define MIDI_SCHED_SOF_WINDOW_FRAMES 1024
+#endif
+// SOFs it takes to lock to the USB frame clock; until then, the messages go out at once
+#ifndef MIDI_SCHED_SOF_LOCK_FRAMES
+#define MIDI_SCHED_SOF_LOCK_FRAMES 16
+#endif
+
+/**
+ * @struct how precisely the scheduled messages went out
+ */
+typedef struct {
+    uint32_t events;      // messages scheduled
+    uint32_t expired;     // messages sent at once because their time had passed or no SOF was locked
+    uint32_t dropped;     // messages lost because no event or TX buffer room was left
+    uint32_t held;        // messages that waited for the end of a SysEx message on a port
+    uint32_t late_max_us; // longest time a message was written to the TX buffers after it was due
+    // Per DIN MIDI OUT port, the longest time from a message being due to
+    // its last byte going into the PIO TX FIFO
+    uint32_t handoff_max_us[MIDI_ROUTER_NUM_DIN_PORTS];
+    uint32_t sof_frames;  // SOFs seen
+    uint32_t sof_relocks; // times the USB frame clock was lost, e.g. while suspended
+    uint32_t sof_period_ns; // the length of a USB frame on the device clock
+} midi_sched_stats_t;
+
+/**
+ * @struct a scheduled message envelope being received on one USB MIDI OUT cable
+ */
+typedef struct {
+    uint8_t bytes[MIDI_SCHED_ENVELOPE_LENGTH];
+    uint8_t len;
+    bool active;
+} midi_sched_envelope_t;
+
+typedef enum {
+    MIDI_SCHED_PACKET_OTHER = 0, // not part of an envelope; route it
+    MIDI_SCHED_PACKET_TAKEN,     // part of an envelope
+    MIDI_SCHED_PACKET_MESSAGE,   // the end of an envelope; the message is ready
+} midi_sched_packet_t;
+
+/**
+ * @brief claim a hardware alarm and set up scheduled output; it starts disabled
+ *
+ * @param midi_uarts the MIDI UARTs of DIN MIDI OUT A-D; NULL for a missing one
+ * @param encoders the running status encoders of DIN MIDI OUT A-D; the alarm
+ * IRQ handler encodes with them too, so the routing loop must block the alarm
+ * (see midi_sched_block_alarm()) while it encodes and writes a message
+ * @note call on the core that writes to the MIDI UARTs; the alarm IRQ runs there
+ */
+void midi_sched_init(void* const midi_uarts[MIDI_ROUTER_NUM_DIN_PORTS], midi_encoder_t* encoders);
+
+/**
+ * @brief take scheduled messages or route the envelopes like any SysEx message
+ *
+ * @param enabled true to take scheduled messages
+ * @note the USB stack only reports SOFs while enabled; see midi_sched_sof()
+ */
+void midi_sched_set_enabled(bool enabled);
+
+/**
+ * @brief check if scheduled messages are taken
+ *
+ * @return true if they are
+ */
+bool midi_sched_is_enabled(void);
+
+/**
+ * @brief check if the device follows the USB frame clock
+ *
+ * @return true if presentation times can be kept
+ */
+bool midi_sched_is_locked(void);
+
+/**
+ * @brief record a SOF; call from tud_sof_cb()
+ *
+ * @param frame the USB frame number of the SOF (11 bits)
+ * @param time_us the time the SOF was reported
+ * @note call from one core only
+ */
+void midi_sched_sof(uint32_t frame, uint64_t time_us);
+
+/**
+ * @brief take a packet received on a USB MIDI OUT cable if it belongs to a
+ * scheduled message envelope
+ *
+ * @param envelope the envelope state of the cable
+ * @param packet the packet
+ * @param message receives the message when the envelope ends
+ * @param sched_time receives the presentation time when the envelope ends
+ * @return what the packet was
+ * @note a packet of an envelope that turns out to be malformed is dropped
+ */
+midi_sched_packet_t midi_sched_take_packet(midi_sched_envelope_t* envelope, const midi_packet_t* packet,
+                                           midi_packet_t* message, uint32_t* sched_time);
+
+/**
+ * @brief send a message to DIN MIDI OUT ports at its presentation time
+ *
+ * @param dest_mask the DIN MIDI OUT destination bits (see MIDI_ROUTER_DEST_BIT())
+ * @param message the message
+ * @param sched_time the presentation time from the envelope
+ * @return false if the message was dropped
+ * @note call on the core the alarm IRQ runs on (see midi_sched_init())
+ */
+bool midi_sched_submit(uint32_t dest_mask, const midi_packet_t* message, uint32_t sched_time);
+
+/**
+ * @brief keep the alarm IRQ handler out of the encoders and the TX buffers of
+ * DIN MIDI OUT A-D, or let it in again; only the alarm IRQ is masked, and a
+ * pending alarm runs as soon as it is let in
+ *
+ * @param blocked true to keep it out
+ * @note call on the core the alarm IRQ runs on (see midi_sched_init()); the
+ * calls do not nest
+ */
+void midi_sched_block_alarm(bool blocked);
+
+/**
+ * @brief check if scheduled messages wait for the end of a SysEx message on a
+ * DIN MIDI OUT port
+ *
+ * @param port the DIN MIDI OUT port
+ * @return true if they do
+ */
+bool midi_sched_is_held(uint8_t port);
+
+/**
+ * @brief send the scheduled messages held for a DIN MIDI OUT port once its
+ * SysEx message has ended; call from the routing loop after it wrote to the
+ * port's TX buffer
+ *
+ * @param port the DIN MIDI OUT port
+ */
+void midi_sched_send_held(uint8_t port);
+
+/**
+ * @brief record when a scheduled message went into a PIO TX FIFO; call from
+ * the TX mark callback for the bytes tagged MIDI_SCHED_TAG
+ *
+ * @param port the DIN MIDI OUT port
+ * @param handoff_us the time from the message being due to its last byte going into the FIFO
+ */
+void midi_sched_record_handoff(uint8_t port, uint32_t handoff_us);
+
+/**
+ * @brief get the number of messages waiting for their time or for the end of
+ * a SysEx message
+ *
+ * @return the number of messages
+ */
+uint32_t midi_sched_get_pending(void);
+
+/**
+ * @brief get the timing statistics
+ *
+ * @param stats receives the statistics
+ */
+void midi_sched_get_stats(midi_sched_stats_t* stats);
+
+/**
+ * @brief clear the timing statistics
+ *
+ * @note a sample recorded while resetting may survive the reset
+ */
+void midi_sched_reset_stats(void);
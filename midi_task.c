@@ -0,0 +1,909 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 rppicomidi
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "hardware/timer.h"
+#include "tusb.h"
+#include "midi_task.h"
+#include "midi_device_multistream.h"
+#include "midi_merge.h"
+#include "midi_encoder.h"
+#include "midi_latency.h"
+#include "midi_clock.h"
+#include "midi_sched.h"
+#include "hardware/sync.h"
+#if MIDISTRIBUTOR_DUAL_CORE
+#include "pico/multicore.h"
+#include "pico/time.h"
+#include "spsc_ring_lib.h"
+#endif
+
+static void* midi_uarts[NUM_PHY_MIDI_PORT_PAIRS]; // MIDI IN A-D and MIDI OUT A-D
+static midi_merge_t midi_out_mergers[NUM_PHY_MIDI_PORT_PAIRS]; // merge all sources routed to MIDI OUT A-D
+static midi_encoder_t midi_out_encoders[NUM_PHY_MIDI_PORT_PAIRS]; // running status encoding for MIDI OUT A-D
+static midi_parser_t midi_in_parsers[NUM_PHY_MIDI_PORT_PAIRS]; // build messages from MIDI IN A-D
+
+static usb_midi_stats_t usb_midi_stats;
+
+// Routed realtime messages jump the TX buffer through the realtime lane of the
+// MIDI UART; 0 sends them in the normal stream, for comparing clock jitter
+#ifndef MIDISTRIBUTOR_REALTIME_LANE
+#define MIDISTRIBUTOR_REALTIME_LANE 1
+#endif
+
+// midi_task() runs when the PIO MIDI UART IRQ handlers, the USB stack or the
+// other core signal work, and otherwise only when its wake-up time comes:
+// - without RX IRQs (PIO_MIDI_UART_RX_DMA), to poll the RX buffers
+// - to retry what the USB MIDI endpoints could not take yet
+// - to send the messages a DIN MIDI OUT merger holds at constant latency
+#define MIDI_TASK_RX_DMA_POLL_US 320 // one MIDI byte
+#define MIDI_TASK_RETRY_US 250
+static volatile bool midi_task_signalled = true;
+static uint64_t midi_task_wake_us = UINT64_MAX;
+static bool midi_task_connected = false; // tud_midi_mounted() when midi_task() last ran
+// Messages wait in a merger or a deferral queue for room in a TX buffer, so
+// the TX IRQ handlers making room signal work too
+static volatile bool midi_tx_waiting = false;
+// When the first message a merger holds at constant latency is due
+static uint64_t midi_out_hold_us = UINT64_MAX;
+// A message taken from a merger whose room in the TX buffer the scheduled
+// output alarm IRQ handler took before it could be written; it goes first
+typedef struct {
+    bool valid;
+    midi_packet_t packet;
+    midi_merge_origin_t origin;
+} midi_out_carry_t;
+static midi_out_carry_t midi_out_carry[NUM_PHY_MIDI_PORT_PAIRS];
+
+// Messages received on a USB MIDI OUT cable that wait for room in a DIN MIDI
+// OUT merger. Every cable has its own queue, so a busy port does not hold up
+// the other cables. The queues are linked lists of items from one shared
+// pool; the endpoint is only left unread, and the host sees NAKs, when the
+// queues together hold all USB_OUT_DEFERRED_PACKETS items.
+#define USB_OUT_DEFERRED_PACKETS 128 // at most 255
+#define USB_OUT_DEFERRED_NONE 0xFF
+typedef struct {
+    midi_packet_t packet;
+    uint32_t dest_mask; // destinations the message still has to go to
+    uint32_t time_us;   // when the message was read from the endpoint
+} usb_out_deferred_t;
+typedef struct {
+    uint8_t head; // oldest item or USB_OUT_DEFERRED_NONE
+    uint8_t tail; // newest item while head is not USB_OUT_DEFERRED_NONE
+} usb_out_deferred_queue_t;
+static usb_out_deferred_t usb_out_deferred_items[USB_OUT_DEFERRED_PACKETS];
+static uint8_t usb_out_deferred_next[USB_OUT_DEFERRED_PACKETS]; // next item of the queue or the free list
+static uint8_t usb_out_deferred_free;                            // first unused item
+static usb_out_deferred_queue_t usb_out_deferred[MIDI_ROUTER_NUM_USB_OUT_CABLES];
+static uint32_t usb_out_ndeferred = 0; // messages in all queues
+
+// Scheduled message envelopes being received on each USB MIDI OUT cable
+static midi_sched_envelope_t usb_out_envelopes[MIDI_ROUTER_NUM_USB_OUT_CABLES];
+
+// Messages waiting for room in the USB MIDI IN endpoint FIFO
+#define USB_IN_PACKET_BUFFER_LENGTH 32
+static midi_packet_t usb_in_packets[USB_IN_PACKET_BUFFER_LENGTH];
+static uint8_t usb_in_npackets = 0;
+
+#if MIDISTRIBUTOR_DUAL_CORE
+// Messages passed between the cores as USB MIDI event packets:
+// USB MIDI OUT from core0 to core1 with the time they were read from the
+// endpoint and USB MIDI IN from core1 to core0
+#define CORE_QUEUE_NUM_PACKETS 64
+typedef struct {
+    midi_packet_t packet;
+    uint32_t time_us;
+} usb_out_queue_item_t;
+static uint8_t usb_out_queue_buf[CORE_QUEUE_NUM_PACKETS * sizeof(usb_out_queue_item_t)];
+static uint8_t usb_in_queue_buf[CORE_QUEUE_NUM_PACKETS * sizeof(midi_packet_t)];
+static spsc_ring_t usb_out_queue;
+static spsc_ring_t usb_in_queue;
+static volatile bool usb_connected = false;
+// The work signal of the core1 routing loop
+static volatile bool core1_signalled = true;
+
+// Tell the routing loop on core1 there is work; __sev() wakes it from __wfe()
+static inline void signal_core1(void)
+{
+    core1_signalled = true;
+    __sev();
+}
+
+// Tell midi_task() on core0 there is work
+static inline void signal_core0(void)
+{
+    midi_task_signalled = true;
+    __sev();
+}
+#endif
+
+static const size_t MIDI_TX_GPIO[NUM_PHY_MIDI_PORT_PAIRS]   = { 24, 25, 22, 23};
+static const size_t MIDI_RX_GPIO[NUM_PHY_MIDI_PORT_PAIRS]   = { 11, 10,  9,  8};
+// RX and TX ring buffer lengths in bytes; powers of 2 that together must fit
+// in PIO_MIDI_UART_BUFFER_POOL_SIZE (MIDISTRIBUTOR_UART_BUFFER_POOL_SIZE). With
+// PIO_MIDI_UART_RX_DMA, RX lengths above PIO_MIDI_UART_BUFFER_POOL_ALIGN leave
+// alignment gaps in the pool.
+static const uint16_t MIDI_RX_BUFFER_LENGTH[NUM_PHY_MIDI_PORT_PAIRS] = { 128, 128, 128, 128};
+static const uint16_t MIDI_TX_BUFFER_LENGTH[NUM_PHY_MIDI_PORT_PAIRS] = { 128, 128, 128, 128};
+
+typedef struct {
+    bool connected;
+    uint8_t src;
+    uint32_t now_us; // when the message entered the device
+} route_context_t;
+
+// Queue a message for the USB MIDI IN endpoint on the given cable; route is
+// NULL for a message the device made itself
+static void queue_usb_in_packet(uint8_t cable, const midi_packet_t* packet, const route_context_t* route)
+{
+    midi_packet_t queued = *packet;
+    queued.bytes[0] = (uint8_t)((cable << 4) | MIDI_PACKET_CIN(packet));
+#if MIDISTRIBUTOR_DUAL_CORE
+    // core0 owns the USB stack; hand the message over
+    if (!spsc_ring_push_all(&usb_in_queue, queued.bytes, sizeof(queued.bytes))) {
+        TU_LOG1("Warning: Dropped a message sending to USB MIDI IN cable %u\r\n", cable);
+        ++usb_midi_stats.in_dropped;
+        return;
+    }
+    signal_core0();
+    uint32_t nqueued = spsc_ring_get_num_bytes(&usb_in_queue) / sizeof(midi_packet_t);
+    if (nqueued > usb_midi_stats.in_queue_max) {
+        usb_midi_stats.in_queue_max = nqueued;
+    }
+#else
+    if (usb_in_npackets >= USB_IN_PACKET_BUFFER_LENGTH) {
+        TU_LOG1("Warning: Dropped a message sending to USB MIDI IN cable %u\r\n", cable);
+        ++usb_midi_stats.in_dropped;
+        return;
+    }
+    usb_in_packets[usb_in_npackets++] = queued;
+    if (usb_in_npackets > usb_midi_stats.in_staged_max) {
+        usb_midi_stats.in_staged_max = usb_in_npackets;
+    }
+#endif
+    if (route) {
+        midi_latency_record(route->src, MIDI_ROUTER_DEST_USB_IN(cable), time_us_32() - route->now_us);
+    }
+}
+
+// Called from the PIO MIDI UART TX IRQ handler when the last byte of a
+// message left the TX buffer of a MIDI OUT port
+static void on_midi_out_message_sent(void* context, uint16_t src, uint32_t time_us, uint32_t now_us)
+{
+    uint8_t port = (uint8_t)(uintptr_t)context;
+    if (src == MIDI_CLOCK_TAG || src == MIDI_CLOCK_TRANSPORT_TAG) {
+        midi_clock_record_handoff(port, src, time_us, now_us);
+        return;
+    }
+    if (src == MIDI_SCHED_TAG) {
+        midi_sched_record_handoff(port, now_us - time_us);
+        return;
+    }
+    midi_latency_record((uint8_t)src, MIDI_ROUTER_DEST_DIN_OUT(port), now_us - time_us);
+}
+
+// Tell the routing loop there is work; call on the core that routes
+static inline void signal_routing(void)
+{
+#if MIDISTRIBUTOR_DUAL_CORE
+    core1_signalled = true;
+#else
+    midi_task_signalled = true;
+#endif
+}
+
+// Called from the PIO MIDI UART IRQ handlers, on the core that routes
+static void on_midi_uart_event(void* context, uint32_t events)
+{
+    (void)context;
+    if ((events & PIO_MIDI_UART_EVENT_RX) || midi_tx_waiting) {
+        signal_routing();
+    }
+}
+
+// Called from the clock alarm IRQ handler, on the core that routes
+static void on_midi_clock_usb(void* context)
+{
+    (void)context;
+    signal_routing();
+}
+
+// Invoked by the USB stack when the USB MIDI OUT endpoint received data
+void tud_midi_rx_cb(uint8_t itf)
+{
+    (void)itf;
+    midi_task_signalled = true;
+}
+
+// Invoked by the USB stack for every SOF while scheduled output is enabled
+void tud_sof_cb(uint32_t frame_count)
+{
+    midi_sched_sof(frame_count, time_us_64());
+}
+
+// Deliver a routed message to all of its destinations. If wait is true, the
+// message is not dropped at a DIN MIDI OUT port whose merger queue is full;
+// return the destinations the message still has to go to.
+static uint32_t deliver_midi_packet(uint32_t dest_mask, const midi_packet_t* packet, const route_context_t* route,
+                                    bool wait)
+{
+    uint32_t waiting = 0;
+    while (dest_mask) {
+        uint8_t dest = (uint8_t)__builtin_ctz(dest_mask);
+        dest_mask &= dest_mask - 1;
+        if (dest < MIDI_ROUTER_NUM_DIN_PORTS) {
+            if (wait && !midi_merge_can_write_packet(midi_out_mergers + dest, route->src, packet, route->now_us)) {
+                waiting |= MIDI_ROUTER_DEST_BIT(dest);
+            }
+            else if (!midi_merge_write_packet(midi_out_mergers + dest, route->src, packet, route->now_us)) {
+                TU_LOG1("Warning: Dropped a message sending to MIDI Out Port %c\r\n", 'A' + dest);
+            }
+        }
+        else if (route->connected) {
+            queue_usb_in_packet(dest - MIDI_ROUTER_NUM_DIN_PORTS, packet, route);
+        }
+    }
+    return waiting;
+}
+
+// While the clock runs, it is the only source of clock and transport
+// messages for its destinations, so those from any source do not go there
+// as routed; a second clock would double the tempo. The messages of the
+// source the clock follows are passed to the clock. Return the destinations
+// left for the message.
+static uint32_t take_clock_sync(uint8_t src, const midi_packet_t* packet, uint32_t dest_mask, uint32_t time_us)
+{
+    if (!midi_clock_is_enabled() || !midi_clock_is_sync_message(packet)) {
+        return dest_mask;
+    }
+    if (src == midi_clock_get_sync_source()) {
+        midi_clock_sync_input(packet->bytes[1], time_us);
+    }
+    return dest_mask & ~midi_clock_get_dest_mask();
+}
+
+static void poll_midi_uarts_rx(bool connected)
+{
+    uint8_t rx[48];
+    uint32_t rx_us[48];
+    midi_packet_t packets[2];
+    route_context_t route = {.connected = connected};
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        uint16_t nread = pio_midi_uart_poll_rx_buffer_timestamped(midi_uarts[port], rx, sizeof(rx), rx_us);
+        route.src = MIDI_ROUTER_SRC_DIN_IN(port);
+        for (uint16_t idx = 0; idx < nread; idx++) {
+            // build complete messages as the bytes arrive and route each one once;
+            // a message is as old as the time its first byte arrived
+            route.now_us = rx_us[idx];
+            uint8_t npackets = midi_parser_parse(midi_in_parsers + port, rx[idx], packets);
+            for (uint8_t n = 0; n < npackets; n++) {
+                uint32_t dest_mask = midi_router_route_packet(route.src, packets + n);
+                dest_mask = take_clock_sync(route.src, packets + n, dest_mask, route.now_us);
+                if (dest_mask) {
+                    // DIN MIDI IN cannot be held back; drop what does not fit
+                    deliver_midi_packet(dest_mask, packets + n, &route, false);
+                }
+            }
+        }
+    }
+}
+
+// Queue the clock messages for the USB MIDI IN cables
+static void poll_midi_clock_usb(bool connected)
+{
+    midi_packet_t packet;
+    while (midi_clock_read_usb_packet(&packet)) {
+        if (connected) {
+            queue_usb_in_packet(MIDI_PACKET_CABLE(&packet), &packet, NULL);
+        }
+    }
+}
+
+// Send the queued messages to the USB MIDI IN endpoint; keep what does not fit for later
+static void flush_usb_in_packets(bool connected)
+{
+    if (!connected) {
+        usb_in_npackets = 0;
+        return;
+    }
+    uint8_t nwritten = 0;
+    while (nwritten < usb_in_npackets) {
+        if (!tud_midi_packet_write(usb_in_packets[nwritten].bytes)) {
+            ++usb_midi_stats.in_refused;
+            break;
+        }
+        ++nwritten;
+    }
+    usb_midi_stats.in_packets += nwritten;
+    if (nwritten > 0 && nwritten < usb_in_npackets) {
+        memmove(usb_in_packets, usb_in_packets + nwritten, (usb_in_npackets - nwritten) * sizeof(midi_packet_t));
+    }
+    usb_in_npackets -= nwritten;
+}
+
+// Send a scheduled message to its DIN MIDI OUT ports at its presentation
+// time and to its USB MIDI IN cables at once
+static void route_scheduled_packet(const midi_packet_t* message, uint32_t sched_time, const route_context_t* route)
+{
+    uint32_t dest_mask = midi_router_route_packet(route->src, message);
+    if (!midi_sched_submit(dest_mask & MIDI_ROUTER_DIN_OUT_MASK, message, sched_time)) {
+        TU_LOG1("Warning: Dropped a scheduled message received on USB MIDI OUT cable %u\r\n",
+                route->src - MIDI_ROUTER_NUM_DIN_PORTS);
+    }
+    deliver_midi_packet(dest_mask & MIDI_ROUTER_USB_IN_MASK, message, route, false);
+}
+
+// Route one message received on the USB MIDI OUT endpoint
+static void route_usb_packet(const midi_packet_t* packet, route_context_t* route)
+{
+    uint8_t cable_num = MIDI_PACKET_CABLE(packet);
+    if (cable_num >= MIDI_ROUTER_NUM_USB_OUT_CABLES) {
+        TU_LOG1("Received a MIDI packet on cable %u", cable_num);
+        return;
+    }
+    route->src = MIDI_ROUTER_SRC_USB_OUT(cable_num);
+    midi_packet_t message;
+    uint32_t sched_time;
+    switch (midi_sched_take_packet(usb_out_envelopes + cable_num, packet, &message, &sched_time)) {
+    case MIDI_SCHED_PACKET_TAKEN:
+        return;
+    case MIDI_SCHED_PACKET_MESSAGE:
+        route_scheduled_packet(&message, sched_time, route);
+        return;
+    default:
+        break;
+    }
+    uint32_t dest_mask = midi_router_route_packet(route->src, packet);
+    dest_mask = take_clock_sync(route->src, packet, dest_mask, route->now_us);
+    usb_out_deferred_queue_t* queue = usb_out_deferred + cable_num;
+    if (dest_mask && queue->head == USB_OUT_DEFERRED_NONE) {
+        dest_mask = deliver_midi_packet(dest_mask, packet, route, true);
+    }
+    if (dest_mask) {
+        // wait behind the earlier messages of the cable; the endpoint is only
+        // read while the pool has an unused item for every packet read
+        uint8_t idx = usb_out_deferred_free;
+        usb_out_deferred_free = usb_out_deferred_next[idx];
+        usb_out_deferred_next[idx] = USB_OUT_DEFERRED_NONE;
+        if (queue->head == USB_OUT_DEFERRED_NONE) {
+            queue->head = idx;
+        }
+        else {
+            usb_out_deferred_next[queue->tail] = idx;
+        }
+        queue->tail = idx;
+        usb_out_deferred_t* item = usb_out_deferred_items + idx;
+        item->packet = *packet;
+        item->dest_mask = dest_mask;
+        item->time_us = route->now_us;
+        ++usb_midi_stats.out_deferred;
+        if (++usb_out_ndeferred > usb_midi_stats.out_deferred_max) {
+            usb_midi_stats.out_deferred_max = usb_out_ndeferred;
+        }
+    }
+}
+
+// Retry the deferred messages of every USB MIDI OUT cable in the order received
+static void poll_usb_out_deferred(bool connected)
+{
+    route_context_t route = {.connected = connected};
+    for (uint8_t cable = 0; cable < MIDI_ROUTER_NUM_USB_OUT_CABLES; cable++) {
+        usb_out_deferred_queue_t* queue = usb_out_deferred + cable;
+        route.src = MIDI_ROUTER_SRC_USB_OUT(cable);
+        while (queue->head != USB_OUT_DEFERRED_NONE) {
+            uint8_t idx = queue->head;
+            usb_out_deferred_t* item = usb_out_deferred_items + idx;
+            route.now_us = item->time_us;
+            item->dest_mask = deliver_midi_packet(item->dest_mask, &item->packet, &route, true);
+            if (item->dest_mask) {
+                break; // still no room at a destination
+            }
+            queue->head = usb_out_deferred_next[idx];
+            usb_out_deferred_next[idx] = usb_out_deferred_free;
+            usb_out_deferred_free = idx;
+            --usb_out_ndeferred;
+        }
+    }
+}
+
+// Take one packet read from the USB MIDI OUT endpoint
+static void dispatch_usb_packet(uint8_t cable_num, const uint8_t rx_packet[4], void* context)
+{
+    (void)cable_num; // the cable number is in the packet
+#if MIDISTRIBUTOR_DUAL_CORE
+    // core1 routes it
+    usb_out_queue_item_t item;
+    memcpy(item.packet.bytes, rx_packet, sizeof(item.packet.bytes));
+    item.time_us = ((const route_context_t*)context)->now_us;
+    ++usb_midi_stats.out_packets;
+    if (!spsc_ring_push_all(&usb_out_queue, (const uint8_t*)&item, sizeof(item))) {
+        TU_LOG1("Warning: Dropped a message received on USB MIDI OUT cable %u\r\n", cable_num);
+        ++usb_midi_stats.out_dropped;
+        return;
+    }
+    signal_core1();
+    uint32_t nqueued = spsc_ring_get_num_bytes(&usb_out_queue) / sizeof(usb_out_queue_item_t);
+    if (nqueued > usb_midi_stats.out_queue_max) {
+        usb_midi_stats.out_queue_max = nqueued;
+    }
+#else
+    midi_packet_t packet;
+    memcpy(packet.bytes, rx_packet, sizeof(packet.bytes));
+    ++usb_midi_stats.out_packets;
+    route_usb_packet(&packet, (route_context_t*)context);
+#endif
+}
+
+static void poll_usb_rx(bool connected)
+{
+    // device must be attached and have the endpoint ready to receive a message
+    if (!connected) {
+        return;
+    }
+    // drain the OUT endpoint FIFO in one pass; the messages are staged
+    // per destination and sent once per midi_task() call
+    uint32_t fifo_level = tud_midi_n_available(0, 0);
+    if (fifo_level > usb_midi_stats.out_fifo_max) {
+        usb_midi_stats.out_fifo_max = fifo_level;
+    }
+    // read only as many messages as can wait if their DIN MIDI OUT ports are busy
+#if MIDISTRIBUTOR_DUAL_CORE
+    uint32_t max_packets = spsc_ring_get_free_space(&usb_out_queue) / sizeof(usb_out_queue_item_t);
+#else
+    uint32_t max_packets = USB_OUT_DEFERRED_PACKETS - usb_out_ndeferred;
+    if (max_packets == 0 && fifo_level > 0) {
+        ++usb_midi_stats.out_stalled;
+    }
+#endif
+    route_context_t route = {.connected = connected, .now_us = time_us_32()};
+    tud_midi_n_demux_dispatch(0, max_packets, dispatch_usb_packet, &route);
+}
+
+// Write a realtime message to the realtime lane of a MIDI OUT port. The clock
+// alarm IRQ handler writes to the lanes too, so only that IRQ is kept out.
+static bool write_realtime(uint8_t port, const midi_packet_t* packet, const midi_merge_origin_t* origin)
+{
+    midi_clock_block_alarm(true);
+    bool written = pio_midi_uart_write_realtime(midi_uarts[port], packet->bytes[1], origin->src, origin->time_us);
+    midi_clock_block_alarm(false);
+    return written;
+}
+
+// Encode a message and write it to the TX buffer of a MIDI OUT port; return
+// false if the TX buffer has no room for it. The scheduled output alarm IRQ
+// handler writes whole messages to the TX buffer with the same encoder, so
+// only that IRQ is kept out, and only for this message.
+static bool write_message(uint8_t port, const midi_packet_t* packet, const midi_merge_origin_t* origin)
+{
+    midi_sched_block_alarm(true);
+    bool written = pio_midi_uart_get_tx_buffer_space(midi_uarts[port]) >= 3;
+    if (written) {
+        uint8_t tx[3];
+        uint8_t nbytes = midi_encoder_encode(midi_out_encoders + port, packet, tx);
+        if (nbytes > 0) {
+            // measure the latency when the last byte of the message leaves the TX buffer
+            pio_midi_uart_mark_tx_buffer(midi_uarts[port], nbytes, origin->src, origin->time_us);
+            pio_midi_uart_write_tx_buffer(midi_uarts[port], tx, nbytes);
+        }
+    }
+    midi_sched_block_alarm(false);
+    return written;
+}
+
+// Move complete messages from the mergers to the MIDI OUT TX buffers; return
+// true if a merger may still hold messages that are due
+static bool merge_serial_port_tx_buffers()
+{
+    bool waiting = false;
+    uint64_t now_us_64 = time_us_64();
+    uint32_t now_us = (uint32_t)now_us_64;
+    midi_out_hold_us = UINT64_MAX;
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        midi_out_carry_t* carry = midi_out_carry + port;
+        bool full = false;
+        bool held_back = false;
+        for (;;) {
+            if (!carry->valid) {
+                // leave the messages in the merger, where they still coalesce,
+                // while the TX buffer has no room
+                if (pio_midi_uart_get_tx_buffer_space(midi_uarts[port]) < 3) {
+                    full = true;
+                    break;
+                }
+                if (!midi_merge_pop(midi_out_mergers + port, now_us, &carry->packet, &carry->origin)) {
+                    break;
+                }
+                carry->valid = true;
+            }
+            // realtime messages jump the bytes already waiting in the TX buffer
+            if (!(MIDISTRIBUTOR_REALTIME_LANE && midi_packet_is_realtime(&carry->packet) &&
+                  write_realtime(port, &carry->packet, &carry->origin)) &&
+                !write_message(port, &carry->packet, &carry->origin)) {
+                full = true;
+                break;
+            }
+            carry->valid = false;
+            // scheduled messages held back by a SysEx message go right after its end
+            if (midi_sched_is_held(port) && !midi_encoder_in_sysex(midi_out_encoders + port)) {
+                held_back = true;
+                break;
+            }
+        }
+        midi_sched_send_held(port);
+        // the loop stopped for lack of room rather than of messages
+        waiting |= held_back || full;
+        uint32_t wait_us;
+        if (midi_merge_get_wait(midi_out_mergers + port, now_us, &wait_us) && wait_us > 0 &&
+            now_us_64 + wait_us < midi_out_hold_us) {
+            midi_out_hold_us = now_us_64 + wait_us;
+        }
+    }
+    return waiting;
+}
+
+static void drain_serial_port_tx_buffers()
+{
+    uint8_t cable;
+    for (cable = 0; cable < NUM_PHY_MIDI_PORT_PAIRS; cable++) {
+#if PIO_MIDI_UART_TX_DMA
+        // the clock and scheduled output alarm IRQ handlers start TX DMA
+        // transfers too; the DMA IRQ handler only does while one is busy
+        midi_clock_block_alarm(true);
+        midi_sched_block_alarm(true);
+        pio_midi_uart_drain_tx_buffer(midi_uarts[cable]);
+        midi_sched_block_alarm(false);
+        midi_clock_block_alarm(false);
+#else
+        // only enables the TX IRQ, which is atomic
+        pio_midi_uart_drain_tx_buffer(midi_uarts[cable]);
+#endif
+    }
+}
+
+// Decide when midi_task() has to run again if nothing signals work
+static void set_midi_task_wake_time(bool connected)
+{
+    uint64_t now_us = time_us_64();
+    midi_task_wake_us = UINT64_MAX;
+#if PIO_MIDI_UART_RX_DMA && !MIDISTRIBUTOR_DUAL_CORE
+    midi_task_wake_us = now_us + MIDI_TASK_RX_DMA_POLL_US;
+#endif
+    // the USB MIDI IN endpoint FIFO was full or the USB MIDI OUT endpoint FIFO
+    // was not read to the end; neither signals when that changes
+    if (usb_in_npackets > 0 || (connected && tud_midi_n_available(0, 0) > 0)) {
+        if (now_us + MIDI_TASK_RETRY_US < midi_task_wake_us) {
+            midi_task_wake_us = now_us + MIDI_TASK_RETRY_US;
+        }
+    }
+#if !MIDISTRIBUTOR_DUAL_CORE
+    if (midi_out_hold_us < midi_task_wake_us) {
+        midi_task_wake_us = midi_out_hold_us;
+    }
+#endif
+}
+
+static void create_midi_uarts(void)
+{
+  for(size_t n = 0; n < NUM_PHY_MIDI_PORT_PAIRS; n++) {
+    midi_uarts[n] = pio_midi_uart_create_sized(MIDI_TX_GPIO[n], MIDI_RX_GPIO[n],
+                                               MIDI_RX_BUFFER_LENGTH[n], MIDI_TX_BUFFER_LENGTH[n]);
+    if(midi_uarts[n] == 0) {
+        printf("Error creating UART %zu\r\n", n);
+    }
+    else {
+        pio_midi_uart_set_tx_mark_cb(midi_uarts[n], on_midi_out_message_sent, (void*)(uintptr_t)n);
+        pio_midi_uart_set_event_cb(midi_uarts[n], on_midi_uart_event, NULL);
+    }
+  }
+  // the clock writes to the MIDI UARTs from its alarm IRQ, so it runs on this core too
+  midi_clock_init(midi_uarts, on_midi_clock_usb, NULL);
+  // so does the scheduled output, which shares the running status encoders
+  midi_sched_init(midi_uarts, midi_out_encoders);
+}
+
+#if MIDISTRIBUTOR_DUAL_CORE
+// Route the messages core0 received on the USB MIDI OUT endpoint
+static void poll_usb_out_queue(bool connected)
+{
+    usb_out_queue_item_t item;
+    route_context_t route = {.connected = connected};
+    // stop taking messages while the deferral queues are full; once this
+    // queue is full too, core0 stops reading the endpoint
+    while (usb_out_ndeferred < USB_OUT_DEFERRED_PACKETS &&
+           spsc_ring_pop(&usb_out_queue, (uint8_t*)&item, sizeof(item)) == sizeof(item)) {
+        route.now_us = item.time_us;
+        route_usb_packet(&item.packet, &route);
+    }
+    if (usb_out_ndeferred == USB_OUT_DEFERRED_PACKETS && !spsc_ring_is_empty(&usb_out_queue)) {
+        ++usb_midi_stats.out_stalled;
+    }
+}
+
+// Stage the messages core1 routed to the USB MIDI IN endpoint
+static void poll_usb_in_queue(void)
+{
+    while (usb_in_npackets < USB_IN_PACKET_BUFFER_LENGTH &&
+           spsc_ring_pop(&usb_in_queue, usb_in_packets[usb_in_npackets].bytes, sizeof(midi_packet_t)) == sizeof(midi_packet_t)) {
+        ++usb_in_npackets;
+    }
+    if (usb_in_npackets > usb_midi_stats.in_staged_max) {
+        usb_midi_stats.in_staged_max = usb_in_npackets;
+    }
+}
+
+// core1 owns the PIO MIDI UARTs, the DIN-side parsing, the routing and the mergers
+static void core1_main(void)
+{
+    // the PIO IRQ handlers run on the core that creates the MIDI UARTs
+    create_midi_uarts();
+    while (1) {
+        core1_signalled = false;
+        midi_tx_waiting = true; // until this pass knows better
+        bool connected = usb_connected;
+        poll_midi_uarts_rx(connected);
+        poll_usb_out_deferred(connected);
+        poll_usb_out_queue(connected);
+        poll_midi_clock_usb(connected);
+        midi_router_sync();
+        bool waiting = merge_serial_port_tx_buffers();
+        drain_serial_port_tx_buffers();
+        midi_tx_waiting = waiting || usb_out_ndeferred > 0;
+#if !PIO_MIDI_UART_RX_DMA
+        // An IRQ handler that signalled work after the check has set the
+        // event register and core0 signals with __sev(), so __wfe() only
+        // sleeps while there is nothing to do. With RX DMA, core1 keeps
+        // polling the RX buffers. A message a merger holds at constant
+        // latency signals nothing when it is due, so sleep until then at most.
+        if (!core1_signalled) {
+            if (midi_out_hold_us != UINT64_MAX) {
+                best_effort_wfe_or_timeout(from_us_since_boot(midi_out_hold_us));
+            }
+            else {
+                __wfe();
+            }
+        }
+#endif
+    }
+}
+
+// core0 only moves messages between the USB MIDI endpoints and core1
+void midi_task(void)
+{
+    midi_task_signalled = false;
+    bool connected = tud_midi_mounted();
+    midi_task_connected = connected;
+    if (connected != usb_connected) {
+        usb_connected = connected;
+        signal_core1();
+    }
+    poll_usb_rx(connected);
+    poll_usb_in_queue();
+    flush_usb_in_packets(connected);
+    set_midi_task_wake_time(connected);
+}
+#else
+void midi_task(void)
+{
+    midi_task_signalled = false;
+    midi_tx_waiting = true; // until this pass knows better
+    bool connected = tud_midi_mounted();
+    midi_task_connected = connected;
+    poll_midi_uarts_rx(connected);
+    poll_usb_out_deferred(connected);
+    poll_usb_rx(connected);
+    poll_midi_clock_usb(connected);
+    midi_router_sync();
+    flush_usb_in_packets(connected);
+    bool waiting = merge_serial_port_tx_buffers();
+    drain_serial_port_tx_buffers();
+    midi_tx_waiting = waiting || usb_out_ndeferred > 0;
+    set_midi_task_wake_time(connected);
+}
+#endif
+
+bool midi_task_is_ready(void)
+{
+    return midi_task_signalled || tud_midi_mounted() != midi_task_connected || time_us_64() >= midi_task_wake_us;
+}
+
+uint64_t midi_task_get_wake_us(void)
+{
+    return midi_task_wake_us;
+}
+
+void midi_task_init(void)
+{
+    midi_router_init();
+    midi_latency_reset();
+    for (uint8_t idx = 0; idx < USB_OUT_DEFERRED_PACKETS; idx++) {
+        usb_out_deferred_next[idx] = idx + 1 < USB_OUT_DEFERRED_PACKETS ? idx + 1 : USB_OUT_DEFERRED_NONE;
+    }
+    usb_out_deferred_free = 0;
+    usb_out_ndeferred = 0;
+    for (uint8_t cable = 0; cable < MIDI_ROUTER_NUM_USB_OUT_CABLES; cable++) {
+        usb_out_deferred[cable].head = USB_OUT_DEFERRED_NONE;
+    }
+    memset(midi_out_carry, 0, sizeof(midi_out_carry));
+    for (uint8_t n = 0; n < NUM_PHY_MIDI_PORT_PAIRS; n++) {
+        midi_merge_init(midi_out_mergers + n);
+        midi_encoder_init(midi_out_encoders + n, true, false);
+        midi_parser_init(midi_in_parsers + n);
+    }
+#if MIDISTRIBUTOR_DUAL_CORE
+    spsc_ring_init(&usb_out_queue, usb_out_queue_buf, sizeof(usb_out_queue_buf));
+    spsc_ring_init(&usb_in_queue, usb_in_queue_buf, sizeof(usb_in_queue_buf));
+    // Create the MIDI UARTs on core1
+    multicore_launch_core1(core1_main);
+#else
+    // Create the MIDI UARTs
+    create_midi_uarts();
+#endif
+}
+
+bool midi_task_get_din_stats(uint8_t port, din_midi_stats_t* stats)
+{
+    if (port >= NUM_PHY_MIDI_PORT_PAIRS || midi_uarts[port] == NULL) {
+        return false;
+    }
+    pio_midi_uart_get_rx_stats(midi_uarts[port], &stats->rx);
+    pio_midi_uart_get_tx_stats(midi_uarts[port], &stats->tx);
+    stats->parse_dropped = midi_in_parsers[port].dropped;
+    stats->merge_dropped = 0;
+    stats->merge_coalesced = 0;
+    stats->merge_sysex_cut = 0;
+    stats->merge_max = 0;
+    for (uint8_t src = 0; src < MIDI_ROUTER_NUM_SOURCES; src++) {
+        midi_merge_stats_t merge_stats;
+        midi_merge_get_stats(midi_out_mergers + port, src, &merge_stats);
+        stats->merge_dropped += merge_stats.dropped;
+        stats->merge_coalesced += merge_stats.coalesced;
+        stats->merge_sysex_cut += merge_stats.sysex_cut;
+        if (merge_stats.max_depth > stats->merge_max) {
+            stats->merge_max = merge_stats.max_depth;
+        }
+    }
+    stats->out_bytes_in = midi_out_encoders[port].bytes_in;
+    stats->out_bytes_saved = midi_out_encoders[port].bytes_saved;
+    return true;
+}
+
+bool midi_task_set_route(uint8_t src, uint32_t dest_mask)
+{
+    if (src >= MIDI_ROUTER_NUM_SOURCES || (dest_mask & ~(uint32_t)(MIDI_ROUTER_DIN_OUT_MASK | MIDI_ROUTER_USB_IN_MASK))) {
+        return false;
+    }
+    midi_router_table_t* table = midi_router_edit();
+    if (table == NULL) {
+        return false;
+    }
+    table->dest_mask[src] = dest_mask;
+    midi_router_commit();
+    return true;
+}
+
+bool midi_task_set_filter(uint8_t src, uint8_t dest, const midi_filter_t* filter)
+{
+    if (src >= MIDI_ROUTER_NUM_SOURCES || dest >= MIDI_ROUTER_NUM_DESTS) {
+        return false;
+    }
+    midi_router_table_t* table = midi_router_edit();
+    if (table == NULL) {
+        return false;
+    }
+    table->filter[src][dest] = *filter;
+    midi_router_commit();
+    return true;
+}
+
+bool midi_task_get_merge_stats(uint8_t port, uint8_t src, midi_merge_stats_t* stats)
+{
+    if (port >= NUM_PHY_MIDI_PORT_PAIRS || src >= MIDI_ROUTER_NUM_SOURCES) {
+        return false;
+    }
+    midi_merge_get_stats(midi_out_mergers + port, src, stats);
+    return true;
+}
+
+bool midi_task_set_merge_weight(uint8_t port, uint8_t src, uint8_t weight)
+{
+    if (port >= NUM_PHY_MIDI_PORT_PAIRS || src >= MIDI_ROUTER_NUM_SOURCES || weight == 0) {
+        return false;
+    }
+    // single stores; the merger may be in use on the other core, where a
+    // turn in progress may still run on the old weight
+    midi_merge_set_weight(midi_out_mergers + port, src, weight);
+    return true;
+}
+
+uint8_t midi_task_get_merge_weight(uint8_t port, uint8_t src)
+{
+    if (port >= NUM_PHY_MIDI_PORT_PAIRS || src >= MIDI_ROUTER_NUM_SOURCES) {
+        return 0;
+    }
+    return midi_out_mergers[port].inputs[src].weight;
+}
+
+bool midi_task_set_out_delay(uint8_t port, uint32_t delay_us)
+{
+    if (port >= NUM_PHY_MIDI_PORT_PAIRS || delay_us > MIDI_TASK_MAX_OUT_DELAY_US) {
+        return false;
+    }
+    // a single store; the merger may be in use on the other core
+    midi_merge_set_delay(midi_out_mergers + port, delay_us);
+#if MIDISTRIBUTOR_DUAL_CORE
+    signal_core1();
+#else
+    midi_task_signalled = true;
+#endif
+    return true;
+}
+
+uint32_t midi_task_get_out_delay(uint8_t port)
+{
+    return port < NUM_PHY_MIDI_PORT_PAIRS ? midi_out_mergers[port].delay_us : 0;
+}
+
+bool midi_task_set_out_encoding(uint8_t port, bool running_status, bool note_off_as_note_on)
+{
+    if (port >= NUM_PHY_MIDI_PORT_PAIRS) {
+        return false;
+    }
+    // single stores; the encoder may be in use on the other core or in the
+    // scheduled output alarm IRQ, and the next message it encodes follows them
+    midi_encoder_set_options(midi_out_encoders + port, running_status, note_off_as_note_on);
+    return true;
+}
+
+bool midi_task_get_out_encoding(uint8_t port, bool* running_status, bool* note_off_as_note_on)
+{
+    if (port >= NUM_PHY_MIDI_PORT_PAIRS) {
+        return false;
+    }
+    *running_status = midi_out_encoders[port].running_status_enabled;
+    *note_off_as_note_on = midi_out_encoders[port].note_off_as_note_on;
+    return true;
+}
+
+void midi_task_get_usb_stats(usb_midi_stats_t* stats)
+{
+    *stats = usb_midi_stats;
+}
+
+void midi_task_reset_stats(void)
+{
+    for (uint8_t port = 0; port < NUM_PHY_MIDI_PORT_PAIRS; port++) {
+        if (midi_uarts[port] != NULL) {
+            pio_midi_uart_reset_rx_stats(midi_uarts[port]);
+            pio_midi_uart_reset_tx_stats(midi_uarts[port]);
+        }
+        midi_merge_reset_stats(midi_out_mergers + port);
+        midi_out_encoders[port].bytes_in = 0;
+        midi_out_encoders[port].bytes_saved = 0;
+        midi_in_parsers[port].dropped = 0;
+    }
+    memset(&usb_midi_stats, 0, sizeof(usb_midi_stats));
+}
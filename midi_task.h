@@ -0,0 +1,249 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 rppicomidi
+ * Copyright (c) 2024 Lena Kryger (lenkaud.io)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "pio_midi_uart_lib.h"
+#include "midi_router.h"
+#include "midi_merge.h"
+
+// The MIDI routing core: moves messages from the 5-pin DIN MIDI IN ports and
+// the USB MIDI Bulk OUT endpoint through the router (see midi_router.h) to
+// the 5-pin DIN MIDI OUT ports and the USB MIDI Bulk IN endpoint. With
+// MIDISTRIBUTOR_DUAL_CORE, midi_task() only moves messages between the USB
+// MIDI endpoints and core1, and core1 does everything else.
+
+// Longest constant latency a DIN MIDI OUT port can be set to. The merger
+// queues hold every message of that time, so a dense stream from a DIN MIDI
+// IN port loses messages (merge_dropped) with a long delay.
+#ifndef MIDI_TASK_MAX_OUT_DELAY_US
+#define MIDI_TASK_MAX_OUT_DELAY_US 100000
+#endif
+
+typedef enum {
+  MIDI_A = 0,
+  MIDI_B = 1,
+  MIDI_C = 2,
+  MIDI_D = 3,
+  NUM_PHY_MIDI_PORT_PAIRS
+} LM_MIDI_PORT;
+
+/**
+ * @struct counters of the USB MIDI paths; each counter is written by one
+ * core only and can be read at any time
+ */
+typedef struct {
+    uint32_t out_packets;      // packets read from the USB MIDI OUT endpoint
+    uint32_t out_dropped;      // of those, packets dropped because the queue to core1 was full
+    uint32_t out_fifo_max;     // most bytes seen waiting in the USB MIDI OUT endpoint FIFO
+    uint32_t out_queue_max;    // most packets waiting in the queue to core1
+    uint32_t out_deferred;     // packets that had to wait for room in a DIN MIDI OUT merger
+    uint32_t out_deferred_max; // most packets waiting for room in the DIN MIDI OUT mergers
+    uint32_t out_stalled;      // passes the endpoint was not read because all deferral room was used
+    uint32_t in_packets;       // packets written to the USB MIDI IN endpoint
+    uint32_t in_dropped;       // packets dropped because the staging buffer or the queue to core0 was full
+    uint32_t in_refused;       // tud_midi_packet_write() calls refused because the endpoint FIFO was full
+    uint32_t in_staged_max;    // most packets waiting for room in the USB MIDI IN endpoint FIFO
+    uint32_t in_queue_max;     // most packets waiting in the queue to core0
+} usb_midi_stats_t;
+
+/**
+ * @struct counters of a 5-pin DIN MIDI port pair
+ */
+typedef struct {
+    pio_midi_uart_rx_stats_t rx; // MIDI IN bytes
+    pio_midi_uart_tx_stats_t tx; // MIDI OUT bytes
+    uint32_t parse_dropped;      // MIDI IN bytes the parser dropped
+    uint32_t merge_dropped;      // messages to MIDI OUT dropped because a merger queue was full
+    uint32_t merge_coalesced;    // messages to MIDI OUT that replaced an older one waiting in a merger queue
+    uint32_t merge_sysex_cut;    // SysEx messages to MIDI OUT a merger ended because their source stalled
+    uint32_t merge_max;          // most messages waiting in one merger queue
+    uint32_t out_bytes_in;       // bytes of the messages to MIDI OUT before encoding
+    uint32_t out_bytes_saved;    // status bytes to MIDI OUT that running status left out
+} din_midi_stats_t;
+
+/**
+ * @brief initialize the router, the mergers and the parsers and create the
+ * PIO MIDI UARTs (on core1 with MIDISTRIBUTOR_DUAL_CORE)
+ */
+void midi_task_init(void);
+
+/**
+ * @brief move the MIDI messages waiting at all sources one step closer to
+ * their destinations; call from the main loop
+ */
+void midi_task(void);
+
+/**
+ * @brief check if midi_task() has work: the PIO MIDI UART IRQ handlers, the
+ * USB stack or the other core signalled some since it last ran, the USB
+ * connection changed or its wake-up time passed
+ *
+ * @return true if the main loop should call midi_task()
+ */
+bool midi_task_is_ready(void);
+
+/**
+ * @brief get the time midi_task() has to run again even if nothing signals
+ * work, e.g. to retry what a full USB MIDI endpoint FIFO did not take
+ *
+ * @return the time in microseconds since boot or UINT64_MAX if there is none
+ */
+uint64_t midi_task_get_wake_us(void);
+
+/**
+ * @brief get the counters of a 5-pin DIN MIDI port pair
+ *
+ * @param port the port pair
+ * @param stats receives the counters
+ * @return false if the port pair does not exist or its MIDI UART could not be created
+ */
+bool midi_task_get_din_stats(uint8_t port, din_midi_stats_t* stats);
+
+/**
+ * @brief route a source to a new set of destinations; the route filters stay
+ *
+ * The source switches over at the next status byte it receives (see
+ * midi_router_commit()). Call from the main loop; with
+ * MIDISTRIBUTOR_DUAL_CORE the routing loop on core1 takes the change.
+ *
+ * @param src the source (a route source index)
+ * @param dest_mask the destinations (MIDI_ROUTER_DEST_BIT() of each)
+ * @return false if the source or a destination does not exist, or if the
+ * routing loop still uses the table before the last change; try again later then
+ */
+bool midi_task_set_route(uint8_t src, uint32_t dest_mask);
+
+/**
+ * @brief set which messages a route passes, e.g. to keep Active Sensing, clock,
+ * SysEx or some MIDI channels from one destination of a source
+ *
+ * The filter applies whether or not the source is routed to the destination
+ * now, and it takes effect like midi_task_set_route().
+ *
+ * @param src the source (a route source index)
+ * @param dest the destination number
+ * @param filter the filter
+ * @return false if the source or the destination does not exist, or if the
+ * routing loop still uses the table before the last change; try again later then
+ */
+bool midi_task_set_filter(uint8_t src, uint8_t dest, const midi_filter_t* filter);
+
+/**
+ * @brief get the queue statistics of one source in the merger of a 5-pin DIN
+ * MIDI OUT port: how many messages wait now and at most, and how long one
+ * waited at most before it was sent
+ *
+ * @param port the port pair
+ * @param src the source (a route source index)
+ * @param stats receives the statistics
+ * @return false if the port pair or the source does not exist
+ */
+bool midi_task_get_merge_stats(uint8_t port, uint8_t src, midi_merge_stats_t* stats);
+
+/**
+ * @brief set how many messages a source may send to a 5-pin DIN MIDI OUT port
+ * per round robin turn when several sources wait; all sources have weight 1
+ * by default
+ *
+ * @param port the port pair
+ * @param src the source (a route source index)
+ * @param weight the number of messages per turn (at least 1)
+ * @return false if the port pair or the source does not exist or the weight is 0
+ */
+bool midi_task_set_merge_weight(uint8_t port, uint8_t src, uint8_t weight);
+
+/**
+ * @brief get how many messages a source may send to a 5-pin DIN MIDI OUT
+ * port per round robin turn
+ *
+ * @param port the port pair
+ * @param src the source (a route source index)
+ * @return the weight, 0 if the port pair or the source does not exist
+ */
+uint8_t midi_task_get_merge_weight(uint8_t port, uint8_t src);
+
+/**
+ * @brief set a constant latency for a 5-pin DIN MIDI OUT port
+ *
+ * Every message routed to the port then goes out the delay after it entered
+ * the device (its first byte arrived on a DIN MIDI IN port or it was read
+ * from the USB MIDI OUT endpoint), in the order the messages entered. This
+ * trades the jitter of the routing loop and the merger for a known latency,
+ * as long as the port is not busy with the messages before. The clock
+ * generator and scheduled output are not delayed.
+ *
+ * @param port the port pair
+ * @param delay_us the delay in microseconds, up to MIDI_TASK_MAX_OUT_DELAY_US;
+ * 0 sends the messages as soon as possible
+ * @return false if the port pair does not exist or the delay is too long
+ */
+bool midi_task_set_out_delay(uint8_t port, uint32_t delay_us);
+
+/**
+ * @brief get the constant latency of a 5-pin DIN MIDI OUT port
+ *
+ * @param port the port pair
+ * @return the delay in microseconds, 0 if none is set
+ */
+uint32_t midi_task_get_out_delay(uint8_t port);
+
+/**
+ * @brief set how a 5-pin DIN MIDI OUT port encodes messages; running status
+ * is on and Note Off goes out as it is by default
+ *
+ * Some receivers mishandle running status or Note On velocity 0, so either
+ * can be turned off per port.
+ *
+ * @param port the port pair
+ * @param running_status true to leave out repeated status bytes
+ * @param note_off_as_note_on true to send Note Off as Note On velocity 0
+ * when that keeps the running status
+ * @return false if the port pair does not exist
+ */
+bool midi_task_set_out_encoding(uint8_t port, bool running_status, bool note_off_as_note_on);
+
+/**
+ * @brief get how a 5-pin DIN MIDI OUT port encodes messages
+ *
+ * @param port the port pair
+ * @param running_status receives true if repeated status bytes are left out
+ * @param note_off_as_note_on receives true if Note Off goes out as Note On velocity 0
+ * @return false if the port pair does not exist
+ */
+bool midi_task_get_out_encoding(uint8_t port, bool* running_status, bool* note_off_as_note_on);
+
+/**
+ * @brief get the counters of the USB MIDI paths
+ *
+ * @param stats receives the counters
+ */
+void midi_task_get_usb_stats(usb_midi_stats_t* stats);
+
+/**
+ * @brief clear all DIN and USB MIDI counters and high-water marks
+ */
+void midi_task_reset_stats(void);